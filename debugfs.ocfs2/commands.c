@@ -471,7 +471,8 @@ static int process_inodestr_args(char **args, int count, uint64_t *blkno)
 }
 
 /* open the device, read the block from the device and get the
- * blocksize from the offset of the ocfs2_super_block.
+ * blocksize from the offset of the ocfs2_super_block.  An image file
+ * has the blocksize in its header.
  */
 static errcode_t get_blocksize(char* dev, uint64_t offset, uint64_t *blocksize,
 			       int super_no)
@@ -502,7 +503,13 @@ static errcode_t get_blocksize(char* dev, uint64_t offset, uint64_t *blocksize,
 			ret = OCFS2_ET_IO;
 			goto bail;
 		}
-		offset = hdr->hdr_superblocks[super_no-1] * hdr->hdr_fsblksz;
+		/*
+		 * Compressed and delta images don't keep a block at any
+		 * fixed offset.  The header has the block size, and
+		 * ocfs2_open() reads the backup through the image.
+		 */
+		*blocksize = hdr->hdr_fsblksz;
+		goto bail;
 	}
 
 	blkno = offset / io_get_blksize(channel);
@@ -708,6 +715,9 @@ static void do_open(char **args)
 		return ;
 	}
 
+	/* cache path lookups, we can live without it */
+	ocfs2_dcache_init(gbls.fs, 4096);
+
 	sb = OCFS2_RAW_SB(gbls.fs->fs_super);
 
 	/* set globals */
@@ -838,8 +848,8 @@ static void do_ls(char **args)
 	}
 
 	ls_opts.out = open_pager(gbls.interactive);
-	ret = ocfs2_dir_iterate(gbls.fs, blkno, 0, NULL,
-				dump_dir_entry, (void *)&ls_opts);
+	ret = ocfs2_dir_iterate(gbls.fs, blkno, OCFS2_DIRENT_FLAG_READAHEAD,
+				NULL, dump_dir_entry, (void *)&ls_opts);
 	if (ret)
 		com_err(args[0], ret, "while iterating directory at "
 			"block %"PRIu64"", blkno);
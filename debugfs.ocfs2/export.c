@@ -0,0 +1,542 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * export.c
+ *
+ * Streams file data out of the volume for dump, cat and rdump.
+ *
+ * Copyright (C) 2026 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301 USA.
+ *
+ */
+
+#include "main.h"
+#include <sys/syscall.h>
+#include <libaio.h>
+
+/*
+ * A file is exported by walking its extents and moving each mapped run
+ * straight from the device to the output.  copy_file_range() does this
+ * in the kernel when the volume is a regular file.  Otherwise splice()
+ * moves the pages through a pipe without copying them to userspace.
+ *
+ * If neither works (O_DIRECT device, old kernel, odd output), runs are
+ * cut into chunks and read into a ring of buffers with async I/O.  The
+ * ring is retired in order, so EXPORT_DEPTH reads stay in flight while
+ * the oldest chunk is written out.  The ring is shared by every file
+ * queued on the context, which lets rdump overlap reads of one file
+ * with writes of the files before it.
+ *
+ * Holes and unwritten extents are left as holes in regular output
+ * files and written as zeros to anything else.
+ */
+#define EXPORT_CHUNK_SIZE	(1024 * 1024)
+#define EXPORT_DEPTH		16
+#define EXPORT_MAX_FILES	64
+
+struct export_file {
+	struct list_head	ef_list;
+	struct ocfs2_dinode	ef_di;
+	char			*ef_name;
+	int			ef_fd;
+	int			ef_seekable;
+	int			ef_preserve;
+	int			ef_pending;	/* chunks in the ring, +1 while
+						   the file is being mapped */
+	int			ef_streamed;	/* has used the ring */
+	uint64_t		ef_size;
+};
+
+struct export_chunk {
+	struct iocb		ch_iocb;
+	struct export_file	*ch_file;
+	char			*ch_buf;
+	uint64_t		ch_offset;
+	uint32_t		ch_len;
+	int			ch_done;
+	errcode_t		ch_ret;
+};
+
+struct export_ctxt {
+	ocfs2_filesys		*ec_fs;
+	int			ec_devfd;
+	int			ec_no_copy_range;
+	int			ec_no_splice;
+	int			ec_pipe[2];
+	io_context_t		ec_ioctx;
+	int			ec_ioctx_valid;
+	struct export_chunk	ec_ring[EXPORT_DEPTH];
+	int			ec_head;
+	int			ec_count;
+	int			ec_inflight;
+	char			*ec_bufs;
+	int			ec_buflen;
+	char			*ec_zeros;
+	struct list_head	ec_files;
+	int			ec_nr_files;
+};
+
+static int export_unsupported(int err)
+{
+	return (err == EXDEV) || (err == EINVAL) || (err == ENOSYS) ||
+		(err == EOPNOTSUPP) || (err == EBADF);
+}
+
+static errcode_t export_write(struct export_file *ef, char *buf,
+			      uint32_t len, uint64_t offset)
+{
+	ssize_t wr;
+
+	while (len) {
+		if (ef->ef_seekable)
+			wr = pwrite64(ef->ef_fd, buf, len, offset);
+		else
+			wr = write(ef->ef_fd, buf, len);
+		if (wr < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno;
+		}
+		if (!wr)
+			return OCFS2_ET_SHORT_WRITE;
+
+		buf += wr;
+		len -= wr;
+		offset += wr;
+	}
+
+	return 0;
+}
+
+static void export_release_file(struct export_ctxt *ec,
+				struct export_file *ef)
+{
+	if (ef->ef_fd > 0 && ef->ef_fd != fileno(stdout))
+		close(ef->ef_fd);
+	list_del(&ef->ef_list);
+	ec->ec_nr_files--;
+	if (ef->ef_name)
+		ocfs2_free(&ef->ef_name);
+	ocfs2_free(&ef);
+}
+
+static errcode_t export_finish_file(struct export_ctxt *ec,
+				    struct export_file *ef)
+{
+	errcode_t ret = 0;
+
+	/* Trailing holes were skipped, so set the size explicitly */
+	if (ef->ef_seekable && ftruncate64(ef->ef_fd, ef->ef_size))
+		ret = errno;
+
+	if (!ret && ef->ef_preserve)
+		ret = fix_perms(&ef->ef_di, &ef->ef_fd, ef->ef_name);
+
+	export_release_file(ec, ef);
+
+	return ret;
+}
+
+static errcode_t export_reap(struct export_ctxt *ec)
+{
+	struct io_event events[EXPORT_DEPTH];
+	struct export_chunk *ch;
+	int i, n;
+
+	do {
+		n = io_getevents(ec->ec_ioctx, 1, EXPORT_DEPTH, events, NULL);
+	} while (n == -EINTR);
+	if (n < 0)
+		return OCFS2_ET_IO;
+
+	for (i = 0; i < n; i++) {
+		ch = events[i].data;
+		ch->ch_done = 1;
+		ec->ec_inflight--;
+		if ((long)events[i].res < 0)
+			ch->ch_ret = OCFS2_ET_IO;
+		else if (events[i].res != ch->ch_iocb.u.c.nbytes)
+			ch->ch_ret = OCFS2_ET_SHORT_READ;
+	}
+
+	return 0;
+}
+
+/* Write out the oldest chunk in the ring, waiting for its read if needed */
+static errcode_t export_retire(struct export_ctxt *ec)
+{
+	struct export_chunk *ch = &ec->ec_ring[ec->ec_head];
+	struct export_file *ef = ch->ch_file;
+	errcode_t ret = 0, err;
+
+	while (!ch->ch_done) {
+		ret = export_reap(ec);
+		if (ret)
+			return ret;
+	}
+
+	ret = ch->ch_ret;
+	if (!ret)
+		ret = export_write(ef, ch->ch_buf, ch->ch_len, ch->ch_offset);
+
+	ch->ch_file = NULL;
+	ec->ec_head = (ec->ec_head + 1) % EXPORT_DEPTH;
+	ec->ec_count--;
+
+	if (!--ef->ef_pending) {
+		err = export_finish_file(ec, ef);
+		if (!ret)
+			ret = err;
+	}
+
+	return ret;
+}
+
+/*
+ * Queue len bytes at src on the device for offset in the output.  A hole
+ * is queued as zeros.  src need not be block aligned; the read is.
+ */
+static errcode_t export_queue(struct export_ctxt *ec, struct export_file *ef,
+			      uint64_t src, uint64_t offset, uint32_t len,
+			      int hole)
+{
+	struct export_chunk *ch;
+	struct iocb *iocb;
+	uint64_t bs = ec->ec_fs->fs_blocksize;
+	uint32_t skip;
+	int slot;
+	errcode_t ret;
+
+	if (ec->ec_count == EXPORT_DEPTH) {
+		ret = export_retire(ec);
+		if (ret)
+			return ret;
+	}
+
+	slot = (ec->ec_head + ec->ec_count) % EXPORT_DEPTH;
+	ch = &ec->ec_ring[slot];
+	ch->ch_file = ef;
+	ch->ch_offset = offset;
+	ch->ch_len = len;
+	ch->ch_ret = 0;
+	ch->ch_done = 1;
+	ec->ec_count++;
+	ef->ef_pending++;
+	ef->ef_streamed = 1;
+
+	if (hole) {
+		ch->ch_buf = ec->ec_zeros;
+		return 0;
+	}
+
+	skip = src & (bs - 1);
+	ch->ch_buf = ec->ec_bufs + (slot * ec->ec_buflen) + skip;
+	ch->ch_done = 0;
+
+	iocb = &ch->ch_iocb;
+	io_prep_pread(iocb, ec->ec_devfd, ch->ch_buf - skip,
+		      (skip + len + bs - 1) & ~(bs - 1), src - skip);
+	iocb->data = ch;
+
+	if (io_submit(ec->ec_ioctx, 1, &iocb) != 1) {
+		ch->ch_done = 1;
+		ch->ch_ret = OCFS2_ET_IO;
+		return 0;
+	}
+	ec->ec_inflight++;
+
+	return 0;
+}
+
+static errcode_t export_copy_range(struct export_ctxt *ec,
+				   struct export_file *ef, uint64_t *src,
+				   uint64_t *offset, uint64_t *len)
+{
+#ifdef __NR_copy_file_range
+	loff_t in = *src, out = *offset;
+	ssize_t n;
+
+	while (*len) {
+		n = syscall(__NR_copy_file_range, ec->ec_devfd, &in,
+			    ef->ef_fd, &out, (size_t)*len, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (export_unsupported(errno)) {
+				ec->ec_no_copy_range = 1;
+				break;
+			}
+			return errno;
+		}
+		if (!n)
+			return OCFS2_ET_SHORT_READ;
+
+		*src += n;
+		*offset += n;
+		*len -= n;
+	}
+#else
+	ec->ec_no_copy_range = 1;
+#endif
+
+	return 0;
+}
+
+static errcode_t export_splice(struct export_ctxt *ec, struct export_file *ef,
+			       uint64_t *src, uint64_t *offset, uint64_t *len)
+{
+	loff_t in = *src, out = *offset;
+	ssize_t n, m;
+
+	while (*len) {
+		n = splice(ec->ec_devfd, &in, ec->ec_pipe[1], NULL,
+			   ocfs2_min(*len, (uint64_t)EXPORT_CHUNK_SIZE),
+			   SPLICE_F_MOVE);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (export_unsupported(errno)) {
+				ec->ec_no_splice = 1;
+				break;
+			}
+			return errno;
+		}
+		if (!n)
+			return OCFS2_ET_SHORT_READ;
+
+		*src += n;
+		*len -= n;
+
+		while (n) {
+			m = splice(ec->ec_pipe[0], NULL, ef->ef_fd,
+				   ef->ef_seekable ? &out : NULL, n,
+				   SPLICE_F_MOVE);
+			if (m < 0) {
+				if (errno == EINTR)
+					continue;
+				/* The pipe still holds data, don't reuse it */
+				ec->ec_no_splice = 1;
+				return errno;
+			}
+			if (!m) {
+				ec->ec_no_splice = 1;
+				return OCFS2_ET_SHORT_WRITE;
+			}
+			n -= m;
+			*offset += m;
+		}
+	}
+
+	return 0;
+}
+
+static errcode_t export_run(struct export_ctxt *ec, struct export_file *ef,
+			    uint64_t p_blkno, uint64_t offset, uint64_t len)
+{
+	uint64_t src = p_blkno * ec->ec_fs->fs_blocksize;
+	uint32_t todo;
+	errcode_t ret = 0;
+
+	/*
+	 * A stream has to be written in order, so once a file has chunks
+	 * in the ring everything after them goes through the ring too.
+	 */
+	if (p_blkno && (ef->ef_seekable || !ef->ef_streamed)) {
+		if (ef->ef_seekable && !ec->ec_no_copy_range)
+			ret = export_copy_range(ec, ef, &src, &offset, &len);
+		if (!ret && len && !ec->ec_no_splice)
+			ret = export_splice(ec, ef, &src, &offset, &len);
+	}
+
+	while (!ret && len) {
+		todo = ocfs2_min(len, (uint64_t)EXPORT_CHUNK_SIZE);
+		ret = export_queue(ec, ef, src, offset, todo, !p_blkno);
+		src += todo;
+		offset += todo;
+		len -= todo;
+	}
+
+	return ret;
+}
+
+/*
+ * Export the data of ci to fd.  The context owns fd from here on, and
+ * closes it (after fixing its permissions if asked) once the last of
+ * the file's data has been written, which may be after this returns.
+ */
+errcode_t export_file(struct export_ctxt *ec, ocfs2_cached_inode *ci,
+		      int fd, char *out_file, int preserve)
+{
+	ocfs2_filesys *fs = ec->ec_fs;
+	struct export_file *ef = NULL;
+	struct stat64 st;
+	uint64_t v_blkno, num_blocks, p_blkno, contig, offset, len;
+	uint16_t ext_flags;
+	int bs_bits = OCFS2_RAW_SB(fs->fs_super)->s_blocksize_bits;
+	errcode_t ret, err;
+
+	while (ec->ec_nr_files >= EXPORT_MAX_FILES && ec->ec_count) {
+		ret = export_retire(ec);
+		if (ret)
+			goto out_close;
+	}
+
+	ret = ocfs2_malloc0(sizeof(struct export_file), &ef);
+	if (ret)
+		goto out_close;
+
+	if (out_file) {
+		ret = ocfs2_malloc(strlen(out_file) + 1, &ef->ef_name);
+		if (ret) {
+			ocfs2_free(&ef);
+			goto out_close;
+		}
+		strcpy(ef->ef_name, out_file);
+	}
+
+	memcpy(&ef->ef_di, ci->ci_inode, sizeof(struct ocfs2_dinode));
+	ef->ef_fd = fd;
+	ef->ef_preserve = preserve;
+	ef->ef_size = ci->ci_inode->i_size;
+	ef->ef_seekable = out_file && !fstat64(fd, &st) && S_ISREG(st.st_mode);
+	ef->ef_pending = 1;
+	list_add_tail(&ef->ef_list, &ec->ec_files);
+	ec->ec_nr_files++;
+
+	num_blocks = ocfs2_blocks_in_bytes(fs, ef->ef_size);
+	for (v_blkno = 0; v_blkno < num_blocks; v_blkno += contig) {
+		ext_flags = 0;
+		ret = ocfs2_extent_map_get_blocks(ci, v_blkno, 1, &p_blkno,
+						  &contig, &ext_flags);
+		if (ret)
+			break;
+
+		if (contig > num_blocks - v_blkno)
+			contig = num_blocks - v_blkno;
+
+		offset = v_blkno << bs_bits;
+		len = ocfs2_min(contig << bs_bits, ef->ef_size - offset);
+
+		if (ext_flags & OCFS2_EXT_UNWRITTEN)
+			p_blkno = 0;
+		if (!p_blkno && ef->ef_seekable)
+			continue;
+
+		ret = export_run(ec, ef, p_blkno, offset, len);
+		if (ret)
+			break;
+	}
+
+	if (!--ef->ef_pending) {
+		err = export_finish_file(ec, ef);
+		if (!ret)
+			ret = err;
+	}
+
+	return ret;
+
+out_close:
+	if (fd > 0 && fd != fileno(stdout))
+		close(fd);
+	return ret;
+}
+
+/* Wait for every queued file to be written out */
+errcode_t export_flush(struct export_ctxt *ec)
+{
+	errcode_t ret = 0;
+
+	while (!ret && ec->ec_count)
+		ret = export_retire(ec);
+
+	return ret;
+}
+
+errcode_t export_init(ocfs2_filesys *fs, struct export_ctxt **ret_ec)
+{
+	struct export_ctxt *ec;
+	int chunk_blocks;
+	errcode_t ret;
+
+	ret = ocfs2_malloc0(sizeof(struct export_ctxt), &ec);
+	if (ret)
+		return ret;
+
+	ec->ec_fs = fs;
+	ec->ec_devfd = io_get_fd(fs->fs_io);
+	ec->ec_pipe[0] = ec->ec_pipe[1] = -1;
+	INIT_LIST_HEAD(&ec->ec_files);
+
+	if (pipe(ec->ec_pipe))
+		ec->ec_no_splice = 1;
+	else
+		fcntl(ec->ec_pipe[1], F_SETPIPE_SZ, EXPORT_CHUNK_SIZE);
+
+	/* One spare block per slot for reads that start mid-block */
+	chunk_blocks = ocfs2_blocks_in_bytes(fs, EXPORT_CHUNK_SIZE) + 1;
+	ec->ec_buflen = chunk_blocks * fs->fs_blocksize;
+	ret = ocfs2_malloc_blocks(fs->fs_io, chunk_blocks * EXPORT_DEPTH,
+				  &ec->ec_bufs);
+	if (ret)
+		goto bail;
+
+	ret = ocfs2_malloc0(EXPORT_CHUNK_SIZE, &ec->ec_zeros);
+	if (ret)
+		goto bail;
+
+	if (io_queue_init(EXPORT_DEPTH, &ec->ec_ioctx)) {
+		ret = OCFS2_ET_IO;
+		goto bail;
+	}
+	ec->ec_ioctx_valid = 1;
+
+	*ret_ec = ec;
+	return 0;
+
+bail:
+	export_free(ec);
+	return ret;
+}
+
+void export_free(struct export_ctxt *ec)
+{
+	struct export_file *ef;
+
+	if (!ec)
+		return;
+
+	/* Buffers can't go away under reads the kernel still owns */
+	while (ec->ec_inflight > 0 && !export_reap(ec))
+		;
+	if (ec->ec_ioctx_valid)
+		io_queue_release(ec->ec_ioctx);
+
+	while (!list_empty(&ec->ec_files)) {
+		ef = list_entry(ec->ec_files.next, struct export_file,
+				ef_list);
+		export_release_file(ec, ef);
+	}
+
+	if (ec->ec_pipe[0] != -1)
+		close(ec->ec_pipe[0]);
+	if (ec->ec_pipe[1] != -1)
+		close(ec->ec_pipe[1]);
+	if (ec->ec_bufs)
+		ocfs2_free(&ec->ec_bufs);
+	if (ec->ec_zeros)
+		ocfs2_free(&ec->ec_zeros);
+	ocfs2_free(&ec);
+}
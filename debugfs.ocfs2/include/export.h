@@ -0,0 +1,36 @@
+/*
+ * export.h
+ *
+ * Function prototypes, macros, etc. for related 'C' files
+ *
+ * Copyright (C) 2026 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301 USA.
+ *
+ */
+
+#ifndef _EXPORT_H_
+#define _EXPORT_H_
+
+struct export_ctxt;
+
+errcode_t export_init(ocfs2_filesys *fs, struct export_ctxt **ret_ec);
+errcode_t export_file(struct export_ctxt *ec, ocfs2_cached_inode *ci,
+		      int fd, char *out_file, int preserve);
+errcode_t export_flush(struct export_ctxt *ec);
+void export_free(struct export_ctxt *ec);
+
+#endif		/* _EXPORT_H_ */
@@ -30,6 +30,8 @@ struct rdump_opts {
 	char *fullname;
 	char *buf;
 	int verbose;
+	struct export_ctxt *ec;
+	struct list_head *dirs;
 };
 
 struct strings {
@@ -60,6 +62,7 @@ void close_pager(FILE *stream);
 int inodestr_to_inode(char *str, uint64_t *blkno);
 errcode_t string_to_inode(ocfs2_filesys *fs, uint64_t root_blkno,
 			  uint64_t cwd_blkno, char *str, uint64_t *blkno);
+errcode_t fix_perms(const struct ocfs2_dinode *di, int *fd, char *name);
 errcode_t dump_file(ocfs2_filesys *fs, uint64_t ino, int fd, char *out_file,
 		    int preserve);
 errcode_t read_whole_file(ocfs2_filesys *fs, uint64_t ino, char **buf,
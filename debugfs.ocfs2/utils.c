@@ -330,8 +330,7 @@ errcode_t string_to_inode(ocfs2_filesys *fs, uint64_t root_blkno,
  * Copyright (C) 1994 Theodore Ts'o.  This file may be redistributed
  * under the terms of the GNU Public License.
  */
-static errcode_t fix_perms(const struct ocfs2_dinode *di, int *fd,
-                           char *name)
+errcode_t fix_perms(const struct ocfs2_dinode *di, int *fd, char *name)
 {
 	struct utimbuf ut;
 	int i;
@@ -386,6 +385,7 @@ errcode_t dump_file(ocfs2_filesys *fs, uint64_t ino, int fd, char *out_file,
 	uint32_t wrote;
 	ocfs2_cached_inode *ci = NULL;
 	uint64_t offset = 0;
+	struct export_ctxt *ec = NULL;
 
 	ret = ocfs2_read_cached_inode(fs, ino, &ci);
 	if (ret) {
@@ -403,6 +403,24 @@ errcode_t dump_file(ocfs2_filesys *fs, uint64_t ino, int fd, char *out_file,
 		goto bail;
 	}
 
+	/*
+	 * Inline data lives in the inode and o2image files carry no file
+	 * data at all, so only the rest can be streamed off the device.
+	 */
+	if (!(ci->ci_inode->i_dyn_features & OCFS2_INLINE_DATA_FL) &&
+	    !(fs->fs_flags & OCFS2_FLAG_IMAGE_FILE)) {
+		/* The caller reports a failure */
+		ret = export_init(fs, &ec);
+		if (ret)
+			goto bail;
+
+		ret = export_file(ec, ci, fd, out_file, preserve);
+		fd = -1;
+		if (!ret)
+			ret = export_flush(ec);
+		goto bail;
+	}
+
 	buflen = 1024 * 1024;
 
 	ret = ocfs2_malloc_blocks(fs->fs_io,
@@ -448,6 +466,7 @@ bail:
 		ocfs2_free(&buf);
 	if (ci)
 		ocfs2_free_cached_inode(fs, ci);
+	export_free(ec);
 	return ret;
 }
 
@@ -616,6 +635,21 @@ bail:
 	return ret;
 }
 
+/*
+ * A directory's permissions are fixed only after everything below it has
+ * been written out, and file data may still be in flight when the walk
+ * leaves a directory.  So directories are remembered here and fixed in
+ * reverse order once the export context has been flushed.
+ */
+struct rdump_dir {
+	struct list_head rd_list;
+	struct ocfs2_dinode rd_di;
+	char *rd_name;
+};
+
+static errcode_t rdump_walk(struct rdump_opts *rd, uint64_t blkno,
+			    const char *name, const char *dumproot);
+
 /*
  * rdump_dirent()
  *
@@ -636,8 +670,7 @@ static int rdump_dirent(struct ocfs2_dir_entry *rec, uint64_t blocknr,
 	if (!strcmp(rec->name, ".") || !strcmp(rec->name, ".."))
 		goto bail;
 
-	ret = rdump_inode(rd->fs, rec->inode, rec->name, rd->fullname,
-			  rd->verbose);
+	ret = rdump_walk(rd, rec->inode, rec->name, rd->fullname);
 
 bail:
 	rec->name[rec->name_len] = tmp;
@@ -646,16 +679,17 @@ bail:
 }
 
 /*
- * rdump_inode()
+ * rdump_walk()
  *
  * Code based on similar function in e2fsprogs-1.32/debugfs/dump.c
  *
  * Copyright (C) 1994 Theodore Ts'o.  This file may be redistributed
  * under the terms of the GNU Public License.
  */
-errcode_t rdump_inode(ocfs2_filesys *fs, uint64_t blkno, const char *name,
-		      const char *dumproot, int verbose)
+static errcode_t rdump_walk(struct rdump_opts *rd, uint64_t blkno,
+			    const char *name, const char *dumproot)
 {
+	ocfs2_filesys *fs = rd->fs;
 	char *fullname = NULL;
 	int len;
 	errcode_t ret;
@@ -663,7 +697,9 @@ errcode_t rdump_inode(ocfs2_filesys *fs, uint64_t blkno, const char *name,
 	char *dirbuf = NULL;
 	struct ocfs2_dinode *di;
 	int fd;
-	struct rdump_opts rd_opts = { NULL, NULL, NULL, 0 };
+	struct rdump_opts rd_opts = *rd;
+	struct rdump_dir *dir;
+	ocfs2_cached_inode *ci = NULL;
 
 	len = strlen(dumproot) + strlen(name) + 2;
 	ret = ocfs2_malloc(len, &fullname);
@@ -694,7 +730,7 @@ errcode_t rdump_inode(ocfs2_filesys *fs, uint64_t blkno, const char *name,
 		if (ret)
 			goto bail;
 	} else if (S_ISREG(di->i_mode)) {
-		if (verbose)
+		if (rd->verbose)
 			fprintf(stdout, "%s\n", fullname);
 		fd = open64(fullname, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXU);
 		if (fd == -1) {
@@ -704,13 +740,25 @@ errcode_t rdump_inode(ocfs2_filesys *fs, uint64_t blkno, const char *name,
 			goto bail;
 		}
 
-		ret = dump_file(fs, blkno, fd, fullname, 1);
-		if (ret)
+		if ((di->i_dyn_features & OCFS2_INLINE_DATA_FL) ||
+		    (fs->fs_flags & OCFS2_FLAG_IMAGE_FILE)) {
+			ret = dump_file(fs, blkno, fd, fullname, 1);
 			goto bail;
+		}
+
+		ret = ocfs2_read_cached_inode(fs, blkno, &ci);
+		if (ret) {
+			close(fd);
+			com_err(gbls.cmd, ret, "while reading inode %"PRIu64,
+				blkno);
+			goto bail;
+		}
+
+		ret = export_file(rd->ec, ci, fd, fullname, 1);
 	} else if (S_ISDIR(di->i_mode) && strcmp(name, ".") &&
 		   strcmp(name, "..")) {
 
-		if (verbose)
+		if (rd->verbose)
 			fprintf(stdout, "%s\n", fullname);
 		/* Create the directory with 0700 permissions, because we
 		 * expect to have to create entries it.  Then fix its perms
@@ -722,29 +770,34 @@ errcode_t rdump_inode(ocfs2_filesys *fs, uint64_t blkno, const char *name,
 			goto bail;
 		}
 
+		ret = ocfs2_malloc0(sizeof(struct rdump_dir), &dir);
+		if (ret) {
+			com_err(gbls.cmd, ret, "while allocating %zu bytes",
+				sizeof(struct rdump_dir));
+			goto bail;
+		}
+		memcpy(&dir->rd_di, di, sizeof(struct ocfs2_dinode));
+		dir->rd_name = fullname;
+		fullname = NULL;
+		list_add(&dir->rd_list, rd->dirs);
+
 		ret = ocfs2_malloc_block(fs->fs_io, &dirbuf);
 		if (ret) {
 			com_err(gbls.cmd, ret, "while allocating a block");
 			goto bail;
 		}
 
-		rd_opts.fs = fs;
 		rd_opts.buf = dirbuf;
-		rd_opts.fullname = fullname;
-		rd_opts.verbose = verbose;
+		rd_opts.fullname = dir->rd_name;
 
-		ret = ocfs2_dir_iterate(fs, blkno, 0, NULL,
+		ret = ocfs2_dir_iterate(fs, blkno,
+					OCFS2_DIRENT_FLAG_READAHEAD, NULL,
 					rdump_dirent, (void *)&rd_opts);
 		if (ret) {
 			com_err(gbls.cmd, ret, "while iterating directory at "
 				"block %"PRIu64, blkno);
 			goto bail;
 		}
-
-		fd = -1;
-		ret = fix_perms(di, &fd, fullname);
-		if (ret)
-			goto bail;
 	}
 	/* else do nothing (don't dump device files, sockets, fifos, etc.) */
 
@@ -755,6 +808,58 @@ bail:
 		ocfs2_free(&buf);
 	if (dirbuf)
 		ocfs2_free(&dirbuf);
+	if (ci)
+		ocfs2_free_cached_inode(fs, ci);
+
+	return ret;
+}
+
+/*
+ * rdump_inode()
+ *
+ * Recursively dumps blkno as dumproot/name.  Regular files are streamed
+ * through one export context, so the data of several files can be in
+ * flight at once.
+ */
+errcode_t rdump_inode(ocfs2_filesys *fs, uint64_t blkno, const char *name,
+		      const char *dumproot, int verbose)
+{
+	struct rdump_opts rd_opts = { NULL, NULL, NULL, 0, NULL, NULL };
+	struct list_head dirs;
+	struct rdump_dir *dir;
+	errcode_t ret, err;
+	int fd;
+
+	INIT_LIST_HEAD(&dirs);
+
+	/* The caller reports a failure of the export itself */
+	ret = export_init(fs, &rd_opts.ec);
+	if (ret)
+		return ret;
+
+	rd_opts.fs = fs;
+	rd_opts.verbose = verbose;
+	rd_opts.dirs = &dirs;
+
+	ret = rdump_walk(&rd_opts, blkno, name, dumproot);
+	if (!ret)
+		ret = export_flush(rd_opts.ec);
+
+	/* Most recently created first, so children before parents */
+	while (!list_empty(&dirs)) {
+		dir = list_entry(dirs.next, struct rdump_dir, rd_list);
+		list_del(&dir->rd_list);
+		if (!ret) {
+			fd = -1;
+			err = fix_perms(&dir->rd_di, &fd, dir->rd_name);
+			if (err)
+				ret = err;
+		}
+		ocfs2_free(&dir->rd_name);
+		ocfs2_free(&dir);
+	}
+
+	export_free(rd_opts.ec);
 
 	return ret;
 }
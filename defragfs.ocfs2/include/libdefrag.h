@@ -8,6 +8,8 @@
 #include <errno.h>
 #include <linux/limits.h>
 #include <linux/types.h>
+#include <stdint.h>
+#include <time.h>
 
 #define PRINT_ERR(msg)	\
 	fprintf(stderr, "[ERROR]\t%s\n", (msg))
@@ -32,5 +34,23 @@ int do_write(int fd, const void *bytes, size_t count);
 
 unsigned int do_csum(const unsigned char *buff, int len);
 
+/*
+ * A token bucket.  Tokens come in at tb_rate a second, up to tb_burst
+ * of them.  tb_take() sleeps until the tokens asked for are there.
+ * A rate of 0 never sleeps.
+ */
+struct token_bucket {
+	double tb_rate;
+	double tb_burst;
+	double tb_tokens;
+	struct timespec tb_last;
+};
+
+void tb_init(struct token_bucket *tb, double rate, double burst);
+
+void tb_take(struct token_bucket *tb, uint64_t n);
+
+int get_extent_count(int fd, unsigned int *extents);
+
 
 #endif
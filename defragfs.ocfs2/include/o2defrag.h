@@ -7,6 +7,7 @@
 #define STATISTIC		0x02
 #define GO_ON			0x04
 #define LOW_IO			0x08
+#define PLAN			0x10
 
 #define DEVNAME			0
 #define DIRNAME			1
@@ -21,6 +22,10 @@
 
 #define RECORD_EVERY_N_FILES	50
 
+#define DEFRAG_WORKERS_MAX	16
+/* How much of a file one move request covers when under a budget */
+#define DEFRAG_BUDGET_CHUNK	(8ULL * 1024 * 1024)
+
 #ifndef OCFS2_IOC_MOVE_EXT
 #define OCFS2_IOC_MOVE_EXT	_IOW('o', 6, struct ocfs2_move_extents)
 #endif
@@ -0,0 +1,23 @@
+#ifndef __PLAN_H__
+#define __PLAN_H__
+
+#include <stdint.h>
+
+/*
+ * The free space of a volume, from its global bitmap.  A free run
+ * never crosses a group, as each group starts with its descriptor,
+ * so runs are kept as a count per length up to clusters per group.
+ */
+struct free_space {
+	uint32_t f_clustersize;
+	uint32_t f_max_len;		/* clusters per group */
+	uint64_t *f_runs;		/* f_runs[len] free runs of len */
+	uint64_t f_nr_runs;
+	uint64_t f_free;		/* free clusters */
+};
+
+extern int load_free_space(const char *dev, struct free_space *fsp);
+extern void release_free_space(struct free_space *fsp);
+extern unsigned int claim_free_space(struct free_space *fsp,
+		uint64_t clusters, int commit);
+#endif
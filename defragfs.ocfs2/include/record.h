@@ -12,6 +12,7 @@
 #include <stdint.h>
 
 #define RECORD_FILE_NAME ".ocfs2.defrag.record" //under /tmp dir
+#define RECORD_DONE_FILE_NAME RECORD_FILE_NAME ".done"
 
 #define offset_of(type, member) (unsigned long)(&((type *)0)->member)
 
@@ -31,6 +32,9 @@ struct argv_node {
 struct resume_record {
 	int r_mode_flag;		/* mode flag, the binary of the combination of options */
 	ino_t r_inode_no;		/* start from the file as a inode number */
+	int r_workers;			/* -j, how many files are defragged at once */
+	uint64_t r_bandwidth;		/* -b, bytes moved per second, 0 for no limit */
+	uint64_t r_iops;		/* -i, move requests per second, 0 for no limit */
 	int r_argc;			/* how many argv_node in the r_argvs list */
 	struct list_head r_argvs;	/* the list of argv_node */
 };
@@ -50,4 +54,7 @@ extern int store_record(struct resume_record *rr);
 extern int load_record(struct resume_record *rr);
 extern void mv_record(struct resume_record *dst, struct resume_record *src);
 extern int remove_record(void);
+extern int append_record_done(ino_t *inos, int nr);
+extern int load_record_done(ino_t **inos, unsigned int *nr);
+extern int remove_record_done(void);
 #endif
@@ -1,5 +1,9 @@
 #include <libdefrag.h>
 #include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
 
 void *do_malloc(size_t size)
 {
@@ -124,3 +128,68 @@ unsigned int do_csum(const unsigned char *buff, int len)
 out:
 	return result;
 }
+
+static double tb_elapsed(struct timespec *from, struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) +
+		(to->tv_nsec - from->tv_nsec) / 1000000000.0;
+}
+
+void tb_init(struct token_bucket *tb, double rate, double burst)
+{
+	tb->tb_rate = rate;
+	tb->tb_burst = burst;
+	tb->tb_tokens = burst;
+	clock_gettime(CLOCK_MONOTONIC, &tb->tb_last);
+}
+
+/*
+ * Asking for more than tb_burst is allowed; the bucket goes into debt
+ * and we sleep it off, so a big request is paced like many small ones.
+ */
+void tb_take(struct token_bucket *tb, uint64_t n)
+{
+	struct timespec now, ts;
+	double wait;
+
+	if (!tb->tb_rate)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	tb->tb_tokens += tb_elapsed(&tb->tb_last, &now) * tb->tb_rate;
+	if (tb->tb_tokens > tb->tb_burst)
+		tb->tb_tokens = tb->tb_burst;
+	tb->tb_last = now;
+
+	tb->tb_tokens -= n;
+	if (tb->tb_tokens >= 0)
+		return;
+
+	wait = -tb->tb_tokens / tb->tb_rate;
+	ts.tv_sec = (time_t)wait;
+	ts.tv_nsec = (long)((wait - ts.tv_sec) * 1000000000.0);
+	/* A signal cuts this short so the caller can see should_stop */
+	nanosleep(&ts, NULL);
+}
+
+/*
+ * get_extent_count() - How many extents a file has, from FIEMAP.
+ * @fd:		the open file.
+ * @extents:	the extent count.
+ *
+ * With fm_extent_count 0 the kernel only counts, so one call does it
+ * however fragmented the file is.
+ */
+int get_extent_count(int fd, unsigned int *extents)
+{
+	struct fiemap fm;
+
+	memset(&fm, 0, sizeof(fm));
+	fm.fm_length = ~0ULL;
+
+	if (ioctl(fd, FS_IOC_FIEMAP, &fm) < 0)
+		return -errno;
+
+	*extents = fm.fm_mapped_extents;
+	return 0;
+}
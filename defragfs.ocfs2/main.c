@@ -24,10 +24,12 @@
 
 #include "ocfs2/ocfs2.h"
 #include "ocfs2/bitops.h"
+#include "tools-internal/workers.h"
 
 #include <record.h>
 #include <libdefrag.h>
 #include <o2defrag.h>
+#include <plan.h>
 
 
 
@@ -41,17 +43,25 @@ static unsigned int processed_count;
 static uid_t current_uid;
 static int should_stop;
 struct resume_record rr;
+static int opt_workers = 1;
+static uint64_t opt_bandwidth;
+static uint64_t opt_iops;
 
 
 
 static void usage(char *progname)
 {
-	printf("usage: %s [-c] [-v] [-l] [-g] [-h] [FILE | DIRECTORY | DEVICE]...\n",
+	printf("usage: %s [-c] [-v] [-l] [-g] [-p] [-j workers] [-b bytes/s] "
+			"[-i requests/s] [-h] [FILE | DIRECTORY | DEVICE]...\n",
 			progname);
 	printf("\t-c\t\tCalculate how many files will be processed\n");
 	printf("\t-v\t\tVerbose mode\n");
 	printf("\t-l\t\tLow io rate mode\n");
 	printf("\t-g\t\tResume last defrag progress\n");
+	printf("\t-p\t\tPlan the work against the free space first\n");
+	printf("\t-j workers\tDefrag this many files at once\n");
+	printf("\t-b bytes/s\tLimit the data moved per second (K, M, G)\n");
+	printf("\t-i requests/s\tLimit the move requests per second\n");
 	printf("\t-h\t\tShow this help\n");
 	exit(0);
 }
@@ -407,6 +417,546 @@ skip:
 	return 0;
 }
 
+static void handle_signal(int sig)
+{
+	switch (sig) {
+	case SIGTERM:
+	case SIGINT:
+		printf("\nProcess Interrupted. signale = %d\n", sig);
+		should_stop = 1;
+	}
+}
+
+/*
+ * With -j, -b or -i the files are defragged by a pool of workers
+ * instead of straight from nftw.  The tree is walked once to score
+ * every file from FIEMAP, the most fragmented go first, and each
+ * worker paces its move requests through its own share of the budget.
+ */
+struct defrag_entry {
+	char *de_path;
+	ino_t de_ino;
+	off64_t de_size;
+	blkcnt64_t de_blocks;
+	unsigned int de_extents;
+	unsigned int de_planned;	/* extents expected after, with -p */
+	double de_score;		/* extents per MB */
+	int de_done;
+};
+
+/* What a worker tells the parent after each file */
+struct defrag_report {
+	unsigned int dr_index;
+	int dr_result;
+	uint64_t dr_moved;
+};
+
+static struct defrag_entry *entries;
+static unsigned int nr_entries;
+static unsigned int max_entries;
+static unsigned int nr_reported;
+static uint64_t moved_bytes;
+
+/* Inodes finished by an earlier run, and those not yet logged */
+static ino_t *done_inos;
+static unsigned int nr_done_inos;
+static ino_t pending_done[RECORD_EVERY_N_FILES];
+static unsigned int nr_pending_done;
+
+static int is_pool_mode(void)
+{
+	return rr.r_workers > 1 || rr.r_bandwidth || rr.r_iops ||
+		(mode_flag & PLAN);
+}
+
+static void add_entry(const char *file, const struct stat64 *buf,
+		      unsigned int extents)
+{
+	struct defrag_entry *de;
+
+	if (nr_entries == max_entries) {
+		max_entries = max_entries ? max_entries * 2 : 1024;
+		entries = realloc(entries,
+				  max_entries * sizeof(struct defrag_entry));
+		if (!entries) {
+			fprintf(stderr, "No mem\n");
+			exit(-1);
+		}
+	}
+
+	de = &entries[nr_entries++];
+	memset(de, 0, sizeof(struct defrag_entry));
+	de->de_path = do_malloc(strlen(file) + 1);
+	strcpy(de->de_path, file);
+	de->de_ino = buf->st_ino;
+	de->de_size = buf->st_size;
+	de->de_blocks = buf->st_blocks;
+	de->de_extents = extents;
+	de->de_score = (double)extents * 1024 * 1024 / buf->st_size;
+}
+
+static void free_done_inos(void)
+{
+	free(done_inos);
+	done_inos = NULL;
+	nr_done_inos = 0;
+	nr_pending_done = 0;
+}
+
+static void free_entries(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_entries; i++)
+		free(entries[i].de_path);
+	free(entries);
+	entries = NULL;
+	nr_entries = max_entries = 0;
+}
+
+static int ino_cmp(const void *a, const void *b)
+{
+	const ino_t *ia = a, *ib = b;
+
+	if (*ia < *ib)
+		return -1;
+	if (*ia > *ib)
+		return 1;
+	return 0;
+}
+
+/*
+ * collect_file_ftw() - Score a file and queue it for the workers.
+ * @file:		the file's name.
+ * @buf:		the pointer of the struct stat64.
+ * @flag:		file type.
+ * @ftwbuf:		the pointer of a struct FTW.
+ *
+ * A file FIEMAP can't count is still queued, behind everything else.
+ */
+static int collect_file_ftw(const char *file, const struct stat64 *buf,
+			    int flag, struct FTW *ftwbuf)
+{
+	int fd, ret;
+	unsigned int extents = 0;
+
+	if (should_stop)
+		return 1;
+
+	if (lost_found_dir[0] != '\0' &&
+	    !memcmp(file, lost_found_dir, strnlen(lost_found_dir, PATH_MAX)))
+		return 0;
+
+	if (!S_ISREG(buf->st_mode))
+		return 0;
+
+	if (nr_done_inos &&
+	    bsearch(&buf->st_ino, done_inos, nr_done_inos, sizeof(ino_t),
+		    ino_cmp)) {
+		if (mode_flag & DETAIL)
+			PRINT_FILE_MSG(file, "already done... skip");
+		processed_count++;
+		skipped_count++;
+		return 0;
+	}
+
+	if (!check_file(file, buf)) {
+		processed_count++;
+		skipped_count++;
+		return 0;
+	}
+
+	fd = open64(file, O_RDONLY);
+	if (fd >= 0) {
+		ret = get_extent_count(fd, &extents);
+		close(fd);
+		if (!ret && extents <= 1) {
+			if (mode_flag & DETAIL)
+				PRINT_FILE_MSG(file,
+					"Already contiguous... skip");
+			processed_count++;
+			skipped_count++;
+			return 0;
+		}
+	}
+
+	add_entry(file, buf, extents);
+	return 0;
+}
+
+static int entry_cmp(const void *a, const void *b)
+{
+	const struct defrag_entry *ea = a, *eb = b;
+
+	if (ea->de_score > eb->de_score)
+		return -1;
+	if (ea->de_score < eb->de_score)
+		return 1;
+	return 0;
+}
+
+/*
+ * defrag_entry() - Defrag one queued file within the budget.
+ *
+ * Returns 0 on success, -1 on failure and 1 if we were interrupted
+ * part of the way through the file.
+ */
+static int defrag_entry(struct defrag_entry *de, struct token_bucket *iot,
+			struct token_bucket *bwt, uint64_t *moved)
+{
+	int fd, ret = 0;
+	uint64_t start, len, chunk = de->de_size;
+	struct ocfs2_move_extents me;
+
+	/* Without a bandwidth limit there is no need to split a file */
+	if (rr.r_bandwidth)
+		chunk = DEFRAG_BUDGET_CHUNK;
+
+	*moved = 0;
+	fd = open64(de->de_path, O_RDWR, 0400);
+	if (fd < 0) {
+		PRINT_FILE_MSG_ERRNO(de->de_path, "Open file failed");
+		return -1;
+	}
+
+	for (start = 0; start < de->de_size; start += len) {
+		len = de->de_size - start;
+		if (len > chunk)
+			len = chunk;
+
+		tb_take(iot, 1);
+		tb_take(bwt, len);
+		if (should_stop) {
+			ret = 1;
+			break;
+		}
+
+		memset(&me, 0, sizeof(me));
+		me.me_start = start;
+		me.me_len = len;
+		me.me_flags = OCFS2_MOVE_EXT_FL_AUTO_DEFRAG;
+		ret = ioctl(fd, OCFS2_IOC_MOVE_EXT, &me);
+		if (ret < 0) {
+			PRINT_FILE_MSG_ERRNO(de->de_path, "Move extent failed");
+			break;
+		}
+		*moved += me.me_moved_len;
+	}
+
+	close(fd);
+	return ret;
+}
+
+/*
+ * The pool records the inodes it has finished rather than a position.
+ * A resumed run scores the files again from FIEMAP and, with -p,
+ * plans against the free space as it is then, so the queue comes out
+ * in a different order.  The finished inodes are skipped wherever
+ * they land in it.
+ */
+static void record_pool_progress(void)
+{
+	int ret;
+
+	if (nr_pending_done) {
+		ret = append_record_done(pending_done, nr_pending_done);
+		if (ret)
+			PRINT_ERR("Record failed");
+		nr_pending_done = 0;
+	}
+
+	rr.r_inode_no = 0;
+
+	if (mode_flag & DETAIL)
+		printf("\nRecording...\n");
+	ret = store_record(&rr);
+	if (ret)
+		PRINT_ERR("Record failed");
+	else if (mode_flag & DETAIL)
+		printf("Record successfully\n"
+			"Use -g option to resume progress\n");
+}
+
+static void entry_done(unsigned int i, int result, uint64_t moved)
+{
+	struct defrag_entry *de = &entries[i];
+
+	if (de->de_done)
+		return;
+
+	de->de_done = 1;
+	pending_done[nr_pending_done++] = de->de_ino;
+	processed_count++;
+	if (!result)
+		succeed_count++;
+	moved_bytes += moved;
+	print_progress(de->de_path, result);
+
+	if (!(++nr_reported % RECORD_EVERY_N_FILES))
+		record_pool_progress();
+}
+
+static void init_budget(struct token_bucket *iot, struct token_bucket *bwt,
+			int nr_workers)
+{
+	double iops = (double)rr.r_iops / nr_workers;
+	double bw = (double)rr.r_bandwidth / nr_workers;
+
+	/* Allow a second's worth to build up, but at least one request */
+	tb_init(iot, iops, iops > 1 ? iops : 1);
+	tb_init(bwt, bw, bw);
+}
+
+static void stop_worker(int sig)
+{
+	should_stop = 1;
+}
+
+/*
+ * Without SA_RESTART a signal breaks a worker out of its budget sleep
+ * and the parent out of waiting on a report.
+ */
+static void set_stop_handler(void (*handler)(int), int flags)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handler;
+	sa.sa_flags = flags;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+static void defrag_worker(int worker, int nr_workers, int pipe_fd,
+			  void *priv)
+{
+	unsigned int i;
+	struct defrag_report dr;
+	struct token_bucket iot, bwt;
+
+	/* Finish the request in flight and go, quietly */
+	set_stop_handler(stop_worker, 0);
+
+	init_budget(&iot, &bwt, nr_workers);
+
+	memset(&dr, 0, sizeof(dr));
+	for (i = worker; i < nr_entries && !should_stop; i += nr_workers) {
+		if (entries[i].de_done)
+			continue;
+
+		dr.dr_index = i;
+		dr.dr_result = defrag_entry(&entries[i], &iot, &bwt,
+					    &dr.dr_moved);
+		if (dr.dr_result > 0)
+			break;
+		if (do_write(pipe_fd, &dr, sizeof(dr)) != sizeof(dr))
+			break;
+	}
+}
+
+/*
+ * Fork nr_workers workers, each taking every nr_workers'th file of
+ * the sorted list, so the worst files are worked on first.  A file is
+ * only done once its report arrives; whatever a worker didn't get to
+ * is left for defrag_serial().
+ */
+static void defrag_parallel(int nr_workers)
+{
+	int stopping = 0;
+	ssize_t rd;
+	struct tools_workers tw;
+	struct defrag_report dr;
+
+	if (!tools_start_workers(&tw, nr_workers, 0, defrag_worker, NULL)) {
+		PRINT_ERR("Could not start the workers");
+		return;
+	}
+
+	set_stop_handler(handle_signal, 0);
+
+	/* A plain read(), so that a signal gets us out to stop the workers */
+	while ((rd = read(tw.tw_fds[0], &dr, sizeof(dr))) != 0) {
+		if (should_stop && !stopping) {
+			tools_kill_workers(&tw);
+			stopping = 1;
+		}
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (rd != sizeof(dr) || dr.dr_index >= nr_entries)
+			break;
+
+		entry_done(dr.dr_index, dr.dr_result, dr.dr_moved);
+	}
+	tools_stop_workers(&tw);
+
+	set_stop_handler(handle_signal, SA_RESTART);
+}
+
+static void defrag_serial(void)
+{
+	unsigned int i;
+	int ret;
+	uint64_t moved;
+	struct token_bucket iot, bwt;
+
+	init_budget(&iot, &bwt, 1);
+
+	for (i = 0; i < nr_entries && !should_stop; i++) {
+		if (entries[i].de_done)
+			continue;
+
+		ret = defrag_entry(&entries[i], &iot, &bwt, &moved);
+		if (ret > 0)
+			break;
+		entry_done(i, ret, moved);
+	}
+}
+
+static void skip_entry(struct defrag_entry *de, const char *msg)
+{
+	if (mode_flag & DETAIL)
+		PRINT_FILE_MSG(de->de_path, msg);
+	de->de_done = 1;
+	processed_count++;
+	skipped_count++;
+}
+
+/*
+ * plan_defrag() - Order the queue by what moving each file buys.
+ * @dev_path:		the device the files are on.
+ *
+ * Each file is first scored on its own against the free space: the
+ * extents it would lose per MB moved.  Then the space is handed out in
+ * that order, so a file only counts on what the files before it left.
+ * Files that would not end up in fewer extents are skipped.  The
+ * expected gain is printed before anything is moved.
+ */
+static void plan_defrag(const char *dev_path)
+{
+	unsigned int i, after, planned = 0, hopeless = 0;
+	uint64_t clusters, bytes, moving = 0, before = 0, expected = 0;
+	uint64_t free, runs;
+	uint32_t largest;
+	struct free_space fsp;
+	struct defrag_entry *de;
+
+	if (load_free_space(dev_path, &fsp)) {
+		PRINT_ERR("Could not read the free space, not planning");
+		return;
+	}
+
+	free = fsp.f_free;
+	runs = fsp.f_nr_runs;
+	for (largest = fsp.f_max_len; largest; largest--)
+		if (fsp.f_runs[largest])
+			break;
+
+	for (i = 0; i < nr_entries; i++) {
+		de = &entries[i];
+		clusters = ((uint64_t)de->de_blocks * 512 +
+			    fsp.f_clustersize - 1) / fsp.f_clustersize;
+		bytes = clusters * fsp.f_clustersize;
+		after = claim_free_space(&fsp, clusters, 0);
+		if (after && after < de->de_extents)
+			de->de_score = (double)(de->de_extents - after) *
+				1024 * 1024 / bytes;
+		else
+			de->de_score = 0;
+	}
+	qsort(entries, nr_entries, sizeof(struct defrag_entry), entry_cmp);
+
+	for (i = 0; i < nr_entries; i++) {
+		de = &entries[i];
+		if (de->de_done)
+			continue;
+		clusters = ((uint64_t)de->de_blocks * 512 +
+			    fsp.f_clustersize - 1) / fsp.f_clustersize;
+		after = claim_free_space(&fsp, clusters, 0);
+		if (!after || after >= de->de_extents) {
+			skip_entry(de, "Not enough free space to improve... skip");
+			hopeless++;
+			continue;
+		}
+		claim_free_space(&fsp, clusters, 1);
+		de->de_planned = after;
+		planned++;
+		before += de->de_extents;
+		expected += after;
+		moving += clusters * fsp.f_clustersize;
+	}
+
+	printf("Plan for %s:\n", dev_path);
+	printf("\tFree space:\t\t%"PRIu64" clusters of %u bytes in "
+		"%"PRIu64" runs, largest %u\n",
+		free, fsp.f_clustersize, runs, largest);
+	printf("\tImprovable:\t\t%u files, %"PRIu64" extents to "
+		"%"PRIu64", %"PRIu64" bytes to move\n",
+		planned, before, expected, moving);
+	printf("\tNot improvable:\t\t%u files\n", hopeless);
+	fflush(stdout);
+
+	release_free_space(&fsp);
+}
+
+/*
+ * defrag_pool() - Defrag everything under dir_path with the pool.
+ * @dir_path:		the directory to walk.
+ * @dev_path:		the device it is on.
+ * @flags:		the nftw flags.
+ */
+static void defrag_pool(const char *dir_path, const char *dev_path,
+			int flags)
+{
+	int nr_workers = rr.r_workers;
+
+	if (load_record_done(&done_inos, &nr_done_inos))
+		PRINT_ERR("Could not load the finished files, redoing them");
+	qsort(done_inos, nr_done_inos, sizeof(ino_t), ino_cmp);
+
+	nftw64(dir_path, collect_file_ftw, FTW_OPEN_FD, flags);
+	if (should_stop) {
+		/* Nothing has been moved yet, keep the old record as is */
+		if (store_record(&rr))
+			PRINT_ERR("Record failed");
+		exit(0);
+	}
+	qsort(entries, nr_entries, sizeof(struct defrag_entry), entry_cmp);
+
+	if (mode_flag & DETAIL)
+		printf("%u of %u files are fragmented\n",
+			nr_entries, regular_count);
+
+	if (mode_flag & PLAN)
+		plan_defrag(dev_path);
+
+	/* -c -p only shows the plan */
+	if (mode_flag & STATISTIC) {
+		free_done_inos();
+		free_entries();
+		return;
+	}
+
+	if (nr_workers > nr_entries)
+		nr_workers = nr_entries;
+	if (nr_workers > 1)
+		defrag_parallel(nr_workers);
+	defrag_serial();
+
+	if (should_stop) {
+		record_pool_progress();
+		exit(0);
+	}
+
+	/* The next path starts afresh */
+	remove_record_done();
+	free_done_inos();
+	free_entries();
+}
+
 static int defrag_dir(const char *dir_path)
 {
 	//lost+found is skipped!
@@ -461,10 +1011,15 @@ static int defrag_dir(const char *dir_path)
 	if (mode_flag & STATISTIC) {
 		printf("%8d files should be defraged in [%s]\n",
 				regular_count, real_dir_path);
+		if (mode_flag & PLAN)
+			defrag_pool(dir_path, dev_path, flags);
 		return 1;
 	}
 
-	nftw64(dir_path, defrag_file_ftw, FTW_OPEN_FD, flags);
+	if (is_pool_mode())
+		defrag_pool(dir_path, dev_path, flags);
+	else
+		nftw64(dir_path, defrag_file_ftw, FTW_OPEN_FD, flags);
 	return 0;
 }
 
@@ -548,21 +1103,12 @@ static int defrag_file(char *file_path)
 	return 0;
 }
 
-static void handle_signal(int sig)
-{
-	switch (sig) {
-	case SIGTERM:
-	case SIGINT:
-		printf("\nProcess Interrupted. signale = %d\n", sig);
-		should_stop = 1;
-	}
-}
-
 static struct o2defrag_opt opt_table[] = {
 	declare_opt(DETAIL, "-v"),
 	declare_opt(STATISTIC, "-c"),
 	declare_opt(GO_ON, "-g"),
 	declare_opt(LOW_IO, "-o"),
+	declare_opt(PLAN, "-p"),
 };
 
 static void dump_mode_flag(int mode_flag)
@@ -575,14 +1121,51 @@ static void dump_mode_flag(int mode_flag)
 	}
 }
 
+/*
+ * parse_rate() - Parse a number with an optional K, M or G suffix.
+ * @arg:		the option argument.
+ * @val:		the value.
+ */
+static int parse_rate(const char *arg, uint64_t *val)
+{
+	char *end;
+	unsigned long long n;
+
+	errno = 0;
+	n = strtoull(arg, &end, 0);
+	if (errno || end == arg)
+		return -1;
+
+	switch (toupper(*end)) {
+	case 'G':
+		n <<= 10;
+	case 'M':
+		n <<= 10;
+	case 'K':
+		n <<= 10;
+		end++;
+	case '\0':
+		break;
+	default:
+		return -1;
+	}
+
+	if (*end != '\0')
+		return -1;
+
+	*val = n;
+	return 0;
+}
+
 static int parse_opt(int argc, char **argv, int *_mode_flag)
 {
 	int opt;
+	uint64_t val;
 
 	if (argc == 1)
 		return 0;
 
-	while ((opt = getopt(argc, argv, "gvclh")) != EOF) {
+	while ((opt = getopt(argc, argv, "gvclphj:b:i:")) != EOF) {
 		switch (opt) {
 		case 'v':
 			*_mode_flag |= DETAIL;
@@ -596,6 +1179,30 @@ static int parse_opt(int argc, char **argv, int *_mode_flag)
 		case 'l':
 			*_mode_flag |= LOW_IO;
 			break;
+		case 'p':
+			*_mode_flag |= PLAN;
+			break;
+		case 'j':
+			if (parse_rate(optarg, &val) || !val ||
+			    val > DEFRAG_WORKERS_MAX) {
+				fprintf(stderr, "Workers must be 1 to %d\n",
+					DEFRAG_WORKERS_MAX);
+				exit(1);
+			}
+			opt_workers = val;
+			break;
+		case 'b':
+			if (parse_rate(optarg, &opt_bandwidth)) {
+				fprintf(stderr, "Bad bandwidth: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'i':
+			if (parse_rate(optarg, &opt_iops)) {
+				fprintf(stderr, "Bad request rate: %s\n", optarg);
+				exit(1);
+			}
+			break;
 		case 'h':
 			usage(PROGRAME_NAME);
 			exit(0);
@@ -668,6 +1275,12 @@ int main(int argc, char *argv[])
 		}
 
 		fill_resume_record(&rr, _mode_flag, &argv[index], argc - index, 0);
+		/* Whatever an old run finished has nothing to do with us */
+		if (!(_mode_flag & STATISTIC))
+			remove_record_done();
+		rr.r_workers = opt_workers;
+		rr.r_bandwidth = opt_bandwidth;
+		rr.r_iops = opt_iops;
 	}
 
 	mode_flag = rr.r_mode_flag & ~GO_ON;
@@ -681,6 +1294,8 @@ int main(int argc, char *argv[])
 		succeed_count = 0;
 		regular_count = 0;
 		skipped_count = 0;
+		processed_count = 0;
+		moved_bytes = 0;
 
 		memset(dir_name, 0, PATH_MAX + 1);
 		memset(dev_name, 0, PATH_MAX + 1);
@@ -725,6 +1340,9 @@ int main(int argc, char *argv[])
 			printf("\n\tFailure:\t\t\t[ %u/%u ]\n",
 				regular_count - succeed_count - skipped_count,
 				regular_count);
+			if (is_pool_mode())
+				printf("\n\tMoved:\t\t\t\t[ %"PRIu64" bytes ]\n",
+					moved_bytes);
 		}
 
 		free_argv_node(n);
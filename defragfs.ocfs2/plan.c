@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "ocfs2/ocfs2.h"
+#include "ocfs2/bitops.h"
+
+#include <plan.h>
+#include <libdefrag.h>
+
+static void add_group_runs(struct free_space *fsp, struct ocfs2_group_desc *bg)
+{
+	int start, end = 0;
+
+	while (end < bg->bg_bits) {
+		start = ocfs2_find_next_bit_clear(bg->bg_bitmap, bg->bg_bits,
+						  end);
+		if (start >= bg->bg_bits)
+			break;
+		end = ocfs2_find_next_bit_set(bg->bg_bitmap, bg->bg_bits,
+					      start);
+		fsp->f_runs[end - start]++;
+		fsp->f_nr_runs++;
+	}
+}
+
+static errcode_t scan_global_bitmap(ocfs2_filesys *fs,
+				    struct ocfs2_chain_list *cl,
+				    struct free_space *fsp, uint64_t clusters)
+{
+	errcode_t ret;
+	int i;
+	uint64_t blkno, seen = 0, num_gds;
+	char *buf = NULL;
+	struct ocfs2_group_desc *bg;
+
+	num_gds = (clusters + cl->cl_cpg - 1) / cl->cl_cpg;
+
+	ret = ocfs2_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		return ret;
+	bg = (struct ocfs2_group_desc *)buf;
+
+	for (i = 0; i < cl->cl_next_free_rec; i++) {
+		if (!cl->cl_recs[i].c_free)
+			continue;
+
+		for (blkno = cl->cl_recs[i].c_blkno; blkno;
+		     blkno = bg->bg_next_group) {
+			/* A chain that loops would keep us here forever */
+			if (++seen > num_gds) {
+				ret = OCFS2_ET_CORRUPT_CHAIN;
+				goto out;
+			}
+			ret = ocfs2_read_group_desc(fs, blkno, buf);
+			if (ret)
+				goto out;
+			if (bg->bg_bits > fsp->f_max_len) {
+				ret = OCFS2_ET_CORRUPT_CHAIN;
+				goto out;
+			}
+			if (bg->bg_free_bits_count)
+				add_group_runs(fsp, bg);
+		}
+	}
+
+out:
+	ocfs2_free(&buf);
+	return ret;
+}
+
+/*
+ * load_free_space() - Index the free space of a mounted volume.
+ * @dev:		the device.
+ * @fsp:		the index.
+ *
+ * This reads the global bitmap under the live filesystem, so it is
+ * only as good as the last time the bitmap was written.  That is good
+ * enough to plan with.
+ */
+int load_free_space(const char *dev, struct free_space *fsp)
+{
+	errcode_t ret;
+	uint64_t gb_inode;
+	char *block = NULL;
+	ocfs2_filesys *fs = NULL;
+	struct ocfs2_dinode *gb_di;
+	struct ocfs2_chain_list *cl;
+
+	memset(fsp, 0, sizeof(struct free_space));
+
+	initialize_ocfs_error_table();
+	ret = ocfs2_open(dev, OCFS2_FLAG_RO, 0, 0, &fs);
+	if (ret) {
+		PRINT_FILE_ERR(dev, error_message(ret));
+		return -1;
+	}
+
+	ret = ocfs2_malloc_block(fs->fs_io, &block);
+	if (ret)
+		goto out;
+	gb_di = (struct ocfs2_dinode *)block;
+
+	ret = ocfs2_lookup_system_inode(fs, GLOBAL_BITMAP_SYSTEM_INODE,
+					0, &gb_inode);
+	if (!ret)
+		ret = ocfs2_read_inode(fs, gb_inode, block);
+	if (ret)
+		goto out;
+
+	cl = &gb_di->id2.i_chain;
+	fsp->f_clustersize = fs->fs_clustersize;
+	fsp->f_max_len = cl->cl_cpg;
+	fsp->f_free = gb_di->id1.bitmap1.i_total - gb_di->id1.bitmap1.i_used;
+	fsp->f_runs = do_malloc((fsp->f_max_len + 1) * sizeof(uint64_t));
+
+	ret = scan_global_bitmap(fs, cl, fsp, gb_di->id1.bitmap1.i_total);
+
+out:
+	if (ret) {
+		PRINT_FILE_ERR(dev, error_message(ret));
+		release_free_space(fsp);
+	}
+	if (block)
+		ocfs2_free(&block);
+	ocfs2_close(fs);
+	return ret ? -1 : 0;
+}
+
+void release_free_space(struct free_space *fsp)
+{
+	free(fsp->f_runs);
+	fsp->f_runs = NULL;
+	fsp->f_nr_runs = 0;
+}
+
+static void take_run(struct free_space *fsp, uint32_t len, uint64_t need)
+{
+	fsp->f_runs[len]--;
+	fsp->f_nr_runs--;
+	if (len > need) {
+		fsp->f_runs[len - need]++;
+		fsp->f_nr_runs++;
+	}
+}
+
+/*
+ * claim_free_space() - Find room for a file in the free space.
+ * @fsp:		the index.
+ * @clusters:		the file's size in clusters.
+ * @commit:		take the space, rather than just look.
+ *
+ * The best fitting run is used if one is big enough.  Otherwise the
+ * file is spread over the largest runs, as few as will hold it.  The
+ * clusters the file gives back are not counted; they are as scattered
+ * as the file was, so they would not help the next file much.
+ *
+ * Returns how many extents the file would end up in, or 0 if there
+ * is not room for it at all.
+ */
+unsigned int claim_free_space(struct free_space *fsp, uint64_t clusters,
+			      int commit)
+{
+	uint64_t len, nr, left, need = clusters;
+	unsigned int pieces = 0;
+
+	if (!clusters || clusters > fsp->f_free)
+		return 0;
+
+	for (len = clusters; len <= fsp->f_max_len; len++) {
+		if (!fsp->f_runs[len])
+			continue;
+		if (commit) {
+			take_run(fsp, len, need);
+			fsp->f_free -= clusters;
+		}
+		return 1;
+	}
+
+	/* Every run left is smaller than the file */
+	for (len = fsp->f_max_len; len && need; len--) {
+		nr = fsp->f_runs[len];
+		if (!nr)
+			continue;
+		if (nr > need / len)
+			nr = need / len;
+		left = fsp->f_runs[len] - nr;
+		pieces += nr;
+		need -= nr * len;
+		if (commit) {
+			fsp->f_runs[len] -= nr;
+			fsp->f_nr_runs -= nr;
+		}
+
+		/* The tail fits in one more run of this length */
+		if (need && need < len && left) {
+			pieces++;
+			if (commit)
+				take_run(fsp, len, need);
+			need = 0;
+		}
+	}
+
+	if (need)
+		return 0;
+
+	if (commit)
+		fsp->f_free -= clusters;
+	return pieces;
+}
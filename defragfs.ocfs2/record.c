@@ -9,6 +9,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include <ocfs2-kernel/kernel-list.h>
 #include <record.h>
@@ -18,12 +19,16 @@
 #define MAX_RECORD_FILE_SIZE (2<<20)
 
 static char record_path[PATH_MAX] = "/tmp/"RECORD_FILE_NAME;
+static char done_path[PATH_MAX] = "/tmp/"RECORD_DONE_FILE_NAME;
 
 void mv_record(struct resume_record *dst, struct resume_record *src)
 {
 	dst->r_argc = src->r_argc;
 	dst->r_inode_no = src->r_inode_no;
 	dst->r_mode_flag = src->r_mode_flag;
+	dst->r_workers = src->r_workers;
+	dst->r_bandwidth = src->r_bandwidth;
+	dst->r_iops = src->r_iops;
 	INIT_LIST_HEAD(&dst->r_argvs);
 	list_splice(&src->r_argvs, &dst->r_argvs);
 }
@@ -38,6 +43,12 @@ void dump_record(char *base_name, struct resume_record *rr,
 
 		printf("%s", base_name);
 		dump_mode_flag(mode_flag);
+		if (rr->r_workers > 1)
+			printf(" -j %d ", rr->r_workers);
+		if (rr->r_bandwidth)
+			printf(" -b %"PRIu64"K ", rr->r_bandwidth >> 10);
+		if (rr->r_iops)
+			printf(" -i %"PRIu64" ", rr->r_iops);
 
 		list_for_each(pos, &rr->r_argvs) {
 			n = list_entry(pos, struct argv_node, a_list);
@@ -120,7 +131,7 @@ static int __store_record(int fd, struct resume_record *rr)
 {
 	struct list_head *pos;
 	struct argv_node *n;
-	int index = 0;
+	int index = 0, argc = 0;
 	unsigned char *buf = do_malloc(MAX_RECORD_FILE_SIZE);
 	int len;
 	int ret;
@@ -138,7 +149,10 @@ static int __store_record(int fd, struct resume_record *rr)
 		}
 		strcpy((char *)&buf[index], n->a_path);
 		index += len;
+		argc++;
 	}
+	/* Paths already finished have been dropped from the list */
+	((struct resume_record *)buf)->r_argc = argc;
 
 	*(int *)&buf[index] = do_csum(buf, index);
 	index += sizeof(int);
@@ -163,6 +177,9 @@ void fill_resume_record(struct resume_record *rr,
 	rr->r_mode_flag = mode_flag;
 	rr->r_argc = argc;
 	rr->r_inode_no = inode_no;
+	rr->r_workers = 1;
+	rr->r_bandwidth = 0;
+	rr->r_iops = 0;
 	INIT_LIST_HEAD(&rr->r_argvs);
 	for (i = 0; i < argc; i++) {
 		len = strlen(argv[i]) + 1;
@@ -182,6 +199,76 @@ int remove_record(void)
 		perror("while deleting record file");
 		return -errno;
 	}
+	return remove_record_done();
+}
+
+/*
+ * The pool keeps the inodes it has finished in a log beside the
+ * record.  The log only grows, so it is appended to rather than
+ * rewritten with the record at every checkpoint.
+ */
+int append_record_done(ino_t *inos, int nr)
+{
+	int fd, ret = 0;
+	size_t len = nr * sizeof(ino_t);
+
+	fd = open(done_path, O_APPEND | O_CREAT | O_WRONLY, 0600);
+	if (fd < 0) {
+		perror("while opening record done file");
+		return -errno;
+	}
+
+	if (do_write(fd, inos, len) != len || fsync(fd))
+		ret = -1;
+
+	close(fd);
+	return ret;
+}
+
+/* A torn append at the end of the log is dropped */
+int load_record_done(ino_t **inos, unsigned int *nr)
+{
+	int fd;
+	struct stat s;
+	ino_t *buf = NULL;
+
+	*inos = NULL;
+	*nr = 0;
+
+	fd = open(done_path, O_RDONLY);
+	if (fd < 0)
+		return (errno == ENOENT) ? 0 : -errno;
+
+	if (fstat(fd, &s))
+		goto error;
+
+	if (s.st_size >= sizeof(ino_t)) {
+		buf = do_malloc(s.st_size);
+		if (do_read(fd, buf, s.st_size) != s.st_size)
+			goto error;
+		*inos = buf;
+		*nr = s.st_size / sizeof(ino_t);
+	}
+
+	close(fd);
+	return 0;
+
+error:
+	if (buf)
+		free(buf);
+	close(fd);
+	return -1;
+}
+
+int remove_record_done(void)
+{
+	int ret;
+
+	ret = unlink(done_path);
+	if (ret && errno != ENOENT) {
+		perror("while deleting record done file");
+		return -errno;
+	}
 	return 0;
 }
 
@@ -213,7 +300,7 @@ static int __load_record(int fd, struct resume_record *rr)
 	struct resume_record *rr_tmp = NULL;
 	char **argv = NULL;
 	int argc;
-	char *p;
+	char *p, *end;
 	int len = 0;
 
 	if (read_record(fd, &rr_tmp, &len))
@@ -223,18 +310,30 @@ static int __load_record(int fd, struct resume_record *rr)
 		goto out;
 
 
+	/* A record from another version can still checksum fine */
+	if (len < RECORD_HEADER_LEN + sizeof(unsigned int))
+		goto out;
+	end = (char *)rr_tmp + len - sizeof(unsigned int);
+
 	argc = rr_tmp->r_argc;
+	if (argc <= 0 || argc > end - (char *)rr_tmp)
+		goto out;
 
 	argv = do_malloc(sizeof(char *) * argc);
 
 	p = (void *)rr_tmp + RECORD_HEADER_LEN;
-	for (i = 0; i < argc; i++, p++) {
+	for (i = 0; i < argc; i++) {
+		if (p >= end || !memchr(p, '\0', end - p))
+			goto out;
 		argv[i] = (char *)p;
 		p += strlen(p) + 1;
 	}
 
 	fill_resume_record(rr, rr_tmp->r_mode_flag,
 			argv, argc, rr_tmp->r_inode_no);
+	rr->r_workers = rr_tmp->r_workers;
+	rr->r_bandwidth = rr_tmp->r_bandwidth;
+	rr->r_iops = rr_tmp->r_iops;
 
 	ret = 0;
 out:
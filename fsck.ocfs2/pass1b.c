@@ -978,7 +978,8 @@ static void walk_cwd(struct dir_scan_context *scan)
 	free(de);
  
 	ret = ocfs2_dir_iterate(scan->ds_ost->ost_fs, scan->ds_ino,
-				OCFS2_DIRENT_FLAG_EXCLUDE_DOTS, NULL,
+				OCFS2_DIRENT_FLAG_EXCLUDE_DOTS |
+				OCFS2_DIRENT_FLAG_READAHEAD, NULL,
 				walk_iterate, scan);
 	if (ret)
 		pass1c_warn(ret);
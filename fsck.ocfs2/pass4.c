@@ -274,7 +274,8 @@ errcode_t replay_orphan_dir(o2fsck_state *ost, int slot_recovery)
 		ctxt.orphan_dir = ino;
 		ost->ost_err = 0;
 		ret = ocfs2_dir_iterate(ost->ost_fs, ino,
-					OCFS2_DIRENT_FLAG_EXCLUDE_DOTS, NULL,
+					OCFS2_DIRENT_FLAG_EXCLUDE_DOTS |
+					OCFS2_DIRENT_FLAG_READAHEAD, NULL,
 					replay_orphan_iterate, &ctxt);
 		if (!ret)
 			ret = ost->ost_err;
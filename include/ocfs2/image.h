@@ -29,8 +29,12 @@
  * 1. Packed - This format(default) contains a ocfs2 image header, packed
  * 		metadata blocks and a bitmap.
  * 2. raw    - A raw image is a sparse file containing the metadata blocks.
+ * 3. Compressed - Like packed, but the metadata blocks are stored in
+ * 		independently compressed chunks (version 2 images).
+ * 4. Delta  - Like packed, but holding only the blocks that changed since
+ * 		a base image (version 3 images).
  *
- * 		Usage: o2image [-rI] <device> <imagefile>
+ * 		Usage: o2image [-rzI] [-b base_image] <device> <imagefile>
  *
  * Packed format contains bitmap towards the end of the image-file. Each bit in
  * the bitmap represents a block in the filesystem.
@@ -41,18 +45,49 @@
  * Raw image is a sparse file containing metadata blocks at the same offset as
  * the filesystem.
  *
+ * A compressed image has the ocfs2 image header, then hdr_chunkcnt chunks,
+ * then the bitmap, and finally a chunk index of hdr_chunkcnt + 1 __le64
+ * byte offsets.  Index entry n is where chunk n starts, and the last entry
+ * is where the bitmap starts.  Chunk n holds image blocks
+ * [n * hdr_chunkblks, (n + 1) * hdr_chunkblks), deflated with zlib.  A
+ * chunk that would not shrink is stored as is.  The index sits at the end,
+ * so an image can be written to a pipe.  Readers find the index from the
+ * file size and inflate only the chunks they touch.
+ *
+ * A delta image (version 3) is laid out like a packed one, but holds only
+ * the metadata blocks that differ from those in an earlier image, its
+ * base.  After the header come the blocks it holds, then the bitmap of all
+ * metadata blocks, then a second bitmap of the blocks this image holds.
+ * The bitmaps sit at the end, so a delta can be written to a pipe too.
+ * hdr_base names the base, and the base's hdr_timestamp and hdr_imgblkcnt
+ * are kept to check that it is the same image.  Opening a delta opens its
+ * base; metadata blocks the delta doesn't hold are read from there.  A
+ * base may itself be a delta.
+ *
  * debugfs.ocfs2 is modified to detect image-file when the image-file is
  * specified with -i option.
  */
 
 #define OCFS2_IMAGE_MAGIC		0x72a3d45f
 #define OCFS2_IMAGE_DESC 		"OCFS2 IMAGE"
-#define OCFS2_IMAGE_VERSION		1
+#define OCFS2_IMAGE_VERSION		3	/* highest we understand */
+#define OCFS2_IMAGE_VERSION_PACKED	1
+#define OCFS2_IMAGE_VERSION_COMPRESSED	2
+#define OCFS2_IMAGE_VERSION_DELTA	3
 #define OCFS2_IMAGE_READ_CHAIN_NO	0
 #define OCFS2_IMAGE_READ_INODE_NO	1
 #define OCFS2_IMAGE_READ_INODE_YES	2
 #define OCFS2_IMAGE_BITMAP_BLOCKSIZE	4096
 #define OCFS2_IMAGE_BITS_IN_BLOCK	(OCFS2_IMAGE_BITMAP_BLOCKSIZE * 8)
+/* 64-bit bitmap words covered by each rank index entry */
+#define OCFS2_IMAGE_RANK_WORDS		8
+#define OCFS2_IMAGE_RANKS_IN_BLOCK	(OCFS2_IMAGE_BITMAP_BLOCKSIZE / \
+					 (OCFS2_IMAGE_RANK_WORDS * 8))
+
+/* Longest base image path a delta can record, with its NUL */
+#define OCFS2_IMAGE_BASE_LEN		256
+/* How many deltas deep we follow bases */
+#define OCFS2_IMAGE_MAX_DEPTH		64
 
 /* on disk ocfs2 image header format */
 struct ocfs2_image_hdr {
@@ -66,6 +101,22 @@ struct ocfs2_image_hdr {
 	__le64	hdr_bmpblksz;		/* bitmap block size */
 	__le64	hdr_superblkcnt;	/* number of super blocks */
 	__le64	hdr_superblocks[OCFS2_MAX_BACKUP_SUPERBLOCKS];
+	__le64	hdr_chunkblks;		/* blocks per chunk (compressed) */
+	__le64	hdr_chunkcnt;		/* number of chunks (compressed) */
+	__le64	hdr_base_imgblkcnt;	/* hdr_imgblkcnt of the base (delta) */
+	__le32	hdr_base_timestamp;	/* hdr_timestamp of the base (delta) */
+	__le32	hdr_reserved1;
+	__u8	hdr_base[OCFS2_IMAGE_BASE_LEN];	/* path to the base (delta) */
+};
+
+/* Uncompressed size of a chunk, and how many inflated chunks we keep */
+#define OCFS2_IMAGE_CHUNK_SIZE		(128 * 1024)
+#define OCFS2_IMAGE_CHUNK_CACHE		8
+
+struct ocfs2_image_chunk {
+	uint64_t	ic_chunk;
+	int		ic_valid;
+	char		*ic_buf;
 };
 
 /*
@@ -97,6 +148,25 @@ struct ocfs2_image_state {
 	int		ost_bpc; 		/* blocks per cluster */
 	int 		ost_superblkcnt; 	/* number of super blocks */
 	ocfs2_image_bitmap_arr	*ost_bmparr; 	/* points to bitmap blocks */
+	/*
+	 * Rank index.  For each run of OCFS2_IMAGE_RANK_WORDS words in a
+	 * bitmap block, the number of bits set before it in that block.
+	 * Together with arr_set_bit_cnt it turns a disk block number into
+	 * an image block number without walking the bitmap.
+	 */
+	uint16_t	*ost_rank;
+	/* Only set up for compressed images */
+	uint64_t	ost_chunkblks;		/* blocks per chunk, 0 if none */
+	uint64_t	ost_chunkcnt;
+	uint64_t	*ost_chunkoff;		/* chunk index, in bytes */
+	char		*ost_zbuf;		/* compressed chunk buffer */
+	int		ost_zfd;		/* buffered fd on the image */
+	struct ocfs2_image_chunk ost_cache[OCFS2_IMAGE_CHUNK_CACHE];
+	uint32_t	ost_timestamp;		/* hdr_timestamp */
+	/* Only set up for delta images */
+	struct ocfs2_image_state *ost_held;	/* bitmap of blocks held */
+	ocfs2_filesys	*ost_base;		/* the image we layer over */
+	char		*ost_dbuf;		/* one block, for partial reads */
 };
 
 errcode_t ocfs2_image_load_bitmap(ocfs2_filesys *ofs);
@@ -104,5 +174,11 @@ void ocfs2_image_free_bitmap(ocfs2_filesys *ofs);
 errcode_t ocfs2_image_alloc_bitmap(ocfs2_filesys *ofs);
 void ocfs2_image_mark_bitmap(ocfs2_filesys *ofs, uint64_t blkno);
 int ocfs2_image_test_bit(ocfs2_filesys *ofs, uint64_t blkno);
+int ocfs2_image_test_bits(ocfs2_filesys *ofs, uint64_t blkno, int count);
 uint64_t ocfs2_image_get_blockno(ocfs2_filesys *ofs, uint64_t blkno);
+errcode_t ocfs2_image_read_chunked(ocfs2_filesys *ofs, uint64_t blkno,
+				   int count, char *data);
+errcode_t ocfs2_image_read_delta(ocfs2_filesys *ofs, uint64_t blkno,
+				 int count, char *data);
+void ocfs2_image_build_index(ocfs2_filesys *ofs, uint64_t *bits_set);
 void ocfs2_image_swap_header(struct ocfs2_image_hdr *hdr);
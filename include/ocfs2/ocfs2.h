@@ -105,6 +105,7 @@
 #define OCFS2_DIRENT_FLAG_INCLUDE_REMOVED	0x02
 #define OCFS2_DIRENT_FLAG_EXCLUDE_DOTS		0x04
 #define OCFS2_DIRENT_FLAG_INCLUDE_TRAILER	0x08
+#define OCFS2_DIRENT_FLAG_READAHEAD		0x10
 
 /* Return flags for the chain iterator functions */
 #define OCFS2_CHAIN_CHANGED	0x01
@@ -177,6 +178,8 @@ struct _ocfs2_quota_info {
 
 typedef struct _ocfs2_quota_info ocfs2_quota_info;
 
+struct ocfs2_dcache;
+
 struct _ocfs2_filesys {
 	char *fs_devname;
 	uint32_t fs_flags;
@@ -205,6 +208,9 @@ struct _ocfs2_filesys {
 
 	ocfs2_quota_info qinfo[MAXQUOTAS];
 
+	/* Directory entry cache, see ocfs2_dcache_init() */
+	struct ocfs2_dcache *fs_dcache;
+
 	/* Reserved for the use of the calling application. */
 	void *fs_private;
 };
@@ -358,8 +364,21 @@ struct io_vec_unit {
 	uint32_t	ivu_buflen;
 };
 
+/*
+ * Vectored I/O.  All units are submitted as async I/O and the call
+ * returns when every unit has completed.  Like io_read_block(), these
+ * know nothing of o2image files.
+ */
 errcode_t io_vec_read_blocks(io_channel *channel, struct io_vec_unit *ivus,
 			     int count);
+errcode_t io_vec_write_blocks(io_channel *channel, struct io_vec_unit *ivus,
+			      int count);
+
+/*
+ * Zero a range of blocks, offloading the work to the device or the
+ * image file's filesystem when it can.
+ */
+errcode_t io_zero_blocks(io_channel *channel, int64_t blkno, int64_t count);
 
 errcode_t ocfs2_read_super(ocfs2_filesys *fs, uint64_t superblock, char *sb);
 /* Writes the main superblock at OCFS2_SUPER_BLOCK_BLKNO */
@@ -446,6 +465,10 @@ errcode_t ocfs2_write_journal_superblock(ocfs2_filesys *fs, uint64_t blkno,
 					 char *jsb_buf);
 errcode_t ocfs2_make_journal(ocfs2_filesys *fs, uint64_t blkno,
 			     uint32_t clusters, ocfs2_fs_options *features);
+errcode_t ocfs2_make_journals(ocfs2_filesys *fs, uint64_t *blknos,
+			      int count, uint32_t clusters,
+			      ocfs2_fs_options *features);
+errcode_t ocfs2_zero_journal(ocfs2_cached_inode *ci);
 errcode_t ocfs2_journal_clear_features(journal_superblock_t *jsb,
 				       ocfs2_fs_options *features);
 errcode_t ocfs2_journal_set_features(journal_superblock_t *jsb,
@@ -527,6 +550,11 @@ errcode_t ocfs2_swap_dir_entries_to_cpu(void *buf, uint64_t bytes);
 void ocfs2_swap_dir_trailer(struct ocfs2_dir_block_trailer *trailer);
 errcode_t ocfs2_read_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
 			       uint64_t block, void *buf);
+errcode_t ocfs2_read_dir_blocks(ocfs2_filesys *fs, struct ocfs2_dinode *di,
+				uint64_t block, int count, void *buf,
+				int *bad);
+errcode_t ocfs2_validate_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
+				   void *buf);
 errcode_t ocfs2_write_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
 				uint64_t block, void *buf);
 unsigned int ocfs2_dir_trailer_blk_off(ocfs2_filesys *fs);
@@ -600,6 +628,30 @@ errcode_t ocfs2_lookup(ocfs2_filesys *fs, uint64_t dir,
 		       const char *name, int namelen, char *buf,
 		       uint64_t *inode);
 
+/*
+ * Directory entry cache.  Once enabled with ocfs2_dcache_init(),
+ * ocfs2_lookup() remembers found and missing names.  The cache is
+ * invalidated by libocfs2's directory modifiers only, so don't enable it
+ * if the application rewrites directories behind the library's back.
+ */
+struct ocfs2_dcache_stats {
+	uint32_t ds_hits;
+	uint32_t ds_negative_hits;
+	uint32_t ds_misses;
+	uint32_t ds_inserts;
+	uint32_t ds_removes;
+};
+
+errcode_t ocfs2_dcache_init(ocfs2_filesys *fs, unsigned int nr_entries);
+void ocfs2_dcache_free(ocfs2_filesys *fs);
+int ocfs2_dcache_lookup(ocfs2_filesys *fs, uint64_t dir, const char *name,
+			int namelen, uint64_t *ino);
+void ocfs2_dcache_insert(ocfs2_filesys *fs, uint64_t dir, const char *name,
+			 int namelen, uint64_t ino);
+void ocfs2_dcache_invalidate_dir(ocfs2_filesys *fs, uint64_t dir);
+void ocfs2_dcache_get_stats(ocfs2_filesys *fs,
+			    struct ocfs2_dcache_stats *stats);
+
 errcode_t ocfs2_lookup_system_inode(ocfs2_filesys *fs, int type,
 				    int slot_num, uint64_t *blkno);
 
@@ -756,8 +808,12 @@ void ocfs2_set_inode_data_inline(ocfs2_filesys *fs, struct ocfs2_dinode *di);
 errcode_t ocfs2_convert_inline_data_to_extents(ocfs2_cached_inode *ci);
 errcode_t ocfs2_new_inode(ocfs2_filesys *fs, uint64_t *ino, int mode);
 errcode_t ocfs2_new_system_inode(ocfs2_filesys *fs, uint64_t *ino, int mode, int flags);
+errcode_t ocfs2_new_system_inodes(ocfs2_filesys *fs, int *types,
+				  uint64_t *inos, int count);
 errcode_t ocfs2_delete_inode(ocfs2_filesys *fs, uint64_t ino);
 errcode_t ocfs2_new_extent_block(ocfs2_filesys *fs, uint64_t *blkno);
+errcode_t ocfs2_reserve_extent_blocks(ocfs2_filesys *fs, int slot,
+				      uint32_t count);
 errcode_t ocfs2_new_dx_root(ocfs2_filesys *fs, struct ocfs2_dinode *di, uint64_t *dr_blkno);
 errcode_t ocfs2_delete_extent_block(ocfs2_filesys *fs, uint64_t blkno);
 errcode_t ocfs2_delete_dx_root(ocfs2_filesys *fs, uint64_t dr_blkno);
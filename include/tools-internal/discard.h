@@ -0,0 +1,51 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * discard.h
+ *
+ * Discard engine for the tools.
+ *
+ * Copyright (C) 2026 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef _INTERNAL_DISCARD_H
+#define _INTERNAL_DISCARD_H
+
+/* How many discards are in flight by default */
+#define TOOLS_DISCARD_WORKERS	4
+
+struct tools_discard_stats {
+	uint64_t ds_chunk_size;		/* bytes per BLKDISCARD */
+	uint64_t ds_discarded;		/* bytes done from the start */
+	uint64_t ds_bytes;		/* bytes done in all */
+	uint64_t ds_usecs;		/* time taken */
+};
+
+/*
+ * Discard len bytes starting at byte offset start of the block device
+ * open on fd.
+ *
+ * The range is cut into chunks sized from the device's
+ * discard_granularity and discard_max_bytes, which are handed to up to
+ * nr_workers worker processes.  BLKDISCARD is synchronous, so this is
+ * the only way to have more than one in flight.  Progress is shown
+ * through tools_progress.
+ *
+ * Returns 0 or an errno value; EOPNOTSUPP means the device can't
+ * discard.  Either way, stats->ds_discarded is how far from start the
+ * range is known to be discarded, so a failed or interrupted discard
+ * can be resumed from start + ds_discarded.
+ */
+int tools_discard(int fd, uint64_t start, uint64_t len, int nr_workers,
+		  struct tools_discard_stats *stats);
+
+#endif  /* _INTERNAL_DISCARD_H */
@@ -0,0 +1,71 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * workers.h
+ *
+ * Worker processes for the tools.
+ *
+ * Copyright (C) 2026 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef _INTERNAL_WORKERS_H
+#define _INTERNAL_WORKERS_H
+
+#include <sys/types.h>
+
+/*
+ * When a tool needs more in flight than aio can give it, say a
+ * synchronous ioctl or CPU work like deflate, it forks workers.  The
+ * tools don't use threads and libocfs2 is not thread safe, so a worker
+ * is a process with its own copy of the tool's state.  It sends back
+ * fixed size reports, and maybe data, over a pipe.
+ *
+ * Each worker runs func(worker, nr_workers, fd, priv) and exits when it
+ * returns.  fd is the write end of its pipe.  Workers should split the
+ * work by their number, so that anything a worker didn't report can be
+ * done by the caller afterwards.
+ */
+typedef void (*tools_worker_func)(int worker, int nr_workers, int fd,
+				  void *priv);
+
+/* Give each worker a pipe of its own rather than one for all of them */
+#define TOOLS_WORKERS_OWN_PIPE	0x01
+
+struct tools_workers {
+	int tw_nr_workers;		/* how many are running */
+	int tw_flags;
+	pid_t *tw_pids;
+	int *tw_fds;			/* read ends, one per worker */
+};
+
+/*
+ * Fork up to nr_workers workers.  Returns how many were started, which
+ * may be fewer than asked for, or 0 if none could be.  Without
+ * TOOLS_WORKERS_OWN_PIPE, every tw_fds[] is the same pipe.
+ */
+int tools_start_workers(struct tools_workers *tw, int nr_workers, int flags,
+			tools_worker_func func, void *priv);
+
+/* Send every worker a SIGTERM */
+void tools_kill_workers(struct tools_workers *tw);
+
+/* Close the pipes and wait for every worker to exit */
+void tools_stop_workers(struct tools_workers *tw);
+
+/*
+ * Read or write all of len bytes, retrying on EINTR.  Returns 0, or -1
+ * on an error or end of file.
+ */
+int tools_full_read(int fd, void *buf, size_t len);
+int tools_full_write(int fd, const void *buf, size_t len);
+
+#endif  /* _INTERNAL_WORKERS_H */
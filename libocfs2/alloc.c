@@ -322,6 +322,117 @@ out:
 	return ret;
 }
 
+/*
+ * Add groups to a chain allocator until it has at least count free bits.
+ */
+static errcode_t ocfs2_chain_reserve_bits(ocfs2_filesys *fs,
+					  ocfs2_cached_inode *cinode,
+					  uint32_t count)
+{
+	errcode_t ret = 0;
+	struct ocfs2_dinode *di = cinode->ci_inode;
+
+	while ((di->id1.bitmap1.i_total - di->id1.bitmap1.i_used) < count) {
+		ret = ocfs2_chain_add_group(fs, cinode);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+/*
+ * Allocate count system inodes of the given types in one go.  The
+ * allocator is grown once up front and written back once at the end,
+ * rather than for every inode.
+ */
+errcode_t ocfs2_new_system_inodes(ocfs2_filesys *fs, int *types,
+				  uint64_t *inos, int count)
+{
+	errcode_t ret;
+	int i, type, allocated = 0, written = 0;
+	char *buf = NULL;
+	uint64_t *gd_blknos = NULL;
+	uint16_t *suballoc_bits = NULL;
+	struct ocfs2_dinode *di;
+
+	ret = ocfs2_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		goto out;
+
+	ret = ocfs2_malloc0(sizeof(uint64_t) * count, &gd_blknos);
+	if (ret)
+		goto out;
+
+	ret = ocfs2_malloc0(sizeof(uint16_t) * count, &suballoc_bits);
+	if (ret)
+		goto out;
+
+	ret = ocfs2_load_allocator(fs, GLOBAL_INODE_ALLOC_SYSTEM_INODE,
+				   0, &fs->fs_system_inode_alloc);
+	if (ret)
+		goto out;
+
+	ret = ocfs2_chain_reserve_bits(fs, fs->fs_system_inode_alloc, count);
+	if (ret)
+		goto out;
+
+	for (allocated = 0; allocated < count; allocated++) {
+		ret = ocfs2_chain_alloc(fs, fs->fs_system_inode_alloc,
+					&gd_blknos[allocated],
+					&suballoc_bits[allocated],
+					&inos[allocated]);
+		if (ret)
+			goto out_free;
+	}
+
+	ret = ocfs2_write_chain_allocator(fs, fs->fs_system_inode_alloc);
+	if (ret)
+		goto out_free;
+
+	for (i = 0; i < count; i++) {
+		type = types[i];
+		memset(buf, 0, fs->fs_blocksize);
+		di = (struct ocfs2_dinode *)buf;
+		ocfs2_init_inode(fs, di, -1, gd_blknos[i], suballoc_bits[i],
+				 inos[i], ocfs2_system_inodes[type].si_mode,
+				 (ocfs2_system_inodes[type].si_iflags |
+				  OCFS2_VALID_FL | OCFS2_SYSTEM_FL));
+
+		ret = ocfs2_write_inode(fs, inos[i], buf);
+		if (ret)
+			goto out_delete;
+		written++;
+	}
+
+	goto out;
+
+out_delete:
+	/* The allocator is already on disk, so give the bits back there */
+	for (i = 0; i < count; i++) {
+		if (i < written)
+			ocfs2_delete_inode(fs, inos[i]);
+		else
+			ocfs2_chain_free_with_io(fs, fs->fs_system_inode_alloc,
+						 inos[i]);
+	}
+	goto out;
+
+out_free:
+	for (i = 0; i < allocated; i++)
+		ocfs2_chain_free(fs, fs->fs_system_inode_alloc, inos[i]);
+
+out:
+	if (suballoc_bits)
+		ocfs2_free(&suballoc_bits);
+	if (gd_blknos)
+		ocfs2_free(&gd_blknos);
+	if (buf)
+		ocfs2_free(&buf);
+
+	return ret;
+}
+
 errcode_t ocfs2_delete_inode(ocfs2_filesys *fs, uint64_t ino)
 {
 	errcode_t ret;
@@ -330,6 +441,8 @@ errcode_t ocfs2_delete_inode(ocfs2_filesys *fs, uint64_t ino)
 	int16_t slot;
 	ocfs2_cached_inode **inode_alloc;
 
+	ocfs2_dcache_invalidate_dir(fs, ino);
+
 	ret = ocfs2_malloc_block(fs->fs_io, &buf);
 	if (ret)
 		return ret;
@@ -473,6 +586,23 @@ out:
 	return ret;
 }
 
+/*
+ * Make sure the extent allocator of the given slot can hand out count
+ * blocks without stopping to add a group.
+ */
+errcode_t ocfs2_reserve_extent_blocks(ocfs2_filesys *fs, int slot,
+				      uint32_t count)
+{
+	errcode_t ret;
+
+	ret = ocfs2_load_allocator(fs, EXTENT_ALLOC_SYSTEM_INODE, slot,
+				   &fs->fs_eb_allocs[slot]);
+	if (ret)
+		return ret;
+
+	return ocfs2_chain_reserve_bits(fs, fs->fs_eb_allocs[slot], count);
+}
+
 errcode_t ocfs2_delete_extent_block(ocfs2_filesys *fs, uint64_t blkno)
 {
 	errcode_t ret;
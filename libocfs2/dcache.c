@@ -0,0 +1,292 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * dcache.c
+ *
+ * Directory entry cache for the OCFS2 userspace library.
+ *
+ * Copyright (C) 2026 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License, version 2,  as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA  02110-1301 USA.
+ */
+
+#define _XOPEN_SOURCE 600 /* Triggers magic in features.h */
+#define _LARGEFILE64_SOURCE
+
+#include <string.h>
+#include <inttypes.h>
+
+#include "ocfs2/ocfs2.h"
+#include "ocfs2/kernel-rbtree.h"
+
+
+/*
+ * The dentry cache remembers the result of ocfs2_lookup() for a
+ * (directory, name) pair.  A found name caches its inode number; a
+ * missing name caches a negative entry (de_ino == 0) so that repeated
+ * probes for something that isn't there don't rescan the directory.
+ *
+ * Entries are kept in an rbtree sorted by directory block number first,
+ * then name hash, then name.  That puts every entry of a directory next
+ * to each other, so invalidating a directory is one search plus a walk.
+ * A fixed pool of entries is recycled through an LRU.
+ *
+ * The cache only knows about changes made through libocfs2.  The
+ * directory modifiers (link, unlink, expand_dir, init_dir,
+ * write_dir_block and delete_inode) drop the entries of the directory
+ * they touch.
+ */
+struct ocfs2_dcache_entry {
+	struct rb_node de_node;
+	struct list_head de_list;
+	uint64_t de_dir;
+	uint64_t de_ino;
+	uint32_t de_hash;
+	int de_namelen;
+	char de_name[OCFS2_MAX_FILENAME_LEN];
+};
+
+struct ocfs2_dcache {
+	unsigned int dc_nr_entries;
+	struct list_head dc_lru;
+	struct rb_root dc_lookup;
+	struct ocfs2_dcache_entry *dc_entries;
+
+	/* stats */
+	struct ocfs2_dcache_stats dc_stats;
+};
+
+static uint32_t dcache_name_hash(const char *name, int namelen)
+{
+	return crc32_le(~0, (unsigned char const *)name, namelen);
+}
+
+static int dcache_compare(uint64_t dir, uint32_t hash, const char *name,
+			  int namelen, struct ocfs2_dcache_entry *de)
+{
+	if (dir != de->de_dir)
+		return dir < de->de_dir ? -1 : 1;
+	if (hash != de->de_hash)
+		return hash < de->de_hash ? -1 : 1;
+	if (namelen != de->de_namelen)
+		return namelen < de->de_namelen ? -1 : 1;
+	return memcmp(name, de->de_name, namelen);
+}
+
+static struct ocfs2_dcache_entry *dcache_find(struct ocfs2_dcache *dc,
+					      uint64_t dir, uint32_t hash,
+					      const char *name, int namelen)
+{
+	struct rb_node *p = dc->dc_lookup.rb_node;
+	struct ocfs2_dcache_entry *de;
+	int cmp;
+
+	while (p) {
+		de = rb_entry(p, struct ocfs2_dcache_entry, de_node);
+		cmp = dcache_compare(dir, hash, name, namelen, de);
+		if (cmp < 0)
+			p = p->rb_left;
+		else if (cmp > 0)
+			p = p->rb_right;
+		else
+			return de;
+	}
+
+	return NULL;
+}
+
+static void dcache_disconnect(struct ocfs2_dcache *dc,
+			      struct ocfs2_dcache_entry *de)
+{
+	/* An unused entry has de_namelen == 0 and isn't in the tree */
+	if (de->de_namelen) {
+		rb_erase(&de->de_node, &dc->dc_lookup);
+		memset(&de->de_node, 0, sizeof(struct rb_node));
+		de->de_namelen = 0;
+	}
+
+	/* Move to the end of the LRU so that it is reused first */
+	list_del(&de->de_list);
+	list_add(&de->de_list, &dc->dc_lru);
+}
+
+errcode_t ocfs2_dcache_init(ocfs2_filesys *fs, unsigned int nr_entries)
+{
+	unsigned int i;
+	errcode_t ret;
+	struct ocfs2_dcache *dc;
+
+	if (fs->fs_dcache)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	if (!nr_entries)
+		return OCFS2_ET_INVALID_ARGUMENT;
+
+	ret = ocfs2_malloc0(sizeof(struct ocfs2_dcache), &dc);
+	if (ret)
+		return ret;
+
+	ret = ocfs2_malloc0(sizeof(struct ocfs2_dcache_entry) * nr_entries,
+			    &dc->dc_entries);
+	if (ret) {
+		ocfs2_free(&dc);
+		return ret;
+	}
+
+	dc->dc_nr_entries = nr_entries;
+	dc->dc_lookup = RB_ROOT;
+	INIT_LIST_HEAD(&dc->dc_lru);
+	for (i = 0; i < nr_entries; i++)
+		list_add_tail(&dc->dc_entries[i].de_list, &dc->dc_lru);
+
+	fs->fs_dcache = dc;
+	return 0;
+}
+
+void ocfs2_dcache_free(ocfs2_filesys *fs)
+{
+	struct ocfs2_dcache *dc = fs->fs_dcache;
+
+	if (!dc)
+		return;
+
+	ocfs2_free(&dc->dc_entries);
+	ocfs2_free(&dc);
+	fs->fs_dcache = NULL;
+}
+
+/*
+ * Returns non-zero if the cache knows the answer.  *ino is set to the
+ * inode number, or to 0 if the name is known not to exist.
+ */
+int ocfs2_dcache_lookup(ocfs2_filesys *fs, uint64_t dir, const char *name,
+			int namelen, uint64_t *ino)
+{
+	struct ocfs2_dcache *dc = fs->fs_dcache;
+	struct ocfs2_dcache_entry *de;
+
+	if (!dc || (namelen <= 0) || (namelen > OCFS2_MAX_FILENAME_LEN))
+		return 0;
+
+	de = dcache_find(dc, dir, dcache_name_hash(name, namelen), name,
+			 namelen);
+	if (!de) {
+		dc->dc_stats.ds_misses++;
+		return 0;
+	}
+
+	/* Move to the front of the LRU */
+	list_del(&de->de_list);
+	list_add_tail(&de->de_list, &dc->dc_lru);
+
+	if (de->de_ino)
+		dc->dc_stats.ds_hits++;
+	else
+		dc->dc_stats.ds_negative_hits++;
+	*ino = de->de_ino;
+
+	return 1;
+}
+
+/* Pass ino == 0 to remember that the name does not exist */
+void ocfs2_dcache_insert(ocfs2_filesys *fs, uint64_t dir, const char *name,
+			 int namelen, uint64_t ino)
+{
+	struct ocfs2_dcache *dc = fs->fs_dcache;
+	struct ocfs2_dcache_entry *de;
+	struct rb_node **p, *parent = NULL;
+	uint32_t hash;
+
+	if (!dc || (namelen <= 0) || (namelen > OCFS2_MAX_FILENAME_LEN))
+		return;
+
+	hash = dcache_name_hash(name, namelen);
+	de = dcache_find(dc, dir, hash, name, namelen);
+	if (!de) {
+		/* Steal the least recently used entry */
+		de = list_entry(dc->dc_lru.next, struct ocfs2_dcache_entry,
+				de_list);
+		if (de->de_namelen) {
+			dcache_disconnect(dc, de);
+			dc->dc_stats.ds_removes++;
+		}
+
+		de->de_dir = dir;
+		de->de_hash = hash;
+		de->de_namelen = namelen;
+		memcpy(de->de_name, name, namelen);
+
+		p = &dc->dc_lookup.rb_node;
+		while (*p) {
+			parent = *p;
+			if (dcache_compare(dir, hash, name, namelen,
+					   rb_entry(parent,
+						    struct ocfs2_dcache_entry,
+						    de_node)) < 0)
+				p = &(*p)->rb_left;
+			else
+				p = &(*p)->rb_right;
+		}
+		rb_link_node(&de->de_node, parent, p);
+		rb_insert_color(&de->de_node, &dc->dc_lookup);
+		dc->dc_stats.ds_inserts++;
+	}
+
+	de->de_ino = ino;
+	list_del(&de->de_list);
+	list_add_tail(&de->de_list, &dc->dc_lru);
+}
+
+/* Forget everything we know about the names in dir */
+void ocfs2_dcache_invalidate_dir(ocfs2_filesys *fs, uint64_t dir)
+{
+	struct ocfs2_dcache *dc = fs->fs_dcache;
+	struct ocfs2_dcache_entry *de;
+	struct rb_node *p, *first = NULL;
+
+	if (!dc)
+		return;
+
+	/* Find the leftmost entry of dir */
+	p = dc->dc_lookup.rb_node;
+	while (p) {
+		de = rb_entry(p, struct ocfs2_dcache_entry, de_node);
+		if (dir <= de->de_dir) {
+			if (dir == de->de_dir)
+				first = p;
+			p = p->rb_left;
+		} else
+			p = p->rb_right;
+	}
+
+	while (first) {
+		de = rb_entry(first, struct ocfs2_dcache_entry, de_node);
+		if (de->de_dir != dir)
+			break;
+		first = rb_next(first);
+		dcache_disconnect(dc, de);
+		dc->dc_stats.ds_removes++;
+	}
+}
+
+void ocfs2_dcache_get_stats(ocfs2_filesys *fs,
+			    struct ocfs2_dcache_stats *stats)
+{
+	if (fs->fs_dcache)
+		memcpy(stats, &fs->fs_dcache->dc_stats,
+		       sizeof(struct ocfs2_dcache_stats));
+	else
+		memset(stats, 0, sizeof(struct ocfs2_dcache_stats));
+}
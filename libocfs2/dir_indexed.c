@@ -13,6 +13,7 @@
  * General Public License for more details.
  */
 #include <assert.h>
+#include <stdlib.h>
 #include <ocfs2/ocfs2.h>
 #include <ocfs2/bitops.h>
 #include <ocfs2/kernel-rbtree.h>
@@ -1192,6 +1193,300 @@ out:
 }
 
 
+/*
+ * Bulk loading of a new index.  Rather than inserting the entries one
+ * by one and splitting leaves as they fill, all the entries are
+ * gathered up front, sorted by hash and written out as packed leaves.
+ */
+
+/* How much leaf space we format and write at a time */
+#define DX_BULK_WRITE_BYTES	(4 * 1024 * 1024)
+
+struct dx_bulk_ctxt {
+	ocfs2_filesys *fs;
+	struct ocfs2_dx_entry *entries;
+	int nr_entries;
+	int alloced;
+	errcode_t err;
+};
+
+static int ocfs2_dx_bulk_collect(struct ocfs2_dir_entry *dentry,
+				 uint64_t blocknr,
+				 int offset,
+				 int blocksize,
+				 char *buf,
+				 void *priv_data)
+{
+	errcode_t err;
+	int alloced;
+	struct dx_bulk_ctxt *ctxt = (struct dx_bulk_ctxt *)priv_data;
+	struct ocfs2_dx_entry *dx_entry;
+	struct ocfs2_dx_hinfo hinfo;
+
+	if (ctxt->nr_entries == ctxt->alloced) {
+		alloced = ctxt->alloced ? ctxt->alloced * 2 : 256;
+		err = ocfs2_realloc(sizeof(struct ocfs2_dx_entry) * alloced,
+				    &ctxt->entries);
+		if (err) {
+			ctxt->err = err;
+			return OCFS2_DIRENT_ABORT;
+		}
+		ctxt->alloced = alloced;
+	}
+
+	ocfs2_dx_dir_name_hash(ctxt->fs, dentry->name, dentry->name_len,
+			       &hinfo);
+
+	dx_entry = &ctxt->entries[ctxt->nr_entries];
+	memset(dx_entry, 0, sizeof(struct ocfs2_dx_entry));
+	dx_entry->dx_major_hash = hinfo.major_hash;
+	dx_entry->dx_minor_hash = hinfo.minor_hash;
+	dx_entry->dx_dirent_blk = blocknr;
+	ctxt->nr_entries++;
+
+	return 0;
+}
+
+/*
+ * Split the sorted entries into clusters.  A cluster takes entries
+ * until one of its leaves would overflow.  The major hash picks the
+ * cluster, so entries sharing a major hash can't be split up.
+ * starts[] gets the index of the first entry of each cluster.
+ */
+static errcode_t ocfs2_dx_bulk_plan(ocfs2_filesys *fs,
+				    struct ocfs2_dx_entry *entries,
+				    int nr_entries, int *starts,
+				    int *ret_nr_clusters)
+{
+	errcode_t ret;
+	int i, j, k, idx, fits, start = 0, nr_clusters = 0;
+	int leaves = ocfs2_clusters_to_blocks(fs, 1);
+	int max = ocfs2_dx_entries_per_leaf(fs->fs_blocksize);
+	int *counts;
+
+	ret = ocfs2_malloc0(sizeof(int) * leaves, &counts);
+	if (ret)
+		return ret;
+
+	i = 0;
+	while (i < nr_entries) {
+		j = i;
+		while ((j < nr_entries) &&
+		       (entries[j].dx_major_hash == entries[i].dx_major_hash))
+			j++;
+
+		fits = 1;
+		for (k = i; k < j; k++) {
+			idx = __ocfs2_dx_dir_hash_idx(fs,
+						      entries[k].dx_minor_hash);
+			if (++counts[idx] > max)
+				fits = 0;
+		}
+		if (fits) {
+			i = j;
+			continue;
+		}
+
+		if (i == start) {
+			/* Not even an empty cluster holds this hash */
+			ret = OCFS2_ET_DIR_NO_SPACE;
+			goto out;
+		}
+
+		/* Close the cluster and retry the hash in a new one */
+		starts[nr_clusters++] = start;
+		start = i;
+		memset(counts, 0, sizeof(int) * leaves);
+	}
+	starts[nr_clusters++] = start;
+
+	*ret_nr_clusters = nr_clusters;
+
+out:
+	ocfs2_free(&counts);
+	return ret;
+}
+
+/*
+ * Format count clusters of leaves at buf, starting with cluster c of
+ * the plan, and fill them with their entries.  The leaves are left in
+ * disk format.
+ */
+static void ocfs2_dx_bulk_fill(ocfs2_filesys *fs,
+			       struct ocfs2_dx_entry *entries,
+			       int nr_entries, int *starts,
+			       int nr_clusters, int c, int count,
+			       uint64_t blkno, char *buf)
+{
+	int i, k, end;
+	int leaves = ocfs2_clusters_to_blocks(fs, 1);
+	struct ocfs2_dx_leaf *dx_leaf;
+
+	memset(buf, 0, (size_t)count * fs->fs_clustersize);
+
+	for (i = 0; i < count * leaves; i++) {
+		dx_leaf = (struct ocfs2_dx_leaf *)(buf +
+						   i * fs->fs_blocksize);
+		strcpy((char *)dx_leaf->dl_signature, OCFS2_DX_LEAF_SIGNATURE);
+		dx_leaf->dl_fs_generation = fs->fs_super->i_fs_generation;
+		dx_leaf->dl_blkno = blkno + i;
+		dx_leaf->dl_list.de_count =
+			ocfs2_dx_entries_per_leaf(fs->fs_blocksize);
+	}
+
+	for (i = 0; i < count; i++) {
+		end = ((c + i + 1) < nr_clusters) ? starts[c + i + 1] :
+						    nr_entries;
+		for (k = starts[c + i]; k < end; k++) {
+			dx_leaf = (struct ocfs2_dx_leaf *)(buf +
+				((i * leaves) +
+				 __ocfs2_dx_dir_hash_idx(fs,
+						entries[k].dx_minor_hash)) *
+				fs->fs_blocksize);
+			ocfs2_dx_dir_leaf_insert_tail(dx_leaf, &entries[k]);
+		}
+	}
+
+	for (i = 0; i < count * leaves; i++) {
+		dx_leaf = (struct ocfs2_dx_leaf *)(buf +
+						   i * fs->fs_blocksize);
+		ocfs2_swap_dx_leaf_from_cpu(dx_leaf);
+		ocfs2_compute_meta_ecc(fs, dx_leaf, &dx_leaf->dl_check);
+	}
+}
+
+/*
+ * Write the planned clusters out and hook them into the dx_root.  Each
+ * contiguous run of new clusters is written with one I/O before its
+ * extents are inserted, so the tree never points at unwritten leaves.
+ */
+static errcode_t ocfs2_dx_bulk_write(ocfs2_filesys *fs,
+				     struct ocfs2_dx_root_block *dx_root,
+				     struct ocfs2_dx_entry *entries,
+				     int nr_entries, int *starts,
+				     int nr_clusters)
+{
+	errcode_t ret;
+	int c, i, want, max_chunk;
+	uint32_t found = 0, cpos;
+	uint64_t blkno;
+	char *buf = NULL;
+	struct ocfs2_extent_tree et;
+	int leaves = ocfs2_clusters_to_blocks(fs, 1);
+
+	max_chunk = DX_BULK_WRITE_BYTES / fs->fs_clustersize;
+	if (!max_chunk)
+		max_chunk = 1;
+
+	ret = ocfs2_malloc_blocks(fs->fs_io, max_chunk * leaves, &buf);
+	if (ret)
+		return ret;
+
+	dx_root->dr_flags &= ~OCFS2_DX_FLAG_INLINE;
+	memset(&dx_root->dr_list, 0, fs->fs_blocksize -
+		offsetof(struct ocfs2_dx_root_block, dr_list));
+	dx_root->dr_list.l_count =
+		ocfs2_extent_recs_per_dx_root(fs->fs_blocksize);
+	dx_root->dr_num_entries = nr_entries;
+
+	ocfs2_init_dx_root_extent_tree(&et, fs, (char *)dx_root,
+				       dx_root->dr_blkno);
+
+	for (c = 0; c < nr_clusters; c += found) {
+		want = nr_clusters - c;
+		if (want > max_chunk)
+			want = max_chunk;
+
+		ret = ocfs2_new_clusters(fs, 1, want, &blkno, &found);
+		if (ret)
+			goto out;
+
+		ocfs2_dx_bulk_fill(fs, entries, nr_entries, starts,
+				   nr_clusters, c, found, blkno, buf);
+
+		ret = io_write_block(fs->fs_io, blkno, found * leaves, buf);
+		if (ret) {
+			ocfs2_free_clusters(fs, found, blkno);
+			goto out;
+		}
+		fs->fs_flags |= OCFS2_FLAG_CHANGED;
+
+		for (i = 0; i < found; i++) {
+			/* The first cluster has to catch the lowest hashes */
+			cpos = (c + i) ? entries[starts[c + i]].dx_major_hash : 0;
+			ret = ocfs2_tree_insert_extent(fs, &et, cpos,
+						       blkno + i * leaves,
+						       1, 0);
+			if (ret) {
+				ocfs2_free_clusters(fs, found - i,
+						    blkno + i * leaves);
+				goto out;
+			}
+		}
+	}
+
+	ret = ocfs2_write_dx_root(fs, dx_root->dr_blkno, (char *)dx_root);
+
+out:
+	ocfs2_free(&buf);
+	return ret;
+}
+
+/*
+ * Index every entry of dir in the empty, inline dx_root.  If they all
+ * fit in the root they stay inline, in directory order, just as
+ * inserting them one at a time would leave them.
+ */
+static errcode_t ocfs2_dx_dir_bulk_load(ocfs2_filesys *fs, uint64_t dir,
+					struct ocfs2_dx_root_block *dx_root)
+{
+	errcode_t ret;
+	int i, nr_clusters = 0, *starts = NULL;
+	struct dx_bulk_ctxt ctxt;
+	struct ocfs2_dx_entry_list *entry_list = &dx_root->dr_entries;
+
+	memset(&ctxt, 0, sizeof(ctxt));
+	ctxt.fs = fs;
+	ret = ocfs2_dir_iterate(fs, dir, 0, NULL, ocfs2_dx_bulk_collect,
+				&ctxt);
+	if (ctxt.err)
+		ret = ctxt.err;
+	if (ret)
+		goto out;
+
+	if (ctxt.nr_entries <= entry_list->de_count) {
+		for (i = 0; i < ctxt.nr_entries; i++)
+			entry_list->de_entries[i] = ctxt.entries[i];
+		entry_list->de_num_used = ctxt.nr_entries;
+		dx_root->dr_num_entries = ctxt.nr_entries;
+		ret = ocfs2_write_dx_root(fs, dx_root->dr_blkno,
+					  (char *)dx_root);
+		goto out;
+	}
+
+	qsort(ctxt.entries, ctxt.nr_entries, sizeof(struct ocfs2_dx_entry),
+	      dx_leaf_sort_cmp);
+
+	ret = ocfs2_malloc0(sizeof(int) * ctxt.nr_entries, &starts);
+	if (ret)
+		goto out;
+
+	ret = ocfs2_dx_bulk_plan(fs, ctxt.entries, ctxt.nr_entries, starts,
+				 &nr_clusters);
+	if (ret)
+		goto out;
+
+	ret = ocfs2_dx_bulk_write(fs, dx_root, ctxt.entries,
+				  ctxt.nr_entries, starts, nr_clusters);
+
+out:
+	if (starts)
+		ocfs2_free(&starts);
+	if (ctxt.entries)
+		ocfs2_free(&ctxt.entries);
+	return ret;
+}
+
 /*
  * This function overwite the indexed dir attribute of
  * the given inode. The caller should make sure the dir's
@@ -1208,7 +1503,6 @@ errcode_t ocfs2_dx_dir_build(ocfs2_filesys *fs,
 	char *dx_buf = NULL, *di_buf = NULL;
 	struct ocfs2_dinode *di;
 	struct ocfs2_dx_root_block *dx_root;
-	struct dx_insert_ctxt ctxt;
 	ocfs2_quota_hash *usrhash = NULL, *grphash = NULL;
 	uint32_t uid, gid;
 	long long change;
@@ -1277,14 +1571,7 @@ errcode_t ocfs2_dx_dir_build(ocfs2_filesys *fs,
 		goto out;
 	}
 
-	ctxt.dir_blkno = dir;
-	ctxt.dx_root_blkno = dr_blkno;
-	ctxt.fs = fs;
-	ctxt.err = 0;
-	ret = ocfs2_dir_iterate(fs, dir, 0, NULL,
-				ocfs2_dx_dir_insert,  &ctxt);
-	if (ctxt.err)
-		ret = ctxt.err;
+	ret = ocfs2_dx_dir_bulk_load(fs, dir, dx_root);
 	if (ret)
 		goto trunc_out;
 
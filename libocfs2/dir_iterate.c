@@ -61,6 +61,182 @@ static int ocfs2_validate_entry(char *buf, int offset, int final_offset)
 	return (offset == final_offset);
 }
 
+/*
+ * Directory read-ahead.
+ *
+ * With OCFS2_DIRENT_FLAG_READAHEAD, ocfs2_process_dir_block() doesn't
+ * read one block at a time.  When it wants a block that isn't in the
+ * window, we map up to a megabyte of the directory from that block on,
+ * read it with one vectored I/O, and validate the whole batch.  A
+ * block that fails validation keeps its error, and the error is
+ * returned when the iteration gets to that block, just like
+ * ocfs2_read_dir_block() would.
+ *
+ * If anything but our own directory block writeback goes through the
+ * channel while we iterate, the window may be stale.  The callback is
+ * modifying the filesystem, so we drop the window and go back to
+ * reading one block at a time.
+ */
+static uint64_t dir_ra_bytes_written(ocfs2_filesys *fs)
+{
+	struct ocfs2_io_stats stats;
+
+	io_get_stats(fs->fs_io, &stats);
+	return stats.is_bytes_written;
+}
+
+static void dir_ra_free(struct dir_context *ctx)
+{
+	if (ctx->ra_ci)
+		ocfs2_free_cached_inode(ctx->ra_ci->ci_fs, ctx->ra_ci);
+	if (ctx->ra_buf)
+		ocfs2_free(&ctx->ra_buf);
+	if (ctx->ra_blknos)
+		ocfs2_free(&ctx->ra_blknos);
+	if (ctx->ra_errs)
+		ocfs2_free(&ctx->ra_errs);
+	if (ctx->ra_ivus)
+		ocfs2_free(&ctx->ra_ivus);
+	ctx->ra_ci = NULL;
+	ctx->ra_count = 0;
+	ctx->ra_max = 0;
+}
+
+static errcode_t dir_ra_init(ocfs2_filesys *fs, struct dir_context *ctx)
+{
+	errcode_t ret;
+	int max = ocfs2_blocks_in_bytes(fs, 1024 * 1024);
+
+	ret = ocfs2_read_cached_inode(fs, ctx->dir, &ctx->ra_ci);
+	if (ret)
+		goto out;
+
+	ret = ocfs2_malloc_blocks(fs->fs_io, max, &ctx->ra_buf);
+	if (ret)
+		goto out;
+
+	ret = ocfs2_malloc0(sizeof(uint64_t) * max, &ctx->ra_blknos);
+	if (ret)
+		goto out;
+
+	ret = ocfs2_malloc0(sizeof(errcode_t) * max, &ctx->ra_errs);
+	if (ret)
+		goto out;
+
+	ret = ocfs2_malloc0(sizeof(struct io_vec_unit) * max, &ctx->ra_ivus);
+	if (ret)
+		goto out;
+
+	ctx->ra_max = max;
+	ctx->ra_count = 0;
+	ctx->ra_written = dir_ra_bytes_written(fs);
+
+out:
+	if (ret)
+		dir_ra_free(ctx);
+	return ret;
+}
+
+static errcode_t dir_ra_fill(ocfs2_filesys *fs, struct dir_context *ctx,
+			     uint64_t blockcnt)
+{
+	errcode_t ret = 0;
+	uint64_t v_blkno = blockcnt, p_blkno, contig, end;
+	int i, count = 0, nr_ivus = 0;
+	uint16_t ext_flags;
+	char *buf;
+
+	ctx->ra_count = 0;
+	end = ocfs2_blocks_in_bytes(fs, ctx->di->i_size);
+
+	while ((count < ctx->ra_max) && (v_blkno < end)) {
+		ret = ocfs2_extent_map_get_blocks(ctx->ra_ci, v_blkno, 1,
+						  &p_blkno, &contig,
+						  &ext_flags);
+		if (ret)
+			return ret;
+
+		/* Stop at a hole, the block iterator won't ask for it */
+		if (!p_blkno || (ext_flags & OCFS2_EXT_UNWRITTEN))
+			break;
+
+		contig = ocfs2_min(contig, (uint64_t)(ctx->ra_max - count));
+		contig = ocfs2_min(contig, end - v_blkno);
+
+		for (i = 0; i < contig; i++)
+			ctx->ra_blknos[count + i] = p_blkno + i;
+
+		ctx->ra_ivus[nr_ivus].ivu_blkno = p_blkno;
+		ctx->ra_ivus[nr_ivus].ivu_buf =
+			ctx->ra_buf + (uint64_t)count * fs->fs_blocksize;
+		ctx->ra_ivus[nr_ivus].ivu_buflen = contig * fs->fs_blocksize;
+		nr_ivus++;
+
+		count += contig;
+		v_blkno += contig;
+	}
+
+	if (!count)
+		return 0;
+
+	/* Image files need their block numbers translated */
+	if ((nr_ivus == 1) || (fs->fs_flags & OCFS2_FLAG_IMAGE_FILE)) {
+		for (i = 0; i < nr_ivus; i++) {
+			ret = ocfs2_read_blocks(fs, ctx->ra_ivus[i].ivu_blkno,
+					ctx->ra_ivus[i].ivu_buflen /
+							fs->fs_blocksize,
+					ctx->ra_ivus[i].ivu_buf);
+			if (ret)
+				return ret;
+		}
+	} else {
+		ret = io_vec_read_blocks(fs->fs_io, ctx->ra_ivus, nr_ivus);
+		if (ret)
+			return ret;
+	}
+
+	for (i = 0, buf = ctx->ra_buf; i < count;
+	     i++, buf += fs->fs_blocksize)
+		ctx->ra_errs[i] = ocfs2_validate_dir_block(fs, ctx->di, buf);
+
+	ctx->ra_first = blockcnt;
+	ctx->ra_count = count;
+	return 0;
+}
+
+static errcode_t dir_ra_read_block(ocfs2_filesys *fs, struct dir_context *ctx,
+				   uint64_t blocknr, uint64_t blockcnt)
+{
+	uint64_t idx;
+
+	if (dir_ra_bytes_written(fs) != ctx->ra_written) {
+		dir_ra_free(ctx);
+		goto read_one;
+	}
+
+	idx = blockcnt - ctx->ra_first;
+	if ((blockcnt < ctx->ra_first) || (idx >= ctx->ra_count) ||
+	    (ctx->ra_blknos[idx] != blocknr)) {
+		if (dir_ra_fill(fs, ctx, blockcnt)) {
+			/* Let the plain reads report any error */
+			dir_ra_free(ctx);
+			goto read_one;
+		}
+		if (!ctx->ra_count || (ctx->ra_blknos[0] != blocknr)) {
+			ctx->ra_count = 0;
+			goto read_one;
+		}
+		idx = 0;
+	}
+
+	memcpy(ctx->buf, ctx->ra_buf + idx * fs->fs_blocksize,
+	       fs->fs_blocksize);
+	return ctx->ra_errs[idx];
+
+read_one:
+	return ocfs2_read_dir_block(fs, ctx->di, blocknr, ctx->buf);
+}
+
 errcode_t ocfs2_dir_iterate2(ocfs2_filesys *fs,
 			     uint64_t dir,
 			     int flags,
@@ -83,6 +259,7 @@ errcode_t ocfs2_dir_iterate2(ocfs2_filesys *fs,
 	if (retval)
 		return retval;
 	
+	memset(&ctx, 0, sizeof(struct dir_context));
 	ctx.dir = dir;
 	ctx.flags = flags;
 	if (block_buf)
@@ -115,10 +292,15 @@ errcode_t ocfs2_dir_iterate2(ocfs2_filesys *fs,
 	if (ocfs2_support_inline_data(OCFS2_RAW_SB(fs->fs_super)) &&
 	    di->i_dyn_features & OCFS2_INLINE_DATA_FL)
 		retval = ocfs2_inline_dir_iterate(fs, di, &ctx);
-	else
+	else {
+		/* Read-ahead is an optimization, we can do without it */
+		if (flags & OCFS2_DIRENT_FLAG_READAHEAD)
+			dir_ra_init(fs, &ctx);
 		retval = ocfs2_block_iterate(fs, dir, 0,
 					     ocfs2_process_dir_block,
 					     &ctx);
+		dir_ra_free(&ctx);
+	}
 
 out:
 	if (!block_buf)
@@ -291,7 +473,11 @@ int ocfs2_process_dir_block(ocfs2_filesys *fs,
 	entry = blockcnt ? OCFS2_DIRENT_OTHER_FILE :
 		OCFS2_DIRENT_DOT_FILE;
 
-	ctx->errcode = ocfs2_read_dir_block(fs, ctx->di, blocknr, ctx->buf);
+	if (ctx->ra_max)
+		ctx->errcode = dir_ra_read_block(fs, ctx, blocknr, blockcnt);
+	else
+		ctx->errcode = ocfs2_read_dir_block(fs, ctx->di, blocknr,
+						    ctx->buf);
 	if (ctx->errcode)
 		return OCFS2_BLOCK_ABORT;
 
@@ -305,6 +491,10 @@ int ocfs2_process_dir_block(ocfs2_filesys *fs,
 						     ctx->buf);
 		if (ctx->errcode)
 			return OCFS2_BLOCK_ABORT;
+
+		/* Only this block changed, the window is still good */
+		if (ctx->ra_max)
+			ctx->ra_written = dir_ra_bytes_written(fs);
 	}
 	if (do_abort)
 		return OCFS2_BLOCK_ABORT;
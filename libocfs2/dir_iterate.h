@@ -42,6 +42,17 @@ struct dir_context {
 		    void *priv_data);
 	void *priv_data;
 	errcode_t errcode;
+
+	/* Read-ahead window, only with OCFS2_DIRENT_FLAG_READAHEAD */
+	ocfs2_cached_inode *ra_ci;
+	char *ra_buf;
+	uint64_t *ra_blknos;
+	errcode_t *ra_errs;
+	struct io_vec_unit *ra_ivus;
+	uint64_t ra_first;
+	int ra_count;
+	int ra_max;
+	uint64_t ra_written;
 };
 
 extern int ocfs2_process_dir_block(ocfs2_filesys *fs,
@@ -164,17 +164,17 @@ void ocfs2_swap_dir_trailer(struct ocfs2_dir_block_trailer *trailer)
 	trailer->db_free_next = bswap_64(trailer->db_free_next);
 }
 
-errcode_t ocfs2_read_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
-			       uint64_t block, void *buf)
+/*
+ * Check the trailer of a directory block that has just been read from
+ * disk and swap it to cpu order.
+ */
+errcode_t ocfs2_validate_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
+				   void *buf)
 {
 	errcode_t retval;
 	int end = fs->fs_blocksize;
 	struct ocfs2_dir_block_trailer *trailer = NULL;
 
-	retval = ocfs2_read_blocks(fs, block, 1, buf);
-	if (retval)
-		goto out;
-
 	if (ocfs2_dir_has_trailer(fs, di)) {
 		end = ocfs2_dir_trailer_blk_off(fs);
 		trailer = ocfs2_dir_trailer_from_block(fs, buf);
@@ -201,6 +201,53 @@ out:
 	return retval;
 }
 
+errcode_t ocfs2_read_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
+			       uint64_t block, void *buf)
+{
+	errcode_t retval;
+
+	retval = ocfs2_read_blocks(fs, block, 1, buf);
+	if (retval)
+		return retval;
+
+	return ocfs2_validate_dir_block(fs, di, buf);
+}
+
+/*
+ * Read count physically contiguous directory blocks with one I/O.
+ * Each block carries its own check, so they are still validated one
+ * by one.  Returns the first error found.  If bad
+ * is not NULL, it is set to the index of the block that failed
+ * validation, or to count if none did; the blocks ahead of it are
+ * good.
+ */
+errcode_t ocfs2_read_dir_blocks(ocfs2_filesys *fs, struct ocfs2_dinode *di,
+				uint64_t block, int count, void *buf,
+				int *bad)
+{
+	errcode_t retval;
+	int i;
+
+	if (bad)
+		*bad = 0;
+
+	retval = ocfs2_read_blocks(fs, block, count, buf);
+	if (retval)
+		return retval;
+
+	for (i = 0; i < count; i++) {
+		retval = ocfs2_validate_dir_block(fs, di,
+					(char *)buf + i * fs->fs_blocksize);
+		if (retval)
+			break;
+	}
+
+	if (bad)
+		*bad = i;
+
+	return retval;
+}
+
 errcode_t ocfs2_write_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
 				uint64_t block, void *inbuf)
 {
@@ -209,6 +256,8 @@ errcode_t ocfs2_write_dir_block(ocfs2_filesys *fs, struct ocfs2_dinode *di,
 	int end = fs->fs_blocksize;
 	struct ocfs2_dir_block_trailer *trailer = NULL;
 
+	ocfs2_dcache_invalidate_dir(fs, di->i_blkno);
+
 	retval = ocfs2_malloc_block(fs->fs_io, &buf);
 	if (retval)
 		return retval;
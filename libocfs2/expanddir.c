@@ -56,6 +56,8 @@ errcode_t ocfs2_expand_dir(ocfs2_filesys *fs,
 	if (!(fs->fs_flags & OCFS2_FLAG_RW))
 		return OCFS2_ET_RO_FILESYS;
 
+	ocfs2_dcache_invalidate_dir(fs, dir);
+
 	/* ensure it is a dir */
 	ret = ocfs2_check_directory(fs, dir);
 	if (ret)
@@ -171,6 +173,8 @@ errcode_t ocfs2_init_dir(ocfs2_filesys *fs,
 	if (!(fs->fs_flags & OCFS2_FLAG_RW))
 		return OCFS2_ET_RO_FILESYS;
 
+	ocfs2_dcache_invalidate_dir(fs, dir);
+
 	/* ensure it is a dir */
 	ret = ocfs2_check_directory(fs, dir);
 	if (ret)
@@ -156,6 +156,131 @@ out_free:
 }
 
 
+/*
+ * Batched file I/O.  Instead of mapping and transferring one contiguous
+ * run at a time, the whole range is mapped up front into a vector of
+ * physical runs, which then goes to the device as a single async
+ * submission via io_vec_read_blocks() or io_vec_write_blocks().
+ */
+struct file_io_vec {
+	struct io_vec_unit	*fv_ivus;
+	int			fv_count;
+	int			fv_alloced;
+	int			fv_unmapped;	/* holes and unwritten runs */
+};
+
+static errcode_t file_io_vec_add(ocfs2_filesys *fs, struct file_io_vec *fv,
+				 uint64_t p_blkno, uint64_t blocks, char *ptr)
+{
+	errcode_t ret;
+	struct io_vec_unit *ivu;
+	int bs_bits = OCFS2_RAW_SB(fs->fs_super)->s_blocksize_bits;
+
+	/* Merge with the previous run if both sides are contiguous */
+	if (fv->fv_count) {
+		ivu = &fv->fv_ivus[fv->fv_count - 1];
+		if ((ivu->ivu_blkno + (ivu->ivu_buflen >> bs_bits) ==
+		     p_blkno) &&
+		    (ivu->ivu_buf + ivu->ivu_buflen == ptr)) {
+			ivu->ivu_buflen += (uint32_t)(blocks << bs_bits);
+			return 0;
+		}
+	}
+
+	if (fv->fv_count == fv->fv_alloced) {
+		ret = ocfs2_realloc(sizeof(struct io_vec_unit) *
+				    (fv->fv_alloced + 32), &fv->fv_ivus);
+		if (ret)
+			return ret;
+		fv->fv_alloced += 32;
+	}
+
+	ivu = &fv->fv_ivus[fv->fv_count++];
+	ivu->ivu_blkno = p_blkno;
+	ivu->ivu_buf = ptr;
+	ivu->ivu_buflen = (uint32_t)(blocks << bs_bits);
+
+	return 0;
+}
+
+/*
+ * Map wanted_blocks starting at v_blkno into fv.  Holes and unwritten
+ * extents are counted in fv_unmapped.  If zero_fill is set, their part
+ * of the buffer is cleared; otherwise mapping stops at the first one,
+ * as the caller has to allocate or convert it.
+ */
+static errcode_t file_io_vec_map(ocfs2_cached_inode *ci, char *ptr,
+				 uint64_t v_blkno, uint32_t wanted_blocks,
+				 int zero_fill, struct file_io_vec *fv)
+{
+	ocfs2_filesys *fs = ci->ci_fs;
+	errcode_t ret;
+	uint64_t p_blkno, contig_blocks;
+	uint16_t extent_flags;
+	int bs_bits = OCFS2_RAW_SB(fs->fs_super)->s_blocksize_bits;
+
+	while (wanted_blocks) {
+		ret = ocfs2_extent_map_get_blocks(ci, v_blkno, 1,
+						  &p_blkno, &contig_blocks,
+						  &extent_flags);
+		if (ret)
+			return ret;
+
+		if (contig_blocks > wanted_blocks)
+			contig_blocks = wanted_blocks;
+
+		if (!p_blkno || extent_flags & OCFS2_EXT_UNWRITTEN) {
+			fv->fv_unmapped++;
+			if (!zero_fill)
+				break;
+			memset(ptr, 0, contig_blocks << bs_bits);
+		} else {
+			ret = file_io_vec_add(fs, fv, p_blkno, contig_blocks,
+					      ptr);
+			if (ret)
+				return ret;
+		}
+
+		wanted_blocks -= contig_blocks;
+		ptr += (contig_blocks << bs_bits);
+		v_blkno += contig_blocks;
+	}
+
+	return 0;
+}
+
+static errcode_t ocfs2_file_read_vec(ocfs2_cached_inode *ci, char *ptr,
+				     uint64_t v_blkno, uint32_t wanted_blocks,
+				     uint64_t offset, uint32_t *got)
+{
+	ocfs2_filesys *fs = ci->ci_fs;
+	errcode_t ret;
+	struct file_io_vec fv = { NULL, };
+
+	ret = file_io_vec_map(ci, ptr, v_blkno, wanted_blocks, 1, &fv);
+	if (ret)
+		goto out;
+
+	/* A single run gains nothing from aio */
+	if (fv.fv_count == 1)
+		ret = ocfs2_read_blocks(fs, fv.fv_ivus[0].ivu_blkno,
+					fv.fv_ivus[0].ivu_buflen /
+							fs->fs_blocksize,
+					fv.fv_ivus[0].ivu_buf);
+	else if (fv.fv_count)
+		ret = io_vec_read_blocks(fs->fs_io, fv.fv_ivus, fv.fv_count);
+	if (ret)
+		goto out;
+
+	*got = wanted_blocks << OCFS2_RAW_SB(fs->fs_super)->s_blocksize_bits;
+	if (*got + offset > ci->ci_inode->i_size)
+		*got = (uint32_t) (ci->ci_inode->i_size - offset);
+
+out:
+	ocfs2_free(&fv.fv_ivus);
+	return ret;
+}
+
 errcode_t ocfs2_file_read(ocfs2_cached_inode *ci, void *buf, uint32_t count,
 			  uint64_t offset, uint32_t *got)
 {
@@ -193,6 +318,14 @@ errcode_t ocfs2_file_read(ocfs2_cached_inode *ci, void *buf, uint32_t count,
 	if (v_blkno + wanted_blocks > num_blocks)
 		wanted_blocks = (uint32_t) (num_blocks - v_blkno);
 
+	/*
+	 * Image files have to translate every block, so only real
+	 * devices take the vectored path.
+	 */
+	if (!(fs->fs_flags & OCFS2_FLAG_IMAGE_FILE))
+		return ocfs2_file_read_vec(ci, ptr, v_blkno, wanted_blocks,
+					   offset, got);
+
 	while(wanted_blocks) {
 		ret = ocfs2_extent_map_get_blocks(ci, v_blkno, 1,
 						  &p_blkno, &contig_blocks,
@@ -307,6 +440,7 @@ static errcode_t ocfs2_file_block_write(ocfs2_cached_inode *ci,
 	uint64_t	bpc = fs->fs_clustersize/fs->fs_blocksize;
 	int		insert = 0;
 	uint16_t	extent_flags = 0;
+	struct file_io_vec fv = { NULL, };
 
 	/* o_direct requires aligned io */
 	tmp = fs->fs_blocksize - 1;
@@ -337,12 +471,32 @@ static errcode_t ocfs2_file_block_write(ocfs2_cached_inode *ci,
 			return ret;
 	}
 
+	/*
+	 * If every block in the range is already allocated and written,
+	 * there's nothing to allocate or convert and the whole range can
+	 * go out as one vectored write.
+	 */
+	ret = file_io_vec_map(ci, ptr, v_blkno, wanted_blocks, 0, &fv);
+	if (ret)
+		goto out;
+
+	if (!fv.fv_unmapped && fv.fv_count > 1) {
+		ret = io_vec_write_blocks(fs->fs_io, fv.fv_ivus, fv.fv_count);
+		if (ret)
+			goto out;
+
+		*wrote = wanted_blocks << bs_bits;
+		if (*wrote + offset > ci->ci_inode->i_size)
+			*wrote = (uint32_t) (ci->ci_inode->i_size - offset);
+		goto out;
+	}
+
 	while(wanted_blocks) {
 		ret = ocfs2_extent_map_get_blocks(ci, v_blkno, 1,
 						  &p_blkno, &contig_blocks,
 						  &extent_flags);
 		if (ret)
-			return ret;
+			goto out;
 
 		if (contig_blocks > wanted_blocks)
 			contig_blocks = wanted_blocks;
@@ -367,7 +521,7 @@ static errcode_t ocfs2_file_block_write(ocfs2_cached_inode *ci,
 			ret = ocfs2_new_clusters(fs, 1, n_clusters, &p_start,
 						 &n_clusters);
 			if (ret || n_clusters == 0)
-				return ret;
+				goto out;
 
 			begin_blocks = v_blkno & (bpc - 1);
 			p_blkno = p_start + begin_blocks;
@@ -394,7 +548,7 @@ static errcode_t ocfs2_file_block_write(ocfs2_cached_inode *ci,
 			 */
 			ret = empty_blocks(fs, p_start, begin_blocks);
 			if (ret)
-				return ret;
+				goto out;
 		}
 
 		if (end_blocks) {
@@ -404,12 +558,12 @@ static errcode_t ocfs2_file_block_write(ocfs2_cached_inode *ci,
 			 */
 			ret = empty_blocks(fs, p_end, end_blocks);
 			if (ret)
-				return ret;
+				goto out;
 		}
 
 		ret = io_write_block(fs->fs_io, p_blkno, contig_blocks, ptr);
 		if (ret)
-			return ret;
+			goto out;
 
 		if (insert) {
 			ret = ocfs2_cached_inode_insert_extent(ci,
@@ -422,13 +576,13 @@ static errcode_t ocfs2_file_block_write(ocfs2_cached_inode *ci,
 				 * to BE LOUDLY UPSET.
 				 */
 				ocfs2_free_clusters(fs, n_clusters, p_start);
-				return ret;
+				goto out;
 			}
 
 			/* save up what we have done. */
 			ret = ocfs2_write_cached_inode(fs, ci);
 			if (ret)
-				return ret;
+				goto out;
 
 			ret = ocfs2_extent_map_get_blocks(ci, v_blkno, 1,
 						&p_blkno, NULL, NULL);
@@ -436,7 +590,7 @@ static errcode_t ocfs2_file_block_write(ocfs2_cached_inode *ci,
 			if (!p_blkno || p_blkno != p_start + begin_blocks)
 				ret = OCFS2_ET_INTERNAL_FAILURE;
 			if (ret)
-				return ret;
+				goto out;
 
 			insert = 0;
 		} else if (extent_flags & OCFS2_EXT_UNWRITTEN) {
@@ -448,7 +602,7 @@ static errcode_t ocfs2_file_block_write(ocfs2_cached_inode *ci,
 					cluster_begin, n_clusters,
 					p_blkno & ~(bpc - 1));
 			if (ret)
-				return ret;
+				goto out;
 			/*
 			 * We don't cache in the library right now, so any
 			 * work done in mark_extent_written won't be reflected
@@ -456,7 +610,7 @@ static errcode_t ocfs2_file_block_write(ocfs2_cached_inode *ci,
 			 */
 			ret = ocfs2_refresh_cached_inode(fs, ci);
 			if (ret)
-				return ret;
+				goto out;
 		}
 
 		*wrote += (contig_blocks << bs_bits);
@@ -473,6 +627,8 @@ static errcode_t ocfs2_file_block_write(ocfs2_cached_inode *ci,
 
 	}
 
+out:
+	ocfs2_free(&fv.fv_ivus);
 	return ret;
 }
 
@@ -38,6 +38,7 @@ void ocfs2_freefs(ocfs2_filesys *fs)
 	if (!fs)
 		abort();
 
+	ocfs2_dcache_free(fs);
 	if (fs->fs_orig_super)
 		ocfs2_free(&fs->fs_orig_super);
 	if (fs->fs_super)
@@ -35,7 +35,12 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <libgen.h>
+#include <sys/stat.h>
 #include <ocfs2/bitops.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "ocfs2/ocfs2.h"
 #include "ocfs2/byteorder.h"
@@ -59,11 +64,32 @@ void ocfs2_image_swap_header(struct ocfs2_image_hdr *hdr)
 	hdr->hdr_imgblkcnt	= bswap_64(hdr->hdr_imgblkcnt);
 	hdr->hdr_bmpblksz	= bswap_64(hdr->hdr_bmpblksz);
 	hdr->hdr_superblkcnt	= bswap_64(hdr->hdr_superblkcnt);
+	hdr->hdr_chunkblks	= bswap_64(hdr->hdr_chunkblks);
+	hdr->hdr_chunkcnt	= bswap_64(hdr->hdr_chunkcnt);
+	hdr->hdr_base_imgblkcnt	= bswap_64(hdr->hdr_base_imgblkcnt);
+	hdr->hdr_base_timestamp	= bswap_32(hdr->hdr_base_timestamp);
 }
 
-void ocfs2_image_free_bitmap(ocfs2_filesys *ofs)
+static void image_free_chunks(struct ocfs2_image_state *ost)
+{
+	int i;
+
+	for (i = 0; i < OCFS2_IMAGE_CHUNK_CACHE; i++) {
+		if (ost->ost_cache[i].ic_buf)
+			ocfs2_free(&ost->ost_cache[i].ic_buf);
+		ost->ost_cache[i].ic_valid = 0;
+	}
+	if (ost->ost_zbuf)
+		ocfs2_free(&ost->ost_zbuf);
+	if (ost->ost_chunkoff) {
+		close(ost->ost_zfd);
+		ocfs2_free(&ost->ost_chunkoff);
+	}
+	ost->ost_chunkblks = 0;
+}
+
+static void image_free_bitmap(struct ocfs2_image_state *ost)
 {
-	struct ocfs2_image_state *ost = ofs->ost;
 	int i;
 
 	if (!ost->ost_bmparr)
@@ -75,7 +101,33 @@ void ocfs2_image_free_bitmap(ocfs2_filesys *ofs)
 
 	if (ost->ost_bmparr)
 		ocfs2_free(&ost->ost_bmparr);
-	return;
+	if (ost->ost_rank)
+		ocfs2_free(&ost->ost_rank);
+}
+
+static void image_free_delta(struct ocfs2_image_state *ost)
+{
+	if (ost->ost_held) {
+		image_free_bitmap(ost->ost_held);
+		ocfs2_free(&ost->ost_held);
+	}
+	if (ost->ost_base) {
+		ocfs2_image_free_bitmap(ost->ost_base);
+		ocfs2_free(&ost->ost_base->ost);
+		ocfs2_close(ost->ost_base);
+		ost->ost_base = NULL;
+	}
+	if (ost->ost_dbuf)
+		ocfs2_free(&ost->ost_dbuf);
+}
+
+void ocfs2_image_free_bitmap(ocfs2_filesys *ofs)
+{
+	struct ocfs2_image_state *ost = ofs->ost;
+
+	image_free_chunks(ost);
+	image_free_delta(ost);
+	image_free_bitmap(ost);
 }
 
 /*
@@ -83,10 +135,10 @@ void ocfs2_image_free_bitmap(ocfs2_filesys *ofs)
  * block is of size OCFS2_IMAGE_BITMAP_BLOCKSIZE and ocfs2_image_bitmap_arr
  * tracks the bitmap blocks
  */
-errcode_t ocfs2_image_alloc_bitmap(ocfs2_filesys *ofs)
+static errcode_t image_alloc_bitmap(io_channel *io,
+				    struct ocfs2_image_state *ost)
 {
 	uint64_t blks, allocsize, leftsize;
-	struct ocfs2_image_state *ost = ofs->ost;
 	int indx, i, n;
 	errcode_t ret;
 	char *buf;
@@ -102,14 +154,20 @@ errcode_t ocfs2_image_alloc_bitmap(ocfs2_filesys *ofs)
 	if (ret)
 		return ret;
 
+	ret = ocfs2_malloc0(blks * OCFS2_IMAGE_RANKS_IN_BLOCK *
+			    sizeof(uint16_t), &ost->ost_rank);
+	if (ret) {
+		ocfs2_free(&ost->ost_bmparr);
+		return ret;
+	}
+
 	allocsize = blks * OCFS2_IMAGE_BITMAP_BLOCKSIZE;
 	leftsize = allocsize;
 	indx = 0;
 
 	/* allocate bitmap blocks and assign blocks to above array */
 	while (leftsize) {
-		ret = ocfs2_malloc_blocks(ofs->fs_io,
-					  allocsize/io_get_blksize(ofs->fs_io),
+		ret = ocfs2_malloc_blocks(io, allocsize/io_get_blksize(io),
 					  &buf);
 		if (ret && (ret != -ENOMEM))
 			goto out;
@@ -148,11 +206,298 @@ out:
 			if (ost->ost_bmparr[i].arr_self)
 				ocfs2_free(&ost->ost_bmparr[i].arr_self);
 		ocfs2_free(&ost->ost_bmparr);
+		ocfs2_free(&ost->ost_rank);
+	}
+
+	return ret;
+}
+
+errcode_t ocfs2_image_alloc_bitmap(ocfs2_filesys *ofs)
+{
+	return image_alloc_bitmap(ofs->fs_io, ofs->ost);
+}
+
+static inline unsigned int image_hweight64(uint64_t w)
+{
+	w = w - ((w >> 1) & 0x5555555555555555ULL);
+	w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+	w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (w * 0x0101010101010101ULL) >> 56;
+}
+
+/*
+ * Fill in the rank index entries for bitmap block i.  Returns the
+ * number of bits set in the block.
+ */
+static uint64_t image_index_block(struct ocfs2_image_state *ost, uint64_t i)
+{
+	uint64_t *map = (uint64_t *)ost->ost_bmparr[i].arr_map;
+	uint16_t *rank = ost->ost_rank + (i * OCFS2_IMAGE_RANKS_IN_BLOCK);
+	unsigned int bits_set = 0;
+	int r, w;
+
+	for (r = 0; r < OCFS2_IMAGE_RANKS_IN_BLOCK; r++) {
+		rank[r] = bits_set;
+		for (w = 0; w < OCFS2_IMAGE_RANK_WORDS; w++)
+			bits_set += image_hweight64(*map++);
+	}
+
+	return bits_set;
+}
+
+/*
+ * (Re)build the rank index and arr_set_bit_cnt from the bitmap.  This
+ * must be called once the bitmap is complete and before any call to
+ * ocfs2_image_get_blockno() or ocfs2_image_test_bits().  If bits_set is
+ * not NULL, it is set to the total number of bits set in the bitmap.
+ */
+void ocfs2_image_build_index(ocfs2_filesys *ofs, uint64_t *bits_set)
+{
+	struct ocfs2_image_state *ost = ofs->ost;
+	uint64_t i, total = 0;
+
+	for (i = 0; i < ost->ost_bmpblks; i++) {
+		ost->ost_bmparr[i].arr_set_bit_cnt = total;
+		total += image_index_block(ost, i);
+	}
+
+	if (bits_set)
+		*bits_set = total;
+}
+
+/* Uncompressed bytes in chunk */
+static uint64_t image_chunk_bytes(struct ocfs2_image_state *ost,
+				  uint64_t chunk)
+{
+	uint64_t blocks = ost->ost_imgblkcnt - chunk * ost->ost_chunkblks;
+
+	if (blocks > ost->ost_chunkblks)
+		blocks = ost->ost_chunkblks;
+
+	return blocks * ost->ost_fsblksz;
+}
+
+/*
+ * Read the chunk index from the tail of a compressed image and check it
+ * against the header.  The index and bitmap don't sit on block
+ * boundaries, so they and the chunks are read through a buffered fd of
+ * our own rather than the (possibly O_DIRECT) io channel.  *bmp_off is
+ * set to where the bitmap starts.
+ */
+static errcode_t image_load_chunk_index(ocfs2_filesys *ofs,
+					struct ocfs2_image_hdr *hdr,
+					uint64_t *bmp_off)
+{
+	struct ocfs2_image_state *ost = ofs->ost;
+	uint64_t i, idx_off, idx_size, max_len = 0, len;
+	struct stat st;
+	int fd;
+	errcode_t ret;
+
+#ifndef HAVE_ZLIB
+	return OCFS2_ET_IMAGE_COMPRESSION_UNSUPP;
+#endif
+
+	ret = OCFS2_ET_CORRUPT_IMAGE;
+	if (!hdr->hdr_chunkblks ||
+	    (hdr->hdr_chunkcnt != (ost->ost_imgblkcnt + hdr->hdr_chunkblks - 1) /
+	     hdr->hdr_chunkblks))
+		return ret;
+
+	fd = open64(ofs->fs_devname, O_RDONLY);
+	if (fd < 0)
+		return OCFS2_ET_IO;
+
+	if (fstat(fd, &st)) {
+		ret = OCFS2_ET_IO;
+		goto out;
 	}
 
+	idx_size = (hdr->hdr_chunkcnt + 1) * sizeof(uint64_t);
+	if ((uint64_t)st.st_size < ost->ost_fsblksz + idx_size)
+		goto out;
+	idx_off = st.st_size - idx_size;
+
+	ret = ocfs2_malloc(idx_size, &ost->ost_chunkoff);
+	if (ret)
+		goto out;
+	ost->ost_zfd = fd;
+	ost->ost_chunkblks = hdr->hdr_chunkblks;
+	ost->ost_chunkcnt = hdr->hdr_chunkcnt;
+
+	if (pread64(fd, ost->ost_chunkoff, idx_size, idx_off) != idx_size) {
+		ret = OCFS2_ET_IO;
+		goto out_free;
+	}
+
+	ret = OCFS2_ET_CORRUPT_IMAGE;
+	for (i = 0; i <= ost->ost_chunkcnt; i++)
+		ost->ost_chunkoff[i] = le64_to_cpu(ost->ost_chunkoff[i]);
+	if (ost->ost_chunkoff[0] != ost->ost_fsblksz)
+		goto out_free;
+	for (i = 0; i < ost->ost_chunkcnt; i++) {
+		if (ost->ost_chunkoff[i + 1] <= ost->ost_chunkoff[i])
+			goto out_free;
+		len = ost->ost_chunkoff[i + 1] - ost->ost_chunkoff[i];
+		if (len > image_chunk_bytes(ost, i))
+			goto out_free;
+		if (len > max_len)
+			max_len = len;
+	}
+	if (ost->ost_chunkoff[ost->ost_chunkcnt] +
+	    (ost->ost_bmpblks * ost->ost_bmpblksz) != idx_off)
+		goto out_free;
+
+	ret = ocfs2_malloc(max_len ? max_len : 1, &ost->ost_zbuf);
+	if (ret)
+		goto out_free;
+
+	*bmp_off = ost->ost_chunkoff[ost->ost_chunkcnt];
+	return 0;
+
+out_free:
+	image_free_chunks(ost);
+	return ret;
+
+out:
+	close(fd);
 	return ret;
 }
 
+/*
+ * Read the bitmap blocks starting at byte offset off of fd and index
+ * them.  *bits_set is set to the number of bits set.
+ */
+static errcode_t image_read_bitmap(struct ocfs2_image_state *ost, int fd,
+				   uint64_t off, uint64_t *bits_set)
+{
+	uint64_t i;
+	ssize_t count;
+
+	*bits_set = 0;
+	for (i = 0; i < ost->ost_bmpblks; i++) {
+		ost->ost_bmparr[i].arr_set_bit_cnt = *bits_set;
+		/*
+		 * we don't use io_read_block as ocfs2 image bitmap block size
+		 * could be different from filesystem block size
+		 */
+		count = pread64(fd, ost->ost_bmparr[i].arr_map,
+				ost->ost_bmpblksz, off);
+		if (count < 0)
+			return OCFS2_ET_IO;
+
+		/* add bits set in this bitmap */
+		*bits_set += image_index_block(ost, i);
+
+		off += ost->ost_bmpblksz;
+	}
+
+	return 0;
+}
+
+/*
+ * Open the base of a delta image.  If it isn't where it was when the
+ * delta was made, we look for it next to the delta, in case the two
+ * were moved together.
+ */
+static errcode_t image_open_base(ocfs2_filesys *ofs,
+				 struct ocfs2_image_hdr *hdr)
+{
+	/* Each base opens its own base from in here */
+	static int depth;
+	struct ocfs2_image_state *ost = ofs->ost, *bst;
+	char *name = (char *)hdr->hdr_base, *dev = NULL, *p;
+	char path[PATH_MAX];
+	ocfs2_filesys *base;
+	int flags;
+	errcode_t ret;
+
+	hdr->hdr_base[OCFS2_IMAGE_BASE_LEN - 1] = '\0';
+	if (!*name || (depth >= OCFS2_IMAGE_MAX_DEPTH))
+		return OCFS2_ET_CORRUPT_IMAGE;
+
+	flags = OCFS2_FLAG_RO | OCFS2_FLAG_IMAGE_FILE |
+		(ofs->fs_flags & (OCFS2_FLAG_NO_ECC_CHECKS |
+				  OCFS2_FLAG_BUFFERED));
+
+	depth++;
+	ret = ocfs2_open(name, flags, 0, 0, &base);
+	if (ret == OCFS2_ET_NAMED_DEVICE_NOT_FOUND) {
+		ret = ocfs2_malloc(strlen(ofs->fs_devname) + 1, &dev);
+		if (!ret) {
+			strcpy(dev, ofs->fs_devname);
+			p = strrchr(name, '/');
+			snprintf(path, sizeof(path), "%s/%s", dirname(dev),
+				 p ? p + 1 : name);
+			ocfs2_free(&dev);
+			ret = ocfs2_open(path, flags, 0, 0, &base);
+		}
+	}
+	depth--;
+	if (ret)
+		return ret;
+
+	ost->ost_base = base;
+	bst = base->ost;
+	if ((bst->ost_fsblkcnt != ost->ost_fsblkcnt) ||
+	    (bst->ost_fsblksz != ost->ost_fsblksz) ||
+	    (bst->ost_timestamp != hdr->hdr_base_timestamp) ||
+	    (bst->ost_imgblkcnt != hdr->hdr_base_imgblkcnt))
+		return OCFS2_ET_IMAGE_BASE_MISMATCH;
+
+	/* The base's channel has the filesystem block size by now */
+	return ocfs2_malloc_block(base->fs_io, &ost->ost_dbuf);
+}
+
+/*
+ * Load the bitmap of the blocks a delta image holds and open its base.
+ * The two bitmaps are the last thing in the file, so the file size tells
+ * us how many blocks are held.  *bmp_off is set to where the bitmap of
+ * all the metadata blocks starts.
+ */
+static errcode_t image_load_delta(ocfs2_filesys *ofs,
+				  struct ocfs2_image_hdr *hdr,
+				  uint64_t *bmp_off)
+{
+	struct ocfs2_image_state *ost = ofs->ost, *held;
+	uint64_t bmp_bytes, held_blks, bits_set;
+	int fd = io_get_fd(ofs->fs_io);
+	struct stat st;
+	errcode_t ret;
+
+	if (fstat(fd, &st))
+		return OCFS2_ET_IO;
+
+	ret = OCFS2_ET_CORRUPT_IMAGE;
+	bmp_bytes = ost->ost_bmpblks * ost->ost_bmpblksz;
+	if ((uint64_t)st.st_size < ost->ost_fsblksz + 2 * bmp_bytes)
+		return ret;
+	*bmp_off = st.st_size - 2 * bmp_bytes;
+	if (*bmp_off % ost->ost_fsblksz)
+		return ret;
+	held_blks = *bmp_off / ost->ost_fsblksz - 1;
+
+	ret = ocfs2_malloc0(sizeof(struct ocfs2_image_state), &ost->ost_held);
+	if (ret)
+		return ret;
+	held = ost->ost_held;
+	held->ost_fsblkcnt = ost->ost_fsblkcnt;
+	held->ost_fsblksz = ost->ost_fsblksz;
+	held->ost_imgblkcnt = held_blks;
+
+	ret = image_alloc_bitmap(ofs->fs_io, held);
+	if (ret)
+		return ret;
+
+	ret = image_read_bitmap(held, fd, *bmp_off + bmp_bytes, &bits_set);
+	if (ret)
+		return ret;
+	if (bits_set != held_blks)
+		return OCFS2_ET_CORRUPT_IMAGE;
+
+	return image_open_base(ofs, hdr);
+}
+
 /*
  * This routine loads bitmap blocks from an o2image image file into memory.
  * This process happens during file open. bitmap blocks reside towards
@@ -162,11 +507,10 @@ errcode_t ocfs2_image_load_bitmap(ocfs2_filesys *ofs)
 {
 	struct ocfs2_image_state *ost;
 	struct ocfs2_image_hdr *hdr;
-	uint64_t blk_off, bits_set;
-	int i, j, fd;
-	ssize_t count;
+	uint64_t blk_off = 0, bits_set;
 	errcode_t ret;
 	char *blk = NULL;
+	int fd;
 
 	ret = ocfs2_malloc0(sizeof(struct ocfs2_image_state), &ofs->ost);
 	if (ret)
@@ -201,37 +545,30 @@ errcode_t ocfs2_image_load_bitmap(ocfs2_filesys *ofs)
 	ost->ost_fsblksz 	= hdr->hdr_fsblksz;
 	ost->ost_imgblkcnt 	= hdr->hdr_imgblkcnt;
 	ost->ost_bmpblksz 	= hdr->hdr_bmpblksz;
+	ost->ost_timestamp	= hdr->hdr_timestamp;
 
 	ret = ocfs2_image_alloc_bitmap(ofs);
 	if (ret)
 		goto out;
 
 	/* load bitmap blocks ocfs2 image state */
-	bits_set = 0;
-	fd 	= io_get_fd(ofs->fs_io);
-	blk_off = (ost->ost_imgblkcnt + 1) * ost->ost_fsblksz;
-
-	for (i = 0; i < ost->ost_bmpblks; i++) {
-		ost->ost_bmparr[i].arr_set_bit_cnt = bits_set;
-		/*
-		 * we don't use io_read_block as ocfs2 image bitmap block size
-		 * could be different from filesystem block size
-		 */
-		count = pread64(fd, ost->ost_bmparr[i].arr_map,
-				ost->ost_bmpblksz, blk_off);
-		if (count < 0) {
-			ret = OCFS2_ET_IO;
+	if (hdr->hdr_version == OCFS2_IMAGE_VERSION_COMPRESSED) {
+		ret = image_load_chunk_index(ofs, hdr, &blk_off);
+		if (ret)
 			goto out;
-		}
-
-		/* add bits set in this bitmap */
-		for (j = 0; j < (ost->ost_bmpblksz * 8); j++)
-			if (ocfs2_test_bit(j, ost->ost_bmparr[i].arr_map))
-				bits_set++;
-
-		blk_off += ost->ost_bmpblksz;
+		fd = ost->ost_zfd;
+	} else if (hdr->hdr_version == OCFS2_IMAGE_VERSION_DELTA) {
+		ret = image_load_delta(ofs, hdr, &blk_off);
+		if (ret)
+			goto out;
+		fd = io_get_fd(ofs->fs_io);
+	} else {
+		fd = io_get_fd(ofs->fs_io);
+		blk_off = (ost->ost_imgblkcnt + 1) * ost->ost_fsblksz;
 	}
 
+	ret = image_read_bitmap(ost, fd, blk_off, &bits_set);
+
 out:
 	if (blk)
 		ocfs2_free(&blk);
@@ -254,9 +591,8 @@ void ocfs2_image_mark_bitmap(ocfs2_filesys *ofs, uint64_t blkno)
 	ocfs2_set_bit(bit, ost->ost_bmparr[bitmap_blk].arr_map);
 }
 
-int ocfs2_image_test_bit(ocfs2_filesys *ofs, uint64_t blkno)
+static int image_test_bit(struct ocfs2_image_state *ost, uint64_t blkno)
 {
-	struct ocfs2_image_state *ost = ofs->ost;
 	int bitmap_blk;
 	int bit;
 
@@ -269,26 +605,217 @@ int ocfs2_image_test_bit(ocfs2_filesys *ofs, uint64_t blkno)
 		return 0;
 }
 
+int ocfs2_image_test_bit(ocfs2_filesys *ofs, uint64_t blkno)
+{
+	return image_test_bit(ofs->ost, blkno);
+}
+
+/* The number of bits set in the bitmap before blkno */
+static uint64_t image_rank(struct ocfs2_image_state *ost, uint64_t blkno)
+{
+	uint64_t bitmap_blk = blkno / OCFS2_IMAGE_BITS_IN_BLOCK;
+	int bit = blkno % OCFS2_IMAGE_BITS_IN_BLOCK;
+	int word = bit / 64;
+	int r = word / OCFS2_IMAGE_RANK_WORDS;
+	uint64_t *map = (uint64_t *)ost->ost_bmparr[bitmap_blk].arr_map;
+	uint64_t rank;
+	int w;
+
+	rank = ost->ost_bmparr[bitmap_blk].arr_set_bit_cnt +
+		ost->ost_rank[bitmap_blk * OCFS2_IMAGE_RANKS_IN_BLOCK + r];
+	for (w = r * OCFS2_IMAGE_RANK_WORDS; w < word; w++)
+		rank += image_hweight64(map[w]);
+
+	/* The bitmap is little-endian, so bit 0 is the low bit of a word */
+	rank += image_hweight64(le64_to_cpu(map[word]) &
+				((1ULL << (bit % 64)) - 1));
+
+	return rank;
+}
+
+/* Returns 1 if all count blocks starting at blkno are in the image */
+int ocfs2_image_test_bits(ocfs2_filesys *ofs, uint64_t blkno, int count)
+{
+	struct ocfs2_image_state *ost = ofs->ost;
+	uint64_t last = blkno + count - 1;
+
+	if (count <= 0)
+		return 1;
+	if (last >= ost->ost_bmpblks * OCFS2_IMAGE_BITS_IN_BLOCK)
+		return 0;
+	if (count == 1)
+		return ocfs2_image_test_bit(ofs, blkno);
+
+	return (image_rank(ost, last) + ocfs2_image_test_bit(ofs, last) -
+		image_rank(ost, blkno)) == count;
+}
+
 uint64_t ocfs2_image_get_blockno(ocfs2_filesys *ofs, uint64_t blkno)
+{
+	if (!ocfs2_image_test_bit(ofs, blkno))
+		return -1;
+
+	return image_rank(ofs->ost, blkno) + 1;
+}
+
+/*
+ * Find an inflated copy of chunk in the chunk cache, reading and
+ * inflating it if it isn't there.
+ */
+static errcode_t image_get_chunk(struct ocfs2_image_state *ost,
+				 uint64_t chunk, char **buf)
+{
+	struct ocfs2_image_chunk *ic;
+	uint64_t raw, len;
+	errcode_t ret;
+
+	ic = &ost->ost_cache[chunk % OCFS2_IMAGE_CHUNK_CACHE];
+	if (ic->ic_valid && (ic->ic_chunk == chunk)) {
+		*buf = ic->ic_buf;
+		return 0;
+	}
+
+	if (!ic->ic_buf) {
+		ret = ocfs2_malloc(ost->ost_chunkblks * ost->ost_fsblksz,
+				   &ic->ic_buf);
+		if (ret)
+			return ret;
+	}
+
+	ic->ic_valid = 0;
+	raw = image_chunk_bytes(ost, chunk);
+	len = ost->ost_chunkoff[chunk + 1] - ost->ost_chunkoff[chunk];
+
+	/* A chunk that wouldn't compress is stored as is */
+	if (len == raw) {
+		if (pread64(ost->ost_zfd, ic->ic_buf, raw,
+			    ost->ost_chunkoff[chunk]) != raw)
+			return OCFS2_ET_IO;
+	} else {
+#ifdef HAVE_ZLIB
+		uLongf dlen = raw;
+
+		if (pread64(ost->ost_zfd, ost->ost_zbuf, len,
+			    ost->ost_chunkoff[chunk]) != len)
+			return OCFS2_ET_IO;
+		if ((uncompress((Bytef *)ic->ic_buf, &dlen,
+				(Bytef *)ost->ost_zbuf, len) != Z_OK) ||
+		    (dlen != raw))
+			return OCFS2_ET_CORRUPT_IMAGE;
+#else
+		return OCFS2_ET_IMAGE_COMPRESSION_UNSUPP;
+#endif
+	}
+
+	ic->ic_chunk = chunk;
+	ic->ic_valid = 1;
+	*buf = ic->ic_buf;
+
+	return 0;
+}
+
+/*
+ * Read count blocks starting at blkno from a compressed image.  Blocks
+ * are in units of the io channel's block size, which is only the
+ * filesystem block size once ocfs2_open() has worked that out, so we go
+ * by byte offset.
+ */
+errcode_t ocfs2_image_read_chunked(ocfs2_filesys *ofs, uint64_t blkno,
+				   int count, char *data)
 {
 	struct ocfs2_image_state *ost = ofs->ost;
-	uint64_t ret_blk;
-	int bitmap_blk;
-	int i, bit;
+	uint64_t pos, len, fsblk, rank, off, n;
+	int blksize = io_get_blksize(ofs->fs_io);
+	char *buf;
+	errcode_t ret;
 
-	bit = blkno % OCFS2_IMAGE_BITS_IN_BLOCK;
-	bitmap_blk = blkno / OCFS2_IMAGE_BITS_IN_BLOCK;
+	pos = blkno * blksize;
+	len = (uint64_t)count * blksize;
+	while (len) {
+		fsblk = pos / ost->ost_fsblksz;
+		if ((fsblk >= ost->ost_fsblkcnt) ||
+		    !ocfs2_image_test_bit(ofs, fsblk))
+			return OCFS2_ET_IO;
+
+		rank = image_rank(ost, fsblk);
+		ret = image_get_chunk(ost, rank / ost->ost_chunkblks, &buf);
+		if (ret)
+			return ret;
+
+		off = (rank % ost->ost_chunkblks) * ost->ost_fsblksz +
+			(pos % ost->ost_fsblksz);
+		n = ost->ost_fsblksz - (pos % ost->ost_fsblksz);
+		if (n > len)
+			n = len;
+
+		memcpy(data, buf + off, n);
+		data += n;
+		pos += n;
+		len -= n;
+	}
+
+	return 0;
+}
 
-	if (ocfs2_test_bit(bit, ost->ost_bmparr[bitmap_blk].arr_map)) {
-		ret_blk = ost->ost_bmparr[bitmap_blk].arr_set_bit_cnt + 1;
+/*
+ * Read count blocks starting at blkno from a delta image.  Each run of
+ * blocks comes from the delta if it holds them, and from the base if it
+ * doesn't.  Like ocfs2_image_read_chunked(), this goes by byte offset,
+ * because the channel's block size may not be the filesystem's yet.
+ */
+errcode_t ocfs2_image_read_delta(ocfs2_filesys *ofs, uint64_t blkno,
+				 int count, char *data)
+{
+	struct ocfs2_image_state *ost = ofs->ost, *held = ost->ost_held;
+	uint64_t pos, len, fsblk, off, n, bytes, imgoff;
+	int blksize = io_get_blksize(ofs->fs_io);
+	int in_delta;
+	errcode_t ret;
 
-		/* add bits set in this block before the block no */
-		for (i = 0; i < bit; i++)
-			if (ocfs2_test_bit(i,
-					   ost->ost_bmparr[bitmap_blk].arr_map))
-				ret_blk++;
-	} else
-		ret_blk = -1;
+	if (ost->ost_fsblksz % blksize)
+		return OCFS2_ET_UNEXPECTED_BLOCK_SIZE;
+
+	pos = blkno * blksize;
+	len = (uint64_t)count * blksize;
+	while (len) {
+		fsblk = pos / ost->ost_fsblksz;
+		off = pos % ost->ost_fsblksz;
+		if ((fsblk >= ost->ost_fsblkcnt) ||
+		    !ocfs2_image_test_bit(ofs, fsblk))
+			return OCFS2_ET_IO;
+
+		/* Take every whole block that comes from the same place */
+		in_delta = image_test_bit(held, fsblk);
+		for (n = 1; !off && ((n + 1) * ost->ost_fsblksz <= len) &&
+		     (fsblk + n < ost->ost_fsblkcnt); n++)
+			if (!ocfs2_image_test_bit(ofs, fsblk + n) ||
+			    (image_test_bit(held, fsblk + n) != in_delta))
+				break;
+
+		bytes = n * ost->ost_fsblksz - off;
+		if (bytes > len)
+			bytes = len;
+
+		if (in_delta) {
+			/* Held blocks are packed, in block order */
+			imgoff = (image_rank(held, fsblk) + 1) *
+				ost->ost_fsblksz + off;
+			ret = io_read_block(ofs->fs_io, imgoff / blksize,
+					    bytes / blksize, data);
+		} else if (bytes < ost->ost_fsblksz) {
+			ret = ocfs2_read_blocks(ost->ost_base, fsblk, 1,
+						ost->ost_dbuf);
+			if (!ret)
+				memcpy(data, ost->ost_dbuf + off, bytes);
+		} else
+			ret = ocfs2_read_blocks(ost->ost_base, fsblk, n, data);
+		if (ret)
+			return ret;
+
+		data += bytes;
+		pos += bytes;
+		len -= bytes;
+	}
 
-	return ret_blk;
+	return 0;
 }
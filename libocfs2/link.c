@@ -127,6 +127,8 @@ errcode_t ocfs2_link(ocfs2_filesys *fs, uint64_t dir, const char *name,
 	    (ino > fs->fs_blocks))
 		return OCFS2_ET_INVALID_ARGUMENT;
 
+	ocfs2_dcache_invalidate_dir(fs, dir);
+
         retval = ocfs2_malloc_block(fs->fs_io, &buf);
         if (retval)
             return retval;
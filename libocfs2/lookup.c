@@ -116,6 +116,9 @@ errcode_t ocfs2_lookup(ocfs2_filesys *fs, uint64_t dir,
 	ls.inode = inode;
 	ls.found = 0;
 
+	if (ocfs2_dcache_lookup(fs, dir, name, namelen, inode))
+		return (*inode) ? 0 : OCFS2_ET_FILE_NOT_FOUND;
+
 	ret = ocfs2_malloc_block(fs->fs_io, &di_buf);
 	if (ret)
 		goto out;
@@ -127,6 +130,8 @@ errcode_t ocfs2_lookup(ocfs2_filesys *fs, uint64_t dir,
 	if (ocfs2_supports_indexed_dirs(OCFS2_RAW_SB(fs->fs_super)) &&
 	    ocfs2_dir_indexed(di)) {
 		ret = ocfs2_find_entry_dx(fs, di, buf, &ls);
+		if (ret == OCFS2_ET_FILE_NOT_FOUND)
+			ret = 0;
 	} else {
 		ret = ocfs2_dir_iterate(fs, dir, 0, buf, lookup_proc, &ls);
 	}
@@ -134,6 +139,7 @@ errcode_t ocfs2_lookup(ocfs2_filesys *fs, uint64_t dir,
 		goto out;
 
 	ret = (ls.found) ? 0 : OCFS2_ET_FILE_NOT_FOUND;
+	ocfs2_dcache_insert(fs, dir, name, namelen, ls.found ? *inode : 0);
 
 out:
 	if(di_buf)
@@ -28,6 +28,7 @@
 #define _XOPEN_SOURCE 600  /* Triggers XOPEN2K in features.h */
 #define _LARGEFILE64_SOURCE
 
+#include <stdlib.h>
 #include <string.h>
 #include <netinet/in.h>
 
@@ -305,35 +306,15 @@ out:
 	return ret;
 }
 
-static errcode_t ocfs2_format_journal(ocfs2_filesys *fs,
-				      ocfs2_cached_inode *ci,
-				      ocfs2_fs_options *features)
+/* Write a fresh journal superblock into the first block of ci */
+static errcode_t ocfs2_write_journal_header(ocfs2_filesys *fs,
+					    ocfs2_cached_inode *ci,
+					    ocfs2_fs_options *features)
 {
-	errcode_t ret = 0;
-	char *buf = NULL, *jsb_buf = NULL;
-	int bs_bits = OCFS2_RAW_SB(fs->fs_super)->s_blocksize_bits;
-	uint64_t offset = 0;
-	uint32_t wrote, count, jrnl_blocks;
-
-#define BUFLEN	1048576
-	ret = ocfs2_malloc_blocks(fs->fs_io, (BUFLEN >> bs_bits), &buf);
-	if (ret)
-		goto out;
-	memset(buf, 0, BUFLEN);
-
-	io_set_nocache(fs->fs_io, true);
-	count = (uint32_t) ci->ci_inode->i_size;
-	while (count) {
-		ret = ocfs2_file_write(ci, buf, ocfs2_min((uint32_t) BUFLEN, count),
-				       offset, &wrote);
-		if (ret)
-			break;
-		offset += wrote;
-		count -= wrote;
-	}
-	io_set_nocache(fs->fs_io, false);
-	if (ret)
-		goto out;
+	errcode_t ret;
+	char *jsb_buf = NULL;
+	uint64_t blkno;
+	uint32_t jrnl_blocks;
 
 	jrnl_blocks = ocfs2_clusters_to_blocks(fs, ci->ci_inode->i_clusters);
 	ret = ocfs2_create_journal_superblock(fs, jrnl_blocks, features,
@@ -341,23 +322,149 @@ static errcode_t ocfs2_format_journal(ocfs2_filesys *fs,
 	if (ret)
 		goto out;
 
-	/* re-use offset here for 1st journal block. */
-	ret = ocfs2_extent_map_get_blocks(ci, 0, 1, &offset, NULL, NULL);
+	ret = ocfs2_extent_map_get_blocks(ci, 0, 1, &blkno, NULL, NULL);
 	if (ret)
 		goto out;
 
-	ret = ocfs2_write_journal_superblock(fs, offset, jsb_buf);
+	ret = ocfs2_write_journal_superblock(fs, blkno, jsb_buf);
 out:
-	if (buf)
-		ocfs2_free(&buf);
 	if (jsb_buf)
 		ocfs2_free(&jsb_buf);
 
 	return ret;
 }
 
-errcode_t ocfs2_make_journal(ocfs2_filesys *fs, uint64_t blkno,
-			     uint32_t clusters, ocfs2_fs_options *features)
+/*
+ * The physical runs backing a set of journals.  They are zeroed in
+ * disk order with io_zero_blocks().
+ */
+struct journal_run {
+	uint64_t jr_blkno;
+	uint64_t jr_count;
+};
+
+struct journal_runs {
+	struct journal_run *jr_runs;
+	int jr_used;
+	int jr_alloced;
+};
+
+static errcode_t journal_map_runs(ocfs2_cached_inode *ci,
+				  struct journal_runs *jr)
+{
+	errcode_t ret;
+	ocfs2_filesys *fs = ci->ci_fs;
+	uint64_t v_blkno = 0, p_blkno, contig, num_blocks;
+	struct journal_run *run;
+
+	num_blocks = ci->ci_inode->i_size >>
+		OCFS2_RAW_SB(fs->fs_super)->s_blocksize_bits;
+	while (v_blkno < num_blocks) {
+		ret = ocfs2_extent_map_get_blocks(ci, v_blkno, 1, &p_blkno,
+						  &contig, NULL);
+		if (ret)
+			return ret;
+		/* Journals are never sparse */
+		if (!p_blkno)
+			return OCFS2_ET_INTERNAL_FAILURE;
+		if (contig > num_blocks - v_blkno)
+			contig = num_blocks - v_blkno;
+		v_blkno += contig;
+
+		if (jr->jr_used) {
+			run = &jr->jr_runs[jr->jr_used - 1];
+			if (run->jr_blkno + run->jr_count == p_blkno) {
+				run->jr_count += contig;
+				continue;
+			}
+		}
+
+		if (jr->jr_used == jr->jr_alloced) {
+			ret = ocfs2_realloc(sizeof(struct journal_run) *
+					    (jr->jr_alloced + 32),
+					    &jr->jr_runs);
+			if (ret)
+				return ret;
+			jr->jr_alloced += 32;
+		}
+
+		run = &jr->jr_runs[jr->jr_used++];
+		run->jr_blkno = p_blkno;
+		run->jr_count = contig;
+	}
+
+	return 0;
+}
+
+static int journal_run_compare(const void *a, const void *b)
+{
+	const struct journal_run *l = a, *r = b;
+
+	if (l->jr_blkno < r->jr_blkno)
+		return -1;
+	if (l->jr_blkno > r->jr_blkno)
+		return 1;
+	return 0;
+}
+
+static errcode_t journal_zero_runs(ocfs2_filesys *fs,
+				   struct journal_runs *jr)
+{
+	errcode_t ret = 0;
+	int i;
+
+	qsort(jr->jr_runs, jr->jr_used, sizeof(struct journal_run),
+	      journal_run_compare);
+
+	for (i = 0; i < jr->jr_used; i++) {
+		ret = io_zero_blocks(fs->fs_io, jr->jr_runs[i].jr_blkno,
+				     jr->jr_runs[i].jr_count);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+/*
+ * Zero the contents of a journal.  The device does the work when it
+ * can; see io_zero_blocks().
+ */
+errcode_t ocfs2_zero_journal(ocfs2_cached_inode *ci)
+{
+	errcode_t ret;
+	struct journal_runs jr = { NULL, };
+
+	ret = journal_map_runs(ci, &jr);
+	if (!ret)
+		ret = journal_zero_runs(ci->ci_fs, &jr);
+
+	if (jr.jr_runs)
+		ocfs2_free(&jr.jr_runs);
+
+	return ret;
+}
+
+static errcode_t ocfs2_format_journal(ocfs2_filesys *fs,
+				      ocfs2_cached_inode *ci,
+				      ocfs2_fs_options *features)
+{
+	errcode_t ret;
+
+	ret = ocfs2_zero_journal(ci);
+	if (!ret)
+		ret = ocfs2_write_journal_header(fs, ci, features);
+
+	return ret;
+}
+
+/*
+ * Allocate or truncate the journal at blkno to clusters and return a
+ * fresh cached inode for it.
+ */
+static errcode_t ocfs2_size_journal(ocfs2_filesys *fs, uint64_t blkno,
+				    uint32_t clusters,
+				    ocfs2_cached_inode **ret_ci)
 {
 	errcode_t ret = 0;
 	ocfs2_cached_inode *ci = NULL;
@@ -421,6 +528,25 @@ errcode_t ocfs2_make_journal(ocfs2_filesys *fs, uint64_t blkno,
 		}
 	}
 
+	*ret_ci = ci;
+	ci = NULL;
+out:
+	if (ci)
+		ocfs2_free_cached_inode(fs, ci);
+
+	return ret;
+}
+
+errcode_t ocfs2_make_journal(ocfs2_filesys *fs, uint64_t blkno,
+			     uint32_t clusters, ocfs2_fs_options *features)
+{
+	errcode_t ret = 0;
+	ocfs2_cached_inode *ci = NULL;
+
+	ret = ocfs2_size_journal(fs, blkno, clusters, &ci);
+	if (ret)
+		goto out;
+
 	ret = ocfs2_format_journal(fs, ci, features);
 out:
 	if (ci)
@@ -429,6 +555,59 @@ out:
 	return ret;
 }
 
+/*
+ * Make count journals of the same size.  All of them are sized first,
+ * then their extents are zeroed together in disk order.  A failure part
+ * way leaves journals sized but without a header, so this is for a
+ * filesystem being created.  Existing journals go through
+ * ocfs2_make_journal() one at a time.
+ */
+errcode_t ocfs2_make_journals(ocfs2_filesys *fs, uint64_t *blknos,
+			      int count, uint32_t clusters,
+			      ocfs2_fs_options *features)
+{
+	errcode_t ret;
+	int i;
+	ocfs2_cached_inode **cis = NULL;
+	struct journal_runs jr = { NULL, };
+
+	ret = ocfs2_malloc0(sizeof(ocfs2_cached_inode *) * count, &cis);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		ret = ocfs2_size_journal(fs, blknos[i], clusters, &cis[i]);
+		if (ret)
+			goto out;
+
+		ret = journal_map_runs(cis[i], &jr);
+		if (ret)
+			goto out;
+	}
+
+	ret = journal_zero_runs(fs, &jr);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		ret = ocfs2_write_journal_header(fs, cis[i], features);
+		if (ret)
+			goto out;
+	}
+
+out:
+	if (cis) {
+		for (i = 0; i < count; i++)
+			if (cis[i])
+				ocfs2_free_cached_inode(fs, cis[i]);
+		ocfs2_free(&cis);
+	}
+	if (jr.jr_runs)
+		ocfs2_free(&jr.jr_runs);
+
+	return ret;
+}
+
 #ifdef DEBUG_EXE
 #if 0
 static uint64_t read_number(const char *num)
@@ -52,7 +52,6 @@
 static errcode_t __ocfs2_read_blocks(ocfs2_filesys *fs, int64_t blkno,
 				     int count, char *data, bool nocache)
 {
-	int i;
 	errcode_t err;
 
 	if (fs->fs_flags & OCFS2_FLAG_IMAGE_FILE) {
@@ -62,9 +61,12 @@ static errcode_t __ocfs2_read_blocks(ocfs2_filesys *fs, int64_t blkno,
 		 * image file. However we check for any holes and
 		 * return -EIO if any.
 		 */
-		for (i = 0; i < count; i++)
-			if (!ocfs2_image_test_bit(fs, blkno+i))
-				return OCFS2_ET_IO;
+		if (!ocfs2_image_test_bits(fs, blkno, count))
+			return OCFS2_ET_IO;
+		if (fs->ost->ost_base)
+			return ocfs2_image_read_delta(fs, blkno, count, data);
+		if (fs->ost->ost_chunkblks)
+			return ocfs2_image_read_chunked(fs, blkno, count, data);
 		/* translate the block number */
 		blkno = ocfs2_image_get_blockno(fs, blkno);
 	}
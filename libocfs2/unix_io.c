@@ -42,6 +42,7 @@
 #include <sys/resource.h>
 #include <sys/utsname.h>
 #include <linux/fs.h>
+#include <linux/falloc.h>
 #include <libaio.h>
 #endif
 #include <sys/mman.h>
@@ -103,6 +104,7 @@ struct _io_channel {
 	int io_error;
 	int io_fd;
 	bool io_nocache;
+	int io_zero_flags;	/* IO_ZERO_NO_* */
 	struct io_cache *io_cache;
 
 	/* stats */
@@ -120,8 +122,22 @@ static inline int one_meg_of_blocks(io_channel *channel)
 	return count / channel->io_blksize;
 }
 
-static errcode_t unix_vec_read_blocks(io_channel *channel,
-				      struct io_vec_unit *ivus, int count)
+/*
+ * The aio context is sized by the number of units in flight.  Large
+ * vectors are pushed through a context of at most this depth.
+ */
+#define IO_VEC_MAX_DEPTH	256
+
+/*
+ * io_zero_blocks() remembers which zeroing methods the channel doesn't
+ * support so it doesn't retry them on every call.
+ */
+#define IO_ZERO_NO_ZEROOUT	0x01
+#define IO_ZERO_NO_ZERO_RANGE	0x02
+
+static errcode_t unix_vec_rw_blocks(io_channel *channel,
+				    struct io_vec_unit *ivus, int count,
+				    int write)
 {
 	int i;
 	int ret;
@@ -129,52 +145,97 @@ static errcode_t unix_vec_read_blocks(io_channel *channel,
 	struct iocb *iocb = NULL, **iocbs = NULL;
 	struct io_event *events = NULL;
 	int64_t offset;
-	int submitted, completed = 0;
+	int depth, batch, submitted, completed, done = 0;
+	uint64_t bytes = 0;
+
+	if (!count)
+		return 0;
+
+	depth = ocfs2_min(count, IO_VEC_MAX_DEPTH);
 
 	ret = OCFS2_ET_NO_MEMORY;
-	iocb = malloc((sizeof(struct iocb) * count));
-	iocbs = malloc((sizeof(struct iocb *) * count));
-	events = malloc((sizeof(struct io_event) * count));
+	iocb = malloc((sizeof(struct iocb) * depth));
+	iocbs = malloc((sizeof(struct iocb *) * depth));
+	events = malloc((sizeof(struct io_event) * depth));
 	if (!iocb || !iocbs || !events)
-		goto out;
+		goto out_free;
 
 	memset(&io_ctx, 0, sizeof(io_ctx));
-	ret = io_queue_init(count, &io_ctx);
-	if (ret)
-		return ret;
-
-	for (i = 0; i < count; ++i) {
-		offset = ivus[i].ivu_blkno * channel->io_blksize;
-		io_prep_pread(&(iocb[i]), channel->io_fd, ivus[i].ivu_buf,
-			      ivus[i].ivu_buflen, offset);
-		iocbs[i] = &iocb[i];
+	ret = io_queue_init(depth, &io_ctx);
+	if (ret) {
+		channel->io_error = -ret;
+		ret = OCFS2_ET_IO;
+		goto out_free;
 	}
 
-resubmit:
-	ret = io_submit(io_ctx, count - completed, &iocbs[completed]);
-	if (!ret && (count - completed))
-		ret = OCFS2_ET_SHORT_READ;
-	if (ret < 0)
-		goto out;
-	submitted = ret;
+	while (done < count) {
+		batch = ocfs2_min(count - done, depth);
+		for (i = 0; i < batch; ++i) {
+			offset = ivus[done + i].ivu_blkno * channel->io_blksize;
+			if (write)
+				io_prep_pwrite(&(iocb[i]), channel->io_fd,
+					       ivus[done + i].ivu_buf,
+					       ivus[done + i].ivu_buflen,
+					       offset);
+			else
+				io_prep_pread(&(iocb[i]), channel->io_fd,
+					      ivus[done + i].ivu_buf,
+					      ivus[done + i].ivu_buflen,
+					      offset);
+			iocbs[i] = &iocb[i];
+		}
 
-	ret = io_getevents(io_ctx, submitted, submitted, events, NULL);
-	if (ret < 0)
-		goto out;
+		completed = 0;
+		while (completed < batch) {
+			ret = io_submit(io_ctx, batch - completed,
+					&iocbs[completed]);
+			if (ret <= 0) {
+				channel->io_error = ret ? -ret : EAGAIN;
+				ret = OCFS2_ET_IO;
+				goto out;
+			}
+			submitted = ret;
+
+			ret = io_getevents(io_ctx, submitted, submitted,
+					   events, NULL);
+			if (ret != submitted) {
+				channel->io_error = (ret < 0) ? -ret : EIO;
+				ret = OCFS2_ET_IO;
+				goto out;
+			}
+
+			for (i = 0; i < submitted; i++) {
+				if ((long)events[i].res < 0) {
+					channel->io_error = -(long)events[i].res;
+					ret = OCFS2_ET_IO;
+					goto out;
+				}
+				bytes += events[i].res;
+				if (events[i].res != events[i].obj->u.c.nbytes) {
+					ret = write ? OCFS2_ET_SHORT_WRITE :
+						OCFS2_ET_SHORT_READ;
+					goto out;
+				}
+			}
+
+			completed += submitted;
+		}
 
-	completed += submitted;
-	if (completed < count)
-		goto resubmit;
+		done += batch;
+	}
+
+	ret = 0;
 
 out:
-	if (ret >= 0)
-		ret = 0;
-	if (!ret)
-		channel->io_bytes_read += (count * channel->io_blksize);
+	io_queue_release(io_ctx);
+out_free:
+	if (write)
+		channel->io_bytes_written += bytes;
+	else
+		channel->io_bytes_read += bytes;
 	free(iocb);
 	free(iocbs);
 	free(events);
-	io_queue_release(io_ctx);
 
 	return ret;
 }
@@ -377,7 +438,7 @@ static errcode_t io_cache_vec_read_blocks(io_channel *channel,
 	 * Read all blocks. We could extend this to not issue ios for already
 	 * cached blocks. But is it worth the effort?
 	 */
-	ret = unix_vec_read_blocks(channel, ivus, count);
+	ret = unix_vec_rw_blocks(channel, ivus, count, 0);
 	if (ret)
 		goto out;
 
@@ -410,6 +471,60 @@ out:
 	return ret;
 }
 
+/*
+ * The vectored write issues all units before touching the cache.  We
+ * can't tell which units made it to disk if the submission fails, so
+ * any cached copy of a block in the vector is dropped in that case.
+ */
+static errcode_t io_cache_vec_write_blocks(io_channel *channel,
+					   struct io_vec_unit *ivus,
+					   int count, bool nocache)
+{
+	struct io_cache *ic = channel->io_cache;
+	struct io_cache_block *icb;
+	errcode_t ret;
+	int i, j, blksize = channel->io_blksize;
+	uint64_t blkno;
+	uint32_t numblks;
+	char *buf;
+
+	ret = unix_vec_rw_blocks(channel, ivus, count, 1);
+
+	for (i = 0; i < count; i++) {
+		blkno = ivus[i].ivu_blkno;
+		numblks = ivus[i].ivu_buflen / blksize;
+		buf = ivus[i].ivu_buf;
+
+		for (j = 0; j < numblks; ++j, ++blkno, buf += blksize) {
+			icb = io_cache_lookup(ic, blkno);
+			if (ret) {
+				if (icb) {
+					io_cache_disconnect(ic, icb);
+					io_cache_unsee(ic, icb);
+				}
+				continue;
+			}
+
+			if (!icb) {
+				if (nocache)
+					continue;
+				icb = io_cache_pop_lru(ic);
+				icb->icb_blkno = blkno;
+				io_cache_insert(ic, icb);
+			}
+
+			memcpy(icb->icb_buf, buf, blksize);
+
+			if (nocache)
+				io_cache_unsee(ic, icb);
+			else
+				io_cache_seen(ic, icb);
+		}
+	}
+
+	return ret;
+}
+
 /*
  * This relies on the fact that our cache is always up to date.  If a
  * block is in the cache, the same thing is on disk.  Even if we re-read
@@ -941,7 +1056,17 @@ errcode_t io_vec_read_blocks(io_channel *channel, struct io_vec_unit *ivus,
 		return io_cache_vec_read_blocks(channel, ivus, count,
 						channel->io_nocache);
 	else
-		return unix_vec_read_blocks(channel, ivus, count);
+		return unix_vec_rw_blocks(channel, ivus, count, 0);
+}
+
+errcode_t io_vec_write_blocks(io_channel *channel, struct io_vec_unit *ivus,
+			      int count)
+{
+	if (channel->io_cache)
+		return io_cache_vec_write_blocks(channel, ivus, count,
+						 channel->io_nocache);
+	else
+		return unix_vec_rw_blocks(channel, ivus, count, 1);
 }
 
 errcode_t io_read_block(io_channel *channel, int64_t blkno, int count,
@@ -984,6 +1109,142 @@ errcode_t io_write_block_nocache(io_channel *channel, int64_t blkno, int count,
 		return unix_io_write_block(channel, blkno, count, data);
 }
 
+/* Zeroed blocks that are in the cache stay valid, just zeroed */
+static void io_cache_zero_blocks(io_channel *channel, uint64_t blkno,
+				 uint64_t count)
+{
+	struct io_cache *ic = channel->io_cache;
+	struct io_cache_block *icb;
+	struct rb_node *p, *first = NULL;
+
+	/* Find the first cached block at or after blkno */
+	p = ic->ic_lookup.rb_node;
+	while (p) {
+		icb = rb_entry(p, struct io_cache_block, icb_node);
+		if (blkno <= icb->icb_blkno) {
+			first = p;
+			p = p->rb_left;
+		} else
+			p = p->rb_right;
+	}
+
+	for (p = first; p; p = rb_next(p)) {
+		icb = rb_entry(p, struct io_cache_block, icb_node);
+		if (icb->icb_blkno >= blkno + count)
+			break;
+		memset(icb->icb_buf, 0, channel->io_blksize);
+	}
+}
+
+static int io_zero_unsupported(int err)
+{
+	return (err == ENOTTY) || (err == EOPNOTSUPP) || (err == ENOSYS);
+}
+
+/* The last resort: write zeroed buffers, a megabyte at a time */
+static errcode_t unix_io_write_zeroes(io_channel *channel, uint64_t blkno,
+				      uint64_t count)
+{
+	errcode_t ret;
+	char *buf = NULL;
+	struct io_vec_unit *ivus = NULL;
+	uint64_t len;
+	int i, max_blocks = one_meg_of_blocks(channel);
+
+	if (count < max_blocks)
+		max_blocks = count;
+
+	ret = ocfs2_malloc_blocks(channel, max_blocks, &buf);
+	if (ret)
+		goto out;
+	memset(buf, 0, max_blocks * channel->io_blksize);
+
+	ret = ocfs2_malloc(sizeof(struct io_vec_unit) * IO_VEC_MAX_DEPTH,
+			   &ivus);
+	if (ret)
+		goto out;
+
+	while (count) {
+		for (i = 0; count && (i < IO_VEC_MAX_DEPTH); i++) {
+			len = ocfs2_min(count, (uint64_t)max_blocks);
+			ivus[i].ivu_blkno = blkno;
+			ivus[i].ivu_buf = buf;
+			ivus[i].ivu_buflen = len * channel->io_blksize;
+			blkno += len;
+			count -= len;
+		}
+
+		ret = unix_vec_rw_blocks(channel, ivus, i, 1);
+		if (ret)
+			break;
+	}
+
+out:
+	if (ivus)
+		ocfs2_free(&ivus);
+	if (buf)
+		ocfs2_free(&buf);
+
+	return ret;
+}
+
+/*
+ * Zero count blocks starting at blkno.
+ *
+ * Block devices are asked to do it themselves with BLKZEROOUT, which
+ * lets thin-provisioned and NVMe storage zero (or unmap) the range
+ * without us pushing buffers of zeros across the bus.  Image files use
+ * fallocate(FALLOC_FL_ZERO_RANGE).  If neither is supported, zeroed
+ * buffers are written.  Either way the range reads back as zeros, and
+ * any cached blocks in it are zeroed in the cache.
+ */
+errcode_t io_zero_blocks(io_channel *channel, int64_t blkno, int64_t count)
+{
+	errcode_t ret;
+	uint64_t range[2];
+	int rc;
+
+	if (count <= 0)
+		return count ? OCFS2_ET_INVALID_ARGUMENT : 0;
+
+	range[0] = (uint64_t)blkno * channel->io_blksize;
+	range[1] = (uint64_t)count * channel->io_blksize;
+
+#ifdef BLKZEROOUT
+	if (!(channel->io_zero_flags & IO_ZERO_NO_ZEROOUT)) {
+		rc = ioctl(channel->io_fd, BLKZEROOUT, range);
+		if (!rc)
+			goto zeroed;
+		if (io_zero_unsupported(errno))
+			channel->io_zero_flags |= IO_ZERO_NO_ZEROOUT;
+	}
+#endif
+
+#ifdef FALLOC_FL_ZERO_RANGE
+	if (!(channel->io_zero_flags & IO_ZERO_NO_ZERO_RANGE)) {
+		rc = fallocate(channel->io_fd, FALLOC_FL_ZERO_RANGE,
+			       range[0], range[1]);
+		if (!rc)
+			goto zeroed;
+		if (io_zero_unsupported(errno) || (errno == ENODEV))
+			channel->io_zero_flags |= IO_ZERO_NO_ZERO_RANGE;
+	}
+#endif
+
+	ret = unix_io_write_zeroes(channel, blkno, count);
+	if (ret)
+		return ret;
+	goto out;
+
+zeroed:
+	channel->io_bytes_written += range[1];
+out:
+	if (channel->io_cache)
+		io_cache_zero_blocks(channel, blkno, count);
+
+	return 0;
+}
+
 
 #ifdef DEBUG_EXE
 #include <stdio.h>
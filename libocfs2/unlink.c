@@ -237,6 +237,8 @@ errcode_t ocfs2_unlink(ocfs2_filesys *fs, uint64_t dir,
 	if (!(fs->fs_flags & OCFS2_FLAG_RW))
 		return OCFS2_ET_RO_FILESYS;
 
+	ocfs2_dcache_invalidate_dir(fs, dir);
+
 	ret = ocfs2_malloc_block(fs->fs_io, &di_buf);
 	if (ret)
 		goto out;
@@ -0,0 +1,309 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * discard.c
+ *
+ * Discard engine for the tools.
+ *
+ * Copyright (C) 2026 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#define _LARGEFILE64_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include "tools-internal/discard.h"
+#include "tools-internal/progress.h"
+#include "tools-internal/workers.h"
+#include "libtools-internal.h"
+
+#if defined(__linux__) && !defined(BLKDISCARD)
+#define BLKDISCARD		_IO(0x12,119)
+#endif
+
+/* The most we hand to a single BLKDISCARD */
+#define DISCARD_STEP		(2048ULL * 1024 * 1024)
+
+struct discard_ctxt {
+	int dc_fd;
+	uint64_t dc_start;
+	uint64_t dc_end;
+	uint64_t dc_base;		/* dc_start rounded down to a chunk */
+	uint64_t dc_chunk;
+	uint64_t dc_nr_chunks;
+	char *dc_done;
+	uint64_t dc_bytes;
+	struct tools_progress *dc_prog;
+};
+
+/* What a worker tells the parent after each chunk */
+struct discard_report {
+	uint64_t dr_chunk;
+	int dr_error;
+};
+
+static uint64_t discard_sysfs_value(struct stat *st, const char *attr)
+{
+	int i;
+	FILE *f;
+	uint64_t val = 0;
+	char path[PATH_MAX];
+	/* A partition has no queue directory of its own */
+	static const char *fmts[] = {
+		"/sys/dev/block/%u:%u/queue/%s",
+		"/sys/dev/block/%u:%u/../queue/%s",
+	};
+
+	for (i = 0; i < sizeof(fmts) / sizeof(fmts[0]); i++) {
+		snprintf(path, sizeof(path), fmts[i], major(st->st_rdev),
+			 minor(st->st_rdev), attr);
+		f = fopen(path, "r");
+		if (!f)
+			continue;
+		if (fscanf(f, "%"SCNu64, &val) != 1)
+			val = 0;
+		fclose(f);
+		break;
+	}
+
+	return val;
+}
+
+/*
+ * Chunks are whole multiples of discard_max_bytes, so the kernel never
+ * has to send a runt request, and of discard_granularity, so no granule
+ * is split between two chunks and silently skipped.
+ */
+static uint64_t discard_chunk_size(int fd)
+{
+	struct stat st;
+	uint64_t gran = 0, max = 0, chunk = DISCARD_STEP;
+
+	if (!fstat(fd, &st) && S_ISBLK(st.st_mode)) {
+		gran = discard_sysfs_value(&st, "discard_granularity");
+		max = discard_sysfs_value(&st, "discard_max_bytes");
+	}
+
+	if (max && (max < chunk))
+		chunk -= chunk % max;
+
+	if (gran) {
+		if (gran < chunk)
+			chunk -= chunk % gran;
+		else
+			chunk = gran;
+	}
+
+	return chunk;
+}
+
+static uint64_t discard_chunk_start(struct discard_ctxt *dc, uint64_t c)
+{
+	uint64_t off = dc->dc_base + c * dc->dc_chunk;
+
+	return (off < dc->dc_start) ? dc->dc_start : off;
+}
+
+static uint64_t discard_chunk_len(struct discard_ctxt *dc, uint64_t c)
+{
+	uint64_t end = dc->dc_base + (c + 1) * dc->dc_chunk;
+
+	if (end > dc->dc_end)
+		end = dc->dc_end;
+
+	return end - discard_chunk_start(dc, c);
+}
+
+static int discard_chunk(struct discard_ctxt *dc, uint64_t c)
+{
+	uint64_t range[2];
+
+	range[0] = discard_chunk_start(dc, c);
+	range[1] = discard_chunk_len(dc, c);
+
+	if (ioctl(dc->dc_fd, BLKDISCARD, &range))
+		return errno;
+
+	return 0;
+}
+
+static void discard_chunk_done(struct discard_ctxt *dc, uint64_t c)
+{
+	if (dc->dc_done[c])
+		return;
+
+	dc->dc_done[c] = 1;
+	dc->dc_bytes += discard_chunk_len(dc, c);
+	tools_progress_step(dc->dc_prog, 1);
+}
+
+static void discard_worker(int worker, int nr_workers, int pipe_fd,
+			   void *priv)
+{
+	struct discard_ctxt *dc = priv;
+	uint64_t c;
+	struct discard_report dr;
+
+	/* The parent's handlers may write to the device; we just die */
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	memset(&dr, 0, sizeof(dr));
+	for (c = worker; c < dc->dc_nr_chunks; c += nr_workers) {
+		if (dc->dc_done[c])
+			continue;
+
+		dr.dr_chunk = c;
+		dr.dr_error = discard_chunk(dc, c);
+		if (tools_full_write(pipe_fd, &dr, sizeof(dr)))
+			break;
+		if (dr.dr_error)
+			break;
+	}
+}
+
+/*
+ * Fork nr_workers workers, each discarding every nr_workers'th chunk.
+ * They report back over a pipe.  A chunk is only marked done once its
+ * report arrives, so anything a worker didn't get to, because it died
+ * or couldn't be forked at all, is picked up by discard_serial().
+ */
+static int discard_parallel(struct discard_ctxt *dc, int nr_workers)
+{
+	int ret = 0;
+	struct tools_workers tw;
+	struct discard_report dr;
+
+	if (!tools_start_workers(&tw, nr_workers, 0, discard_worker, dc))
+		return 0;
+
+	while (!tools_full_read(tw.tw_fds[0], &dr, sizeof(dr))) {
+		if (!dr.dr_error) {
+			discard_chunk_done(dc, dr.dr_chunk);
+			continue;
+		}
+
+		/* Stop everyone on the first failure */
+		if (!ret) {
+			ret = dr.dr_error;
+			tools_kill_workers(&tw);
+		}
+	}
+	tools_stop_workers(&tw);
+
+	return ret;
+}
+
+static int discard_serial(struct discard_ctxt *dc)
+{
+	uint64_t c;
+	int ret;
+
+	for (c = 0; c < dc->dc_nr_chunks; c++) {
+		if (dc->dc_done[c])
+			continue;
+
+		ret = discard_chunk(dc, c);
+		if (ret)
+			return ret;
+		discard_chunk_done(dc, c);
+	}
+
+	return 0;
+}
+
+/*
+ * Public API
+ */
+
+int tools_discard(int fd, uint64_t start, uint64_t len, int nr_workers,
+		  struct tools_discard_stats *stats)
+{
+	int ret;
+	uint64_t c;
+	struct timeval tv_start, tv_end;
+	struct discard_ctxt dc;
+
+	memset(stats, 0, sizeof(struct tools_discard_stats));
+	if (!len)
+		return 0;
+
+	memset(&dc, 0, sizeof(dc));
+	dc.dc_fd = fd;
+	dc.dc_start = start;
+	dc.dc_end = start + len;
+	dc.dc_chunk = discard_chunk_size(fd);
+	dc.dc_base = start - (start % dc.dc_chunk);
+	dc.dc_nr_chunks = (dc.dc_end - dc.dc_base + dc.dc_chunk - 1) /
+		dc.dc_chunk;
+
+	dc.dc_done = calloc(dc.dc_nr_chunks, 1);
+	if (!dc.dc_done)
+		return ENOMEM;
+
+	dc.dc_prog = tools_progress_start("Discarding", "discard",
+					  dc.dc_nr_chunks);
+	if (!dc.dc_prog) {
+		free(dc.dc_done);
+		return ENOMEM;
+	}
+
+	gettimeofday(&tv_start, NULL);
+
+	/*
+	 * The first chunk goes alone.  If the device can't discard at
+	 * all, we find out without forking anybody.
+	 */
+	ret = discard_chunk(&dc, 0);
+	if (!ret) {
+		discard_chunk_done(&dc, 0);
+		if (nr_workers > dc.dc_nr_chunks - 1)
+			nr_workers = dc.dc_nr_chunks - 1;
+		if (nr_workers > 1)
+			ret = discard_parallel(&dc, nr_workers);
+		if (!ret)
+			ret = discard_serial(&dc);
+	}
+
+	gettimeofday(&tv_end, NULL);
+	tools_progress_stop(dc.dc_prog);
+
+	for (c = 0; c < dc.dc_nr_chunks; c++)
+		if (!dc.dc_done[c])
+			break;
+
+	stats->ds_chunk_size = dc.dc_chunk;
+	stats->ds_discarded = (c == dc.dc_nr_chunks) ? len :
+		discard_chunk_start(&dc, c) - start;
+	stats->ds_bytes = dc.dc_bytes;
+	stats->ds_usecs = (tv_end.tv_sec - tv_start.tv_sec) * 1000000ULL +
+		tv_end.tv_usec - tv_start.tv_usec;
+
+	free(dc.dc_done);
+
+	return ret;
+}
@@ -0,0 +1,167 @@
+/* -*- mode: c; c-basic-offset: 8; -*-
+ * vim: noexpandtab sw=8 ts=8 sts=0:
+ *
+ * workers.c
+ *
+ * Worker processes for the tools.
+ *
+ * Copyright (C) 2026 Oracle.  All rights reserved.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "tools-internal/workers.h"
+
+/* Start one worker, with its pipe in fds.  Returns the pid or -1. */
+static pid_t start_worker(struct tools_workers *tw, int worker,
+			  int nr_workers, int *fds, tools_worker_func func,
+			  void *priv)
+{
+	int i;
+	pid_t pid;
+
+	pid = fork();
+	if (pid)
+		return pid;
+
+	close(fds[0]);
+	if (tw->tw_flags & TOOLS_WORKERS_OWN_PIPE) {
+		for (i = 0; i < worker; i++)
+			close(tw->tw_fds[i]);
+	}
+
+	func(worker, nr_workers, fds[1], priv);
+	_exit(0);
+}
+
+int tools_start_workers(struct tools_workers *tw, int nr_workers, int flags,
+			tools_worker_func func, void *priv)
+{
+	int i, fds[2];
+
+	memset(tw, 0, sizeof(struct tools_workers));
+	tw->tw_flags = flags;
+	tw->tw_pids = calloc(nr_workers, sizeof(pid_t));
+	tw->tw_fds = calloc(nr_workers, sizeof(int));
+	if (!tw->tw_pids || !tw->tw_fds)
+		goto out;
+
+	/* Or the workers would print whatever we haven't yet */
+	fflush(stdout);
+
+	if (!(flags & TOOLS_WORKERS_OWN_PIPE) && pipe(fds))
+		goto out;
+
+	for (i = 0; i < nr_workers; i++) {
+		if ((flags & TOOLS_WORKERS_OWN_PIPE) && pipe(fds))
+			break;
+
+		tw->tw_pids[i] = start_worker(tw, i, nr_workers, fds, func,
+					      priv);
+		if (tw->tw_pids[i] < 0) {
+			if (flags & TOOLS_WORKERS_OWN_PIPE) {
+				close(fds[0]);
+				close(fds[1]);
+			}
+			break;
+		}
+
+		tw->tw_fds[i] = fds[0];
+		if (flags & TOOLS_WORKERS_OWN_PIPE)
+			close(fds[1]);
+	}
+	tw->tw_nr_workers = i;
+
+	if (!(flags & TOOLS_WORKERS_OWN_PIPE)) {
+		close(fds[1]);
+		if (!i)
+			close(fds[0]);
+	}
+
+out:
+	if (!tw->tw_nr_workers) {
+		free(tw->tw_fds);
+		free(tw->tw_pids);
+		memset(tw, 0, sizeof(struct tools_workers));
+	}
+
+	return tw->tw_nr_workers;
+}
+
+void tools_kill_workers(struct tools_workers *tw)
+{
+	int i;
+
+	for (i = 0; i < tw->tw_nr_workers; i++)
+		kill(tw->tw_pids[i], SIGTERM);
+}
+
+void tools_stop_workers(struct tools_workers *tw)
+{
+	int i, status;
+
+	for (i = 0; i < tw->tw_nr_workers; i++) {
+		if (!i || (tw->tw_flags & TOOLS_WORKERS_OWN_PIPE))
+			close(tw->tw_fds[i]);
+	}
+
+	for (i = 0; i < tw->tw_nr_workers; i++) {
+		while ((waitpid(tw->tw_pids[i], &status, 0) < 0) &&
+		       (errno == EINTR))
+			;
+	}
+
+	free(tw->tw_fds);
+	free(tw->tw_pids);
+	memset(tw, 0, sizeof(struct tools_workers));
+}
+
+int tools_full_read(int fd, void *buf, size_t len)
+{
+	ssize_t rd;
+
+	while (len) {
+		rd = read(fd, buf, len);
+		if ((rd < 0) && (errno == EINTR))
+			continue;
+		if (rd <= 0)
+			return -1;
+		buf = (char *)buf + rd;
+		len -= rd;
+	}
+
+	return 0;
+}
+
+int tools_full_write(int fd, const void *buf, size_t len)
+{
+	ssize_t wr;
+
+	while (len) {
+		wr = write(fd, buf, len);
+		if ((wr < 0) && (errno == EINTR))
+			continue;
+		if (wr <= 0)
+			return -1;
+		buf = (const char *)buf + wr;
+		len -= wr;
+	}
+
+	return 0;
+}
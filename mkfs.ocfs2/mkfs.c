@@ -34,6 +34,11 @@ static uint64_t get_valid_size(uint64_t num, uint64_t lo, uint64_t hi);
 static void *do_malloc(State *s, size_t size);
 static void do_pwrite(State *s, const void *buf, size_t count, 
 		      uint64_t offset);
+static void format_writer_init(State *s);
+static void format_writer_exit(State *s);
+static void queue_pwrite(State *s, void *buf, size_t count,
+			 uint64_t offset);
+static void flush_writes(State *s);
 static AllocBitmap *initialize_bitmap(State *s, uint32_t bits,
 				      uint32_t unit_bits, const char *name,
 				      SystemFileDiskRecord *bm_record);
@@ -127,6 +132,7 @@ enum {
 	CLUSTER_STACK_OPTION,
 	CLUSTER_NAME_OPTION,
 	GLOBAL_HEARTBEAT_OPTION,
+	QUEUE_DEPTH_OPTION,
 };
 
 static uint64_t align_bytes_to_clusters_ceil(State *s,
@@ -543,42 +549,28 @@ static void finish_normal_format(State *s)
 	ocfs2_close(fs);
 }
 
-static inline int discard_blocks(State *s, uint64_t from,
-		uint64_t count)
-{
-	uint64_t range[2];
-
-	range[0] = from << s->blocksize_bits;
-	range[1] = count << s->blocksize_bits;
-
-	return ioctl(s->fd, BLKDISCARD, &range);
-}
-
 static int discard_device_blocks(State *s)
 {
-	uint64_t blocks = s->volume_size_in_blocks;
-	uint64_t count = DISCARD_STEP_MB;
-	uint64_t cur = 0;
-	int retval = 0;
-
-	count *= (1024 * 1024);
-	count >>= s->blocksize_bits;
+	int retval;
+	struct tools_discard_stats stats;
 
-	while (cur < blocks) {
-		if (cur + count > blocks)
-			count = blocks - cur;
-
-		retval = discard_blocks(s, cur, count);
-		if (retval) {
-			if (!s->quiet && errno != EOPNOTSUPP)
-				com_err(s->progname, 0, "Discard device blocks: %s",
-					strerror(errno));
-			break;
-		}
-		cur += count;
+	retval = tools_discard(s->fd, 0, s->volume_size_in_bytes,
+			       TOOLS_DISCARD_WORKERS, &stats);
+	if (retval) {
+		if (!s->quiet && retval != EOPNOTSUPP)
+			com_err(s->progname, 0, "Discard device blocks: %s",
+				strerror(retval));
+		return retval;
 	}
 
-	return retval;
+	if (s->verbose && stats.ds_usecs)
+		printf("Discarded %"PRIu64" MB in %"PRIu64" ms (%"PRIu64
+		       " MB/s)\n", stats.ds_bytes >> ONE_MB_SHIFT,
+		       stats.ds_usecs / 1000,
+		       (stats.ds_bytes >> ONE_MB_SHIFT) * 1000000 /
+		       stats.ds_usecs);
+
+	return 0;
 }
 
 int
@@ -656,6 +648,8 @@ main(int argc, char **argv)
 	if (s->discard_blocks)
 		discard_device_blocks(s);
 
+	format_writer_init(s);
+
 	clear_both_ends(s);
 
 	init_record(s, &superblock_rec, SFI_OTHER, S_IFREG | 0644);
@@ -713,6 +707,7 @@ main(int argc, char **argv)
 	tmprec->chain_off =
 		tmprec->group->gd->bg_blkno << s->blocksize_bits;
 
+	flush_writes(s);
 	fsync(s->fd);
 	if (!s->quiet)
 		printf("done\n");
@@ -802,6 +797,7 @@ main(int argc, char **argv)
 		}
 	}
 
+	flush_writes(s);
 	fsync(s->fd);
 	if (!s->quiet)
 		printf("done\n");
@@ -846,6 +842,7 @@ main(int argc, char **argv)
 	tmprec = &(record[HEARTBEAT_SYSTEM_INODE][0]);
 	write_metadata(s, tmprec, NULL);
 
+	flush_writes(s);
 	fsync(s->fd);
 	if (!s->quiet)
 		printf("done\n");
@@ -931,6 +928,7 @@ get_state(int argc, char **argv)
 	enum ocfs2_feature_levels level = OCFS2_FEATURE_LEVEL_DEFAULT;
 	ocfs2_fs_options feature_flags = {0,0,0}, reverse_flags = {0,0,0};
 	int discard_blocks = 1;
+	unsigned int queue_depth = FORMAT_QUEUE_DEPTH_DEFAULT;
 
 	static struct option long_options[] = {
 		{ "block-size", 1, 0, 'b' },
@@ -945,6 +943,7 @@ get_state(int argc, char **argv)
 		{ "force", 0, 0, 'F'},
 		{ "mount", 1, 0, 'M'},
 		{ "dry-run", 0, 0, 'n' },
+		{ "progress", 0, 0, 'P' },
 		{ "nodiscard", 0, 0, 'o'},
 		{ "discard", 0, 0, 'O'},
 		{ "no-backup-super", 0, 0, BACKUP_SUPER_OPTION },
@@ -953,6 +952,7 @@ get_state(int argc, char **argv)
 		{ "cluster-stack=", 1, 0, CLUSTER_STACK_OPTION },
 		{ "cluster-name=", 1, 0, CLUSTER_NAME_OPTION },
 		{ "global-heartbeat", 0, 0, GLOBAL_HEARTBEAT_OPTION },
+		{ "queue-depth=", 1, 0, QUEUE_DEPTH_OPTION },
 		{ 0, 0, 0, 0}
 	};
 
@@ -962,7 +962,7 @@ get_state(int argc, char **argv)
 		progname = "mkfs.ocfs2";
 
 	while (1) {
-		c = getopt_long(argc, argv, "b:C:L:N:J:M:vnqVFHxT:U:",
+		c = getopt_long(argc, argv, "b:C:L:N:J:M:vnqVFHxPT:U:",
 				long_options, NULL);
 
 		if (c == -1)
@@ -1147,6 +1147,22 @@ get_state(int argc, char **argv)
 			globalhb = 1;
 			break;
 
+		case QUEUE_DEPTH_OPTION:
+			queue_depth = strtoul(optarg, &dummy, 0);
+
+			if (*dummy != '\0' || queue_depth < 1 ||
+			    queue_depth > FORMAT_QUEUE_DEPTH_MAX) {
+				com_err(progname, 0,
+					"Queue depth must be between 1 and %d",
+					FORMAT_QUEUE_DEPTH_MAX);
+				exit(1);
+			}
+			break;
+
+		case 'P':
+			tools_progress_enable();
+			break;
+
 		case 'O':
 			discard_blocks = 1;
 			break;
@@ -1201,6 +1217,7 @@ get_state(int argc, char **argv)
 	s->force         = force;
 	s->dry_run       = dry_run;
 	s->discard_blocks = discard_blocks;
+	s->queue_depth   = queue_depth;
 
 	s->prompt        = xtool ? 0 : 1;
 
@@ -1448,11 +1465,12 @@ usage(const char *progname)
 	fprintf(stderr, "usage: %s [-b block-size] [-C cluster-size] "
 		"[-J journal-options]\n\t\t[-L volume-label] [-M mount-type] "
 		"[-N number-of-node-slots]\n\t\t[-T filesystem-type] [-U uuid]"
-		"[-HFnqvV] [--dry-run]"
+		"[-HFnPqvV] [--dry-run]"
 		"\n\t\t[--fs-feature-level=[default|max-compat|max-features]] "
 		"\n\t\t[--fs-features=[[no]sparse,...]] [--global-heartbeat]"
 		"\n\t\t[--cluster-stack=stackname] [--cluster-name=clustername]"
-		"\n\t\t[--no-backup-super] device [blocks-count]\n", progname);
+		"\n\t\t[--queue-depth=N] [--no-backup-super] device "
+		"[blocks-count]\n", progname);
 	exit(1);
 }
 
@@ -1937,6 +1955,9 @@ do_pwrite(State *s, const void *buf, size_t count, uint64_t offset)
 {
 	ssize_t ret;
 
+	/* Anything queued must hit the disk before us */
+	flush_writes(s);
+
 	ret = pwrite64(s->fd, buf, count, offset);
 
 	if (ret == -1) {
@@ -1946,6 +1967,209 @@ do_pwrite(State *s, const void *buf, size_t count, uint64_t offset)
 	}
 }
 
+/*
+ * The async format writer.  Formatting a large volume means hundreds of
+ * thousands of small writes: one per cluster group descriptor, one per
+ * system inode, and so on.  Issuing them one pwrite at a time leaves
+ * the device idle between requests.  Instead, queue_pwrite() hands the
+ * write to libaio and returns, keeping up to s->queue_depth writes in
+ * flight.  A write that starts where the previous one ended is
+ * coalesced into the same request as another iovec.
+ *
+ * queue_pwrite() takes ownership of the buffer, which must come from
+ * do_malloc(); it is freed once the write completes.  Writes that
+ * overlap one still in flight wait for the queue to drain first, so the
+ * last write to a block always wins, exactly as with do_pwrite().
+ * flush_writes() waits for everything, and must be called before
+ * anything else (fsync, libocfs2) looks at the device.
+ *
+ * If the aio context can't be set up, queue_pwrite() falls back to
+ * do_pwrite().
+ */
+static void format_writer_init(State *s)
+{
+	FormatWriter *w;
+	unsigned int i;
+
+	w = do_malloc(s, sizeof(FormatWriter));
+	memset(w, 0, sizeof(FormatWriter));
+	w->depth = s->queue_depth;
+
+	if (io_queue_init(w->depth, &w->ctx)) {
+		free(w);
+		return;
+	}
+
+	w->ios = do_malloc(s, sizeof(FormatIO) * w->depth);
+	w->events = do_malloc(s, sizeof(struct io_event) * w->depth);
+	for (i = 0; i < w->depth; i++) {
+		w->ios[i].next = w->free_ios;
+		w->free_ios = &w->ios[i];
+	}
+
+	s->writer = w;
+}
+
+static void format_writer_exit(State *s)
+{
+	FormatWriter *w = s->writer;
+
+	if (!w)
+		return;
+
+	flush_writes(s);
+	io_queue_release(w->ctx);
+	free(w->events);
+	free(w->ios);
+	free(w);
+	s->writer = NULL;
+}
+
+static void format_io_done(State *s, FormatIO *io, long res)
+{
+	FormatWriter *w = s->writer;
+	int i;
+
+	if (res < 0 || (size_t)res != io->len) {
+		com_err(s->progname, 0, "Could not write: %s",
+			res < 0 ? strerror(-res) : "short write");
+		exit(1);
+	}
+
+	for (i = 0; i < io->nr_iovs; i++)
+		free(io->iov[i].iov_base);
+	io->nr_iovs = 0;
+	io->len = 0;
+
+	io->next = w->free_ios;
+	w->free_ios = io;
+	w->nr_in_flight--;
+}
+
+/* Reap at least min_nr completed writes */
+static void format_writer_reap(State *s, unsigned int min_nr)
+{
+	FormatWriter *w = s->writer;
+	struct iocb *iocb;
+	int ret, i;
+
+	while (min_nr && w->nr_in_flight) {
+		ret = io_getevents(w->ctx, 1, w->nr_in_flight, w->events,
+				   NULL);
+		if (ret == -EINTR)
+			continue;
+		if (ret < 0) {
+			com_err(s->progname, 0, "Could not write: %s",
+				strerror(-ret));
+			exit(1);
+		}
+
+		for (i = 0; i < ret; i++) {
+			iocb = w->events[i].obj;
+			format_io_done(s,
+				       (FormatIO *)((char *)iocb -
+						    offsetof(FormatIO, iocb)),
+				       w->events[i].res);
+		}
+		min_nr = (min_nr > (unsigned int)ret) ? min_nr - ret : 0;
+	}
+}
+
+static void format_writer_submit(State *s)
+{
+	FormatWriter *w = s->writer;
+	FormatIO *io = w->pending;
+	struct iocb *iocbs[1];
+	int ret;
+
+	if (!io)
+		return;
+
+	w->pending = NULL;
+	io_prep_pwritev(&io->iocb, s->fd, io->iov, io->nr_iovs, io->offset);
+	iocbs[0] = &io->iocb;
+
+	do {
+		ret = io_submit(w->ctx, 1, iocbs);
+	} while (ret == -EINTR || ret == -EAGAIN);
+	if (ret != 1) {
+		com_err(s->progname, 0, "Could not write: %s",
+			ret < 0 ? strerror(-ret) : "submit failed");
+		exit(1);
+	}
+
+	w->nr_in_flight++;
+}
+
+static int format_io_overlaps(FormatIO *io, size_t count, uint64_t offset)
+{
+	return io->len && (offset < io->offset + io->len) &&
+		(io->offset < offset + count);
+}
+
+static int format_writer_overlaps(FormatWriter *w, size_t count,
+				  uint64_t offset)
+{
+	unsigned int i;
+
+	for (i = 0; i < w->depth; i++)
+		if (format_io_overlaps(&w->ios[i], count, offset))
+			return 1;
+
+	return 0;
+}
+
+static void flush_writes(State *s)
+{
+	FormatWriter *w = s->writer;
+
+	if (!w)
+		return;
+
+	format_writer_submit(s);
+	format_writer_reap(s, w->nr_in_flight);
+}
+
+static void
+queue_pwrite(State *s, void *buf, size_t count, uint64_t offset)
+{
+	FormatWriter *w = s->writer;
+	FormatIO *io;
+
+	if (!w) {
+		do_pwrite(s, buf, count, offset);
+		free(buf);
+		return;
+	}
+
+	if (format_writer_overlaps(w, count, offset))
+		flush_writes(s);
+
+	io = w->pending;
+	if (io && (io->offset + io->len == offset) &&
+	    (io->nr_iovs < FORMAT_IO_MAX_IOVS) &&
+	    (io->len + count <= FORMAT_IO_MAX_BYTES))
+		goto add;
+
+	format_writer_submit(s);
+	if (!w->free_ios)
+		format_writer_reap(s, 1);
+
+	io = w->free_ios;
+	w->free_ios = io->next;
+	io->next = NULL;
+	io->offset = offset;
+	io->len = 0;
+	io->nr_iovs = 0;
+	w->pending = io;
+
+add:
+	io->iov[io->nr_iovs].iov_base = buf;
+	io->iov[io->nr_iovs].iov_len = count;
+	io->nr_iovs++;
+	io->len += count;
+}
+
 static AllocGroup *
 initialize_alloc_group(State *s, const char *name,
 		       SystemFileDiskRecord *alloc_inode,
@@ -2470,15 +2694,6 @@ static void mkfs_swap_group_desc_from_cpu(State *s, struct ocfs2_group_desc *gd)
 	ocfs2_swap_group_desc_from_cpu(&fake_fs, gd);
 }
 
-static void mkfs_swap_group_desc_to_cpu(State *s, struct ocfs2_group_desc *gd)
-{
-	ocfs2_filesys fake_fs;
-	char super_buf[OCFS2_MAX_BLOCKSIZE];
-
-	fill_fake_fs(s, &fake_fs, super_buf);
-	ocfs2_swap_group_desc_to_cpu(&fake_fs, gd);
-}
-
 static void
 format_superblock(State *s, SystemFileDiskRecord *rec,
 		  SystemFileDiskRecord *root_rec, SystemFileDiskRecord *sys_rec)
@@ -2752,8 +2967,7 @@ format_file(State *s, SystemFileDiskRecord *rec)
 write_out:
 	mkfs_swap_inode_from_cpu(s, di);
 	mkfs_compute_meta_ecc(s, di, &di->i_check);
-	do_pwrite(s, di, s->blocksize, rec->fe_off);
-	free(di);
+	queue_pwrite(s, di, s->blocksize, rec->fe_off);
 }
 
 static void
@@ -2767,9 +2981,7 @@ write_metadata(State *s, SystemFileDiskRecord *rec, void *src)
 	if (src)
 		memcpy(buf, src, rec->file_size);
 
-	do_pwrite(s, buf, rec->extent_len, rec->extent_off);
-
-	free(buf);
+	queue_pwrite(s, buf, rec->extent_len, rec->extent_off);
 }
 
 static void
@@ -2780,9 +2992,6 @@ write_bitmap_data(State *s, AllocBitmap *bitmap)
 	struct ocfs2_group_desc *gd, *gd_buf;
 	char *buf = NULL;
 
-	buf = do_malloc(s, s->cluster_size);
-	memset(buf, 0, s->cluster_size);
-
 	parent_blkno = bitmap->bm_record->fe_off >> s->blocksize_bits;
 	for(i = 0; i < s->nr_cluster_groups; i++) {
 		gd = bitmap->groups[i]->gd;
@@ -2793,24 +3002,29 @@ write_bitmap_data(State *s, AllocBitmap *bitmap)
 		/* Ok, we didn't get a chance to fill in the parent
 		 * blkno until now. */
 		gd->bg_parent_dinode = parent_blkno;
+		/* Each group gets its own buffer, the writer frees it */
+		buf = do_malloc(s, s->cluster_size);
+		memset(buf + s->blocksize, 0, s->cluster_size - s->blocksize);
 		memcpy(buf, gd, s->blocksize);
 		gd_buf = (struct ocfs2_group_desc *)buf;
 		mkfs_swap_group_desc_from_cpu(s, gd_buf);
 		mkfs_compute_meta_ecc(s, buf, &gd_buf->bg_check);
-		do_pwrite(s, buf, s->cluster_size,
-			  gd->bg_blkno << s->blocksize_bits);
+		queue_pwrite(s, buf, s->cluster_size,
+			     gd->bg_blkno << s->blocksize_bits);
 	}
-	free(buf);
 }
 
 static void
 write_group_data(State *s, AllocGroup *group)
 {
 	uint64_t blkno = group->gd->bg_blkno;
-	mkfs_swap_group_desc_from_cpu(s, group->gd);
-	mkfs_compute_meta_ecc(s, group->gd, &group->gd->bg_check);
-	do_pwrite(s, group->gd, s->blocksize, blkno << s->blocksize_bits);
-	mkfs_swap_group_desc_to_cpu(s, group->gd);
+	struct ocfs2_group_desc *gd;
+
+	gd = do_malloc(s, s->blocksize);
+	memcpy(gd, group->gd, s->blocksize);
+	mkfs_swap_group_desc_from_cpu(s, gd);
+	mkfs_compute_meta_ecc(s, gd, &gd->bg_check);
+	queue_pwrite(s, gd, s->blocksize, blkno << s->blocksize_bits);
 }
 
 static void mkfs_swap_dir(State *s, DirData *dir,
@@ -2910,6 +3124,7 @@ open_device(State *s)
 static void
 close_device(State *s)
 {
+	format_writer_exit(s);
 	fsync(s->fd);
 	close(s->fd);
 	s->fd = -1;
@@ -3132,9 +3347,9 @@ bail:
 static void format_journals(State *s, ocfs2_filesys *fs)
 {
 	errcode_t ret;
-	int i;
+	int i, max_slots = OCFS2_RAW_SB(fs->fs_super)->s_max_slots;
 	uint32_t journal_size_in_clusters;
-	uint64_t blkno;
+	uint64_t *blknos = NULL;
 	char jrnl_file[40];
 	ocfs2_fs_options features = {
 		.opt_incompat =
@@ -3144,28 +3359,35 @@ static void format_journals(State *s, ocfs2_filesys *fs)
 	journal_size_in_clusters = s->journal_size_in_bytes >>
 		OCFS2_RAW_SB(fs->fs_super)->s_clustersize_bits;
 
-	for(i = 0; i < OCFS2_RAW_SB(fs->fs_super)->s_max_slots; i++) {
+	ret = ocfs2_malloc0(sizeof(uint64_t) * max_slots, &blknos);
+	if (ret) {
+		com_err(s->progname, ret,
+			"while allocating the journal list");
+		goto error;
+	}
+
+	for(i = 0; i < max_slots; i++) {
 		snprintf (jrnl_file, sizeof(jrnl_file),
 			  ocfs2_system_inodes[JOURNAL_SYSTEM_INODE].si_name, i);
 		ret = ocfs2_lookup(fs, fs->fs_sysdir_blkno, jrnl_file,
-				   strlen(jrnl_file), NULL, &blkno);
+				   strlen(jrnl_file), NULL, &blknos[i]);
 		if (ret) {
 			com_err(s->progname, ret,
 				"while looking up journal filename \"%.*s\"",
 				(int)strlen(jrnl_file), jrnl_file);
 			goto error;
 		}
+	}
 
-		ret = ocfs2_make_journal(fs, blkno, journal_size_in_clusters,
-					 &features);
-		if (ret) {
-			com_err(s->progname, ret,
-				"while formatting journal \"%.*s\"",
-				(int)strlen(jrnl_file), jrnl_file);
-			goto error;
-		}
+	/* All the journals are zeroed together, in disk order */
+	ret = ocfs2_make_journals(fs, blknos, max_slots,
+				  journal_size_in_clusters, &features);
+	if (ret) {
+		com_err(s->progname, ret, "while formatting the journals");
+		goto error;
 	}
 
+	ocfs2_free(&blknos);
 	return;
 
 error:
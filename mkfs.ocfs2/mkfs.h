@@ -42,12 +42,16 @@
 #include <ctype.h>
 #include <assert.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 
 #include <uuid/uuid.h>
+#include <libaio.h>
 
 #include "ocfs2/ocfs2.h"
 #include "ocfs2/bitops.h"
 #include "ocfs2-kernel/ocfs1_fs_compat.h"
+#include "tools-internal/progress.h"
+#include "tools-internal/discard.h"
 
 #include <signal.h>
 #include <libgen.h>
@@ -93,11 +97,12 @@
 
 #define MAX_EXTALLOC_RESERVE_PERCENT	5
 
-#define DISCARD_STEP_MB         2048
+/* Async format writer tunables */
+#define FORMAT_QUEUE_DEPTH_DEFAULT	32
+#define FORMAT_QUEUE_DEPTH_MAX		1024
+#define FORMAT_IO_MAX_IOVS		64
+#define FORMAT_IO_MAX_BYTES		(4 * 1024 * 1024)
 
-#if defined(__linux__) && !defined(BLKDISCARD)
-#define BLKDISCARD		_IO(0x12,119)
-#endif
 
 
 
@@ -187,6 +192,33 @@ struct _DirData {
 	SystemFileDiskRecord *record;
 };
 
+typedef struct _FormatIO FormatIO;
+
+/*
+ * One write in the async format writer.  Adjacent writes are coalesced
+ * into a single FormatIO, each piece keeping its own buffer in iov[].
+ */
+struct _FormatIO {
+	struct iocb iocb;
+	struct iovec iov[FORMAT_IO_MAX_IOVS];
+	int nr_iovs;
+	uint64_t offset;
+	size_t len;
+	FormatIO *next;		/* free list */
+};
+
+typedef struct _FormatWriter FormatWriter;
+
+struct _FormatWriter {
+	io_context_t ctx;
+	unsigned int depth;
+	unsigned int nr_in_flight;
+	FormatIO *ios;
+	FormatIO *free_ios;
+	FormatIO *pending;	/* being coalesced, not yet submitted */
+	struct io_event *events;
+};
+
 typedef struct _State State;
 
 struct _State {
@@ -236,6 +268,8 @@ struct _State {
 	uint32_t vol_generation;
 
 	int fd;
+	unsigned int queue_depth;
+	FormatWriter *writer;
 
 	time_t format_time;
 
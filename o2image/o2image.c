@@ -22,6 +22,7 @@
  * Boston, MA  02110-1301 USA.
  */
 
+#define _GNU_SOURCE /* for splice() */
 #define _XOPEN_SOURCE 600 /* Triggers magic in features.h */
 #define _LARGEFILE64_SOURCE
 
@@ -38,17 +39,34 @@
 #include <fcntl.h>
 #include <ocfs2/bitops.h>
 #include <libgen.h>
+#include <signal.h>
+#include <sys/stat.h>
 #include <sys/vfs.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 #include "ocfs2/ocfs2.h"
+#include "ocfs2/byteorder.h"
 #include "ocfs2/image.h"
+#include "tools-internal/workers.h"
+
+/* The block cache the metadata scan reads ahead into */
+#define O2IMAGE_SCAN_CACHE	(64 * 1024 * 1024)
+
+/* How many allocated inodes of a group we read ahead at a time */
+#define O2IMAGE_INODE_RA	1024
+
+/* How much the copy phase reads and writes at a time */
+#define O2IMAGE_COPY_SIZE	(4 * 1024 * 1024)
 
 static errcode_t traverse_inode(ocfs2_filesys *ofs, uint64_t inode);
 char *program_name = NULL;
 
 static void usage(void)
 {
-	fprintf(stderr, ("Usage: %s [-frI] device image_file\n"),
+	fprintf(stderr, ("Usage: %s [-frzI] [-b base_image] device "
+			 "image_file\n"),
 		program_name);
 	exit(1);
 }
@@ -60,16 +78,69 @@ static errcode_t mark_localalloc_bits(ocfs2_filesys *ofs,
 	return 0;
 }
 
+/*
+ * Read the inodes of the next O2IMAGE_INODE_RA allocated bits of the
+ * group, from bit start on, into the scan cache, a run of contiguous
+ * blocks per vector unit.  Returns the bit after the window.  This is
+ * only read-ahead; if it fails, traverse_inode() reads the blocks itself
+ * and reports the error.
+ */
+static int prefetch_inodes(ocfs2_filesys *ofs, struct ocfs2_group_desc *grp,
+			   int bpc, int start, char *buf,
+			   struct io_vec_unit *ivus)
+{
+	int i, nr = 0, blocks = 0;
+	uint64_t blkno;
+
+	for (i = start; (i < grp->bg_bits) && (blocks < O2IMAGE_INODE_RA);
+	     i++) {
+		if (!ocfs2_test_bit(i, grp->bg_bitmap))
+			continue;
+
+		blkno = ocfs2_get_block_from_group(ofs, grp, bpc, i);
+		if (nr && (ivus[nr - 1].ivu_blkno +
+			   ivus[nr - 1].ivu_buflen / ofs->fs_blocksize ==
+			   blkno)) {
+			ivus[nr - 1].ivu_buflen += ofs->fs_blocksize;
+		} else {
+			ivus[nr].ivu_blkno = blkno;
+			ivus[nr].ivu_buf = buf + blocks * ofs->fs_blocksize;
+			ivus[nr].ivu_buflen = ofs->fs_blocksize;
+			nr++;
+		}
+		blocks++;
+	}
+
+	io_vec_read_blocks(ofs->fs_io, ivus, nr);
+
+	return i;
+}
+
 static errcode_t traverse_group_desc(ocfs2_filesys *ofs,
 				     struct ocfs2_group_desc *grp,
 				     int dump_type, int bpc)
 {
+	struct io_vec_unit *ivus = NULL;
 	errcode_t ret = 0;
+	char *buf = NULL;
 	uint64_t blkno;
-	int i;
+	int i, ra = 0;
+
+	/* Without the scan cache there's nowhere to put read-ahead */
+	if ((dump_type == OCFS2_IMAGE_READ_INODE_YES) &&
+	    io_get_cache_size(ofs->fs_io)) {
+		ret = ocfs2_malloc_blocks(ofs->fs_io, O2IMAGE_INODE_RA, &buf);
+		if (!ret)
+			ret = ocfs2_malloc(sizeof(struct io_vec_unit) *
+					   O2IMAGE_INODE_RA, &ivus);
+		if (ret)
+			goto out;
+	}
 
 	blkno = grp->bg_blkno;
 	for (i = 1; i < grp->bg_bits; i++) {
+		if (buf && (i >= ra))
+			ra = prefetch_inodes(ofs, grp, bpc, i, buf, ivus);
 		blkno = ocfs2_get_block_from_group(ofs, grp, bpc, i);
 		if ((dump_type == OCFS2_IMAGE_READ_INODE_YES) &&
 		    ocfs2_test_bit(i, grp->bg_bitmap))
@@ -77,6 +148,12 @@ static errcode_t traverse_group_desc(ocfs2_filesys *ofs,
 		else
 			ocfs2_image_mark_bitmap(ofs, blkno);
 	}
+
+out:
+	if (ivus)
+		ocfs2_free(&ivus);
+	if (buf)
+		ocfs2_free(&buf);
 	return ret;
 }
 
@@ -287,9 +364,17 @@ static errcode_t traverse_inode(ocfs2_filesys *ofs, uint64_t inode)
 
 	if ((di->i_flags & OCFS2_LOCAL_ALLOC_FL))
 		ret = mark_localalloc_bits(ofs, &(di->id2.i_lab));
-	else if (di->i_flags & OCFS2_CHAIN_FL)
+	else if (di->i_flags & OCFS2_CHAIN_FL) {
+		/*
+		 * Read the group descriptors of all the chains side by
+		 * side, a link of every chain per vectored read, so that
+		 * walking them one chain at a time hits the scan cache.
+		 * Errors are found again by the walk.
+		 */
+		if (io_get_cache_size(ofs->fs_io))
+			ocfs2_cache_chain_allocator_blocks(ofs, di);
 		ret = traverse_chains(ofs, &(di->id2.i_chain), dump_type);
-	else if (di->i_flags & OCFS2_DEALLOC_FL)
+	} else if (di->i_flags & OCFS2_DEALLOC_FL)
 		ret = mark_dealloc_bits(ofs, &(di->id2.i_dealloc));
 	else if ((di->i_dyn_features & OCFS2_HAS_XATTR_FL) && di->i_xattr_loc)
 		/* Do need to traverse xattr btree to map bucket leaves */
@@ -402,142 +487,792 @@ out:
 	return ret;
 }
 
+static uint64_t next_marked_block(ocfs2_filesys *ofs, uint64_t blk)
+{
+	struct ocfs2_image_state *ost = ofs->ost;
+	uint64_t bmp;
+	int bit;
+
+	while (blk < ofs->fs_blocks) {
+		bmp = blk / OCFS2_IMAGE_BITS_IN_BLOCK;
+		bit = ocfs2_find_next_bit_set(ost->ost_bmparr[bmp].arr_map,
+					      OCFS2_IMAGE_BITS_IN_BLOCK,
+					      blk % OCFS2_IMAGE_BITS_IN_BLOCK);
+		if (bit < OCFS2_IMAGE_BITS_IN_BLOCK)
+			return bmp * OCFS2_IMAGE_BITS_IN_BLOCK + bit;
+		blk = (bmp + 1) * OCFS2_IMAGE_BITS_IN_BLOCK;
+	}
+
+	return ofs->fs_blocks;
+}
+
+struct copy_run {
+	uint64_t cr_blkno;
+	uint64_t cr_blocks;
+};
+
+struct copy_ctxt {
+	ocfs2_filesys *cc_fs;
+	uint64_t cc_blk;		/* where the bitmap walk is up to */
+	uint64_t cc_bufblks;
+	char *cc_buf;
+	struct copy_run *cc_runs;
+	struct io_vec_unit *cc_ivus;
+	/* Only for a delta */
+	ocfs2_filesys *cc_base;
+	char *cc_basebuf;		/* the base's copy of a run */
+	struct copy_run *cc_kept;	/* runs that differ from the base */
+	char *cc_held;			/* bitmap of the blocks written */
+};
+
+/* What the reader sends ahead of each batch */
+struct copy_report {
+	uint64_t cp_blkno;		/* first block, or the one that failed */
+	uint64_t cp_runs;
+	uint64_t cp_blocks;
+	errcode_t cp_error;
+};
+
+/*
+ * Read the next buffer's worth of marked blocks, in runs of contiguous
+ * blocks.  A device is read with one vectored I/O for the lot, so all
+ * the runs are in flight at once.  An image has to go through
+ * ocfs2_read_blocks() to be translated, which at least reads a run at
+ * a time.
+ */
+static void copy_read_batch(struct copy_ctxt *cc, struct copy_report *cp)
+{
+	ocfs2_filesys *ofs = cc->cc_fs;
+	struct io_vec_unit *ivu;
+	uint64_t blk, run;
+	int i;
+
+	memset(cp, 0, sizeof(struct copy_report));
+	while (cp->cp_blocks < cc->cc_bufblks) {
+		blk = next_marked_block(ofs, cc->cc_blk);
+		if (blk >= ofs->fs_blocks)
+			break;
+		if (!cp->cp_runs)
+			cp->cp_blkno = blk;
+
+		for (run = 1; (cp->cp_blocks + run < cc->cc_bufblks) &&
+		     (blk + run < ofs->fs_blocks); run++)
+			if (!ocfs2_image_test_bit(ofs, blk + run))
+				break;
+
+		cc->cc_runs[cp->cp_runs].cr_blkno = blk;
+		cc->cc_runs[cp->cp_runs].cr_blocks = run;
+		ivu = &cc->cc_ivus[cp->cp_runs];
+		ivu->ivu_blkno = blk;
+		ivu->ivu_buf = cc->cc_buf + cp->cp_blocks * ofs->fs_blocksize;
+		ivu->ivu_buflen = run * ofs->fs_blocksize;
+		cp->cp_runs++;
+		cp->cp_blocks += run;
+		cc->cc_blk = blk + run;
+	}
+
+	if (!(ofs->fs_flags & OCFS2_FLAG_IMAGE_FILE)) {
+		cp->cp_error = io_vec_read_blocks(ofs->fs_io, cc->cc_ivus,
+						  cp->cp_runs);
+		return;
+	}
+
+	for (i = 0; i < cp->cp_runs; i++) {
+		ivu = &cc->cc_ivus[i];
+		cp->cp_error = ocfs2_read_blocks(ofs, ivu->ivu_blkno,
+						 cc->cc_runs[i].cr_blocks,
+						 ivu->ivu_buf);
+		if (cp->cp_error) {
+			cp->cp_blkno = ivu->ivu_blkno;
+			break;
+		}
+	}
+}
+
+/*
+ * Drop the blocks of a batch that are the same in the base image,
+ * sliding the rest down the buffer.  The base is an image file, so
+ * reading its copy of a run is cheap next to reading the device.
+ */
+static void copy_drop_unchanged(struct copy_ctxt *cc, struct copy_report *cp)
+{
+	ocfs2_filesys *ofs = cc->cc_fs, *base = cc->cc_base;
+	int bs = ofs->fs_blocksize;
+	uint64_t i, b, m, blk, cnt, nr = 0, in = 0, kept = 0;
+	struct copy_run *cr;
+	char *src;
+
+	for (i = 0; i < cp->cp_runs; i++) {
+		blk = cc->cc_runs[i].cr_blkno;
+		cnt = cc->cc_runs[i].cr_blocks;
+
+		for (b = 0; b < cnt; b += m) {
+			m = 1;
+			if (!ocfs2_image_test_bit(base, blk + b))
+				continue;
+			while ((b + m < cnt) &&
+			       ocfs2_image_test_bit(base, blk + b + m))
+				m++;
+			cp->cp_error = ocfs2_read_blocks(base, blk + b, m,
+							 cc->cc_basebuf +
+							 b * bs);
+			if (cp->cp_error) {
+				cp->cp_blkno = blk + b;
+				return;
+			}
+		}
+
+		for (b = 0; b < cnt; b++, in++) {
+			src = cc->cc_buf + in * bs;
+			if (ocfs2_image_test_bit(base, blk + b) &&
+			    !memcmp(src, cc->cc_basebuf + b * bs, bs))
+				continue;
+
+			cr = nr ? &cc->cc_kept[nr - 1] : NULL;
+			if (cr && (cr->cr_blkno + cr->cr_blocks == blk + b)) {
+				cr->cr_blocks++;
+			} else {
+				cr = &cc->cc_kept[nr++];
+				cr->cr_blkno = blk + b;
+				cr->cr_blocks = 1;
+			}
+			if (kept != in)
+				memmove(cc->cc_buf + kept * bs, src, bs);
+			kept++;
+		}
+	}
+
+	cr = cc->cc_runs;
+	cc->cc_runs = cc->cc_kept;
+	cc->cc_kept = cr;
+	cp->cp_runs = nr;
+	cp->cp_blocks = kept;
+}
+
+/*
+ * The next batch to write.  A delta skips over batches where nothing
+ * changed; only the last batch is empty.
+ */
+static void copy_next_batch(struct copy_ctxt *cc, struct copy_report *cp)
+{
+	ocfs2_filesys *ofs = cc->cc_fs;
+
+	do {
+		copy_read_batch(cc, cp);
+		if (!cc->cc_base || cp->cp_error)
+			return;
+		copy_drop_unchanged(cc, cp);
+	} while (!cp->cp_error && !cp->cp_runs &&
+		 (next_marked_block(ofs, cc->cc_blk) < ofs->fs_blocks));
+}
+
+static void copy_reader(int worker, int nr_workers, int pipe_fd, void *priv)
+{
+	struct copy_ctxt *cc = priv;
+	struct copy_report cp;
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	do {
+		copy_next_batch(cc, &cp);
+		if (tools_full_write(pipe_fd, &cp, sizeof(cp)) || cp.cp_error)
+			break;
+		if (tools_full_write(pipe_fd, cc->cc_runs,
+			      cp.cp_runs * sizeof(struct copy_run)) ||
+		    tools_full_write(pipe_fd, cc->cc_buf,
+			      cp.cp_blocks * cc->cc_fs->fs_blocksize))
+			break;
+	} while (cp.cp_runs);
+}
+
 /*
- * This write function takes a file descriptor and pretends to be
- * pwrite64().  If the descriptor is seekable, it will just call
- * pwrite64().  Otherwise it will send zeros down to fill any holes.  The
- * caller can't go backwards in the file, because seeking may not be
- * possible.
+ * Where a raw image or an install goes.  Only the metadata blocks are
+ * written; everything between them is left alone.
  *
- * It returns -1 if it fails to finish up at offset+count.  It will
- * print its error, so the caller does not need to.
+ * A block device gets its own io channel, so each batch goes down as one
+ * vectored write with all its runs in flight at once.  Anything else we
+ * can seek on gets a pwrite64() per run, which leaves holes between the
+ * runs of a file.  Streams can't skip, so the gaps are sent as zeros,
+ * spliced from /dev/zero when the stream is a pipe.
  */
+enum raw_target_type {
+	RAW_TARGET_FILE,
+	RAW_TARGET_DEVICE,
+	RAW_TARGET_STREAM,
+};
+
+struct raw_target {
+	enum raw_target_type rt_type;
+	int rt_fd;
+	io_channel *rt_io;		/* devices only */
+	loff_t rt_pos;			/* streams only: bytes written */
+	int rt_zero_fd;			/* streams only: /dev/zero or -1 */
+	char *rt_zero_buf;
+};
+
 #define ZERO_BUF_SIZE  (1<<20)
-static ssize_t raw_write(ocfs2_filesys *fs, int fd, const void *buf,
-			 size_t count, loff_t offset)
+
+static errcode_t raw_target_open(ocfs2_filesys *ofs, int fd,
+				 const char *dest_file, struct raw_target *rt)
 {
+	struct stat st;
 	errcode_t ret;
-	ssize_t written;
-	static char *zero_buf = NULL;
-	static int can_seek = -1;
-	static loff_t fpos = 0;
-	loff_t to_write;
-
-	if (can_seek == -1) {
-		/* Test if we can seek/pwrite */
-		fpos = lseek64(fd, 0, SEEK_CUR);
-		if (fpos < 0) {
-			fpos = 0;
-			can_seek = 0;
-		} else
-			can_seek = 1;
-	}
-
-	if (!can_seek && !zero_buf) {
-		ret = ocfs2_malloc_blocks(fs->fs_io,
-					  ZERO_BUF_SIZE / fs->fs_blocksize,
-					  &zero_buf);
+
+	memset(rt, 0, sizeof(struct raw_target));
+	rt->rt_fd = fd;
+	rt->rt_zero_fd = -1;
+
+	if (lseek64(fd, 0, SEEK_CUR) < 0) {
+		rt->rt_type = RAW_TARGET_STREAM;
+		rt->rt_zero_fd = open("/dev/zero", O_RDONLY);
+		ret = ocfs2_malloc_blocks(ofs->fs_io,
+					  ZERO_BUF_SIZE / ofs->fs_blocksize,
+					  &rt->rt_zero_buf);
 		if (ret) {
 			com_err(program_name, ret,
 				"while allocating zero buffer");
-			written = -1;
-			goto out;
+			return ret;
 		}
-		memset(zero_buf, 0, ZERO_BUF_SIZE);
+		memset(rt->rt_zero_buf, 0, ZERO_BUF_SIZE);
+		return 0;
 	}
 
-	if (can_seek) {
-		written = pwrite64(fd, buf, count, offset);
-		goto out;
+	rt->rt_type = RAW_TARGET_FILE;
+	if (strcmp(dest_file, "-") && !fstat(fd, &st) &&
+	    S_ISBLK(st.st_mode) &&
+	    !io_open(dest_file, OCFS2_FLAG_RW, &rt->rt_io)) {
+		rt->rt_type = RAW_TARGET_DEVICE;
+		io_set_blksize(rt->rt_io, ofs->fs_blocksize);
+	}
+
+	return 0;
+}
+
+/*
+ * A raw image file is as big as the filesystem, even if the last blocks
+ * are not metadata.  The tail is a hole.  Closing a device's io channel
+ * can fail too, and then the image may not all be on disk.
+ */
+static errcode_t raw_target_close(ocfs2_filesys *ofs, struct raw_target *rt,
+				  const char *dest_file)
+{
+	struct stat st;
+	loff_t size = (loff_t)ofs->fs_blocks * ofs->fs_blocksize;
+	errcode_t ret = 0, err;
+
+	if ((rt->rt_type == RAW_TARGET_FILE) && !fstat(rt->rt_fd, &st) &&
+	    S_ISREG(st.st_mode) && (st.st_size < size) &&
+	    ftruncate64(rt->rt_fd, size)) {
+		ret = errno;
+		com_err(program_name, ret, "while extending \"%s\"",
+			dest_file);
+	}
+
+	if (rt->rt_io) {
+		err = io_close(rt->rt_io);
+		if (err) {
+			com_err(program_name, err, "while closing \"%s\"",
+				dest_file);
+			if (!ret)
+				ret = err;
+		}
 	}
+	if (rt->rt_zero_fd >= 0)
+		close(rt->rt_zero_fd);
+	if (rt->rt_zero_buf)
+		ocfs2_free(&rt->rt_zero_buf);
+
+	return ret;
+}
+
+/* Bring a stream up to offset with zeros */
+static errcode_t raw_target_fill(struct raw_target *rt, loff_t offset)
+{
+	ssize_t done;
+	size_t len;
 
-	/* Ok, let's fake pwrite64() for the caller */
-	if (fpos > offset) {
+	if (rt->rt_pos > offset) {
 		com_err(program_name, OCFS2_ET_INTERNAL_FAILURE,
 			": file position went backwards while writing "
 			"image file");
-		written = -1;
-		goto out;
+		return OCFS2_ET_INTERNAL_FAILURE;
 	}
 
-	while (fpos < offset) {
-		to_write = ocfs2_min((loff_t)ZERO_BUF_SIZE, offset - fpos);
-		written = write(fd, zero_buf, to_write);
-		if (written < 0) {
+	while (rt->rt_pos < offset) {
+		len = ocfs2_min((loff_t)ZERO_BUF_SIZE, offset - rt->rt_pos);
+		done = -1;
+		if (rt->rt_zero_fd >= 0) {
+			done = splice(rt->rt_zero_fd, NULL, rt->rt_fd, NULL,
+				      len, 0);
+			/* Not a pipe, or no splice from /dev/zero */
+			if ((done < 0) && (errno != EINTR)) {
+				close(rt->rt_zero_fd);
+				rt->rt_zero_fd = -1;
+			}
+		}
+		if ((done < 0) && (rt->rt_zero_fd < 0))
+			done = write(rt->rt_fd, rt->rt_zero_buf, len);
+		if ((done < 0) && (errno == EINTR))
+			continue;
+		if (done <= 0) {
 			com_err(program_name, OCFS2_ET_IO,
 				"while writing zero blocks: %s",
 				strerror(errno));
-			goto out;
+			return OCFS2_ET_IO;
 		}
-		fpos += written;
+		rt->rt_pos += done;
 	}
 
-	to_write = count;
-	while (to_write) {
-		written = write(fd, buf, to_write);
-		if (written < 0) {
-			com_err(program_name, OCFS2_ET_IO,
-				"while writing data blocks: %s",
-				strerror(errno));
-			goto out;
+	return 0;
+}
+
+static errcode_t raw_target_write(ocfs2_filesys *ofs, struct raw_target *rt,
+				  struct copy_ctxt *cc, struct copy_report *cp)
+{
+	struct io_vec_unit *ivu;
+	char *buf = cc->cc_buf;
+	uint64_t i, len;
+	loff_t offset;
+	ssize_t done;
+	errcode_t ret;
+
+	if (rt->rt_type == RAW_TARGET_DEVICE) {
+		for (i = 0; i < cp->cp_runs; i++) {
+			ivu = &cc->cc_ivus[i];
+			ivu->ivu_blkno = cc->cc_runs[i].cr_blkno;
+			ivu->ivu_buf = buf;
+			ivu->ivu_buflen = cc->cc_runs[i].cr_blocks *
+				ofs->fs_blocksize;
+			buf += ivu->ivu_buflen;
 		}
-		fpos += written;
-		to_write -= written;
+		return io_vec_write_blocks(rt->rt_io, cc->cc_ivus,
+					   cp->cp_runs);
 	}
-	/* Ok, we did it */
-	written = count;
 
-out:
-	return written;
+	for (i = 0; i < cp->cp_runs; i++) {
+		len = cc->cc_runs[i].cr_blocks * ofs->fs_blocksize;
+		offset = (loff_t)cc->cc_runs[i].cr_blkno * ofs->fs_blocksize;
+
+		if (rt->rt_type == RAW_TARGET_STREAM) {
+			ret = raw_target_fill(rt, offset);
+			if (ret)
+				return ret;
+			if (tools_full_write(rt->rt_fd, buf, len))
+				return errno ? errno : OCFS2_ET_IO;
+			rt->rt_pos += len;
+			buf += len;
+			continue;
+		}
+
+		while (len) {
+			done = pwrite64(rt->rt_fd, buf, len, offset);
+			if ((done < 0) && (errno == EINTR))
+				continue;
+			if (done <= 0)
+				return done ? errno : OCFS2_ET_SHORT_WRITE;
+			buf += done;
+			offset += done;
+			len -= done;
+		}
+	}
+
+	return 0;
+}
+
+static errcode_t copy_write_batch(struct copy_ctxt *cc, int fd,
+				  struct raw_target *rt,
+				  struct copy_report *cp)
+{
+	ocfs2_filesys *ofs = cc->cc_fs;
+
+	if (rt)
+		return raw_target_write(ofs, rt, cc, cp);
+
+	if (tools_full_write(fd, cc->cc_buf, cp->cp_blocks * ofs->fs_blocksize))
+		return errno ? errno : OCFS2_ET_IO;
+
+	return 0;
 }
 
-static errcode_t write_raw_image_file(ocfs2_filesys *ofs, int fd)
+/* Note the blocks of a batch in the bitmap of blocks a delta holds */
+static void copy_mark_held(struct copy_ctxt *cc, struct copy_report *cp)
+{
+	uint64_t i, b, blk;
+
+	for (i = 0; i < cp->cp_runs; i++) {
+		for (b = 0; b < cc->cc_runs[i].cr_blocks; b++) {
+			blk = cc->cc_runs[i].cr_blkno + b;
+			ocfs2_set_bit(blk % OCFS2_IMAGE_BITS_IN_BLOCK,
+				      cc->cc_held +
+				      (blk / OCFS2_IMAGE_BITS_IN_BLOCK) *
+				      OCFS2_IMAGE_BITMAP_BLOCKSIZE);
+		}
+	}
+}
+
+/*
+ * Copy every marked block to fd, in block order.  raw puts each block
+ * at its own offset; otherwise the blocks are packed one after another.
+ * With a base image, only the blocks that differ from the base are
+ * copied, and each is marked in the held bitmap.
+ *
+ * A forked reader fills the batches and hands them over a pipe, so the
+ * device is read for the next batch while we are writing this one.
+ * The pipe holds little, so the reader is never more than a batch ahead.
+ * If we can't fork, we do both halves ourselves.
+ */
+static errcode_t copy_marked_blocks(ocfs2_filesys *ofs, int fd,
+				    struct raw_target *rt,
+				    ocfs2_filesys *base, char *held)
 {
-	char *blk_buf = NULL;
-	uint64_t blk = -1;
-	ssize_t count;
+	struct copy_ctxt cc;
+	struct copy_report cp;
+	struct tools_workers tw;
+	int nr_readers;
 	errcode_t ret;
 
-	ret = ocfs2_malloc_block(ofs->fs_io, &blk_buf);
+	memset(&cc, 0, sizeof(cc));
+	cc.cc_fs = ofs;
+	cc.cc_bufblks = O2IMAGE_COPY_SIZE / ofs->fs_blocksize;
+	cc.cc_base = base;
+	cc.cc_held = held;
+
+	ret = ocfs2_malloc_blocks(ofs->fs_io, cc.cc_bufblks, &cc.cc_buf);
+	if (!ret)
+		ret = ocfs2_malloc(sizeof(struct copy_run) * cc.cc_bufblks,
+				   &cc.cc_runs);
+	if (!ret)
+		ret = ocfs2_malloc(sizeof(struct io_vec_unit) * cc.cc_bufblks,
+				   &cc.cc_ivus);
+	if (!ret && base)
+		ret = ocfs2_malloc_blocks(ofs->fs_io, cc.cc_bufblks,
+					  &cc.cc_basebuf);
+	if (!ret && base)
+		ret = ocfs2_malloc(sizeof(struct copy_run) * cc.cc_bufblks,
+				   &cc.cc_kept);
 	if (ret) {
 		com_err(program_name, ret, "while allocating I/O buffer");
 		goto out;
 	}
 
-	while (++blk < ofs->fs_blocks) {
-		if (ocfs2_image_test_bit(ofs, blk)) {
-			ret = ocfs2_read_blocks(ofs, blk, 1, blk_buf);
-			if (ret) {
-				com_err(program_name, ret,
-					"while reading block %"PRIu64, blk);
+	nr_readers = tools_start_workers(&tw, 1, 0, copy_reader, &cc);
+
+	do {
+		if (!nr_readers)
+			copy_next_batch(&cc, &cp);
+		else if (tools_full_read(tw.tw_fds[0], &cp, sizeof(cp)) ||
+			 (!cp.cp_error &&
+			  ((cp.cp_runs > cc.cc_bufblks) ||
+			   (cp.cp_blocks > cc.cc_bufblks) ||
+			   tools_full_read(tw.tw_fds[0], cc.cc_runs,
+				    cp.cp_runs * sizeof(struct copy_run)) ||
+			   tools_full_read(tw.tw_fds[0], cc.cc_buf,
+				    cp.cp_blocks * ofs->fs_blocksize)))) {
+			ret = OCFS2_ET_IO;
+			com_err(program_name, ret, "while receiving blocks "
+				"from the reader");
+			break;
+		}
+
+		ret = cp.cp_error;
+		if (ret) {
+			com_err(program_name, ret, "while reading block "
+				"%"PRIu64, cp.cp_blkno);
+			break;
+		}
+
+		ret = copy_write_batch(&cc, fd, rt, &cp);
+		if (ret) {
+			com_err(program_name, ret, "while writing blocks "
+				"from %"PRIu64, cp.cp_blkno);
+			break;
+		}
+		if (held)
+			copy_mark_held(&cc, &cp);
+	} while (cp.cp_runs);
+
+	if (nr_readers) {
+		if (ret)
+			tools_kill_workers(&tw);
+		tools_stop_workers(&tw);
+	}
+
+out:
+	if (cc.cc_kept)
+		ocfs2_free(&cc.cc_kept);
+	if (cc.cc_basebuf)
+		ocfs2_free(&cc.cc_basebuf);
+	if (cc.cc_ivus)
+		ocfs2_free(&cc.cc_ivus);
+	if (cc.cc_runs)
+		ocfs2_free(&cc.cc_runs);
+	if (cc.cc_buf)
+		ocfs2_free(&cc.cc_buf);
+	return ret;
+}
+
+static errcode_t write_raw_image_file(ocfs2_filesys *ofs, int fd,
+				      const char *dest_file)
+{
+	struct raw_target rt;
+	errcode_t ret, err;
+
+	ret = raw_target_open(ofs, fd, dest_file, &rt);
+	if (!ret)
+		ret = copy_marked_blocks(ofs, fd, &rt, NULL, NULL);
+
+	err = raw_target_close(ofs, &rt, dest_file);
+	if (err && !ret)
+		ret = err;
+
+	return ret;
+}
+
+#ifdef HAVE_ZLIB
+/* The most processes we fork to compress chunks */
+#define O2IMAGE_ZWORKERS_MAX	8
+
+struct zchunk_ctxt {
+	ocfs2_filesys *zc_fs;
+	uint64_t zc_chunkblks;
+	uint64_t zc_chunkcnt;
+	uint64_t zc_blk;		/* where the bitmap walk is up to */
+	char *zc_raw;
+	char *zc_zbuf;
+	uLong zc_zbufsz;
+};
+
+/* What a worker sends ahead of each compressed chunk */
+struct zchunk_report {
+	uint64_t zr_len;
+	errcode_t zr_error;
+};
+
+static uint64_t zchunk_blocks(struct zchunk_ctxt *zc, uint64_t chunk)
+{
+	uint64_t blocks = zc->zc_fs->ost->ost_imgblkcnt -
+		chunk * zc->zc_chunkblks;
+
+	return ocfs2_min(blocks, zc->zc_chunkblks);
+}
+
+/* Step the bitmap walk over a chunk somebody else is doing */
+static void zchunk_skip(struct zchunk_ctxt *zc, uint64_t chunk)
+{
+	uint64_t n = zchunk_blocks(zc, chunk);
+
+	while (n--)
+		zc->zc_blk = next_marked_block(zc->zc_fs, zc->zc_blk) + 1;
+}
+
+/*
+ * Read the next chunk's blocks, a run of contiguous marked blocks at a
+ * time, and deflate them.  *out points at whichever of the raw or the
+ * deflated data is smaller.
+ */
+static errcode_t zchunk_make(struct zchunk_ctxt *zc, uint64_t chunk,
+			     char **out, uint64_t *len)
+{
+	ocfs2_filesys *ofs = zc->zc_fs;
+	uint64_t n = zchunk_blocks(zc, chunk), done = 0, blk;
+	uLongf zlen = zc->zc_zbufsz;
+	errcode_t ret;
+	int run;
+
+	while (done < n) {
+		blk = next_marked_block(ofs, zc->zc_blk);
+		for (run = 1; (done + run) < n; run++)
+			if (!ocfs2_image_test_bit(ofs, blk + run))
 				break;
-			}
 
-			count = raw_write(ofs, fd, blk_buf,
-					  ofs->fs_blocksize,
-					  (loff_t)(blk * ofs->fs_blocksize));
-			if (count < 0) {
+		ret = ocfs2_read_blocks(ofs, blk, run,
+					zc->zc_raw + done * ofs->fs_blocksize);
+		if (ret)
+			return ret;
+
+		done += run;
+		zc->zc_blk = blk + run;
+	}
+
+	*out = zc->zc_raw;
+	*len = n * ofs->fs_blocksize;
+	if ((compress2((Bytef *)zc->zc_zbuf, &zlen, (Bytef *)zc->zc_raw,
+		       *len, Z_BEST_SPEED) == Z_OK) && (zlen < *len)) {
+		*out = zc->zc_zbuf;
+		*len = zlen;
+	}
+
+	return 0;
+}
+
+static void zchunk_worker(int worker, int nr_workers, int pipe_fd, void *priv)
+{
+	struct zchunk_ctxt *zc = priv;
+	uint64_t chunk;
+	struct zchunk_report zr;
+	char *data;
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	for (chunk = 0; chunk < zc->zc_chunkcnt; chunk++) {
+		if ((chunk % nr_workers) != worker) {
+			zchunk_skip(zc, chunk);
+			continue;
+		}
+
+		memset(&zr, 0, sizeof(zr));
+		zr.zr_error = zchunk_make(zc, chunk, &data, &zr.zr_len);
+		if (tools_full_write(pipe_fd, &zr, sizeof(zr)) || zr.zr_error)
+			break;
+		if (tools_full_write(pipe_fd, data, zr.zr_len))
+			break;
+	}
+}
+
+/*
+ * Write the metadata blocks as independently deflated chunks, then the
+ * bitmap, then the chunk index.  Each chunk is compressed by one of up to
+ * O2IMAGE_ZWORKERS_MAX forked workers; worker n takes every nth chunk and
+ * hands it back over its own pipe, so we can collect them in order by
+ * reading the pipes round robin.  A worker blocks on its pipe until we
+ * want its chunk, which bounds the memory in flight.  If we can't fork,
+ * we compress everything ourselves.
+ */
+static errcode_t write_compressed_blocks(ocfs2_filesys *ofs, int fd)
+{
+	struct ocfs2_image_state *ost = ofs->ost;
+	struct zchunk_ctxt zc;
+	struct zchunk_report zr;
+	uint64_t chunk, off, *index = NULL;
+	struct tools_workers tw;
+	int nr_workers = 0, fd_in;
+	long cpus;
+	char *data;
+	errcode_t ret;
+
+	memset(&zc, 0, sizeof(zc));
+	zc.zc_fs = ofs;
+	zc.zc_chunkblks = OCFS2_IMAGE_CHUNK_SIZE / ofs->fs_blocksize;
+	zc.zc_chunkcnt = (ost->ost_imgblkcnt + zc.zc_chunkblks - 1) /
+		zc.zc_chunkblks;
+	/* Big enough for a deflated chunk or a raw one */
+	zc.zc_zbufsz = compressBound(OCFS2_IMAGE_CHUNK_SIZE);
+
+	ret = ocfs2_malloc_blocks(ofs->fs_io, zc.zc_chunkblks, &zc.zc_raw);
+	if (!ret)
+		ret = ocfs2_malloc(zc.zc_zbufsz, &zc.zc_zbuf);
+	if (!ret)
+		ret = ocfs2_malloc((zc.zc_chunkcnt + 1) * sizeof(uint64_t),
+				   &index);
+	if (ret) {
+		com_err(program_name, ret, "while allocating chunk buffers");
+		goto out;
+	}
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > O2IMAGE_ZWORKERS_MAX)
+		cpus = O2IMAGE_ZWORKERS_MAX;
+	if (cpus > zc.zc_chunkcnt)
+		cpus = zc.zc_chunkcnt;
+	if (cpus > 1) {
+		nr_workers = tools_start_workers(&tw, cpus,
+						 TOOLS_WORKERS_OWN_PIPE,
+						 zchunk_worker, &zc);
+		/* The chunks go round robin, so it's all of them or none */
+		if (nr_workers && (nr_workers < cpus)) {
+			tools_kill_workers(&tw);
+			tools_stop_workers(&tw);
+			nr_workers = 0;
+		}
+	}
+
+	off = ofs->fs_blocksize;
+	for (chunk = 0; chunk < zc.zc_chunkcnt; chunk++) {
+		if (nr_workers) {
+			fd_in = tw.tw_fds[chunk % nr_workers];
+			if (tools_full_read(fd_in, &zr, sizeof(zr))) {
+				ret = OCFS2_ET_IO;
+				break;
+			}
+			ret = zr.zr_error;
+			if (ret)
+				break;
+			if ((zr.zr_len > zc.zc_zbufsz) ||
+			    tools_full_read(fd_in, zc.zc_zbuf, zr.zr_len)) {
 				ret = OCFS2_ET_IO;
 				break;
 			}
+			data = zc.zc_zbuf;
+		} else {
+			ret = zchunk_make(&zc, chunk, &data, &zr.zr_len);
+			if (ret)
+				break;
 		}
+
+		if (tools_full_write(fd, data, zr.zr_len)) {
+			ret = errno;
+			break;
+		}
+		index[chunk] = cpu_to_le64(off);
+		off += zr.zr_len;
+	}
+	index[chunk] = cpu_to_le64(off);
+
+	if (nr_workers) {
+		if (ret)
+			tools_kill_workers(&tw);
+		tools_stop_workers(&tw);
+	}
+	if (ret) {
+		com_err(program_name, ret, "while writing compressed chunk "
+			"%"PRIu64, chunk);
+		goto out;
+	}
+
+	/* bitmap blocks, then the index at the very end */
+	for (chunk = 0; chunk < ost->ost_bmpblks; chunk++) {
+		if (tools_full_write(fd, ost->ost_bmparr[chunk].arr_map,
+			      ost->ost_bmpblksz)) {
+			ret = errno;
+			com_err(program_name, ret, "error writing bitmap "
+				"blk %"PRIu64, chunk);
+			goto out;
+		}
+	}
+
+	if (tools_full_write(fd, index, (zc.zc_chunkcnt + 1) * sizeof(uint64_t))) {
+		ret = errno;
+		com_err(program_name, ret, "while writing the chunk index");
 	}
 
 out:
-	if (blk_buf)
-		ocfs2_free(&blk_buf);
+	if (index)
+		ocfs2_free(&index);
+	if (zc.zc_zbuf)
+		ocfs2_free(&zc.zc_zbuf);
+	if (zc.zc_raw)
+		ocfs2_free(&zc.zc_raw);
+
 	return ret;
 }
+#endif
 
-static errcode_t write_image_file(ocfs2_filesys *ofs, int fd)
+/*
+ * Write a packed or compressed image of ofs to fd.  If base is set, this
+ * is a delta against it, and base_path is where to find it again.
+ */
+static errcode_t write_image_file(ocfs2_filesys *ofs, int fd, int compress,
+				  ocfs2_filesys *base, const char *base_path)
 {
 	uint64_t supers[OCFS2_MAX_BACKUP_SUPERBLOCKS];
 	struct ocfs2_image_state *ost = ofs->ost;
 	struct ocfs2_image_hdr *hdr;
 	uint64_t i, blk;
 	errcode_t ret;
-	int bytes;
-	char *buf;
+	int bytes = 0;
+	char *buf, *held = NULL;
 
 	ret = ocfs2_malloc_block(ofs->fs_io, &buf);
 	if (ret) {
@@ -545,22 +1280,17 @@ static errcode_t write_image_file(ocfs2_filesys *ofs, int fd)
 			ofs->fs_blocksize);
 		return ret;
 	}
+	memset(buf, 0, ofs->fs_blocksize);
 	hdr = (struct ocfs2_image_hdr *)buf;
 	hdr->hdr_magic = OCFS2_IMAGE_MAGIC;
 	memcpy(hdr->hdr_magic_desc, OCFS2_IMAGE_DESC,
 	       sizeof(OCFS2_IMAGE_DESC));
 
-	/* count metadata blocks that will be backedup */
-	blk = 0;
-	for (i = 0; i<ofs->fs_blocks; i++)
-		if (ocfs2_image_test_bit(ofs, i))
-			blk++;
-
 	hdr->hdr_timestamp 	= time(0);
-	hdr->hdr_version 	= OCFS2_IMAGE_VERSION;
+	hdr->hdr_version 	= OCFS2_IMAGE_VERSION_PACKED;
 	hdr->hdr_fsblkcnt 	= ofs->fs_blocks;
 	hdr->hdr_fsblksz 	= ofs->fs_blocksize;
-	hdr->hdr_imgblkcnt	= blk;
+	hdr->hdr_imgblkcnt	= ost->ost_imgblkcnt;
 	hdr->hdr_bmpblksz	= ost->ost_bmpblksz;
 	hdr->hdr_superblkcnt 	=
 		ocfs2_get_backup_super_offsets(ofs, supers,
@@ -568,6 +1298,25 @@ static errcode_t write_image_file(ocfs2_filesys *ofs, int fd)
 	for (i = 0; i < hdr->hdr_superblkcnt; i++)
 		hdr->hdr_superblocks[i] = ocfs2_image_get_blockno(ofs,
 								  supers[i]);
+	if (compress) {
+		hdr->hdr_version = OCFS2_IMAGE_VERSION_COMPRESSED;
+		hdr->hdr_chunkblks = OCFS2_IMAGE_CHUNK_SIZE / ofs->fs_blocksize;
+		hdr->hdr_chunkcnt = (ost->ost_imgblkcnt + hdr->hdr_chunkblks -
+				     1) / hdr->hdr_chunkblks;
+	}
+	if (base) {
+		hdr->hdr_version = OCFS2_IMAGE_VERSION_DELTA;
+		hdr->hdr_base_imgblkcnt = base->ost->ost_imgblkcnt;
+		hdr->hdr_base_timestamp = base->ost->ost_timestamp;
+		strcpy((char *)hdr->hdr_base, base_path);
+
+		ret = ocfs2_malloc0(ost->ost_bmpblks * ost->ost_bmpblksz,
+				    &held);
+		if (ret) {
+			com_err(program_name, ret, "while allocating bitmap");
+			goto out;
+		}
+	}
 
 	ocfs2_image_swap_header(hdr);
 	/* o2image header size is smaller than ofs->fs_blocksize */
@@ -582,24 +1331,18 @@ static errcode_t write_image_file(ocfs2_filesys *ofs, int fd)
 		goto out;
 	}
 
+#ifdef HAVE_ZLIB
+	if (compress) {
+		ret = write_compressed_blocks(ofs, fd);
+		goto out;
+	}
+#endif
+
 	/* copy metadata blocks to image files */
-	for (blk = 0; blk < ofs->fs_blocks; blk++) {
-		if (ocfs2_image_test_bit(ofs, blk)) {
-			ret = ocfs2_read_blocks(ofs, blk, 1, buf);
-			if (ret) {
-				com_err(program_name, ret, "error occurred "
-					"during read block %"PRIu64"", blk);
-				goto out;
-			}
+	ret = copy_marked_blocks(ofs, fd, NULL, base, held);
+	if (ret)
+		goto out;
 
-			bytes = write(fd, buf, ofs->fs_blocksize);
-			if ((bytes == -1) || (bytes < ofs->fs_blocksize)) {
-				com_err(program_name, errno, "error writing "
-					"blk %"PRIu64"", blk);
-				goto out;
-			}
-		}
-	}
 	/* write bitmap blocks at the end */
 	for(blk = 0; blk < ost->ost_bmpblks; blk++) {
 		bytes = write(fd, ost->ost_bmparr[blk].arr_map,
@@ -610,7 +1353,15 @@ static errcode_t write_image_file(ocfs2_filesys *ofs, int fd)
 			goto out;
 		}
 	}
+
+	/* a delta ends with the bitmap of the blocks it holds */
+	if (held && tools_full_write(fd, held, ost->ost_bmpblks * ost->ost_bmpblksz)) {
+		ret = errno;
+		com_err(program_name, ret, "while writing the held bitmap");
+	}
 out:
+	if (held)
+		ocfs2_free(&held);
 	if (buf)
 		ocfs2_free(&buf);
 	if (bytes < 0)
@@ -621,34 +1372,98 @@ out:
 
 static errcode_t scan_raw_disk(ocfs2_filesys *ofs)
 {
-	struct ocfs2_image_state *ost = ofs->ost;
-	uint64_t bits_set = 0;
 	errcode_t ret;
-	int i, j;
+
+	/*
+	 * The scan can live without its cache, it just doesn't get any
+	 * read-ahead.  The copy reads everything once, so it goes
+	 * uncached.
+	 */
+	io_init_cache_size(ofs->fs_io, O2IMAGE_SCAN_CACHE);
 
 	/*
 	 * global inode alloc has list of all metadata inodes blocks.
 	 * traverse_inode recursively traverses each inode
 	 */
 	ret = traverse_inode(ofs, ofs->ost->ost_glbl_inode_alloc);
+	io_destroy_cache(ofs->fs_io);
 	if (ret)
 		goto out;
 
-	/* update set_bit_cnt for future use */
-	for (i = 0; i < ost->ost_bmpblks; i++) {
-		ost->ost_bmparr[i].arr_set_bit_cnt = bits_set;
-		for (j = 0; j < (ost->ost_bmpblksz * 8); j++)
-			if (ocfs2_test_bit(j, ost->ost_bmparr[i].arr_map))
-				bits_set++;
-	}
+	/* index the bitmap for block translation and remember the total */
+	ocfs2_image_build_index(ofs, &ofs->ost->ost_imgblkcnt);
 
 out:
 	return ret;
 }
 
+/*
+ * Open the image a delta is to be taken against and check that it is an
+ * image of this filesystem.  base_path is set to its absolute path, which
+ * goes in the delta's header.
+ */
+static errcode_t open_base_image(ocfs2_filesys *ofs, const char *base_file,
+				 const char *dest_file, ocfs2_filesys **base,
+				 char *base_path)
+{
+	struct stat bst, dst;
+	char path[PATH_MAX];
+	errcode_t ret;
+
+	if (!realpath(base_file, path)) {
+		ret = errno;
+		com_err(program_name, ret, "while looking for base image "
+			"\"%s\"", base_file);
+		return ret;
+	}
+	if (strlen(path) >= OCFS2_IMAGE_BASE_LEN) {
+		ret = OCFS2_ET_INVALID_ARGUMENT;
+		com_err(program_name, ret, "; the path to base image \"%s\" "
+			"is longer than %d characters", path,
+			OCFS2_IMAGE_BASE_LEN - 1);
+		return ret;
+	}
+	strcpy(base_path, path);
+
+	/* Opening the delta would truncate its own base */
+	if (strcmp(dest_file, "-") && !stat(dest_file, &dst) &&
+	    !stat(path, &bst) && (dst.st_dev == bst.st_dev) &&
+	    (dst.st_ino == bst.st_ino)) {
+		ret = OCFS2_ET_INVALID_ARGUMENT;
+		com_err(program_name, ret, "; cannot write a delta over its "
+			"base image \"%s\"", base_file);
+		return ret;
+	}
+
+	ret = ocfs2_open(path, OCFS2_FLAG_RO | OCFS2_FLAG_NO_ECC_CHECKS |
+			 OCFS2_FLAG_IMAGE_FILE, 0, 0, base);
+	if (ret) {
+		com_err(program_name, ret, "while opening base image \"%s\"",
+			base_file);
+		return ret;
+	}
+
+	if (((*base)->fs_blocks != ofs->fs_blocks) ||
+	    ((*base)->fs_blocksize != ofs->fs_blocksize) ||
+	    memcmp(OCFS2_RAW_SB((*base)->fs_super)->s_uuid,
+		   OCFS2_RAW_SB(ofs->fs_super)->s_uuid, OCFS2_VOL_UUID_LEN)) {
+		ret = OCFS2_ET_IMAGE_BASE_MISMATCH;
+		com_err(program_name, ret, "; \"%s\" is not an image of "
+			"this filesystem", base_file);
+	}
+
+	return ret;
+}
+
+static void close_base_image(ocfs2_filesys *base)
+{
+	ocfs2_image_free_bitmap(base);
+	ocfs2_free(&base->ost);
+	ocfs2_close(base);
+}
+
 static int prompt_image_creation(ocfs2_filesys *ofs, int rawflg, char *filename)
 {
-	int i, n;
 	uint64_t free_spc;
 	struct statfs stat;
 	uint64_t img_size = 0;
@@ -658,15 +1473,9 @@ static int prompt_image_creation(ocfs2_filesys *ofs, int rawflg, char *filename)
 	statfs(dirname(filepath), &stat);
 	free_spc = stat.f_bsize * stat.f_bavail;
 
-	n = ofs->ost->ost_bmpblks - 1;
 	if (!rawflg)
 		img_size = ofs->ost->ost_bmpblks * ofs->ost->ost_bmpblksz;
-	img_size += ofs->ost->ost_bmparr[n].arr_set_bit_cnt *
-		ofs->fs_blocksize;
-
-	for (i = 0; i < (ofs->ost->ost_bmpblksz * 8); i++)
-		if (ocfs2_test_bit(i, ofs->ost->ost_bmparr[n].arr_map))
-			img_size += ofs->fs_blocksize;
+	img_size += ofs->ost->ost_imgblkcnt * ofs->fs_blocksize;
 
 	fprintf(stdout, "Image file expected to be %luK, "
 		"Available free space %luK. Continue ? (y/N): ",
@@ -683,14 +1492,17 @@ static int prompt_image_creation(ocfs2_filesys *ofs, int rawflg, char *filename)
 
 int main(int argc, char **argv)
 {
-	ocfs2_filesys *ofs;
+	ocfs2_filesys *ofs, *base = NULL;
 	errcode_t ret;
 	char *src_file	= NULL;
 	char *dest_file	= NULL;
+	char *base_file	= NULL;
+	char base_path[OCFS2_IMAGE_BASE_LEN];
 	int open_flags		= 0;
 	int raw_flag      	= 0;
 	int install_flag  	= 0;
 	int interactive		= 0;
+	int compress		= 0;
 	int fd            	= STDOUT_FILENO;
 	int c;
 
@@ -700,11 +1512,22 @@ int main(int argc, char **argv)
 	initialize_ocfs_error_table();
 
 	optind = 0;
-	while((c = getopt(argc, argv, "irI")) != EOF) {
+	while((c = getopt(argc, argv, "b:irzI")) != EOF) {
 		switch (c) {
+		case 'b':
+			base_file = optarg;
+			break;
 		case 'r':
 			raw_flag++;
 			break;
+		case 'z':
+#ifndef HAVE_ZLIB
+			com_err(program_name, OCFS2_ET_IMAGE_COMPRESSION_UNSUPP,
+				"; o2image was built without zlib");
+			exit(1);
+#endif
+			compress++;
+			break;
 		case 'I':
 			install_flag++;
 			break;
@@ -719,6 +1542,10 @@ int main(int argc, char **argv)
 	if (optind != argc -2)
 		usage();
 
+	/* A delta is a packed image */
+	if (base_file && (raw_flag || install_flag || compress))
+		usage();
+
 	/* We interchange src_file and image file if installing */
 	if (install_flag) {
 		dest_file    = argv[optind];
@@ -785,6 +1612,13 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (base_file) {
+		ret = open_base_image(ofs, base_file, dest_file, &base,
+				      base_path);
+		if (ret)
+			goto out;
+	}
+
 	if (strcmp(dest_file, "-") == 0)
 		fd = STDOUT_FILENO;
 	else {
@@ -803,9 +1637,9 @@ int main(int argc, char **argv)
 
 	/* Installs always are done in raw format */
 	if (raw_flag || install_flag)
-		ret = write_raw_image_file(ofs, fd);
+		ret = write_raw_image_file(ofs, fd, dest_file);
 	else
-		ret = write_image_file(ofs, fd);
+		ret = write_image_file(ofs, fd, compress, base, base_path);
 
 	if (ret) {
 		com_err(program_name, ret, "while writing to image \"%s\"",
@@ -814,6 +1648,9 @@ int main(int argc, char **argv)
 	}
 
 out:
+	if (base)
+		close_base_image(base);
+
 	ocfs2_image_free_bitmap(ofs);
 
 	if (ofs->ost->ost_inode_allocs)
@@ -23,13 +23,19 @@
 
 #include <errno.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 #include <linux/fiemap.h>
 
 #include "ocfs2/ocfs2.h"
 #include "ocfs2/bitops.h"
+#include "ocfs2/byteorder.h"
 #include "tools-internal/verbose.h"
+#include "tools-internal/workers.h"
 #include "libo2info.h"
 
 int o2info_get_fs_features(ocfs2_filesys *fs, struct o2info_fs_features *ofs)
@@ -194,114 +200,153 @@ static void o2info_update_freefrag_stats(struct o2info_freefrag *off,
 	off->free_chunks_real++;
 }
 
-static int o2info_scan_global_bitmap_chain(ocfs2_filesys *fs,
-					   struct ocfs2_chain_rec *rec,
-					   struct o2info_freefrag *off)
+/*
+ * Find the next bit at or after offset that is set (or clear), a word
+ * at a time.  The bitmap is little-endian, so bit n of a 64-bit
+ * little-endian word loaded from byte 8k is bit 64k + n of the bitmap.
+ */
+static unsigned int find_next_bit(const unsigned char *map, unsigned int size,
+				  unsigned int offset, int set)
 {
-	int ret = 0, used;
-	uint64_t blkno;
-
-	char *block = NULL;
-	struct ocfs2_group_desc *bg = NULL;
-
-	unsigned int max_bits, num_clusters;
-	unsigned int offset = 0, cluster, chunk;
-	unsigned int chunk_free, last_chunksize = 0;
-
-	if (!rec->c_free)
-		goto out;
-
-	ret = ocfs2_malloc_block(fs->fs_io, &block);
-	if (ret) {
-		tcom_err(ret, "while allocating block buffer");
-		goto out;
-	}
-
-	do {
-		if (!bg)
-			blkno = rec->c_blkno;
-		else
-			blkno = bg->bg_next_group;
-
-		ret = ocfs2_read_blocks(fs, blkno, 1, block);
-		if (ret < 0) {
-			tcom_err(ret, "while reading group descriptor "
-				 "%"PRIu64" for stats", blkno);
-			goto out;
+	uint64_t word;
+	unsigned int base, bytes;
+
+	while (offset < size) {
+		base = offset & ~63U;
+		bytes = (size - base + 7) >> 3;
+		if (bytes > sizeof(word))
+			bytes = sizeof(word);
+
+		word = 0;
+		memcpy(&word, map + (base >> 3), bytes);
+		word = le64_to_cpu(word);
+		if (!set)
+			word = ~word;
+		word &= ~0ULL << (offset & 63);
+
+		if (word) {
+			offset = base + ffsll(word) - 1;
+			return (offset < size) ? offset : size;
 		}
 
-		bg = (struct ocfs2_group_desc *)block;
-
-		if (!bg->bg_free_bits_count)
-			continue;
-
-		max_bits = bg->bg_bits;
-		offset = 0;
-
-		for (chunk = 0; chunk < off->chunks_in_group; chunk++) {
-
-			/*
-			 * last chunk may be not an entire one.
-			 */
-			if ((offset + off->clusters_in_chunk) > max_bits)
-				num_clusters = max_bits - offset;
-			else
-				num_clusters = off->clusters_in_chunk;
-
-			chunk_free = 0;
-
-			for (cluster = 0; cluster < num_clusters; cluster++) {
-				used = ocfs2_test_bit(offset,
-						(unsigned long *)bg->bg_bitmap);
-				if (!used) {
-					last_chunksize++;
-					chunk_free++;
-				}
-
-				if (used && (last_chunksize)) {
-					o2info_update_freefrag_stats(off,
-								last_chunksize);
-					last_chunksize = 0;
-				}
-
-				offset++;
-			}
+		offset = base + 64;
+	}
 
-			if (chunk_free == off->clusters_in_chunk)
-				off->free_chunks++;
-		}
+	return size;
+}
 
-		/*
-		 * need to update the info of last free chunk.
-		 */
-		if (last_chunksize)
-			o2info_update_freefrag_stats(off, last_chunksize);
+/*
+ * A free extent never runs past the end of its group, as the next
+ * group in the chain is somewhere else on disk.
+ */
+static void o2info_scan_group_bitmap(struct o2info_freefrag *off,
+				     struct ocfs2_group_desc *bg)
+{
+	unsigned int start, end = 0, first, last;
+	unsigned int max_bits = bg->bg_bits;
+	unsigned int cic = off->clusters_in_chunk;
 
-	} while (bg->bg_next_group);
+	while (1) {
+		start = find_next_bit(bg->bg_bitmap, max_bits, end, 0);
+		if (start >= max_bits)
+			break;
+		end = find_next_bit(bg->bg_bitmap, max_bits, start, 1);
 
-out:
-	if (block)
-		ocfs2_free(&block);
+		o2info_update_freefrag_stats(off, end - start);
 
-	return ret;
+		/* The whole chunks inside this extent are free chunks */
+		first = (start + cic - 1) / cic;
+		last = end / cic;
+		if (last > first)
+			off->free_chunks += last - first;
+	}
 }
 
+/*
+ * Walk all the chains of the global bitmap at once.  Each pass reads the
+ * next group descriptor of every chain that has one in a single vectored
+ * read, so there are as many reads in flight as there are chains.
+ */
 static int o2info_scan_global_bitmap(ocfs2_filesys *fs,
 				     struct ocfs2_chain_list *cl,
 				     struct o2info_freefrag *off)
 {
-	int ret = 0, i;
+	int ret = 0, i, count = 0, next;
+	uint32_t num_gds, seen = 0;
+	char *buf = NULL;
+	struct io_vec_unit *ivus = NULL;
 	struct ocfs2_chain_rec *rec = NULL;
+	struct ocfs2_group_desc *bg = NULL;
 
 	off->chunks_in_group = (cl->cl_cpg / off->clusters_in_chunk) + 1;
+	num_gds = (off->clusters + cl->cl_cpg - 1) / cl->cl_cpg;
+
+	ret = ocfs2_malloc_blocks(fs->fs_io, cl->cl_next_free_rec, &buf);
+	if (!ret)
+		ret = ocfs2_malloc0(sizeof(struct io_vec_unit) *
+				    cl->cl_next_free_rec, &ivus);
+	if (ret) {
+		tcom_err(ret, "while allocating group descriptor buffers");
+		goto out;
+	}
 
 	for (i = 0; i < cl->cl_next_free_rec; i++) {
 		rec = &(cl->cl_recs[i]);
-		ret = o2info_scan_global_bitmap_chain(fs, rec, off);
-		if (ret)
-			return ret;
+		if (!rec->c_free)
+			continue;
+		ivus[count].ivu_blkno = rec->c_blkno;
+		ivus[count].ivu_buf = buf + (count * fs->fs_blocksize);
+		ivus[count].ivu_buflen = fs->fs_blocksize;
+		count++;
+	}
+
+	while (count) {
+		ret = io_vec_read_blocks(fs->fs_io, ivus, count);
+		if (ret) {
+			tcom_err(ret, "while reading group descriptors "
+				 "for stats");
+			goto out;
+		}
+
+		for (i = 0, next = 0; i < count; i++) {
+			bg = (struct ocfs2_group_desc *)ivus[i].ivu_buf;
+
+			ret = ocfs2_validate_meta_ecc(fs, ivus[i].ivu_buf,
+						      &bg->bg_check);
+			if (!ret &&
+			    memcmp(bg->bg_signature, OCFS2_GROUP_DESC_SIGNATURE,
+				   strlen(OCFS2_GROUP_DESC_SIGNATURE)))
+				ret = OCFS2_ET_BAD_GROUP_DESC_MAGIC;
+			/* A chain that loops would keep us here forever */
+			if (!ret && (++seen > num_gds))
+				ret = OCFS2_ET_CORRUPT_CHAIN;
+			if (ret) {
+				tcom_err(ret, "while reading group descriptor "
+					 "%"PRIu64" for stats",
+					 ivus[i].ivu_blkno);
+				goto out;
+			}
+			ocfs2_swap_group_desc_to_cpu(fs, bg);
+
+			if (bg->bg_free_bits_count)
+				o2info_scan_group_bitmap(off, bg);
+
+			if (!bg->bg_next_group)
+				continue;
+
+			/* Slot next is at or before slot i, so it is done */
+			ivus[next].ivu_blkno = bg->bg_next_group;
+			next++;
+		}
+		count = next;
 	}
 
+out:
+	if (ivus)
+		ocfs2_free(&ivus);
+	if (buf)
+		ocfs2_free(&buf);
+
 	return ret;
 }
 
@@ -400,12 +445,55 @@ static uint32_t clusters_in_bytes(uint32_t clustersize, uint32_t bytes)
 	return (uint32_t)ret;
 }
 
+/* Add one extent of a file to its stats */
+static void o2info_count_extent(struct o2info_fiemap *ofp, int xattr,
+				struct fiemap_extent *fm_ext,
+				uint32_t *prev_start, uint32_t *prev_len)
+{
+	int cluster_shift = 0;
+	uint32_t start, len;
+
+	if (ofp->clustersize)
+		cluster_shift = ul_log2(ofp->clustersize);
+
+	start = fm_ext->fe_logical >> cluster_shift;
+	len = fm_ext->fe_length >> cluster_shift;
+
+	if (xattr) {
+		ofp->xattr += len;
+	} else {
+		if (fm_ext->fe_flags & FIEMAP_EXTENT_UNWRITTEN)
+			ofp->unwrittens += len;
+
+		if (fm_ext->fe_flags & FIEMAP_EXTENT_SHARED)
+			ofp->shared += len;
+
+		if ((*prev_start + *prev_len) < start)
+			ofp->holes += start - *prev_start - *prev_len;
+	}
+
+	*prev_start = start;
+	*prev_len = len;
+
+	ofp->clusters += len;
+}
+
+static void o2info_fiemap_score(struct o2info_fiemap *ofp)
+{
+	if ((ofp->clusters > 1) && ofp->num_extents) {
+		float e = ofp->num_extents, c = ofp->clusters;
+		int clusters_per_mb = clusters_in_bytes(ofp->clustersize,
+							OCFS2_MAX_CLUSTERSIZE);
+		ofp->frag = 100 * (e / c);
+		ofp->score = ofp->frag * clusters_per_mb;
+	}
+}
+
 static int do_fiemap(int fd, int flags, struct o2info_fiemap *ofp)
 {
 	char buf[4096];
 
 	int ret = 0, last = 0;
-	int cluster_shift = 0;
 	int count = (sizeof(buf) - sizeof(struct fiemap)) /
 		     sizeof(struct fiemap_extent);
 
@@ -414,10 +502,6 @@ static int do_fiemap(int fd, int flags, struct o2info_fiemap *ofp)
 	uint32_t num_extents = 0, extents_got = 0, i;
 
 	uint32_t prev_start = 0, prev_len = 0;
-	uint32_t start = 0, len = 0;
-
-	if (ofp->clustersize)
-		cluster_shift = ul_log2(ofp->clustersize);
 
 	memset(fiemap, 0, sizeof(*fiemap));
 
@@ -451,32 +535,14 @@ static int do_fiemap(int fd, int flags, struct o2info_fiemap *ofp)
 
 		for (i = 0; i < fiemap->fm_mapped_extents; i++) {
 
-			start = fm_ext[i].fe_logical >> cluster_shift;
-			len = fm_ext[i].fe_length >> cluster_shift;
-
-			if (fiemap->fm_flags & FIEMAP_FLAG_XATTR) {
-				ofp->xattr += len;
-			} else {
-				if (fm_ext[i].fe_flags &
-				    FIEMAP_EXTENT_UNWRITTEN)
-					ofp->unwrittens += len;
-
-				if (fm_ext[i].fe_flags & FIEMAP_EXTENT_SHARED)
-					ofp->shared += len;
-
-				if ((prev_start + prev_len) < start)
-					ofp->holes += start - prev_start -
-						      prev_len;
-			}
+			o2info_count_extent(ofp,
+					    fiemap->fm_flags & FIEMAP_FLAG_XATTR,
+					    &fm_ext[i], &prev_start, &prev_len);
 
 			if (fm_ext[i].fe_flags & FIEMAP_EXTENT_LAST)
 				last = 1;
 
-			prev_start = start;
-			prev_len = len;
-
 			extents_got++;
-			ofp->clusters += len;
 		}
 
 		fiemap->fm_start = (fm_ext[i-1].fe_logical +
@@ -505,13 +571,375 @@ int o2info_get_fiemap(int fd, int flags, struct o2info_fiemap *ofp)
 	if (ret)
 		return ret;
 
-	if ((ofp->clusters > 1) && ofp->num_extents) {
-		float e = ofp->num_extents, c = ofp->clusters;
-		int clusters_per_mb = clusters_in_bytes(ofp->clustersize,
-							OCFS2_MAX_CLUSTERSIZE);
-		ofp->frag = 100 * (e / c);
-		ofp->score = ofp->frag * clusters_per_mb;
+	o2info_fiemap_score(ofp);
+
+	return ret;
+}
+
+/*
+ * A FIEMAP buffer that is kept from file to file.  It starts with room
+ * for a page of extents, and doubles whenever a file needed more than
+ * one call, so that the next fragmented file is likely to fit at once.
+ */
+#define FIEMAP_BUF_START	((4096 - sizeof(struct fiemap)) / \
+				 sizeof(struct fiemap_extent))
+#define FIEMAP_BUF_MAX		(64 * 1024)
+
+struct fiemap_buf {
+	struct fiemap *fb_map;
+	uint32_t fb_count;
+};
+
+static int fiemap_buf_grow(struct fiemap_buf *fb, uint32_t count)
+{
+	struct fiemap *map;
+
+	map = realloc(fb->fb_map, sizeof(struct fiemap) +
+		      count * sizeof(struct fiemap_extent));
+	if (!map)
+		return -1;
+
+	fb->fb_map = map;
+	fb->fb_count = count;
+
+	return 0;
+}
+
+/*
+ * Like do_fiemap() for the data of a file, but without asking for the
+ * extent count first; the extents are counted as they come.
+ */
+static int fiemap_buf_map(int fd, struct fiemap_buf *fb,
+			  struct o2info_fiemap *ofp)
+{
+	int calls = 0, last = 0;
+	uint32_t i, prev_start = 0, prev_len = 0;
+	uint64_t start = 0;
+	struct fiemap *fiemap = fb->fb_map;
+	struct fiemap_extent *fm_ext = fiemap->fm_extents;
+
+	do {
+		memset(fiemap, 0, sizeof(struct fiemap));
+		fiemap->fm_start = start;
+		fiemap->fm_length = ~0ULL;
+		fiemap->fm_extent_count = fb->fb_count;
+
+		if (ioctl(fd, FS_IOC_FIEMAP, (unsigned long)fiemap) < 0)
+			return errno;
+		calls++;
+
+		if (!fiemap->fm_mapped_extents)
+			break;
+
+		for (i = 0; i < fiemap->fm_mapped_extents; i++) {
+			o2info_count_extent(ofp, 0, &fm_ext[i], &prev_start,
+					    &prev_len);
+			if (fm_ext[i].fe_flags & FIEMAP_EXTENT_LAST)
+				last = 1;
+		}
+		ofp->num_extents += fiemap->fm_mapped_extents;
+
+		start = fm_ext[i - 1].fe_logical + fm_ext[i - 1].fe_length;
+	} while (!last);
+
+	/* A failure just leaves the buffer as it was */
+	if ((calls > 1) && (fb->fb_count < FIEMAP_BUF_MAX))
+		fiemap_buf_grow(fb, fb->fb_count * 2);
+
+	o2info_fiemap_score(ofp);
+
+	return 0;
+}
+
+struct treestat_file {
+	uint32_t tf_dir;
+	char *tf_path;
+};
+
+struct treestat_ctxt {
+	struct o2info_treestat *tc_ots;
+	uint32_t tc_clustersize;
+	struct treestat_file *tc_files;
+	uint64_t tc_nr_files;
+	uint64_t tc_alloc_files;
+	uint32_t tc_alloc_dirs;
+	uint32_t *tc_stack;		/* directory at each walk level */
+	int tc_stack_len;
+	char *tc_done;
+	int tc_error;
+};
+
+/* What a worker tells the parent after each file */
+struct treestat_report {
+	uint64_t tr_file;
+	int tr_error;
+	struct o2info_fiemap tr_fiemap;
+};
+
+/* nftw() has no way to pass this along */
+static struct treestat_ctxt *treestat_walk_ctxt;
+
+static int treestat_add_dir(struct treestat_ctxt *tc, const char *path,
+			    int level)
+{
+	struct o2info_treestat *ots = tc->tc_ots;
+	struct o2info_dirstat *dirs;
+	uint32_t *stack;
+
+	if (ots->ndirs == tc->tc_alloc_dirs) {
+		dirs = realloc(ots->dirs, sizeof(struct o2info_dirstat) *
+			       (tc->tc_alloc_dirs * 2 + 16));
+		if (!dirs)
+			return ENOMEM;
+		ots->dirs = dirs;
+		tc->tc_alloc_dirs = tc->tc_alloc_dirs * 2 + 16;
+	}
+
+	if (level >= tc->tc_stack_len) {
+		stack = realloc(tc->tc_stack, sizeof(uint32_t) * (level + 16));
+		if (!stack)
+			return ENOMEM;
+		tc->tc_stack = stack;
+		tc->tc_stack_len = level + 16;
+	}
+
+	memset(&ots->dirs[ots->ndirs], 0, sizeof(struct o2info_dirstat));
+	ots->dirs[ots->ndirs].path = strdup(path);
+	if (!ots->dirs[ots->ndirs].path)
+		return ENOMEM;
+
+	tc->tc_stack[level] = ots->ndirs++;
+
+	return 0;
+}
+
+static int treestat_add_file(struct treestat_ctxt *tc, const char *path,
+			     int level)
+{
+	struct treestat_file *files;
+	struct treestat_file *tf;
+
+	if (tc->tc_nr_files == tc->tc_alloc_files) {
+		files = realloc(tc->tc_files, sizeof(struct treestat_file) *
+				(tc->tc_alloc_files * 2 + 64));
+		if (!files)
+			return ENOMEM;
+		tc->tc_files = files;
+		tc->tc_alloc_files = tc->tc_alloc_files * 2 + 64;
+	}
+
+	tf = &tc->tc_files[tc->tc_nr_files];
+	tf->tf_dir = tc->tc_stack[level - 1];
+	tf->tf_path = strdup(path);
+	if (!tf->tf_path)
+		return ENOMEM;
+
+	tc->tc_nr_files++;
+
+	return 0;
+}
+
+static int treestat_walk(const char *path, const struct stat *st, int flag,
+			 struct FTW *ftwbuf)
+{
+	struct treestat_ctxt *tc = treestat_walk_ctxt;
+
+	if (flag == FTW_D)
+		tc->tc_error = treestat_add_dir(tc, path, ftwbuf->level);
+	else if ((flag == FTW_F) && S_ISREG(st->st_mode) && ftwbuf->level)
+		tc->tc_error = treestat_add_file(tc, path, ftwbuf->level);
+	else if ((flag == FTW_DNR) || (flag == FTW_NS))
+		tc->tc_ots->skipped++;
+
+	return tc->tc_error ? FTW_STOP : FTW_CONTINUE;
+}
+
+static int treestat_map_file(struct treestat_ctxt *tc, uint64_t f,
+			     struct fiemap_buf *fb, struct o2info_fiemap *ofp)
+{
+	int fd, ret;
+
+	memset(ofp, 0, sizeof(struct o2info_fiemap));
+	ofp->clustersize = tc->tc_clustersize;
+
+	fd = open(tc->tc_files[f].tf_path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return errno;
+
+	ret = fiemap_buf_map(fd, fb, ofp);
+	close(fd);
+
+	return ret;
+}
+
+static void treestat_file_done(struct treestat_ctxt *tc, uint64_t f,
+			       int error, struct o2info_fiemap *ofp)
+{
+	struct o2info_dirstat *ods;
+
+	if (tc->tc_done[f])
+		return;
+	tc->tc_done[f] = 1;
+
+	ods = &tc->tc_ots->dirs[tc->tc_files[f].tf_dir];
+	if (error) {
+		ods->skipped++;
+		tc->tc_ots->skipped++;
+		return;
+	}
+
+	ods->files++;
+	ods->clusters += ofp->clusters;
+	ods->extents += ofp->num_extents;
+	ods->shared += ofp->shared;
+	ods->unwrittens += ofp->unwrittens;
+	ods->holes += ofp->holes;
+	tc->tc_ots->files++;
+}
+
+struct treestat_worker_args {
+	struct treestat_ctxt *ta_tc;
+	struct fiemap_buf *ta_fb;
+};
+
+static void treestat_worker(int worker, int nr_workers, int pipe_fd,
+			    void *priv)
+{
+	struct treestat_worker_args *ta = priv;
+	struct treestat_ctxt *tc = ta->ta_tc;
+	uint64_t f;
+	struct treestat_report tr;
+
+	/* Nothing to clean up, the parent does the rest */
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	memset(&tr, 0, sizeof(tr));
+	for (f = worker; f < tc->tc_nr_files; f += nr_workers) {
+		tr.tr_file = f;
+		tr.tr_error = treestat_map_file(tc, f, ta->ta_fb,
+						&tr.tr_fiemap);
+		if (tools_full_write(pipe_fd, &tr, sizeof(tr)))
+			break;
+	}
+}
+
+/*
+ * Fork nr_workers workers, each mapping every nr_workers'th file, and
+ * total their reports up per directory.  A file is only done once its
+ * report arrives, so anything a worker didn't get to is mapped by the
+ * caller afterwards.
+ */
+static void treestat_parallel(struct treestat_ctxt *tc, struct fiemap_buf *fb,
+			      int nr_workers)
+{
+	struct tools_workers tw;
+	struct treestat_worker_args ta = { tc, fb };
+	struct treestat_report tr;
+
+	if (!tools_start_workers(&tw, nr_workers, 0, treestat_worker, &ta))
+		return;
+
+	while (!tools_full_read(tw.tw_fds[0], &tr, sizeof(tr))) {
+		if (tr.tr_file >= tc->tc_nr_files)
+			break;
+
+		treestat_file_done(tc, tr.tr_file, tr.tr_error,
+				   &tr.tr_fiemap);
 	}
+	tools_stop_workers(&tw);
+}
+
+static void treestat_free(struct treestat_ctxt *tc)
+{
+	uint64_t f;
+
+	for (f = 0; f < tc->tc_nr_files; f++)
+		free(tc->tc_files[f].tf_path);
+	free(tc->tc_files);
+	free(tc->tc_stack);
+	free(tc->tc_done);
+}
+
+void o2info_free_treestat(struct o2info_treestat *ots)
+{
+	uint32_t i;
+
+	for (i = 0; i < ots->ndirs; i++)
+		free(ots->dirs[i].path);
+	free(ots->dirs);
+	memset(ots, 0, sizeof(struct o2info_treestat));
+}
+
+int o2info_get_treestat(const char *path, uint32_t clustersize,
+			int nr_workers, struct o2info_treestat *ots)
+{
+	int ret;
+	uint64_t f;
+	uint32_t d;
+	struct treestat_ctxt tc;
+	struct fiemap_buf fb = { NULL, 0 };
+	struct o2info_fiemap ofp;
+	struct o2info_dirstat *ods;
+
+	memset(ots, 0, sizeof(struct o2info_treestat));
+	memset(&tc, 0, sizeof(tc));
+	tc.tc_ots = ots;
+	tc.tc_clustersize = clustersize;
+
+	treestat_walk_ctxt = &tc;
+	ret = nftw(path, treestat_walk, 64, FTW_PHYS | FTW_MOUNT |
+		   FTW_ACTIONRETVAL);
+	treestat_walk_ctxt = NULL;
+	if (ret < 0)
+		ret = errno;
+	else
+		ret = tc.tc_error;
+	if (ret) {
+		tcom_err(ret, "while walking %s", path);
+		goto out;
+	}
+
+	ret = fiemap_buf_grow(&fb, FIEMAP_BUF_START);
+	if (!ret && tc.tc_nr_files) {
+		tc.tc_done = calloc(tc.tc_nr_files, 1);
+		if (!tc.tc_done)
+			ret = -1;
+	}
+	if (ret) {
+		ret = ENOMEM;
+		tcom_err(ret, "while allocating fiemap buffers");
+		goto out;
+	}
+
+	if (nr_workers > tc.tc_nr_files)
+		nr_workers = tc.tc_nr_files;
+	if (nr_workers > 1)
+		treestat_parallel(&tc, &fb, nr_workers);
+
+	for (f = 0; f < tc.tc_nr_files; f++) {
+		if (tc.tc_done[f])
+			continue;
+		ret = treestat_map_file(&tc, f, &fb, &ofp);
+		treestat_file_done(&tc, f, ret, &ofp);
+	}
+	ret = 0;
+
+	for (d = 0; d < ots->ndirs; d++) {
+		ods = &ots->dirs[d];
+		if ((ods->clusters > 1) && ods->extents) {
+			ods->frag = 100 * ((float)ods->extents / ods->clusters);
+			ods->score = ods->frag *
+				clusters_in_bytes(clustersize,
+						  OCFS2_MAX_CLUSTERSIZE);
+		}
+	}
+
+out:
+	free(fb.fb_map);
+	treestat_free(&tc);
+	if (ret)
+		o2info_free_treestat(ots);
 
 	return ret;
 }
@@ -87,11 +87,35 @@ struct o2info_fiemap {
 	float score;
 };
 
+/* The files directly in one directory, added up */
+struct o2info_dirstat {
+	char *path;
+	uint64_t files;
+	uint64_t skipped;	/* files that couldn't be mapped */
+	uint64_t clusters;
+	uint64_t extents;
+	uint64_t shared;
+	uint64_t holes;
+	uint64_t unwrittens;
+	float frag; /* extents / clusters ratio */
+	float score;
+};
+
+struct o2info_treestat {
+	uint32_t ndirs;
+	uint64_t files;
+	uint64_t skipped;
+	struct o2info_dirstat *dirs;
+};
+
 int o2info_get_fs_features(ocfs2_filesys *fs, struct o2info_fs_features *ofs);
 int o2info_get_volinfo(ocfs2_filesys *fs, struct o2info_volinfo *vf);
 int o2info_get_mkfs(ocfs2_filesys *fs, struct o2info_mkfs *oms);
 int o2info_get_freeinode(ocfs2_filesys *fs, struct o2info_freeinode *ofi);
 int o2info_get_freefrag(ocfs2_filesys *fs, struct o2info_freefrag *off);
 int o2info_get_fiemap(int fd, int flags, struct o2info_fiemap *ofp);
+int o2info_get_treestat(const char *path, uint32_t clustersize,
+			int nr_workers, struct o2info_treestat *ots);
+void o2info_free_treestat(struct o2info_treestat *ots);
 
 #endif
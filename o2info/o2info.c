@@ -26,6 +26,10 @@
 #include <signal.h>
 #include <getopt.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <time.h>
+#include <limits.h>
+#include <inttypes.h>
 
 #include "ocfs2/ocfs2.h"
 #include "ocfs2-kernel/ocfs2_ioctl.h"
@@ -41,10 +45,19 @@ extern struct o2info_operation freeinode_op;
 extern struct o2info_operation freefrag_op;
 extern struct o2info_operation space_usage_op;
 extern struct o2info_operation filestat_op;
+extern struct o2info_operation tree_stat_op;
 
 static LIST_HEAD(o2info_op_task_list);
 static int o2info_op_task_count;
+static int o2info_op_task_failed;
 int cluster_coherent;
+int o2info_json;
+
+/* Seconds a cached report stays good for, 0 for no caching */
+static long cache_interval;
+
+/* Where the cached reports live unless O2INFO_CACHE_DIR says otherwise */
+#define O2INFO_CACHE_DIR	"/var/cache/o2info"
 
 void print_usage(int rc);
 static int help_handler(struct o2info_option *opt, char *arg)
@@ -66,6 +79,26 @@ static int coherency_handler(struct o2info_option *opt, char *arg)
 	return 0;
 }
 
+static int json_handler(struct o2info_option *opt, char *arg)
+{
+	o2info_json = 1;
+
+	return 0;
+}
+
+static int cache_handler(struct o2info_option *opt, char *arg)
+{
+	char *end;
+
+	cache_interval = strtol(arg, &end, 0);
+	if ((*end != '\0') || (cache_interval < 0)) {
+		errorf("bad cache interval '%s'\n", arg);
+		return -1;
+	}
+
+	return 0;
+}
+
 static struct o2info_option help_option = {
 	.opt_option	= {
 		.name		= "help",
@@ -106,6 +139,32 @@ static struct o2info_option coherency_option = {
 	.opt_private = NULL,
 };
 
+static struct o2info_option json_option = {
+	.opt_option	= {
+		.name		= "json",
+		.val		= CHAR_MAX,
+		.has_arg	= 0,
+		.flag		= NULL,
+	},
+	.opt_help	= "   --json",
+	.opt_handler	= json_handler,
+	.opt_op		= NULL,
+	.opt_private	= NULL,
+};
+
+static struct o2info_option cache_option = {
+	.opt_option	= {
+		.name		= "cache",
+		.val		= CHAR_MAX,
+		.has_arg	= 1,
+		.flag		= NULL,
+	},
+	.opt_help	= "   --cache <seconds>",
+	.opt_handler	= cache_handler,
+	.opt_op		= NULL,
+	.opt_private	= NULL,
+};
+
 static struct o2info_option fs_features_option = {
 	.opt_option	= {
 		.name		= "fs-features",
@@ -197,10 +256,25 @@ static struct o2info_option filestat_option = {
 	.opt_private	= NULL,
 };
 
+static struct o2info_option tree_stat_option = {
+	.opt_option	= {
+		.name		= "tree-stat",
+		.val		= CHAR_MAX,
+		.has_arg	= 0,
+		.flag		= NULL,
+	},
+	.opt_help	= "   --tree-stat",
+	.opt_handler	= NULL,
+	.opt_op		= &tree_stat_op,
+	.opt_private	= NULL,
+};
+
 static struct o2info_option *options[] = {
 	&help_option,
 	&version_option,
 	&coherency_option,
+	&json_option,
+	&cache_option,
 	&fs_features_option,
 	&volinfo_option,
 	&mkfs_option,
@@ -208,6 +282,7 @@ static struct o2info_option *options[] = {
 	&freefrag_option,
 	&space_usage_option,
 	&filestat_option,
+	&tree_stat_option,
 	NULL,
 };
 
@@ -478,20 +553,187 @@ out:
 	return err;
 }
 
+/*
+ * With --json, the whole run is one object holding an object per
+ * operation, named after it.  A failed operation says so in its own
+ * object; the details went to stderr.
+ */
 static errcode_t o2info_run_task(struct o2info_method *om)
 {
+	int rc;
 	struct list_head *p, *n;
 	struct o2info_op_task *task;
 
+	if (o2info_json) {
+		o2info_json_open(NULL);
+		o2info_json_string("device", om->om_path);
+	}
+
 	list_for_each_safe(p, n, &o2info_op_task_list) {
 		task = list_entry(p, struct o2info_op_task, o2p_list);
-		task->o2p_task->to_run(task->o2p_task, om,
-				       task->o2p_task->to_private);
+		if (o2info_json)
+			o2info_json_open(task->o2p_task->to_name);
+		rc = task->o2p_task->to_run(task->o2p_task, om,
+					    task->o2p_task->to_private);
+		if (rc)
+			o2info_op_task_failed++;
+		if (o2info_json) {
+			if (rc)
+				o2info_json_int("error", rc);
+			o2info_json_close();
+		}
 	}
 
+	if (o2info_json)
+		o2info_json_close();
+
 	return 0;
 }
 
+/*
+ * A monitoring agent may ask the same questions of many volumes every
+ * minute.  With --cache, the report is saved, and the same command line
+ * within the interval gets the saved report without touching the
+ * volume.  The cache file is named for a hash of the arguments and the
+ * real path of the device or file.
+ */
+static char *o2info_cache_path(int argc, char *argv[],
+			       const char *device_or_file)
+{
+	int i;
+	const char *dir, *c;
+	char real[PATH_MAX], *path = NULL;
+	uint64_t hash = 14695981039346656037ULL;	/* FNV-1a */
+
+	if (!realpath(device_or_file, real))
+		return NULL;
+
+	for (i = 1; i <= argc; i++) {
+		for (c = (i < argc) ? argv[i] : real; *c; c++) {
+			hash ^= (unsigned char)*c;
+			hash *= 1099511628211ULL;
+		}
+		/* Keep "-a b" and "-ab" apart */
+		hash *= 1099511628211ULL;
+	}
+
+	dir = getenv("O2INFO_CACHE_DIR");
+	if (!dir)
+		dir = O2INFO_CACHE_DIR;
+	mkdir(dir, 0700);
+
+	if (asprintf(&path, "%s/o2info.%u.%016"PRIx64, dir, geteuid(),
+		     hash) < 0)
+		return NULL;
+
+	return path;
+}
+
+static int o2info_copy_fd(int from, int to)
+{
+	char buf[4096];
+	ssize_t rd, wr, done;
+
+	while ((rd = read(from, buf, sizeof(buf))) != 0) {
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		for (done = 0; done < rd; done += wr) {
+			wr = write(to, buf + done, rd - done);
+			if (wr < 0) {
+				if (errno == EINTR) {
+					wr = 0;
+					continue;
+				}
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Print the cached report if there is a fresh one */
+static int o2info_cache_show(const char *path)
+{
+	int fd, rc = -1;
+	struct stat st;
+	time_t now = time(NULL);
+
+	fd = open(path, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return -1;
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) &&
+	    (st.st_uid == geteuid()) && (st.st_mtime <= now) &&
+	    (now - st.st_mtime < cache_interval))
+		rc = o2info_copy_fd(fd, STDOUT_FILENO);
+
+	close(fd);
+
+	return rc;
+}
+
+/*
+ * Send stdout to a new file next to the cache file.  It is renamed over
+ * the cache file once the report is known to be good.
+ */
+static int o2info_cache_start(const char *path, char **tmp_path,
+			      int *saved_stdout)
+{
+	int fd;
+
+	if (asprintf(tmp_path, "%s.XXXXXX", path) < 0) {
+		*tmp_path = NULL;
+		return -1;
+	}
+
+	fd = mkstemp(*tmp_path);
+	if (fd < 0)
+		goto out_free;
+
+	*saved_stdout = dup(STDOUT_FILENO);
+	if (*saved_stdout < 0)
+		goto out_unlink;
+
+	if (dup2(fd, STDOUT_FILENO) < 0) {
+		close(*saved_stdout);
+		goto out_unlink;
+	}
+
+	close(fd);
+	return 0;
+
+out_unlink:
+	close(fd);
+	unlink(*tmp_path);
+out_free:
+	free(*tmp_path);
+	*tmp_path = NULL;
+	return -1;
+}
+
+static void o2info_cache_finish(const char *path, char *tmp_path,
+				int saved_stdout, int keep)
+{
+	int fd;
+
+	dup2(saved_stdout, STDOUT_FILENO);
+	close(saved_stdout);
+
+	fd = open(tmp_path, O_RDONLY);
+	if ((fd < 0) || o2info_copy_fd(fd, STDOUT_FILENO))
+		keep = 0;
+	if (fd >= 0)
+		close(fd);
+
+	if (!keep || rename(tmp_path, path))
+		unlink(tmp_path);
+	free(tmp_path);
+}
+
 static void handle_signal(int caught_sig)
 {
 	int exitp = 0, abortp = 0;
@@ -574,14 +816,25 @@ static void o2info_init(const char *argv0)
 
 int main(int argc, char *argv[])
 {
-	int rc = 0;
+	int rc = 0, saved_stdout = -1;
 
 	char *device_or_file = NULL;
+	char *cache_path = NULL, *cache_tmp = NULL;
 	static struct o2info_method om;
 
 	o2info_init(argv[0]);
 	parse_options(argc, argv, &device_or_file);
 
+	if (cache_interval) {
+		cache_path = o2info_cache_path(argc, argv, device_or_file);
+		if (cache_path) {
+			if (!o2info_cache_show(cache_path))
+				goto out;
+			o2info_cache_start(cache_path, &cache_tmp,
+					   &saved_stdout);
+		}
+	}
+
 	rc = o2info_method(device_or_file);
 	if (rc < 0)
 		goto out;
@@ -602,6 +855,11 @@ int main(int argc, char *argv[])
 
 	rc = o2info_close(&om);
 out:
+	if (cache_tmp)
+		o2info_cache_finish(cache_path, cache_tmp, saved_stdout,
+				    !rc && !o2info_op_task_failed);
+	if (cache_path)
+		free(cache_path);
 	if (device_or_file)
 		ocfs2_free(&device_or_file);
 
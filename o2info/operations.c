@@ -22,6 +22,7 @@
 #define _GNU_SOURCE /* Because libc really doesn't want us using O_DIRECT? */
 
 #include <errno.h>
+#include <unistd.h>
 #include <sys/raw.h>
 #include <inttypes.h>
 
@@ -36,6 +37,7 @@
 
 extern void print_usage(int rc);
 extern int cluster_coherent;
+extern int o2info_json;
 
 static inline void o2info_fill_request(struct ocfs2_info_request *req,
 				       size_t size,
@@ -53,10 +55,11 @@ static inline void o2info_fill_request(struct ocfs2_info_request *req,
 static void o2i_info(struct o2info_operation *op, const char *fmt, ...)
 {
 	va_list ap;
+	FILE *out = o2info_json ? stderr : stdout;
 
-	fprintf(stdout, "%s Info: ", op->to_name);
+	fprintf(out, "%s Info: ", op->to_name);
 	va_start(ap, fmt);
-	vfprintf(stdout, fmt, ap);
+	vfprintf(out, fmt, ap);
 	va_end(ap);
 
 	return;
@@ -207,64 +210,6 @@ static void o2info_print_line(char const *qualifier, char *content,
 		ocfs2_free(&tmp);
 }
 
-static int fs_features_run(struct o2info_operation *op,
-			   struct o2info_method *om,
-			   void *arg)
-{
-	int rc = 0;
-	static struct o2info_fs_features ofs;
-
-	char *compat = NULL;
-	char *incompat = NULL;
-	char *rocompat = NULL;
-	char *features = NULL;
-
-	if (om->om_method == O2INFO_USE_IOCTL)
-		rc = get_fs_features_ioctl(op, om->om_fd, &ofs);
-	else
-		rc = o2info_get_fs_features(om->om_fs, &ofs);
-	if (rc)
-		goto out;
-
-	rc = o2info_get_compat_flag(ofs.compat, &compat);
-	if (rc)
-		goto out;
-
-	rc = o2info_get_incompat_flag(ofs.incompat, &incompat);
-	if (rc)
-		goto out;
-
-	rc = o2info_get_rocompat_flag(ofs.rocompat, &rocompat);
-	if (rc)
-		goto out;
-
-	features = malloc(strlen(compat) + strlen(incompat) +
-			  strlen(rocompat) + 3);
-
-	sprintf(features, "%s %s %s", compat, incompat, rocompat);
-
-	o2info_print_line("", features, ' ');
-
-out:
-	if (compat)
-		ocfs2_free(&compat);
-
-	if (incompat)
-		ocfs2_free(&incompat);
-
-	if (rocompat)
-		ocfs2_free(&rocompat);
-
-	if (features)
-		ocfs2_free(&features);
-
-	return rc;
-}
-
-DEFINE_O2INFO_OP(fs_features,
-		 fs_features_run,
-		 NULL);
-
 static int get_volinfo_ioctl(struct o2info_operation *op,
 			     int fd,
 			     struct o2info_volinfo *vf)
@@ -333,6 +278,95 @@ out:
 	return rc;
 }
 
+/*
+ * Most operations want the volume info.  When several run together,
+ * only the first one asks for it.
+ */
+static int get_volinfo(struct o2info_operation *op, struct o2info_method *om,
+		       struct o2info_volinfo *vf)
+{
+	int rc = 0;
+	static int cached;
+	static struct o2info_volinfo ovf;
+
+	if (!cached) {
+		if (om->om_method == O2INFO_USE_IOCTL)
+			rc = get_volinfo_ioctl(op, om->om_fd, &ovf);
+		else
+			rc = o2info_get_volinfo(om->om_fs, &ovf);
+		if (rc)
+			return rc;
+		cached = 1;
+	}
+
+	memcpy(vf, &ovf, sizeof(*vf));
+
+	return rc;
+}
+
+static int fs_features_run(struct o2info_operation *op,
+			   struct o2info_method *om,
+			   void *arg)
+{
+	int rc = 0;
+	static struct o2info_volinfo vf;
+	struct o2info_fs_features ofs;
+
+	char *compat = NULL;
+	char *incompat = NULL;
+	char *rocompat = NULL;
+	char *features = NULL;
+
+	rc = get_volinfo(op, om, &vf);
+	if (rc)
+		goto out;
+	ofs = vf.ofs;
+
+	rc = o2info_get_compat_flag(ofs.compat, &compat);
+	if (rc)
+		goto out;
+
+	rc = o2info_get_incompat_flag(ofs.incompat, &incompat);
+	if (rc)
+		goto out;
+
+	rc = o2info_get_rocompat_flag(ofs.rocompat, &rocompat);
+	if (rc)
+		goto out;
+
+	features = malloc(strlen(compat) + strlen(incompat) +
+			  strlen(rocompat) + 3);
+
+	sprintf(features, "%s %s %s", compat, incompat, rocompat);
+
+	if (o2info_json) {
+		o2info_json_uint("compat", ofs.compat);
+		o2info_json_uint("incompat", ofs.incompat);
+		o2info_json_uint("rocompat", ofs.rocompat);
+		o2info_json_words("features", features);
+	} else
+		o2info_print_line("", features, ' ');
+
+out:
+	if (compat)
+		ocfs2_free(&compat);
+
+	if (incompat)
+		ocfs2_free(&incompat);
+
+	if (rocompat)
+		ocfs2_free(&rocompat);
+
+	if (features)
+		ocfs2_free(&features);
+
+	return rc;
+}
+
+DEFINE_O2INFO_OP(fs_features,
+		 fs_features_run,
+		 NULL);
+
 static int volinfo_run(struct o2info_operation *op,
 		       struct o2info_method *om,
 		       void *arg)
@@ -351,10 +385,7 @@ static int volinfo_run(struct o2info_operation *op,
 		"Cluster Size: %u\n" \
 		"  Node Slots: %u\n"
 
-	if (om->om_method == O2INFO_USE_IOCTL)
-		rc = get_volinfo_ioctl(op, om->om_fd, &vf);
-	else
-		rc = o2info_get_volinfo(om->om_fs, &vf);
+	rc = get_volinfo(op, om, &vf);
 	if (rc)
 		goto out;
 
@@ -375,6 +406,16 @@ static int volinfo_run(struct o2info_operation *op,
 
 	sprintf(features, "%s %s %s", compat, incompat, rocompat);
 
+	if (o2info_json) {
+		o2info_json_string("label", (char *)vf.label);
+		o2info_json_string("uuid", (char *)vf.uuid_str);
+		o2info_json_uint("block_size", vf.blocksize);
+		o2info_json_uint("cluster_size", vf.clustersize);
+		o2info_json_uint("node_slots", vf.maxslots);
+		o2info_json_words("features", features);
+		goto out;
+	}
+
 	fprintf(stdout, VOLINFO, vf.label, vf.uuid_str, vf.blocksize,
 		vf.clustersize, vf.maxslots);
 
@@ -433,8 +474,6 @@ static int get_mkfs_ioctl(struct o2info_operation *op, int fd,
 	if (oij.ij_req.ir_flags & OCFS2_INFO_FL_FILLED)
 		oms->journal_size = oij.ij_journal_size;
 
-	rc = get_volinfo_ioctl(op, fd, &(oms->ovf));
-
 out:
 	return rc;
 }
@@ -519,16 +558,22 @@ static int mkfs_run(struct o2info_operation *op, struct o2info_method *om,
 	static struct o2info_mkfs oms;
 	char *mkfs = NULL;
 
-	if (om->om_method == O2INFO_USE_IOCTL)
+	if (om->om_method == O2INFO_USE_IOCTL) {
 		rc = get_mkfs_ioctl(op, om->om_fd, &oms);
-	else
+		if (!rc)
+			rc = get_volinfo(op, om, &oms.ovf);
+	} else
 		rc = o2info_get_mkfs(om->om_fs, &oms);
 	if (rc)
 		goto out;
 
 	o2info_gen_mkfs_string(oms, &mkfs);
 
-	fprintf(stdout, "%s\n", mkfs);
+	if (o2info_json) {
+		o2info_json_uint("journal_size", oms.journal_size);
+		o2info_json_string("options", mkfs);
+	} else
+		fprintf(stdout, "%s\n", mkfs);
 out:
 	if (mkfs)
 		ocfs2_free(&mkfs);
@@ -598,6 +643,23 @@ static int freeinode_run(struct o2info_operation *op,
 	if (ret)
 		return ret;
 
+	if (o2info_json) {
+		o2info_json_open_array("slots");
+		for (i = 0; i < ofi.slotnum ; i++) {
+			o2info_json_open(NULL);
+			o2info_json_int("slot", i);
+			o2info_json_uint("space", ofi.fi[i].total);
+			o2info_json_uint("free", ofi.fi[i].free);
+			o2info_json_close();
+			total += ofi.fi[i].total;
+			free += ofi.fi[i].free;
+		}
+		o2info_json_close();
+		o2info_json_uint("space", total);
+		o2info_json_uint("free", free);
+		return ret;
+	}
+
 	fprintf(stdout, "Slot\t\tSpace\t\tFree\n");
 	for (i = 0; i < ofi.slotnum ; i++) {
 		fprintf(stdout, "%3d\t%13lu\t%12lu\n", i, ofi.fi[i].total,
@@ -780,6 +842,39 @@ static void o2info_report_freefrag(struct o2info_freefrag *off)
 	}
 }
 
+static void o2info_json_freefrag(struct o2info_freefrag *off)
+{
+	int i;
+
+	o2info_json_uint("block_size", 1 << off->blksize_bits);
+	o2info_json_uint("cluster_size", 1 << off->clustersize_bits);
+	o2info_json_uint("total_clusters", off->clusters);
+	o2info_json_uint("free_clusters", off->free_clusters);
+	o2info_json_uint("min_free_extent_kb", off->min);
+	o2info_json_uint("max_free_extent_kb", off->max);
+	o2info_json_uint("avg_free_extent_kb", off->avg);
+
+	if (off->chunkbytes) {
+		o2info_json_uint("chunk_size", off->chunkbytes);
+		o2info_json_uint("total_chunks", off->total_chunks);
+		o2info_json_uint("free_chunks", off->free_chunks);
+	}
+
+	/* Bucket i holds the free extents of 2^i to 2^(i+1)-1 clusters */
+	o2info_json_open_array("histogram");
+	for (i = 0; i < OCFS2_INFO_MAX_HIST; i++) {
+		if (!off->histogram.fc_chunks[i])
+			continue;
+		o2info_json_open(NULL);
+		o2info_json_uint("min_clusters", 1ULL << i);
+		o2info_json_uint("free_extents", off->histogram.fc_chunks[i]);
+		o2info_json_uint("free_clusters",
+				 off->histogram.fc_clusters[i]);
+		o2info_json_close();
+	}
+	o2info_json_close();
+}
+
 static int freefrag_run(struct o2info_operation *op,
 			struct o2info_method *om,
 			void *arg)
@@ -804,10 +899,7 @@ static int freefrag_run(struct o2info_operation *op,
 
 	off.chunkbytes *= 1024;
 
-	if (om->om_method == O2INFO_USE_IOCTL)
-		ret = get_volinfo_ioctl(op, om->om_fd, &ovf);
-	else
-		ret = o2info_get_volinfo(om->om_fs, &ovf);
+	ret = get_volinfo(op, om, &ovf);
 	if (ret)
 		return -1;
 
@@ -831,7 +923,10 @@ static int freefrag_run(struct o2info_operation *op,
 	if (ret)
 		return ret;
 
-	o2info_report_freefrag(&off);
+	if (o2info_json)
+		o2info_json_freefrag(&off);
+	else
+		o2info_report_freefrag(&off);
 
 	return ret;
 }
@@ -865,7 +960,7 @@ static int space_usage_run(struct o2info_operation *op,
 
 	memset(&ofp, 0, sizeof(ofp));
 
-	ret = get_volinfo_ioctl(op, om->om_fd, &ovf);
+	ret = get_volinfo(op, om, &ovf);
 	if (ret)
 		return -1;
 
@@ -876,9 +971,15 @@ static int space_usage_run(struct o2info_operation *op,
 	if (ret)
 		goto out;
 
-	fprintf(stdout, "Blocks: %-10u Shared: %-10u\tUnwritten: %-7u "
-		"Holes: %-6u\n", st.st_blocks, ofp.shared, ofp.unwrittens,
-		ofp.holes);
+	if (o2info_json) {
+		o2info_json_uint("blocks", st.st_blocks);
+		o2info_json_uint("shared", ofp.shared);
+		o2info_json_uint("unwritten", ofp.unwrittens);
+		o2info_json_uint("holes", ofp.holes);
+	} else
+		fprintf(stdout, "Blocks: %-10u Shared: %-10u\tUnwritten: %-7u "
+			"Holes: %-6u\n", st.st_blocks, ofp.shared,
+			ofp.unwrittens, ofp.holes);
 
 out:
 	return ret;
@@ -923,6 +1024,44 @@ static int o2info_report_filestat(struct o2info_method *om,
 	if (!ofp->blocksize)
 		ofp->blocksize = st->st_blksize;
 
+	ret = o2info_get_human_time(&ah_time, o2info_get_stat_atime(st));
+	if (ret)
+		goto out;
+	ret = o2info_get_human_time(&mh_time, o2info_get_stat_mtime(st));
+	if (ret)
+		goto out;
+	ret = o2info_get_human_time(&ch_time, o2info_get_stat_ctime(st));
+	if (ret)
+		goto out;
+
+	if (o2info_json) {
+		o2info_json_string("file", path);
+		o2info_json_uint("size", st->st_size);
+		o2info_json_uint("blocks", st->st_blocks);
+		o2info_json_uint("io_block", ofp->blocksize);
+		o2info_json_string("type", filetype);
+		o2info_json_uint("device", st->st_dev);
+		o2info_json_uint("inode", st->st_ino);
+		o2info_json_uint("links", st->st_nlink);
+		o2info_json_float("frag_pct", ofp->frag);
+		o2info_json_uint("clusters", ofp->clusters);
+		o2info_json_uint("extents", ofp->num_extents);
+		o2info_json_float("score", ofp->score);
+		o2info_json_uint("shared", ofp->shared);
+		o2info_json_uint("unwritten", ofp->unwrittens);
+		o2info_json_uint("holes", ofp->holes);
+		o2info_json_uint("xattr", ofp->xattr);
+		o2info_json_uint("mode", perm);
+		o2info_json_uint("uid", st->st_uid);
+		o2info_json_string("user", uname);
+		o2info_json_uint("gid", st->st_gid);
+		o2info_json_string("group", gname);
+		o2info_json_string("atime", ah_time);
+		o2info_json_string("mtime", mh_time);
+		o2info_json_string("ctime", ch_time);
+		goto out;
+	}
+
 	fprintf(stdout, "  File: %s\n", path);
 	fprintf(stdout, "  Size: %-10lu\tBlocks: %-10u IO Block: %-6u %s\n",
 		st->st_size, st->st_blocks, ofp->blocksize, filetype);
@@ -944,16 +1083,6 @@ static int o2info_report_filestat(struct o2info_method *om,
 		"Gid: (%5u/%8s)\n", perm, h_perm, st->st_uid,
 		uname, st->st_gid, gname);
 
-	ret = o2info_get_human_time(&ah_time, o2info_get_stat_atime(st));
-	if (ret)
-		goto out;
-	ret = o2info_get_human_time(&mh_time, o2info_get_stat_mtime(st));
-	if (ret)
-		goto out;
-	ret = o2info_get_human_time(&ch_time, o2info_get_stat_ctime(st));
-	if (ret)
-		goto out;
-
 	fprintf(stdout, "Access: %s\n", ah_time);
 	fprintf(stdout, "Modify: %s\n", mh_time);
 	fprintf(stdout, "Change: %s\n", ch_time);
@@ -1004,7 +1133,7 @@ static int filestat_run(struct o2info_operation *op,
 
 	memset(&ofp, 0, sizeof(ofp));
 
-	ret = get_volinfo_ioctl(op, om->om_fd, &ovf);
+	ret = get_volinfo(op, om, &ovf);
 	if (ret)
 		return -1;
 
@@ -1023,3 +1152,123 @@ out:
 DEFINE_O2INFO_OP(filestat,
 		 filestat_run,
 		 NULL);
+
+/* The most processes we fork to map the files of a tree */
+#define O2INFO_TREESTAT_WORKERS_MAX	8
+
+static int tree_stat_cmp(const void *a, const void *b)
+{
+	const struct o2info_dirstat *da = *(const struct o2info_dirstat **)a;
+	const struct o2info_dirstat *db = *(const struct o2info_dirstat **)b;
+
+	if (da->score != db->score)
+		return (da->score < db->score) ? 1 : -1;
+
+	return strcmp(da->path, db->path);
+}
+
+static void o2info_report_tree_stat(struct o2info_treestat *ots,
+				    struct o2info_dirstat **sorted, int nr)
+{
+	int i;
+	struct o2info_dirstat *ods;
+
+	if (o2info_json) {
+		o2info_json_uint("directories", ots->ndirs);
+		o2info_json_uint("files", ots->files);
+		o2info_json_uint("skipped", ots->skipped);
+		o2info_json_open_array("by_directory");
+		for (i = 0; i < nr; i++) {
+			ods = sorted[i];
+			o2info_json_open(NULL);
+			o2info_json_string("directory", ods->path);
+			o2info_json_uint("files", ods->files);
+			o2info_json_uint("skipped", ods->skipped);
+			o2info_json_uint("clusters", ods->clusters);
+			o2info_json_uint("extents", ods->extents);
+			o2info_json_float("frag_pct", ods->frag);
+			o2info_json_float("score", ods->score);
+			o2info_json_uint("shared", ods->shared);
+			o2info_json_uint("unwritten", ods->unwrittens);
+			o2info_json_uint("holes", ods->holes);
+			o2info_json_close();
+		}
+		o2info_json_close();
+		return;
+	}
+
+	fprintf(stdout, "Directories: %u  Files: %"PRIu64"  Skipped: %"PRIu64
+		"\n\n", ots->ndirs, ots->files, ots->skipped);
+	fprintf(stdout, "%8s %10s %10s %7s %8s %10s %10s %10s  %s\n",
+		"Files", "Clusters", "Extents", "Frag%", "Score", "Shared",
+		"Unwritten", "Holes", "Directory");
+
+	for (i = 0; i < nr; i++) {
+		ods = sorted[i];
+		fprintf(stdout, "%8"PRIu64" %10"PRIu64" %10"PRIu64" %7.2f "
+			"%8.0f %10"PRIu64" %10"PRIu64" %10"PRIu64"  %s\n",
+			ods->files, ods->clusters, ods->extents, ods->frag,
+			ods->score, ods->shared, ods->unwrittens, ods->holes,
+			ods->path);
+	}
+}
+
+/*
+ * Map every file under a directory and add the results up for each
+ * directory, most fragmented first.
+ */
+static int tree_stat_run(struct o2info_operation *op,
+			 struct o2info_method *om,
+			 void *arg)
+{
+	int ret = 0, nr = 0, workers;
+	uint32_t i;
+	struct o2info_volinfo ovf;
+	struct o2info_treestat ots;
+	struct o2info_dirstat **sorted = NULL;
+
+	if (om->om_method == O2INFO_USE_LIBOCFS2) {
+		o2i_error(op, "specify a directory on a mounted file "
+			  "system\n");
+		return -1;
+	}
+
+	ret = get_volinfo(op, om, &ovf);
+	if (ret)
+		return -1;
+
+	workers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (workers > O2INFO_TREESTAT_WORKERS_MAX)
+		workers = O2INFO_TREESTAT_WORKERS_MAX;
+
+	ret = o2info_get_treestat(om->om_path, ovf.clustersize, workers,
+				  &ots);
+	if (ret)
+		return -1;
+
+	sorted = calloc(ots.ndirs + 1, sizeof(struct o2info_dirstat *));
+	if (!sorted) {
+		o2i_error(op, "no memory for allocation\n");
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < ots.ndirs; i++) {
+		if (ots.dirs[i].files || ots.dirs[i].skipped)
+			sorted[nr++] = &ots.dirs[i];
+	}
+	qsort(sorted, nr, sizeof(struct o2info_dirstat *), tree_stat_cmp);
+
+	o2info_report_tree_stat(&ots, sorted, nr);
+
+out:
+	if (sorted)
+		free(sorted);
+	o2info_free_treestat(&ots);
+
+	return ret;
+}
+
+DEFINE_O2INFO_OP(tree_stat,
+		 tree_stat_run,
+		 NULL);
@@ -25,6 +25,8 @@
 #include <errno.h>
 #include <pwd.h>
 #include <grp.h>
+#include <assert.h>
+#include <inttypes.h>
 
 #include "ocfs2/ocfs2.h"
 #include "tools-internal/verbose.h"
@@ -484,3 +486,117 @@ int o2info_get_human_path(mode_t st_mode, const char *path, char **h_path)
 
 	return 0;
 }
+
+/*
+ * A small JSON writer for --json.  Objects and arrays nest up to
+ * O2INFO_JSON_DEPTH deep; members of an object have a key, elements of
+ * an array pass a NULL key.
+ */
+#define O2INFO_JSON_DEPTH	8
+
+static int json_depth;
+static int json_count[O2INFO_JSON_DEPTH];
+static char json_closer[O2INFO_JSON_DEPTH];
+
+static void json_put_string(const char *str)
+{
+	const unsigned char *p;
+
+	fputc('"', stdout);
+	for (p = (const unsigned char *)str; *p; p++) {
+		if ((*p == '"') || (*p == '\\'))
+			fprintf(stdout, "\\%c", *p);
+		else if (*p < 0x20)
+			fprintf(stdout, "\\u%04x", *p);
+		else
+			fputc(*p, stdout);
+	}
+	fputc('"', stdout);
+}
+
+static void json_put_key(const char *key)
+{
+	if (json_depth) {
+		if (json_count[json_depth - 1]++)
+			fputc(',', stdout);
+		fprintf(stdout, "\n%*s", json_depth * 2, "");
+	}
+
+	if (key) {
+		json_put_string(key);
+		fprintf(stdout, ": ");
+	}
+}
+
+static void json_open(const char *key, char opener, char closer)
+{
+	assert(json_depth < O2INFO_JSON_DEPTH);
+
+	json_put_key(key);
+	fputc(opener, stdout);
+	json_count[json_depth] = 0;
+	json_closer[json_depth] = closer;
+	json_depth++;
+}
+
+void o2info_json_open(const char *key)
+{
+	json_open(key, '{', '}');
+}
+
+void o2info_json_open_array(const char *key)
+{
+	json_open(key, '[', ']');
+}
+
+void o2info_json_close(void)
+{
+	assert(json_depth > 0);
+
+	json_depth--;
+	if (json_count[json_depth])
+		fprintf(stdout, "\n%*s", json_depth * 2, "");
+	fputc(json_closer[json_depth], stdout);
+	if (!json_depth)
+		fputc('\n', stdout);
+}
+
+void o2info_json_string(const char *key, const char *val)
+{
+	json_put_key(key);
+	json_put_string(val);
+}
+
+void o2info_json_int(const char *key, int64_t val)
+{
+	json_put_key(key);
+	fprintf(stdout, "%"PRId64, val);
+}
+
+void o2info_json_uint(const char *key, uint64_t val)
+{
+	json_put_key(key);
+	fprintf(stdout, "%"PRIu64, val);
+}
+
+void o2info_json_float(const char *key, double val)
+{
+	json_put_key(key);
+	fprintf(stdout, "%.2f", val);
+}
+
+/* An array of the words of a space separated list, like feature names */
+void o2info_json_words(const char *key, const char *words)
+{
+	char *dup, *word, *save = NULL;
+
+	o2info_json_open_array(key);
+	dup = strdup(words);
+	if (dup) {
+		for (word = strtok_r(dup, " ", &save); word;
+		     word = strtok_r(NULL, " ", &save))
+			o2info_json_string(NULL, word);
+		free(dup);
+	}
+	o2info_json_close();
+}
@@ -40,4 +40,13 @@ int o2info_method(const char *path);
 errcode_t o2info_open(struct o2info_method *om, int flags);
 errcode_t o2info_close(struct o2info_method *om);
 
+void o2info_json_open(const char *key);
+void o2info_json_open_array(const char *key);
+void o2info_json_close(void);
+void o2info_json_string(const char *key, const char *val);
+void o2info_json_int(const char *key, int64_t val);
+void o2info_json_uint(const char *key, uint64_t val);
+void o2info_json_float(const char *key, double val);
+void o2info_json_words(const char *key, const char *words);
+
 #endif		/* __UTILS_H__ */
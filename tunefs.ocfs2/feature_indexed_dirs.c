@@ -138,7 +138,10 @@ static int enable_indexed_dirs(ocfs2_filesys *fs, int flags)
 		goto unblock_out;
 	}
 	tools_progress_step(prog, 1);
-	ret = tunefs_foreach_inode(fs, build_dx_dir, &ctxt);
+	ret = tunefs_foreach_inode_batched(fs,
+					   TUNEFS_PREFETCH_META |
+					   TUNEFS_PREFETCH_DIRDATA,
+					   build_dx_dir, &ctxt);
 	if (ret)
 		tcom_err(ret, "while building indexed trees");
 unblock_out:
@@ -194,7 +197,8 @@ static errcode_t find_indexed_dirs(ocfs2_filesys *fs,
 		goto bail;
 	}
 
-	ret = tunefs_foreach_inode(fs, dx_dir_iterate, ctxt);
+	ret = tunefs_foreach_inode_batched(fs, TUNEFS_PREFETCH_META,
+					   dx_dir_iterate, ctxt);
 	if (ret) {
 		if (ret != TUNEFS_ET_NO_MEMORY)
 			ret = TUNEFS_ET_DX_DIRS_SCAN_FAILED;
@@ -132,7 +132,8 @@ static errcode_t find_inline_data(ocfs2_filesys *fs,
 		goto bail;
 	}
 
-	ret = tunefs_foreach_inode(fs, inline_iterate, ctxt);
+	ret = tunefs_foreach_inode_batched(fs, TUNEFS_PREFETCH_META,
+					   inline_iterate, ctxt);
 	if (ret)
 		goto bail;
 
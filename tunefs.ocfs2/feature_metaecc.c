@@ -17,9 +17,13 @@
  * General Public License for more details.
  */
 
+#define _LARGEFILE64_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <ctype.h>
 #include <inttypes.h>
@@ -42,7 +46,10 @@
  * write that last from fs->fs_super.
  *
  * We store all of this in an rb-tree of block_to_ecc structures.  We can
- * look blocks back up if needed, and we have writeback functions attached.
+ * look blocks back up if needed, and each block has a function attached
+ * that turns it into what goes on disk, ECC included.  The tree is in
+ * block order, so write_ecc_blocks() can hand runs of adjacent blocks to
+ * the disk as single writes.
  *
  * For directory inodes, we pass e_buf into tunefs_prepare_dir_trailer(),
  * which does not copy off the inode.  Thus, when
@@ -52,13 +59,45 @@
  * For directory blocks, tunefs_prepare_dir_trailer() makes its own copies.
  * After we run tunefs_install_dir_trailer(), we'll have to copy the
  * changes back to our copy.
+ *
+ * On a big volume, a copy of every metadata block will not fit in
+ * memory.  Once ae_max_buffered blocks are held, further blocks are only
+ * remembered by number and type.  They are collected into sorted runs,
+ * and each full run is written to an unlinked temporary file.  Nothing
+ * changes these blocks after we scan them, so write_ecc_blocks() merges
+ * the runs with the tree and rereads them from disk as it goes.  The
+ * inodes of directories that need trailers are always held, because the
+ * trailer code works on our copy.
  */
 struct block_to_ecc {
 	struct rb_node e_node;
 	uint64_t e_blkno;
 	struct ocfs2_dinode *e_di;
 	char *e_buf;
-	errcode_t (*e_write)(ocfs2_filesys *fs, struct block_to_ecc *block);
+	errcode_t (*e_prepare)(ocfs2_filesys *fs, struct block_to_ecc *block,
+			       char *buf);
+};
+
+enum ecc_block_type {
+	ECC_BLOCK_DINODE = 0,
+	ECC_BLOCK_EB,
+	ECC_BLOCK_GD,
+	ECC_BLOCK_DIRBLOCK,
+};
+
+/* 16MB of spilled_blocks per run */
+#define SPILL_RUN_ENTRIES	(1024 * 1024)
+/* How much of each run the merge reads at a time */
+#define SPILL_READ_ENTRIES	512
+
+struct spilled_block {
+	uint64_t sb_blkno;
+	uint32_t sb_type;
+};
+
+struct spill_run {
+	off64_t sr_offset;
+	uint64_t sr_count;
 };
 
 /*
@@ -82,6 +121,16 @@ struct add_ecc_context {
 	uint64_t ae_chaincount;
 	struct rb_root ae_blocks;
 	uint64_t ae_blockcount;
+
+	/* Blocks past ae_max_buffered are spilled */
+	uint64_t ae_max_buffered;
+	uint64_t ae_spillcount;
+	struct spilled_block *ae_run;
+	uint64_t ae_run_len;
+	struct spill_run *ae_runs;
+	int ae_nr_runs;
+	int ae_spill_fd;
+	off64_t ae_spill_size;
 };
 
 static void block_free(struct block_to_ecc *block)
@@ -156,19 +205,166 @@ static errcode_t block_insert(struct add_ecc_context *ctxt,
 	return ret;
 }
 
-static errcode_t dinode_write_func(ocfs2_filesys *fs,
-				   struct block_to_ecc *block)
+/*
+ * Leave most of the free memory alone, as fsck does.  The I/O cache has
+ * already taken its share by the time we get here.
+ */
+static void block_set_max_buffered(ocfs2_filesys *fs,
+				   struct add_ecc_context *ctxt)
+{
+	long pages = sysconf(_SC_AVPHYS_PAGES);
+
+	ctxt->ae_max_buffered = UINT64_MAX;
+	if (pages <= 0)
+		return;
+
+	ctxt->ae_max_buffered = (uint64_t)(pages / 5) * getpagesize() /
+		(fs->fs_blocksize + sizeof(struct block_to_ecc));
+	verbosef(VL_APP,
+		 "Holding up to %"PRIu64" metadata blocks in memory\n",
+		 ctxt->ae_max_buffered);
+}
+
+static int block_should_spill(struct add_ecc_context *ctxt)
+{
+	return (ctxt->ae_blockcount - ctxt->ae_spillcount) >=
+		ctxt->ae_max_buffered;
+}
+
+static int spilled_block_compare(const void *a, const void *b)
+{
+	const struct spilled_block *sa = a, *sb = b;
+
+	if (sa->sb_blkno < sb->sb_blkno)
+		return -1;
+	if (sa->sb_blkno > sb->sb_blkno)
+		return 1;
+	return 0;
+}
+
+static errcode_t spill_open(struct add_ecc_context *ctxt)
 {
-	return ocfs2_write_inode(fs, block->e_blkno, block->e_buf);
+	const char *dir = getenv("TMPDIR");
+	char path[PATH_MAX];
+
+	if (!dir || !*dir)
+		dir = "/tmp";
+	snprintf(path, sizeof(path), "%s/tunefs.metaecc.XXXXXX", dir);
+
+	ctxt->ae_spill_fd = mkstemp(path);
+	if (ctxt->ae_spill_fd < 0) {
+		verbosef(VL_APP, "Unable to create spill file in %s: %s\n",
+			 dir, strerror(errno));
+		return TUNEFS_ET_SPILL_FILE_FAILED;
+	}
+	unlink(path);
+
+	verbosef(VL_APP, "Spilling metadata block numbers to %s\n", dir);
+	return 0;
 }
 
+/* Sort the current run and append it to the spill file */
+static errcode_t spill_flush_run(struct add_ecc_context *ctxt)
+{
+	errcode_t ret;
+	char *p;
+	size_t len;
+	ssize_t wrote;
+	off64_t offset;
+	struct spill_run *run;
+
+	if (!ctxt->ae_run_len)
+		return 0;
+
+	if (ctxt->ae_spill_fd < 0) {
+		ret = spill_open(ctxt);
+		if (ret)
+			return ret;
+	}
+
+	ret = ocfs2_realloc(sizeof(struct spill_run) * (ctxt->ae_nr_runs + 1),
+			    &ctxt->ae_runs);
+	if (ret)
+		return ret;
+
+	qsort(ctxt->ae_run, ctxt->ae_run_len, sizeof(struct spilled_block),
+	      spilled_block_compare);
+
+	p = (char *)ctxt->ae_run;
+	len = ctxt->ae_run_len * sizeof(struct spilled_block);
+	offset = ctxt->ae_spill_size;
+	while (len) {
+		wrote = pwrite64(ctxt->ae_spill_fd, p, len, offset);
+		if (wrote < 0) {
+			if (errno == EINTR)
+				continue;
+			return TUNEFS_ET_SPILL_FILE_FAILED;
+		}
+		p += wrote;
+		len -= wrote;
+		offset += wrote;
+	}
+
+	run = &ctxt->ae_runs[ctxt->ae_nr_runs++];
+	run->sr_offset = ctxt->ae_spill_size;
+	run->sr_count = ctxt->ae_run_len;
+	ctxt->ae_spill_size = offset;
+	ctxt->ae_run_len = 0;
+
+	return 0;
+}
+
+static errcode_t block_spill(struct add_ecc_context *ctxt, uint64_t blkno,
+			     enum ecc_block_type type)
+{
+	errcode_t ret;
+
+	if (!ctxt->ae_run) {
+		ret = ocfs2_malloc(sizeof(struct spilled_block) *
+				   SPILL_RUN_ENTRIES, &ctxt->ae_run);
+		if (ret)
+			return ret;
+	}
+
+	if (ctxt->ae_run_len == SPILL_RUN_ENTRIES) {
+		ret = spill_flush_run(ctxt);
+		if (ret)
+			return ret;
+	}
+
+	ctxt->ae_run[ctxt->ae_run_len].sb_blkno = blkno;
+	ctxt->ae_run[ctxt->ae_run_len].sb_type = type;
+	ctxt->ae_run_len++;
+	ctxt->ae_spillcount++;
+	ctxt->ae_blockcount++;
+
+	return 0;
+}
+
+static errcode_t dinode_prepare_func(ocfs2_filesys *fs,
+				     struct block_to_ecc *block, char *buf)
+{
+	struct ocfs2_dinode *di = (struct ocfs2_dinode *)buf;
+
+	memcpy(buf, block->e_buf, fs->fs_blocksize);
+	ocfs2_swap_inode_from_cpu(fs, di);
+	ocfs2_compute_meta_ecc(fs, buf, &di->i_check);
+
+	return 0;
+}
+
+/* A held inode is never spilled */
 static errcode_t block_insert_dinode(ocfs2_filesys *fs,
 				     struct add_ecc_context *ctxt,
-				     struct ocfs2_dinode *di)
+				     struct ocfs2_dinode *di,
+				     int hold)
 {
 	errcode_t ret;
 	struct block_to_ecc *block = NULL;
 
+	if (!hold && block_should_spill(ctxt))
+		return block_spill(ctxt, di->i_blkno, ECC_BLOCK_DINODE);
+
 	ret = ocfs2_malloc0(sizeof(struct block_to_ecc), &block);
 	if (ret)
 		goto out;
@@ -180,7 +376,7 @@ static errcode_t block_insert_dinode(ocfs2_filesys *fs,
 	memcpy(block->e_buf, di, fs->fs_blocksize);
 	block->e_di = (struct ocfs2_dinode *)block->e_buf;
 	block->e_blkno = di->i_blkno;
-	block->e_write = dinode_write_func;
+	block->e_prepare = dinode_prepare_func;
 	block_insert(ctxt, block);
 
 out:
@@ -189,10 +385,16 @@ out:
 	return ret;
 }
 
-static errcode_t eb_write_func(ocfs2_filesys *fs,
-			       struct block_to_ecc *block)
+static errcode_t eb_prepare_func(ocfs2_filesys *fs,
+				 struct block_to_ecc *block, char *buf)
 {
-	return ocfs2_write_extent_block(fs, block->e_blkno, block->e_buf);
+	struct ocfs2_extent_block *eb = (struct ocfs2_extent_block *)buf;
+
+	memcpy(buf, block->e_buf, fs->fs_blocksize);
+	ocfs2_swap_extent_block_from_cpu(fs, eb);
+	ocfs2_compute_meta_ecc(fs, buf, &eb->h_check);
+
+	return 0;
 }
 
 static errcode_t block_insert_eb(ocfs2_filesys *fs,
@@ -203,6 +405,9 @@ static errcode_t block_insert_eb(ocfs2_filesys *fs,
 	errcode_t ret;
 	struct block_to_ecc *block = NULL;
 
+	if (block_should_spill(ctxt))
+		return block_spill(ctxt, eb->h_blkno, ECC_BLOCK_EB);
+
 	ret = ocfs2_malloc0(sizeof(struct block_to_ecc), &block);
 	if (ret)
 		goto out;
@@ -213,7 +418,7 @@ static errcode_t block_insert_eb(ocfs2_filesys *fs,
 
 	memcpy(block->e_buf, eb, fs->fs_blocksize);
 	block->e_blkno = eb->h_blkno;
-	block->e_write = eb_write_func;
+	block->e_prepare = eb_prepare_func;
 	block_insert(ctxt, block);
 
 out:
@@ -222,10 +427,16 @@ out:
 	return ret;
 }
 
-static errcode_t gd_write_func(ocfs2_filesys *fs,
-			       struct block_to_ecc *block)
+static errcode_t gd_prepare_func(ocfs2_filesys *fs,
+				 struct block_to_ecc *block, char *buf)
 {
-	return ocfs2_write_group_desc(fs, block->e_blkno, block->e_buf);
+	struct ocfs2_group_desc *gd = (struct ocfs2_group_desc *)buf;
+
+	memcpy(buf, block->e_buf, fs->fs_blocksize);
+	ocfs2_swap_group_desc_from_cpu(fs, gd);
+	ocfs2_compute_meta_ecc(fs, buf, &gd->bg_check);
+
+	return 0;
 }
 
 static errcode_t block_insert_gd(ocfs2_filesys *fs,
@@ -236,6 +447,9 @@ static errcode_t block_insert_gd(ocfs2_filesys *fs,
 	errcode_t ret;
 	struct block_to_ecc *block = NULL;
 
+	if (block_should_spill(ctxt))
+		return block_spill(ctxt, gd->bg_blkno, ECC_BLOCK_GD);
+
 	ret = ocfs2_malloc0(sizeof(struct block_to_ecc), &block);
 	if (ret)
 		goto out;
@@ -246,7 +460,7 @@ static errcode_t block_insert_gd(ocfs2_filesys *fs,
 
 	memcpy(block->e_buf, gd, fs->fs_blocksize);
 	block->e_blkno = gd->bg_blkno;
-	block->e_write = gd_write_func;
+	block->e_prepare = gd_prepare_func;
 	block_insert(ctxt, block);
 
 out:
@@ -255,11 +469,29 @@ out:
 	return ret;
 }
 
-static errcode_t dirblock_write_func(ocfs2_filesys *fs,
-				     struct block_to_ecc *block)
+/*
+ * Every dirblock we store has a trailer by the time it is written, so
+ * unlike ocfs2_write_dir_block() we don't need to check.  Only the
+ * check field changes, so the names in the dentry cache stay good and
+ * the directory isn't invalidated either.
+ */
+static errcode_t dirblock_prepare_func(ocfs2_filesys *fs,
+				       struct block_to_ecc *block, char *buf)
 {
-	return ocfs2_write_dir_block(fs, block->e_di, block->e_blkno,
-				     block->e_buf);
+	errcode_t ret;
+	struct ocfs2_dir_block_trailer *trailer;
+
+	memcpy(buf, block->e_buf, fs->fs_blocksize);
+	ret = ocfs2_swap_dir_entries_from_cpu(buf,
+					      ocfs2_dir_trailer_blk_off(fs));
+	if (ret)
+		return ret;
+
+	trailer = ocfs2_dir_trailer_from_block(fs, buf);
+	ocfs2_swap_dir_trailer(trailer);
+	ocfs2_compute_meta_ecc(fs, buf, &trailer->db_check);
+
+	return 0;
 }
 
 static errcode_t block_insert_dirblock(ocfs2_filesys *fs,
@@ -270,6 +502,9 @@ static errcode_t block_insert_dirblock(ocfs2_filesys *fs,
 	errcode_t ret;
 	struct block_to_ecc *block = NULL;
 
+	if (block_should_spill(ctxt))
+		return block_spill(ctxt, blkno, ECC_BLOCK_DIRBLOCK);
+
 	ret = ocfs2_malloc0(sizeof(struct block_to_ecc), &block);
 	if (ret)
 		goto out;
@@ -279,9 +514,8 @@ static errcode_t block_insert_dirblock(ocfs2_filesys *fs,
 		goto out;
 
 	memcpy(block->e_buf, buf, fs->fs_blocksize);
-	block->e_di = di;
 	block->e_blkno = blkno;
-	block->e_write = dirblock_write_func;
+	block->e_prepare = dirblock_prepare_func;
 	block_insert(ctxt, block);
 
 out:
@@ -339,6 +573,13 @@ static void empty_add_ecc_context(struct add_ecc_context *ctxt)
 	}
 
 	empty_ecc_blocks(ctxt);
+
+	if (ctxt->ae_run)
+		ocfs2_free(&ctxt->ae_run);
+	if (ctxt->ae_runs)
+		ocfs2_free(&ctxt->ae_runs);
+	if (ctxt->ae_spill_fd >= 0)
+		close(ctxt->ae_spill_fd);
 }
 
 struct add_ecc_iterate {
@@ -390,10 +631,13 @@ static int dirdata_iterate(ocfs2_filesys *fs, struct ocfs2_extent_rec *rec,
 	struct add_ecc_iterate *iter = priv_data;
 	char *buf = NULL;
 	struct ocfs2_extent_block *eb;
-	int iret = 0;
-	uint64_t blocks, i;
+	int iret = 0, good;
+	uint64_t blocks, i, j, count, vblk, size_blocks;
+	errcode_t err;
+	/* Directory data is read a megabyte at a time */
+	int batch = ocfs2_blocks_in_bytes(fs, 1024 * 1024);
 
-	ret = ocfs2_malloc_block(fs->fs_io, &buf);
+	ret = ocfs2_malloc_blocks(fs->fs_io, batch, &buf);
 	if (ret)
 		goto out;
 
@@ -407,18 +651,37 @@ static int dirdata_iterate(ocfs2_filesys *fs, struct ocfs2_extent_rec *rec,
 
 		ret = block_insert_eb(fs, iter->ic_ctxt, iter->ic_di, eb);
 	} else {
+		/*
+		 * The blocks past i_size in the last cluster are unused
+		 * and don't validate as directory blocks, so stop there.
+		 */
+		vblk = ocfs2_clusters_to_blocks(fs, rec->e_cpos);
+		size_blocks = ocfs2_blocks_in_bytes(fs, iter->ic_di->i_size);
+		if (vblk >= size_blocks)
+			goto out;
 		blocks = ocfs2_clusters_to_blocks(fs, rec->e_leaf_clusters);
-		for (i = 0; i < blocks; i++) {
-			ret = ocfs2_read_dir_block(fs, iter->ic_di,
-						   rec->e_blkno + i, buf);
-			if (ret)
-				break;
-
-			ret = block_insert_dirblock(fs, iter->ic_ctxt,
-						    iter->ic_di,
-						    rec->e_blkno + i, buf);
-			if (ret)
+		if (blocks > size_blocks - vblk)
+			blocks = size_blocks - vblk;
+
+		for (i = 0; i < blocks; i += count) {
+			count = ocfs2_min(blocks - i, (uint64_t)batch);
+			err = ocfs2_read_dir_blocks(fs, iter->ic_di,
+						    rec->e_blkno + i, count,
+						    buf, &good);
+
+			/* The blocks ahead of a bad one still get stored */
+			for (j = 0; j < good; j++) {
+				ret = block_insert_dirblock(fs, iter->ic_ctxt,
+						iter->ic_di, rec->e_blkno + i + j,
+						buf + j * fs->fs_blocksize);
+				if (ret)
+					goto out;
+			}
+
+			if (err) {
+				ret = err;
 				break;
+			}
 		}
 	}
 
@@ -480,7 +743,6 @@ static errcode_t find_chain_blocks(ocfs2_filesys *fs,
 	struct list_head *pos;
 	struct chain_to_ecc *cte;
 	struct ocfs2_dinode *di;
-	struct block_to_ecc *block;
 	char *buf = NULL;
 	struct tools_progress *prog;
 	struct add_ecc_iterate iter = {
@@ -505,24 +767,16 @@ static errcode_t find_chain_blocks(ocfs2_filesys *fs,
 			break;
 
 		di = (struct ocfs2_dinode *)buf;
-		ret = block_insert_dinode(fs, ctxt, di);
+		ret = block_insert_dinode(fs, ctxt, di, 0);
 		if (ret)
 			break;
 
-		/* We need the inode, look it back up */
-		block = block_lookup(ctxt, di->i_blkno);
-		if (!block) {
-			ret = TUNEFS_ET_INTERNAL_FAILURE;
-			break;
-		}
-
-		/* Now using our copy of the inode */
-		di = (struct ocfs2_dinode *)block->e_buf;
-		assert(di->i_blkno == cte->ce_blkno);
-
 		iter.ic_di = di;
 		ret = ocfs2_chain_iterate(fs, di->i_blkno, chain_iterate,
 					  &iter);
+		/* An aborted iteration returns 0, the error is in ae_ret */
+		if (!ret)
+			ret = ctxt->ae_ret;
 		if (ret)
 			break;
 		tools_progress_step(prog, 1);
@@ -542,6 +796,7 @@ static errcode_t inode_iterate(ocfs2_filesys *fs, struct ocfs2_dinode *di,
 			       void *user_data)
 {
 	errcode_t ret;
+	int needs_trailer;
 	struct block_to_ecc *block = NULL;
 	struct tunefs_trailer_context *tc;
 	struct add_ecc_context *ctxt = user_data;
@@ -558,26 +813,32 @@ static errcode_t inode_iterate(ocfs2_filesys *fs, struct ocfs2_dinode *di,
 		goto out;
 	}
 
-	ret = block_insert_dinode(fs, ctxt, di);
-	if (ret)
-		goto out;
-
 	/* These inodes have no other metadata on them */
 	if ((di->i_flags & (OCFS2_SUPER_BLOCK_FL | OCFS2_LOCAL_ALLOC_FL |
 			    OCFS2_DEALLOC_FL)) ||
 	    (S_ISLNK(di->i_mode) && di->i_clusters == 0) ||
-	    (di->i_dyn_features & OCFS2_INLINE_DATA_FL))
+	    (di->i_dyn_features & OCFS2_INLINE_DATA_FL)) {
+		ret = block_insert_dinode(fs, ctxt, di, 0);
 		goto out;
+	}
 
-	/* We need the inode, look it back up */
-	block = block_lookup(ctxt, di->i_blkno);
-	if (!block) {
-		ret = TUNEFS_ET_INTERNAL_FAILURE;
+	/* A directory that needs trailers is changed through our copy */
+	needs_trailer = S_ISDIR(di->i_mode) && !ocfs2_dir_has_trailer(fs, di);
+	ret = block_insert_dinode(fs, ctxt, di, needs_trailer);
+	if (ret)
 		goto out;
-	}
 
-	/* Now using our copy of the inode */
-	di = (struct ocfs2_dinode *)block->e_buf;
+	if (needs_trailer) {
+		/* We need the inode, look it back up */
+		block = block_lookup(ctxt, di->i_blkno);
+		if (!block) {
+			ret = TUNEFS_ET_INTERNAL_FAILURE;
+			goto out;
+		}
+
+		/* Now using our copy of the inode */
+		di = (struct ocfs2_dinode *)block->e_buf;
+	}
 	iter.ic_di = di;
 
 	/*
@@ -610,6 +871,8 @@ static errcode_t inode_iterate(ocfs2_filesys *fs, struct ocfs2_dinode *di,
 							 tc->d_blocks_needed);
 		}
 	}
+	if (!ret)
+		ret = ctxt->ae_ret;
 
 out:
 	tools_progress_step(ctxt->ae_prog, 1);
@@ -629,7 +892,10 @@ static errcode_t find_blocks(ocfs2_filesys *fs, struct add_ecc_context *ctxt)
 		goto bail;
 	}
 
-	ret = tunefs_foreach_inode(fs, inode_iterate, ctxt);
+	ret = tunefs_foreach_inode_batched(fs,
+					   TUNEFS_PREFETCH_META |
+					   TUNEFS_PREFETCH_DIRDATA,
+					   inode_iterate, ctxt);
 	if (ret)
 		goto bail;
 	tools_progress_stop(ctxt->ae_prog);
@@ -688,6 +954,8 @@ static errcode_t install_trailers(ocfs2_filesys *fs,
 		 */
 		ret = ocfs2_extent_iterate_inode(fs, tc->d_di, 0, NULL,
 						 dirdata_iterate, &iter);
+		if (!ret)
+			ret = ctxt->ae_ret;
 		if (ret)
 			break;
 
@@ -698,34 +966,446 @@ static errcode_t install_trailers(ocfs2_filesys *fs,
 	return ret;
 }
 
+/*
+ * Blocks are prepared into a batch buffer in block order.  Each run of
+ * adjacent blocks becomes one io_vec_unit, and the whole batch is handed
+ * to io_vec_write_blocks() at once.  Spilled blocks get a slot in the
+ * batch too; they are read into it just before the batch is written.
+ */
+#define ECC_WRITE_BATCH_BYTES	(4 * 1024 * 1024)
+#define ECC_WRITE_MAX_RUNS	256
+#define ECC_SLOT_PREPARED	(-1)
+
+struct ecc_write_batch {
+	char *wb_buf;
+	int wb_max_blocks;
+	int wb_nr_blocks;
+	int wb_nr_runs;
+	struct io_vec_unit wb_runs[ECC_WRITE_MAX_RUNS];
+
+	/* ECC_SLOT_PREPARED, or the type of a block to reread */
+	int *wb_slots;
+	struct io_vec_unit *wb_reads;
+};
+
+/* Fill in the ECC of a spilled block we just read back */
+static void spilled_block_ecc(ocfs2_filesys *fs, int type, char *buf)
+{
+	struct ocfs2_block_check *bc;
+
+	switch (type) {
+	case ECC_BLOCK_DINODE:
+		bc = &((struct ocfs2_dinode *)buf)->i_check;
+		break;
+	case ECC_BLOCK_EB:
+		bc = &((struct ocfs2_extent_block *)buf)->h_check;
+		break;
+	case ECC_BLOCK_GD:
+		bc = &((struct ocfs2_group_desc *)buf)->bg_check;
+		break;
+	case ECC_BLOCK_DIRBLOCK:
+	default:
+		bc = &ocfs2_dir_trailer_from_block(fs, buf)->db_check;
+		break;
+	}
+
+	ocfs2_compute_meta_ecc(fs, buf, bc);
+}
+
+static errcode_t ecc_write_batch_reread(ocfs2_filesys *fs,
+					struct ecc_write_batch *wb)
+{
+	errcode_t ret;
+	int i, j, slot, nr_reads = 0;
+	struct io_vec_unit *run, *read;
+
+	/*
+	 * The slots of a run are adjacent on disk, so each stretch of
+	 * spilled slots within a run is a single read.
+	 */
+	for (i = 0; i < wb->wb_nr_runs; i++) {
+		run = &wb->wb_runs[i];
+		slot = (run->ivu_buf - wb->wb_buf) / fs->fs_blocksize;
+		read = NULL;
+
+		for (j = 0; j < (run->ivu_buflen / fs->fs_blocksize);
+		     j++, slot++) {
+			if (wb->wb_slots[slot] == ECC_SLOT_PREPARED) {
+				read = NULL;
+				continue;
+			}
+
+			if (!read) {
+				read = &wb->wb_reads[nr_reads++];
+				read->ivu_blkno = run->ivu_blkno + j;
+				read->ivu_buf = wb->wb_buf +
+					(slot * fs->fs_blocksize);
+				read->ivu_buflen = 0;
+			}
+			read->ivu_buflen += fs->fs_blocksize;
+		}
+	}
+
+	if (!nr_reads)
+		return 0;
+
+	ret = io_vec_read_blocks(fs->fs_io, wb->wb_reads, nr_reads);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < wb->wb_nr_blocks; i++)
+		if (wb->wb_slots[i] != ECC_SLOT_PREPARED)
+			spilled_block_ecc(fs, wb->wb_slots[i],
+					  wb->wb_buf + (i * fs->fs_blocksize));
+
+	return 0;
+}
+
+static errcode_t ecc_write_batch_flush(ocfs2_filesys *fs,
+				       struct ecc_write_batch *wb)
+{
+	errcode_t ret;
+
+	if (!wb->wb_nr_runs)
+		return 0;
+
+	ret = ecc_write_batch_reread(fs, wb);
+	if (ret)
+		return ret;
+
+	verbosef(VL_DEBUG,
+		 "Writing %d blocks in %d runs starting at block %"PRIu64"\n",
+		 wb->wb_nr_blocks, wb->wb_nr_runs, wb->wb_runs[0].ivu_blkno);
+
+	tunefs_block_signals();
+	ret = io_vec_write_blocks(fs->fs_io, wb->wb_runs, wb->wb_nr_runs);
+	tunefs_unblock_signals();
+	if (!ret)
+		fs->fs_flags |= OCFS2_FLAG_CHANGED;
+
+	wb->wb_nr_blocks = 0;
+	wb->wb_nr_runs = 0;
+
+	return ret;
+}
+
+/* block is NULL for a spilled block of the given type */
+static errcode_t ecc_write_batch_add(ocfs2_filesys *fs,
+				     struct ecc_write_batch *wb,
+				     uint64_t blkno,
+				     struct block_to_ecc *block,
+				     int type)
+{
+	errcode_t ret;
+	int contig = 0;
+	struct io_vec_unit *run = NULL;
+
+	if (wb->wb_nr_runs) {
+		run = &wb->wb_runs[wb->wb_nr_runs - 1];
+		contig = (blkno ==
+			  run->ivu_blkno + (run->ivu_buflen / fs->fs_blocksize));
+	}
+
+	if ((wb->wb_nr_blocks == wb->wb_max_blocks) ||
+	    (!contig && (wb->wb_nr_runs == ECC_WRITE_MAX_RUNS))) {
+		ret = ecc_write_batch_flush(fs, wb);
+		if (ret)
+			return ret;
+		contig = 0;
+	}
+
+	if (!contig) {
+		run = &wb->wb_runs[wb->wb_nr_runs++];
+		run->ivu_blkno = blkno;
+		run->ivu_buf = wb->wb_buf +
+			(wb->wb_nr_blocks * fs->fs_blocksize);
+		run->ivu_buflen = 0;
+	}
+
+	if (block) {
+		ret = block->e_prepare(fs, block,
+				       wb->wb_buf +
+				       (wb->wb_nr_blocks * fs->fs_blocksize));
+		if (ret)
+			return ret;
+		wb->wb_slots[wb->wb_nr_blocks] = ECC_SLOT_PREPARED;
+	} else
+		wb->wb_slots[wb->wb_nr_blocks] = type;
+
+	run->ivu_buflen += fs->fs_blocksize;
+	wb->wb_nr_blocks++;
+
+	return 0;
+}
+
+/*
+ * A k-way merge of the spill runs.  Each run has a cursor reading
+ * SPILL_READ_ENTRIES at a time, and the cursors sit in a min-heap on
+ * their current block number.
+ */
+struct spill_cursor {
+	struct spill_run *sc_run;
+	uint64_t sc_done;		/* entries read from the run */
+	int sc_nr, sc_next;
+	struct spilled_block *sc_buf;
+};
+
+struct spill_merge {
+	int sm_fd;
+	int sm_nr;			/* cursors still in the heap */
+	int sm_nr_cursors;
+	struct spill_cursor *sm_cursors;
+	struct spill_cursor **sm_heap;
+};
+
+static errcode_t spill_cursor_fill(struct spill_merge *sm,
+				   struct spill_cursor *sc)
+{
+	char *p;
+	size_t len;
+	ssize_t got;
+	off64_t offset;
+	uint64_t count = sc->sc_run->sr_count - sc->sc_done;
+
+	if (count > SPILL_READ_ENTRIES)
+		count = SPILL_READ_ENTRIES;
+
+	p = (char *)sc->sc_buf;
+	len = count * sizeof(struct spilled_block);
+	offset = sc->sc_run->sr_offset +
+		sc->sc_done * sizeof(struct spilled_block);
+	while (len) {
+		got = pread64(sm->sm_fd, p, len, offset);
+		if (got < 0) {
+			if (errno == EINTR)
+				continue;
+			return TUNEFS_ET_SPILL_FILE_FAILED;
+		}
+		if (!got)
+			return TUNEFS_ET_SPILL_FILE_FAILED;
+		p += got;
+		len -= got;
+		offset += got;
+	}
+
+	sc->sc_done += count;
+	sc->sc_nr = count;
+	sc->sc_next = 0;
+
+	return 0;
+}
+
+static uint64_t spill_cursor_blkno(struct spill_cursor *sc)
+{
+	return sc->sc_buf[sc->sc_next].sb_blkno;
+}
+
+static void spill_heap_down(struct spill_merge *sm, int i)
+{
+	int child;
+	struct spill_cursor *tmp;
+
+	while ((child = (2 * i) + 1) < sm->sm_nr) {
+		if ((child + 1 < sm->sm_nr) &&
+		    (spill_cursor_blkno(sm->sm_heap[child + 1]) <
+		     spill_cursor_blkno(sm->sm_heap[child])))
+			child++;
+		if (spill_cursor_blkno(sm->sm_heap[i]) <=
+		    spill_cursor_blkno(sm->sm_heap[child]))
+			break;
+
+		tmp = sm->sm_heap[i];
+		sm->sm_heap[i] = sm->sm_heap[child];
+		sm->sm_heap[child] = tmp;
+		i = child;
+	}
+}
+
+static void spill_merge_exit(struct spill_merge *sm)
+{
+	int i;
+
+	if (sm->sm_cursors) {
+		for (i = 0; i < sm->sm_nr_cursors; i++)
+			if (sm->sm_cursors[i].sc_buf)
+				ocfs2_free(&sm->sm_cursors[i].sc_buf);
+		ocfs2_free(&sm->sm_cursors);
+	}
+	if (sm->sm_heap)
+		ocfs2_free(&sm->sm_heap);
+}
+
+static errcode_t spill_merge_init(struct add_ecc_context *ctxt,
+				  struct spill_merge *sm)
+{
+	errcode_t ret;
+	int i;
+
+	memset(sm, 0, sizeof(struct spill_merge));
+
+	/* Whatever is left in memory becomes the last run */
+	ret = spill_flush_run(ctxt);
+	if (ret)
+		return ret;
+
+	if (!ctxt->ae_nr_runs)
+		return 0;
+
+	sm->sm_fd = ctxt->ae_spill_fd;
+	ret = ocfs2_malloc0(sizeof(struct spill_cursor) * ctxt->ae_nr_runs,
+			    &sm->sm_cursors);
+	if (ret)
+		goto out;
+	sm->sm_nr_cursors = ctxt->ae_nr_runs;
+
+	ret = ocfs2_malloc0(sizeof(struct spill_cursor *) * ctxt->ae_nr_runs,
+			    &sm->sm_heap);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < ctxt->ae_nr_runs; i++) {
+		ret = ocfs2_malloc(sizeof(struct spilled_block) *
+				   SPILL_READ_ENTRIES,
+				   &sm->sm_cursors[i].sc_buf);
+		if (ret)
+			goto out;
+
+		sm->sm_cursors[i].sc_run = &ctxt->ae_runs[i];
+		ret = spill_cursor_fill(sm, &sm->sm_cursors[i]);
+		if (ret)
+			goto out;
+		sm->sm_heap[i] = &sm->sm_cursors[i];
+		sm->sm_nr++;
+	}
+
+	for (i = (sm->sm_nr / 2) - 1; i >= 0; i--)
+		spill_heap_down(sm, i);
+
+out:
+	if (ret)
+		spill_merge_exit(sm);
+	return ret;
+}
+
+/* Returns the smallest spilled block left, or NULL */
+static struct spilled_block *spill_merge_peek(struct spill_merge *sm)
+{
+	struct spill_cursor *sc;
+
+	if (!sm->sm_nr)
+		return NULL;
+
+	sc = sm->sm_heap[0];
+	return &sc->sc_buf[sc->sc_next];
+}
+
+static errcode_t spill_merge_next(struct spill_merge *sm)
+{
+	errcode_t ret;
+	struct spill_cursor *sc = sm->sm_heap[0];
+
+	sc->sc_next++;
+	if (sc->sc_next == sc->sc_nr) {
+		if (sc->sc_done < sc->sc_run->sr_count) {
+			ret = spill_cursor_fill(sm, sc);
+			if (ret)
+				return ret;
+		} else {
+			/* This run is done */
+			sm->sm_nr--;
+			sm->sm_heap[0] = sm->sm_heap[sm->sm_nr];
+		}
+	}
+
+	spill_heap_down(sm, 0);
+	return 0;
+}
+
 static errcode_t write_ecc_blocks(ocfs2_filesys *fs,
 				  struct add_ecc_context *ctxt)
 {
 	errcode_t ret = 0;
 	struct rb_node *n;
 	struct block_to_ecc *block;
+	struct spilled_block *sb;
 	struct tools_progress *prog;
+	struct ecc_write_batch wb;
+	struct spill_merge sm;
+	uint64_t last_blkno = 0;
+
+	ret = spill_merge_init(ctxt, &sm);
+	if (ret)
+		return ret;
+
+	memset(&wb, 0, sizeof(wb));
+	wb.wb_max_blocks = ocfs2_blocks_in_bytes(fs, ECC_WRITE_BATCH_BYTES);
+	ret = ocfs2_malloc_blocks(fs->fs_io, wb.wb_max_blocks, &wb.wb_buf);
+	if (!ret)
+		ret = ocfs2_malloc(sizeof(int) * wb.wb_max_blocks,
+				   &wb.wb_slots);
+	if (!ret)
+		ret = ocfs2_malloc(sizeof(struct io_vec_unit) *
+				   wb.wb_max_blocks, &wb.wb_reads);
+	if (ret)
+		goto out;
 
 	prog = tools_progress_start("Writing blocks", "ECC",
 				    ctxt->ae_blockcount);
-	if (!prog)
-		return TUNEFS_ET_NO_MEMORY;
+	if (!prog) {
+		ret = TUNEFS_ET_NO_MEMORY;
+		goto out;
+	}
 
 	n = rb_first(&ctxt->ae_blocks);
-	while (n) {
-		block = rb_entry(n, struct block_to_ecc, e_node);
-		verbosef(VL_DEBUG, "Writing block %"PRIu64"\n",
-			 block->e_blkno);
+	sb = spill_merge_peek(&sm);
+	while (n || sb) {
+		if (n) {
+			block = rb_entry(n, struct block_to_ecc, e_node);
+			if (!sb || (block->e_blkno <= sb->sb_blkno)) {
+				verbosef(VL_DEBUG, "Preparing block %"PRIu64"\n",
+					 block->e_blkno);
+				ret = ecc_write_batch_add(fs, &wb,
+							  block->e_blkno,
+							  block, 0);
+				last_blkno = block->e_blkno;
+				n = rb_next(n);
+				tools_progress_step(prog, 1);
+				if (ret)
+					break;
+				continue;
+			}
+		}
 
-		tools_progress_step(prog, 1);
-		ret = block->e_write(fs, block);
+		/* A block we hold wins over a spilled copy */
+		if (sb->sb_blkno != last_blkno) {
+			verbosef(VL_DEBUG, "Rereading block %"PRIu64"\n",
+				 sb->sb_blkno);
+			ret = ecc_write_batch_add(fs, &wb, sb->sb_blkno, NULL,
+						  sb->sb_type);
+			last_blkno = sb->sb_blkno;
+			tools_progress_step(prog, 1);
+			if (ret)
+				break;
+		}
+
+		ret = spill_merge_next(&sm);
 		if (ret)
 			break;
-
-		n = rb_next(n);
+		sb = spill_merge_peek(&sm);
 	}
+	if (!ret)
+		ret = ecc_write_batch_flush(fs, &wb);
 	tools_progress_stop(prog);
 
+out:
+	if (wb.wb_reads)
+		ocfs2_free(&wb.wb_reads);
+	if (wb.wb_slots)
+		ocfs2_free(&wb.wb_slots);
+	if (wb.wb_buf)
+		ocfs2_free(&wb.wb_buf);
+	spill_merge_exit(&sm);
+
 	return ret;
 }
 
@@ -759,6 +1439,8 @@ static int enable_metaecc(ocfs2_filesys *fs, int flags)
 	INIT_LIST_HEAD(&ctxt.ae_dirs);
 	INIT_LIST_HEAD(&ctxt.ae_chains);
 	ctxt.ae_blocks = RB_ROOT;
+	ctxt.ae_spill_fd = -1;
+	block_set_max_buffered(fs, &ctxt);
 	ret = find_blocks(fs, &ctxt);
 	if (ret) {
 		if (ret == OCFS2_ET_NO_SPACE)
@@ -276,7 +276,8 @@ static errcode_t find_refcounted_files(ocfs2_filesys *fs,
 		goto bail;
 	}
 
-	ret = tunefs_foreach_inode(fs, refcount_iterate, ctxt);
+	ret = tunefs_foreach_inode_batched(fs, TUNEFS_PREFETCH_META,
+					   refcount_iterate, ctxt);
 	if (ret)
 		goto bail;
 
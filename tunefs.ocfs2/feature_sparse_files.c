@@ -138,7 +138,8 @@ static int enable_sparse_files(ocfs2_filesys *fs, int flags)
 		goto out;
 	}
 
-	ret = tunefs_foreach_inode(fs, truncate_to_i_size, prog);
+	ret = tunefs_foreach_inode_batched(fs, TUNEFS_PREFETCH_META,
+					   truncate_to_i_size, prog);
 	if (ret) {
 		tcom_err(ret,
 			 "while trying to remove any extraneous allocation");
@@ -354,7 +355,8 @@ static errcode_t find_sparse_files(ocfs2_filesys *fs,
 		goto bail;
 	}
 
-	ret = tunefs_foreach_inode(fs, hole_iterate, ctxt);
+	ret = tunefs_foreach_inode_batched(fs, TUNEFS_PREFETCH_META,
+					   hole_iterate, ctxt);
 	if (ret)
 		goto bail;
 
@@ -381,8 +383,73 @@ bail:
 	return ret;
 }
 
-static errcode_t fill_one_hole(ocfs2_filesys *fs, struct sparse_file *file,
-			       struct hole_list *hole)
+/*
+ * One allocation made to fill (part of) a hole.  ocfs2_new_clusters()
+ * may not find a hole's worth of contiguous space, so a hole can need
+ * more than one of these; last_piece marks the one that finishes it.
+ */
+struct hole_fill {
+	struct sparse_file *file;
+	uint32_t cpos;
+	uint32_t clusters;
+	uint64_t p_blkno;
+	int last_piece;
+};
+
+/*
+ * Holes are filled a batch of files at a time.  First we allocate
+ * clusters for every hole in the batch.  Then all of those clusters are
+ * zeroed in one sorted pass, and finally the extents are inserted.  The
+ * last step only touches metadata.
+ *
+ * Until its extent is inserted, an allocated cluster is only known to
+ * the batch.  Signals are blocked from the first allocation of a batch
+ * until its last insert, or until release_batch() gives the clusters
+ * back, so an interrupt can't leak them.
+ */
+#define FILL_BATCH_PIECES	4096
+
+struct fill_batch {
+	struct hole_fill *fills;
+	int used;
+	int alloced;
+	int inserted;
+	struct tunefs_zero_list zeroes;
+};
+
+static errcode_t add_fill(ocfs2_filesys *fs, struct fill_batch *batch,
+			  struct sparse_file *file, uint32_t cpos,
+			  uint64_t p_blkno, uint32_t clusters)
+{
+	errcode_t ret;
+	struct hole_fill *fill;
+
+	if (batch->used == batch->alloced) {
+		ret = ocfs2_realloc(sizeof(struct hole_fill) *
+				    (batch->alloced + 256),
+				    &batch->fills);
+		if (ret)
+			return ret;
+		batch->alloced += 256;
+	}
+
+	ret = tunefs_zero_list_add(fs, &batch->zeroes, p_blkno, clusters);
+	if (ret)
+		return ret;
+
+	fill = &batch->fills[batch->used++];
+	fill->file = file;
+	fill->cpos = cpos;
+	fill->clusters = clusters;
+	fill->p_blkno = p_blkno;
+	fill->last_piece = 0;
+
+	return 0;
+}
+
+static errcode_t alloc_one_hole(ocfs2_filesys *fs, struct sparse_file *file,
+				struct hole_list *hole,
+				struct fill_batch *batch)
 {
 	errcode_t ret = 0;
 	uint32_t start = hole->start;
@@ -391,7 +458,6 @@ static errcode_t fill_one_hole(ocfs2_filesys *fs, struct sparse_file *file,
 	uint64_t p_start;
 
 	while (len) {
-		tunefs_block_signals();
 		ret = ocfs2_new_clusters(fs, 1, len,
 					 &p_start, &n_clusters);
 		if ((!ret && (n_clusters == 0)) ||
@@ -400,29 +466,24 @@ static errcode_t fill_one_hole(ocfs2_filesys *fs, struct sparse_file *file,
 		if (ret)
 			break;
 
-		ret = tunefs_empty_clusters(fs, p_start, n_clusters);
-		if (ret)
-			break;
-
-		ret = ocfs2_inode_insert_extent(fs, file->blkno,
-					  start, p_start,
-					  n_clusters, 0);
-		if (ret)
+		ret = add_fill(fs, batch, file, start, p_start, n_clusters);
+		if (ret) {
+			ocfs2_free_clusters(fs, n_clusters, p_start);
 			break;
+		}
 
 		len -= n_clusters;
 		start += n_clusters;
-		tunefs_unblock_signals();
 	}
 
-	if (ret)
-		tunefs_unblock_signals();
+	if (!ret && hole->len)
+		batch->fills[batch->used - 1].last_piece = 1;
 
 	return ret;
 }
 
-static errcode_t fill_one_file(ocfs2_filesys *fs, struct sparse_file *file,
-			       struct tools_progress *prog)
+static errcode_t alloc_one_file(ocfs2_filesys *fs, struct sparse_file *file,
+				struct fill_batch *batch)
 {
 	errcode_t ret = 0;
 	struct hole_list *hole;
@@ -430,10 +491,94 @@ static errcode_t fill_one_file(ocfs2_filesys *fs, struct sparse_file *file,
 
 	list_for_each(pos, &file->holes) {
 		hole = list_entry(pos, struct hole_list, list);
-		ret = fill_one_hole(fs, file, hole);
+		ret = alloc_one_hole(fs, file, hole, batch);
+		if (ret)
+			break;
+	}
+
+	return ret;
+}
+
+static errcode_t fill_batch_holes(ocfs2_filesys *fs,
+				  struct fill_batch *batch,
+				  struct tools_progress *prog)
+{
+	errcode_t ret;
+	struct hole_fill *fill;
+
+	ret = tunefs_zero_list_run(fs, &batch->zeroes);
+	if (ret)
+		return ret;
+
+	while (batch->inserted < batch->used) {
+		fill = &batch->fills[batch->inserted];
+		ret = ocfs2_inode_insert_extent(fs, fill->file->blkno,
+						fill->cpos, fill->p_blkno,
+						fill->clusters, 0);
 		if (ret)
 			break;
-		tools_progress_step(prog, 1);
+
+		batch->inserted++;
+		if (fill->last_piece)
+			tools_progress_step(prog, 1);
+	}
+
+	return ret;
+}
+
+/* Give back any clusters we allocated but never got into a file */
+static void release_batch(ocfs2_filesys *fs, struct fill_batch *batch)
+{
+	struct hole_fill *fill;
+
+	tunefs_block_signals();
+	while (batch->inserted < batch->used) {
+		fill = &batch->fills[batch->inserted++];
+		ocfs2_free_clusters(fs, fill->clusters, fill->p_blkno);
+	}
+	tunefs_unblock_signals();
+
+	batch->used = 0;
+	batch->inserted = 0;
+}
+
+/* Truncate and charge quota for a file whose holes are filled */
+static errcode_t finish_one_file(ocfs2_filesys *fs, struct sparse_file *file,
+				 char *buf, ocfs2_quota_hash *usrhash,
+				 ocfs2_quota_hash *grphash,
+				 struct tools_progress *prog)
+{
+	errcode_t ret;
+	struct ocfs2_dinode *di;
+	struct ocfs2_super_block *super = OCFS2_RAW_SB(fs->fs_super);
+	long long change;
+
+	if (!file->truncate && !usrhash && !grphash)
+		return 0;
+
+	ret = ocfs2_read_inode(fs, file->blkno, buf);
+	if (ret)
+		return ret;
+	di = (struct ocfs2_dinode *)buf;
+	if (file->truncate) {
+		ret = truncate_to_i_size(fs, di, prog);
+		if (ret)
+			return ret;
+	}
+	if (di->i_clusters != file->old_clusters &&
+	    (!(di->i_flags & OCFS2_SYSTEM_FL) ||
+	    file->blkno == super->s_root_blkno)) {
+		if (di->i_clusters > file->old_clusters) {
+			change = ocfs2_clusters_to_bytes(fs,
+				di->i_clusters - file->old_clusters);
+		} else {
+			change = -ocfs2_clusters_to_bytes(fs,
+				file->old_clusters - di->i_clusters);
+		}
+
+		ret = ocfs2_apply_quota_change(fs, usrhash, grphash,
+					       di->i_uid, di->i_gid,
+					       change, 0);
 	}
 
 	return ret;
@@ -443,13 +588,15 @@ static errcode_t fill_sparse_files(ocfs2_filesys *fs,
 				   struct fill_hole_context *ctxt)
 {
 	errcode_t ret = 0, err;
+	int blocked = 0;
 	char *buf = NULL;
-	struct ocfs2_dinode *di = NULL;
-	struct list_head *pos;
+	struct list_head *pos, *first;
 	struct sparse_file *file;
 	struct tools_progress *prog;
+	struct fill_batch batch;
 	ocfs2_quota_hash *usrhash = NULL, *grphash = NULL;
-	struct ocfs2_super_block *super = OCFS2_RAW_SB(fs->fs_super);
+
+	memset(&batch, 0, sizeof(batch));
 
 	prog = tools_progress_start("Filling holes", "filling",
 				    ctxt->holecount);
@@ -471,46 +618,46 @@ static errcode_t fill_sparse_files(ocfs2_filesys *fs,
 	if (ret)
 		goto out;
 
-	/* Iterate all the holes and fill them. */
+	/* Iterate all the holes and fill them, a batch at a time. */
+	first = ctxt->files.next;
 	list_for_each(pos, &ctxt->files) {
 		file = list_entry(pos, struct sparse_file, list);
-		ret = fill_one_file(fs, file, prog);
+		if (!blocked) {
+			tunefs_block_signals();
+			blocked = 1;
+		}
+		ret = alloc_one_file(fs, file, &batch);
 		if (ret)
 			break;
 
-		if (!file->truncate && !usrhash && !grphash)
+		if ((batch.used < FILL_BATCH_PIECES) &&
+		    (pos->next != &ctxt->files))
 			continue;
 
-		ret = ocfs2_read_inode(fs, file->blkno, buf);
+		ret = fill_batch_holes(fs, &batch, prog);
 		if (ret)
 			break;
-		di = (struct ocfs2_dinode *)buf;
-		if (file->truncate) {
-			ret = truncate_to_i_size(fs, di, prog);
-			if (ret)
-				break;
-		}
-		if (di->i_clusters != file->old_clusters &&
-		    (!(di->i_flags & OCFS2_SYSTEM_FL) ||
-		    file->blkno == super->s_root_blkno)) {
-			long long change;
-
-			if (di->i_clusters > file->old_clusters) {
-				change = ocfs2_clusters_to_bytes(fs,
-					di->i_clusters - file->old_clusters);
-			} else {
-				change = -ocfs2_clusters_to_bytes(fs,
-					file->old_clusters - di->i_clusters);
-			}
-
-			ret = ocfs2_apply_quota_change(fs, usrhash, grphash,
-						       di->i_uid, di->i_gid,
-						       change, 0);
+		batch.used = 0;
+		batch.inserted = 0;
+		tunefs_unblock_signals();
+		blocked = 0;
+
+		for (; first != pos->next; first = first->next) {
+			file = list_entry(first, struct sparse_file, list);
+			ret = finish_one_file(fs, file, buf, usrhash, grphash,
+					      prog);
 			if (ret)
 				break;
 		}
+		if (ret)
+			break;
 	}
 
+	if (ret)
+		release_batch(fs, &batch);
+	if (blocked)
+		tunefs_unblock_signals();
+
 	ocfs2_free(&buf);
 
 out:
@@ -518,6 +665,10 @@ out:
 	if (!ret)
 		ret = err;
 
+	tunefs_zero_list_free(&batch.zeroes);
+	if (batch.fills)
+		ocfs2_free(&batch.fills);
+
 	if (prog)
 		tools_progress_stop(prog);
 
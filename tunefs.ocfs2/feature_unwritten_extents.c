@@ -78,6 +78,96 @@ out:
 	return ret;
 }
 
+/*
+ * Unwritten extents are cleared in batches.  The inode scan only notes
+ * where they are.  Once a batch is full, all of its extents are zeroed
+ * in one sorted pass and then marked written, which touches only
+ * metadata.
+ */
+#define UNWRITTEN_BATCH		4096
+
+struct unwritten_extent {
+	uint64_t ino;
+	uint32_t cpos;
+	uint32_t clusters;
+	uint64_t p_blkno;
+};
+
+struct unwritten_context {
+	struct tools_progress *prog;
+	struct unwritten_extent *extents;
+	int used;
+	int alloced;
+	struct tunefs_zero_list zeroes;
+	char *buf;
+};
+
+static errcode_t add_unwritten_extent(ocfs2_filesys *fs,
+				      struct unwritten_context *ctxt,
+				      uint64_t ino, uint32_t cpos,
+				      uint64_t p_blkno, uint32_t clusters)
+{
+	errcode_t ret;
+	struct unwritten_extent *ue;
+
+	if (ctxt->used == ctxt->alloced) {
+		ret = ocfs2_realloc(sizeof(struct unwritten_extent) *
+				    (ctxt->alloced + 256),
+				    &ctxt->extents);
+		if (ret)
+			return ret;
+		ctxt->alloced += 256;
+	}
+
+	ret = tunefs_zero_list_add(fs, &ctxt->zeroes, p_blkno, clusters);
+	if (ret)
+		return ret;
+
+	ue = &ctxt->extents[ctxt->used++];
+	ue->ino = ino;
+	ue->cpos = cpos;
+	ue->clusters = clusters;
+	ue->p_blkno = p_blkno;
+
+	return 0;
+}
+
+static errcode_t write_unwritten_extents(ocfs2_filesys *fs,
+					 struct unwritten_context *ctxt)
+{
+	errcode_t ret;
+	int i;
+	uint64_t ino = 0;
+	struct unwritten_extent *ue;
+	struct ocfs2_dinode *di = (struct ocfs2_dinode *)ctxt->buf;
+
+	ret = tunefs_zero_list_run(fs, &ctxt->zeroes);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < ctxt->used; i++) {
+		ue = &ctxt->extents[i];
+		if (ue->ino != ino) {
+			ret = ocfs2_read_inode(fs, ue->ino, ctxt->buf);
+			if (ret)
+				break;
+			ino = ue->ino;
+		}
+
+		tunefs_block_signals();
+		ret = ocfs2_mark_extent_written(fs, di, ue->cpos,
+						ue->clusters, ue->p_blkno);
+		tunefs_unblock_signals();
+		if (ret)
+			break;
+		tools_progress_step(ctxt->prog, 1);
+	}
+
+out:
+	ctxt->used = 0;
+	return ret;
+}
+
 static errcode_t unwritten_iterate(ocfs2_filesys *fs,
 				   struct ocfs2_dinode *di,
 				   void *user_data)
@@ -87,7 +177,7 @@ static errcode_t unwritten_iterate(ocfs2_filesys *fs,
 	uint16_t extent_flags;
 	uint64_t p_blkno;
 	ocfs2_cached_inode *ci = NULL;
-	struct tools_progress *prog = user_data;
+	struct unwritten_context *ctxt = user_data;
 
 	if (!S_ISREG(di->i_mode))
 		goto bail;
@@ -114,29 +204,25 @@ static errcode_t unwritten_iterate(ocfs2_filesys *fs,
 
 		if (extent_flags & OCFS2_EXT_UNWRITTEN) {
 			p_blkno = ocfs2_clusters_to_blocks(fs, p_cluster);
-			ret = tunefs_empty_clusters(fs, p_blkno,
-						    num_clusters);
-			if (ret)
-				break;
-
-			tools_progress_step(prog, 1);
-			tunefs_block_signals();
-			ret = ocfs2_mark_extent_written(fs, di, v_cluster,
-							num_clusters,
-							p_blkno);
-			tunefs_unblock_signals();
+			ret = add_unwritten_extent(fs, ctxt, di->i_blkno,
+						   v_cluster, p_blkno,
+						   num_clusters);
 			if (ret)
 				break;
-			tools_progress_step(prog, 1);
+			tools_progress_step(ctxt->prog, 1);
 		}
 
 		v_cluster += num_clusters;
 	}
 
+	/* Flush between inodes, so an inode is never split across batches */
+	if (!ret && (ctxt->used >= UNWRITTEN_BATCH))
+		ret = write_unwritten_extents(fs, ctxt);
+
 bail:
 	if (ci)
 		ocfs2_free_cached_inode(fs, ci);
-	tools_progress_step(prog, 1);
+	tools_progress_step(ctxt->prog, 1);
 
 	return ret;
 }
@@ -144,7 +230,27 @@ bail:
 static errcode_t clear_unwritten_extents(ocfs2_filesys *fs,
 					 struct tools_progress *prog)
 {
-	return tunefs_foreach_inode(fs, unwritten_iterate, prog);
+	errcode_t ret;
+	struct unwritten_context ctxt;
+
+	memset(&ctxt, 0, sizeof(ctxt));
+	ctxt.prog = prog;
+
+	ret = ocfs2_malloc_block(fs->fs_io, &ctxt.buf);
+	if (ret)
+		return ret;
+
+	ret = tunefs_foreach_inode_batched(fs, TUNEFS_PREFETCH_META,
+					   unwritten_iterate, &ctxt);
+	if (!ret)
+		ret = write_unwritten_extents(fs, &ctxt);
+
+	tunefs_zero_list_free(&ctxt.zeroes);
+	if (ctxt.extents)
+		ocfs2_free(&ctxt.extents);
+	ocfs2_free(&ctxt.buf);
+
+	return ret;
 }
 
 static int disable_unwritten_extents(ocfs2_filesys *fs, int flags)
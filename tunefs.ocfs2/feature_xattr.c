@@ -411,7 +411,8 @@ static int disable_xattr(ocfs2_filesys *fs, int flag)
 		goto out;
 	}
 	INIT_LIST_HEAD(&ctxt.inodes);
-	ret = tunefs_foreach_inode(fs, xattr_iterate, &ctxt);
+	ret = tunefs_foreach_inode_batched(fs, TUNEFS_PREFETCH_META,
+					   xattr_iterate, &ctxt);
 	tools_progress_stop(ctxt.prog);
 	if (ret) {
 		tcom_err(ret, "while trying to find files with"
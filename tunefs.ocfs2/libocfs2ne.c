@@ -455,40 +455,96 @@ bail:
 
 errcode_t tunefs_empty_clusters(ocfs2_filesys *fs, uint64_t start_blk,
 				uint32_t num_clusters)
+{
+	return io_zero_blocks(fs->fs_io, start_blk,
+			      ocfs2_clusters_to_blocks(fs, num_clusters));
+}
+
+errcode_t tunefs_zero_list_add(ocfs2_filesys *fs, struct tunefs_zero_list *zl,
+			       uint64_t start_blk, uint32_t num_clusters)
 {
 	errcode_t ret;
-	char *buf = NULL;
-	uint64_t bpc = ocfs2_clusters_to_blocks(fs, 1);
-	uint64_t total_blocks = ocfs2_clusters_to_blocks(fs, num_clusters);
-	uint64_t io_blocks = total_blocks;
+	struct tunefs_zero_run *run;
 
-	ret = ocfs2_malloc_blocks(fs->fs_io, io_blocks, &buf);
-	if (ret == OCFS2_ET_NO_MEMORY) {
-		io_blocks = bpc;
-		ret = ocfs2_malloc_blocks(fs->fs_io, io_blocks, &buf);
+	if (zl->zl_used == zl->zl_alloced) {
+		ret = ocfs2_realloc(sizeof(struct tunefs_zero_run) *
+				    (zl->zl_alloced + 256),
+				    &zl->zl_runs);
+		if (ret)
+			return ret;
+		zl->zl_alloced += 256;
 	}
-	if (ret)
-		goto bail;
 
-	memset(buf, 0, io_blocks * fs->fs_blocksize);
+	run = &zl->zl_runs[zl->zl_used++];
+	run->zr_blkno = start_blk;
+	run->zr_blocks = ocfs2_clusters_to_blocks(fs, num_clusters);
+
+	return 0;
+}
+
+static int tunefs_zero_run_compare(const void *a, const void *b)
+{
+	const struct tunefs_zero_run *l = a, *r = b;
+
+	if (l->zr_blkno < r->zr_blkno)
+		return -1;
+	if (l->zr_blkno > r->zr_blkno)
+		return 1;
+	return 0;
+}
+
+/*
+ * Zero everything on the list in disk order.  io_zero_blocks() hands
+ * each merged run to the device as a single request where it can, and
+ * falls back to large async writes where it can't.  The list is emptied
+ * whether or not we succeed.
+ */
+errcode_t tunefs_zero_list_run(ocfs2_filesys *fs, struct tunefs_zero_list *zl)
+{
+	errcode_t ret = 0;
+	int i;
+	uint64_t blkno, blocks;
 
-	while (total_blocks) {
-		ret = io_write_block_nocache(fs->fs_io, start_blk,
-					     io_blocks, buf);
+	if (!zl->zl_used)
+		return 0;
+
+	qsort(zl->zl_runs, zl->zl_used, sizeof(struct tunefs_zero_run),
+	      tunefs_zero_run_compare);
+
+	blkno = zl->zl_runs[0].zr_blkno;
+	blocks = zl->zl_runs[0].zr_blocks;
+	for (i = 1; i < zl->zl_used; i++) {
+		if (zl->zl_runs[i].zr_blkno <= blkno + blocks) {
+			if (zl->zl_runs[i].zr_blkno +
+			    zl->zl_runs[i].zr_blocks > blkno + blocks)
+				blocks = zl->zl_runs[i].zr_blkno +
+					zl->zl_runs[i].zr_blocks - blkno;
+			continue;
+		}
+
+		ret = io_zero_blocks(fs->fs_io, blkno, blocks);
 		if (ret)
-			goto bail;
+			goto out;
 
-		total_blocks -= io_blocks;
-		start_blk += io_blocks;
+		blkno = zl->zl_runs[i].zr_blkno;
+		blocks = zl->zl_runs[i].zr_blocks;
 	}
 
-bail:
-	if (buf)
-		ocfs2_free(&buf);
+	ret = io_zero_blocks(fs->fs_io, blkno, blocks);
 
+out:
+	zl->zl_used = 0;
 	return ret;
 }
 
+void tunefs_zero_list_free(struct tunefs_zero_list *zl)
+{
+	if (zl->zl_runs)
+		ocfs2_free(&zl->zl_runs);
+	zl->zl_used = 0;
+	zl->zl_alloced = 0;
+}
+
 errcode_t tunefs_get_free_clusters(ocfs2_filesys *fs, uint32_t *clusters)
 {
 	errcode_t ret;
@@ -536,28 +592,172 @@ static errcode_t tunefs_validate_inode(ocfs2_filesys *fs,
 	return 0;
 }
 
-errcode_t tunefs_foreach_inode(ocfs2_filesys *fs,
-			       errcode_t (*func)(ocfs2_filesys *fs,
-						 struct ocfs2_dinode *di,
-						 void *user_data),
-			       void *user_data)
+/*
+ * Batched inode walking.
+ *
+ * tunefs_foreach_inode_batched() pulls up to TUNEFS_INODE_BATCH valid
+ * inodes off the scan, then gathers the metadata blocks their
+ * callbacks are going to read: first-level extent blocks, xattr
+ * blocks, indexed dir roots, refcount roots and, if asked, directory
+ * data.  Those are sorted, merged into contiguous runs and read with
+ * one vectored I/O, which warms the I/O cache.  Then the callbacks run
+ * in scan order and find their blocks in the cache.
+ *
+ * The callbacks still run one at a time, so anything they do to the
+ * allocators is serialized just like with tunefs_foreach_inode().
+ * Prefetching is only a hint.  If it fails, the callbacks will do
+ * their own reads and see any real error.
+ */
+#define TUNEFS_INODE_BATCH	64
+
+struct tunefs_prefetch {
+	int			tp_flags;
+	uint64_t		*tp_blknos;
+	int			tp_count;
+	int			tp_max;
+	struct io_vec_unit	*tp_ivus;
+	char			*tp_buf;
+};
+
+static void tunefs_prefetch_add(struct tunefs_prefetch *tp, uint64_t blkno,
+				uint64_t count)
+{
+	while (count-- && (tp->tp_count < tp->tp_max) && blkno)
+		tp->tp_blknos[tp->tp_count++] = blkno++;
+}
+
+static void tunefs_prefetch_inode(ocfs2_filesys *fs,
+				  struct tunefs_prefetch *tp,
+				  struct ocfs2_dinode *di)
+{
+	int i;
+	struct ocfs2_extent_list *el = &di->id2.i_list;
+	struct ocfs2_extent_rec *rec;
+
+	if ((di->i_dyn_features & OCFS2_HAS_XATTR_FL) && di->i_xattr_loc)
+		tunefs_prefetch_add(tp, di->i_xattr_loc, 1);
+	if ((di->i_dyn_features & OCFS2_INDEXED_DIR_FL) && di->i_dx_root)
+		tunefs_prefetch_add(tp, di->i_dx_root, 1);
+	if ((di->i_dyn_features & OCFS2_HAS_REFCOUNT_FL) &&
+	    di->i_refcount_loc)
+		tunefs_prefetch_add(tp, di->i_refcount_loc, 1);
+
+	/* Only plain extent lists from here on */
+	if (di->i_flags & (OCFS2_CHAIN_FL | OCFS2_LOCAL_ALLOC_FL |
+			   OCFS2_DEALLOC_FL))
+		return;
+	if (di->i_dyn_features & OCFS2_INLINE_DATA_FL)
+		return;
+	if (S_ISLNK(di->i_mode) && !di->i_clusters)
+		return;
+
+	for (i = 0; (i < el->l_next_free_rec) && (i < el->l_count); i++) {
+		rec = &el->l_recs[i];
+		if (el->l_tree_depth)
+			tunefs_prefetch_add(tp, rec->e_blkno, 1);
+		else if (S_ISDIR(di->i_mode) &&
+			 (tp->tp_flags & TUNEFS_PREFETCH_DIRDATA))
+			tunefs_prefetch_add(tp, rec->e_blkno,
+				ocfs2_clusters_to_blocks(fs,
+							 rec->e_leaf_clusters));
+	}
+}
+
+static int tunefs_prefetch_compare(const void *a, const void *b)
+{
+	const uint64_t *l = a, *r = b;
+
+	if (*l < *r)
+		return -1;
+	return *l > *r;
+}
+
+static void tunefs_prefetch_read(ocfs2_filesys *fs,
+				 struct tunefs_prefetch *tp)
 {
 	errcode_t ret;
+	int i, nr_ivus = 0;
 	uint64_t blkno;
-	char *buf;
+	char *p = tp->tp_buf;
+	struct io_vec_unit *ivu = NULL;
+
+	qsort(tp->tp_blknos, tp->tp_count, sizeof(uint64_t),
+	      tunefs_prefetch_compare);
+
+	for (i = 0; i < tp->tp_count; i++) {
+		blkno = tp->tp_blknos[i];
+		if ((blkno <= OCFS2_SUPER_BLOCK_BLKNO) ||
+		    (blkno >= fs->fs_blocks))
+			continue;
+
+		if (ivu) {
+			uint64_t end = ivu->ivu_blkno +
+				ivu->ivu_buflen / fs->fs_blocksize;
+
+			/* Shared blocks (refcount trees) show up twice */
+			if (blkno < end)
+				continue;
+			if (blkno == end) {
+				ivu->ivu_buflen += fs->fs_blocksize;
+				p += fs->fs_blocksize;
+				continue;
+			}
+		}
+
+		ivu = &tp->tp_ivus[nr_ivus++];
+		ivu->ivu_blkno = blkno;
+		ivu->ivu_buf = p;
+		ivu->ivu_buflen = fs->fs_blocksize;
+		p += fs->fs_blocksize;
+	}
+
+	tp->tp_count = 0;
+	if (!nr_ivus)
+		return;
+
+	ret = io_vec_read_blocks(fs->fs_io, tp->tp_ivus, nr_ivus);
+	if (ret)
+		verbosef(VL_LIB, "%s while prefetching inode metadata\n",
+			 error_message(ret));
+}
+
+errcode_t tunefs_foreach_inode_batched(ocfs2_filesys *fs, int flags,
+				       errcode_t (*func)(ocfs2_filesys *fs,
+							 struct ocfs2_dinode *di,
+							 void *user_data),
+				       void *user_data)
+{
+	errcode_t ret, err;
+	uint64_t blkno;
+	char *buf = NULL;
 	struct ocfs2_dinode *di;
 	ocfs2_inode_scan *scan;
+	struct tunefs_prefetch tp = {
+		.tp_flags = flags,
+	};
+	int i, nr, done = 0, batch = 1;
 
-	ret = ocfs2_malloc_block(fs->fs_io, &buf);
+	if (flags)
+		batch = TUNEFS_INODE_BATCH;
+
+	ret = ocfs2_malloc_blocks(fs->fs_io, batch, &buf);
+	if (!ret && flags) {
+		tp.tp_max = ocfs2_blocks_in_bytes(fs, 1024 * 1024);
+		ret = ocfs2_malloc_blocks(fs->fs_io, tp.tp_max, &tp.tp_buf);
+		if (!ret)
+			ret = ocfs2_malloc0(sizeof(uint64_t) * tp.tp_max,
+					    &tp.tp_blknos);
+		if (!ret)
+			ret = ocfs2_malloc0(sizeof(struct io_vec_unit) *
+					    tp.tp_max, &tp.tp_ivus);
+	}
 	if (ret) {
 		verbosef(VL_LIB,
 			 "%s while allocating a buffer for inode scanning\n",
 			 error_message(ret));
-		goto out;
+		goto out_free;
 	}
 
-	di = (struct ocfs2_dinode *)buf;
-
 	ret = ocfs2_open_inode_scan(fs, &scan);
 	if (ret) {
 		verbosef(VL_LIB,
@@ -566,35 +766,74 @@ errcode_t tunefs_foreach_inode(ocfs2_filesys *fs,
 		goto out_free;
 	}
 
-	for(;;) {
-		ret = ocfs2_get_next_inode(scan, &blkno, buf);
-		if (ret) {
-			verbosef(VL_LIB, "%s while getting next inode\n",
-				 error_message(ret));
-			break;
-		}
-		if (blkno == 0)
-			break;
+	while (!done) {
+		/* Fill a batch of valid inodes */
+		for (nr = 0; nr < batch; ) {
+			di = (struct ocfs2_dinode *)(buf +
+						     nr * fs->fs_blocksize);
+			ret = ocfs2_get_next_inode(scan, &blkno, (char *)di);
+			if (ret) {
+				verbosef(VL_LIB,
+					 "%s while getting next inode\n",
+					 error_message(ret));
+				done = 1;
+				break;
+			}
+			if (blkno == 0) {
+				done = 1;
+				break;
+			}
 
-		ret = tunefs_validate_inode(fs, di);
-		if (ret)
-			continue;
+			if (tunefs_validate_inode(fs, di))
+				continue;
 
-		if (func) {
-			ret = func(fs, di, user_data);
-			if (ret)
+			nr++;
+			if (flags) {
+				tunefs_prefetch_inode(fs, &tp, di);
+				if (tp.tp_count >= tp.tp_max)
+					break;
+			}
+		}
+
+		if (tp.tp_count)
+			tunefs_prefetch_read(fs, &tp);
+
+		/* A scan error stops us after the inodes we already have */
+		for (i = 0; func && (i < nr); i++) {
+			di = (struct ocfs2_dinode *)(buf +
+						     i * fs->fs_blocksize);
+			err = func(fs, di, user_data);
+			if (err) {
+				ret = err;
+				done = 1;
 				break;
+			}
 		}
 	}
 
 	ocfs2_close_inode_scan(scan);
 out_free:
-	ocfs2_free(&buf);
+	if (tp.tp_ivus)
+		ocfs2_free(&tp.tp_ivus);
+	if (tp.tp_blknos)
+		ocfs2_free(&tp.tp_blknos);
+	if (tp.tp_buf)
+		ocfs2_free(&tp.tp_buf);
+	if (buf)
+		ocfs2_free(&buf);
 
-out:
 	return ret;
 }
 
+errcode_t tunefs_foreach_inode(ocfs2_filesys *fs,
+			       errcode_t (*func)(ocfs2_filesys *fs,
+						 struct ocfs2_dinode *di,
+						 void *user_data),
+			       void *user_data)
+{
+	return tunefs_foreach_inode_batched(fs, 0, func, user_data);
+}
+
 /* A dirblock we have to add a trailer to */
 struct tunefs_trailer_dirblock {
 	struct list_head db_list;
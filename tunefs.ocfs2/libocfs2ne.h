@@ -231,6 +231,29 @@ errcode_t tunefs_get_free_clusters(ocfs2_filesys *fs, uint32_t *clusters);
 errcode_t tunefs_empty_clusters(ocfs2_filesys *fs, uint64_t start_blk,
 				uint32_t num_clusters);
 
+/*
+ * A list of extents waiting to be zeroed.  Callers that convert many
+ * extents add them as they find them and zero the lot with one
+ * tunefs_zero_list_run().  That sorts the extents by disk offset and
+ * merges neighbours, so the device sees a few large zeroing requests
+ * instead of one per extent.
+ */
+struct tunefs_zero_run {
+	uint64_t zr_blkno;
+	uint64_t zr_blocks;
+};
+
+struct tunefs_zero_list {
+	struct tunefs_zero_run *zl_runs;
+	int zl_used;
+	int zl_alloced;
+};
+
+errcode_t tunefs_zero_list_add(ocfs2_filesys *fs, struct tunefs_zero_list *zl,
+			       uint64_t start_blk, uint32_t num_clusters);
+errcode_t tunefs_zero_list_run(ocfs2_filesys *fs, struct tunefs_zero_list *zl);
+void tunefs_zero_list_free(struct tunefs_zero_list *zl);
+
 /* Tell tunefs that you updated the filesystem size */
 void tunefs_update_fs_clusters(ocfs2_filesys *fs);
 
@@ -256,6 +279,20 @@ errcode_t tunefs_foreach_inode(ocfs2_filesys *fs,
 						 struct ocfs2_dinode *di,
 						 void *user_data),
 			       void *user_data);
+/*
+ * Like tunefs_foreach_inode(), but inodes are handed to func() in
+ * batches.  With TUNEFS_PREFETCH_META, the metadata blocks hanging off
+ * each inode of a batch are read into the I/O cache with one vectored
+ * I/O before func() is called.  TUNEFS_PREFETCH_DIRDATA adds the data
+ * blocks of directories with a flat extent list.
+ */
+#define TUNEFS_PREFETCH_META		0x01
+#define TUNEFS_PREFETCH_DIRDATA		0x02
+errcode_t tunefs_foreach_inode_batched(ocfs2_filesys *fs, int flags,
+				       errcode_t (*func)(ocfs2_filesys *fs,
+							 struct ocfs2_dinode *di,
+							 void *user_data),
+				       void *user_data);
 
 /* Functions used by the core program sources */
 
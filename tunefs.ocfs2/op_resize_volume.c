@@ -24,11 +24,14 @@
 #include <string.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <errno.h>
 #include <sys/ioctl.h>
+#include <libaio.h>
 
 #include "o2dlm/o2dlm.h"
 #include "ocfs2/ocfs2.h"
 #include "ocfs2/bitops.h"
+#include "tools-internal/discard.h"
 
 #include "libocfs2ne.h"
 
@@ -133,44 +136,250 @@ out:
 	return ret;
 }
 
-static errcode_t online_resize_group_add(ocfs2_filesys *fs,
-					 struct ocfs2_dinode *di,
-					 uint64_t gd_blkno,
-					 char *gd_buf,
-					 uint16_t chain,
-					 uint32_t new_clusters)
+/*
+ * New groups are set up a batch at a time.  The first cluster of each
+ * group, with the descriptor in its first block, is built in memory and
+ * goes out as a single write, and the whole batch is in flight at once.
+ * The chain records are updated as each descriptor is built.
+ *
+ * An online resize has the kernel link each group with a GROUP_ADD
+ * ioctl, which wants the descriptor on disk already.  Those ioctls are
+ * issued for one batch while the writes of the next are in flight.
+ *
+ * The writes go straight to the device.  Everything past the old end
+ * of the volume is new to us, so no cached block can go stale.
+ */
+#define RESIZE_BATCH_GROUPS	256
+#define RESIZE_BATCH_BYTES	(16 * 1024 * 1024)
+
+struct resize_group {
+	uint64_t rg_blkno;
+	uint32_t rg_clusters;
+	uint32_t rg_frees;	/* online only */
+	uint16_t rg_chain;
+};
+
+struct resize_batch {
+	int rb_nr;
+	char *rb_buf;		/* one cluster per group */
+	struct resize_group rb_groups[RESIZE_BATCH_GROUPS];
+	struct io_vec_unit rb_ivus[RESIZE_BATCH_GROUPS];
+	struct iocb rb_iocbs[RESIZE_BATCH_GROUPS];
+	struct iocb *rb_iocbps[RESIZE_BATCH_GROUPS];
+	int rb_in_flight;
+};
+
+struct resize_writer {
+	ocfs2_filesys *rw_fs;
+	io_context_t rw_ctx;	/* NULL means write synchronously */
+	int rw_max;
+	struct resize_batch rw_batches[2];
+};
+
+static errcode_t resize_writer_init(ocfs2_filesys *fs,
+				    struct resize_writer *rw)
+{
+	int i;
+	errcode_t ret = 0;
+
+	memset(rw, 0, sizeof(struct resize_writer));
+	rw->rw_fs = fs;
+	rw->rw_max = RESIZE_BATCH_BYTES / fs->fs_clustersize;
+	if (rw->rw_max > RESIZE_BATCH_GROUPS)
+		rw->rw_max = RESIZE_BATCH_GROUPS;
+	if (!rw->rw_max)
+		rw->rw_max = 1;
+
+	for (i = 0; i < 2; i++) {
+		ret = ocfs2_malloc_blocks(fs->fs_io,
+					  ocfs2_clusters_to_blocks(fs,
+								   rw->rw_max),
+					  &rw->rw_batches[i].rb_buf);
+		if (ret)
+			return ret;
+	}
+
+	/* Without aio we still get one vectored write per batch */
+	if (io_queue_init(rw->rw_max, &rw->rw_ctx))
+		rw->rw_ctx = NULL;
+
+	return 0;
+}
+
+static void resize_writer_exit(struct resize_writer *rw)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		if (rw->rw_batches[i].rb_buf)
+			ocfs2_free(&rw->rw_batches[i].rb_buf);
+
+	if (rw->rw_ctx)
+		io_queue_release(rw->rw_ctx);
+}
+
+/*
+ * Build the next group of the new range into buf and link it into its
+ * chain record.  buf is left in disk order, ready to be written.
+ */
+static errcode_t resize_build_group(ocfs2_filesys *fs,
+				    struct ocfs2_dinode *di,
+				    struct resize_group *rg,
+				    char *buf,
+				    uint32_t *total_bits,
+				    uint32_t *used_bits,
+				    int online)
 {
 	errcode_t ret;
-	uint16_t backups = 0, cl_bpc = di->id2.i_chain.cl_bpc;
-	struct ocfs2_group_desc *gd = (struct ocfs2_group_desc *)gd_buf;
+	uint16_t backups = 0;
+	struct ocfs2_chain_list *cl = &di->id2.i_chain;
+	struct ocfs2_chain_rec *cr;
+	struct ocfs2_group_desc *gd = (struct ocfs2_group_desc *)buf;
+
+	memset(buf, 0, fs->fs_clustersize);
+	ocfs2_init_group_desc(fs, gd, rg->rg_blkno,
+			      fs->fs_super->i_fs_generation, di->i_blkno,
+			      (rg->rg_clusters * cl->cl_bpc), rg->rg_chain, 0);
+
+	/* Add group to chain */
+	cr = &(cl->cl_recs[rg->rg_chain]);
+	if (rg->rg_chain >= cl->cl_next_free_rec) {
+		cl->cl_next_free_rec++;
+		cr->c_free = 0;
+		cr->c_total = 0;
+		cr->c_blkno = 0;
+	}
+
+	gd->bg_next_group = cr->c_blkno;
+	cr->c_blkno = rg->rg_blkno;
+	cr->c_free += gd->bg_free_bits_count;
+	cr->c_total += gd->bg_bits;
+
+	*used_bits += (gd->bg_bits - gd->bg_free_bits_count);
+	*total_bits += gd->bg_bits;
+
+	if (online) {
+		ret = reserve_backup_in_group(fs, di, gd, &backups);
+		if (ret) {
+			tcom_err(ret,
+				 "while reserving the backup superblocks in "
+				 "the cluster group at block %"PRIu64,
+				 rg->rg_blkno);
+			return ret;
+		}
+		/* free clusters is checked again in the kernel */
+		rg->rg_frees = gd->bg_bits / cl->cl_bpc - 1 - backups;
+	}
+
+	ocfs2_swap_group_desc_from_cpu(fs, gd);
+	ocfs2_compute_meta_ecc(fs, buf, &gd->bg_check);
+
+	return 0;
+}
+
+static errcode_t resize_submit_batch(struct resize_writer *rw,
+				     struct resize_batch *rb)
+{
+	int i, done, rc;
+	ocfs2_filesys *fs = rw->rw_fs;
+	int fd = io_get_fd(fs->fs_io);
+
+	if (!rw->rw_ctx) {
+		for (i = 0; i < rb->rb_nr; i++) {
+			rb->rb_ivus[i].ivu_blkno = rb->rb_groups[i].rg_blkno;
+			rb->rb_ivus[i].ivu_buf = rb->rb_buf +
+				(i * fs->fs_clustersize);
+			rb->rb_ivus[i].ivu_buflen = fs->fs_clustersize;
+		}
+		return io_vec_write_blocks(fs->fs_io, rb->rb_ivus, rb->rb_nr);
+	}
+
+	for (i = 0; i < rb->rb_nr; i++) {
+		io_prep_pwrite(&rb->rb_iocbs[i], fd,
+			       rb->rb_buf + (i * fs->fs_clustersize),
+			       fs->fs_clustersize,
+			       rb->rb_groups[i].rg_blkno * fs->fs_blocksize);
+		rb->rb_iocbps[i] = &rb->rb_iocbs[i];
+	}
+
+	for (done = 0; done < rb->rb_nr; done += rc) {
+		rc = io_submit(rw->rw_ctx, rb->rb_nr - done,
+			       rb->rb_iocbps + done);
+		if (rc <= 0)
+			break;
+		rb->rb_in_flight += rc;
+	}
+
+	return (done < rb->rb_nr) ? OCFS2_ET_IO : 0;
+}
+
+static errcode_t resize_reap_batch(struct resize_writer *rw,
+				   struct resize_batch *rb)
+{
+	int i, rc;
+	errcode_t ret = 0;
+	struct io_event events[RESIZE_BATCH_GROUPS];
+
+	while (rb->rb_in_flight) {
+		rc = io_getevents(rw->rw_ctx, rb->rb_in_flight,
+				  rb->rb_in_flight, events, NULL);
+		if (rc == -EINTR)
+			continue;
+		if (rc <= 0)
+			return OCFS2_ET_IO;
+
+		for (i = 0; i < rc; i++) {
+			if ((long)events[i].res < 0)
+				ret = OCFS2_ET_IO;
+			else if (events[i].res != events[i].obj->u.c.nbytes)
+				ret = OCFS2_ET_SHORT_WRITE;
+		}
+		rb->rb_in_flight -= rc;
+	}
+
+	return ret;
+}
+
+/*
+ * The groups of rb are on disk.  Account for them and, when online,
+ * hand them to the kernel.
+ */
+static errcode_t resize_add_batch(ocfs2_filesys *fs,
+				  struct resize_batch *rb,
+				  int online)
+{
+	int i;
+	errcode_t ret = 0;
+	struct resize_group *rg;
 	struct ocfs2_new_group_input input;
 
-	ret = reserve_backup_in_group(fs, di, gd, &backups);
-	if (ret)
-		goto out;
+	for (i = 0; i < rb->rb_nr; i++) {
+		rg = &rb->rb_groups[i];
 
-	ret = ocfs2_write_group_desc(fs, gd_blkno, gd_buf);
-	if (ret)
-		goto out;
+		fs->fs_clusters += rg->rg_clusters;
+		fs->fs_blocks += ocfs2_clusters_to_blocks(fs, rg->rg_clusters);
+		fs->fs_flags |= OCFS2_FLAG_CHANGED;
 
-	/*
-	 * Initialize the input data and call online resize procedure.
-	 * free clusters is calculated accordingly and checked in the kernel.
-	 */
-	memset(&input, 0, sizeof(input));
+		if (!online)
+			continue;
 
-	input.group = gd_blkno;
-	input.clusters = new_clusters;
-	input.chain = chain;
-	input.frees = gd->bg_bits/cl_bpc - 1 - backups;
+		memset(&input, 0, sizeof(input));
+		input.group = rg->rg_blkno;
+		input.clusters = rg->rg_clusters;
+		input.chain = rg->rg_chain;
+		input.frees = rg->rg_frees;
+
+		ret = tunefs_online_ioctl(fs, OCFS2_IOC_GROUP_ADD, &input);
+		if (ret) {
+			tcom_err(ret,
+				 "while asking the kernel to link the group at "
+				 "block %"PRIu64" to chain %u",
+				 rg->rg_blkno, rg->rg_chain);
+			break;
+		}
+		tunefs_update_fs_clusters(fs);
+	}
 
-	ret = tunefs_online_ioctl(fs, OCFS2_IOC_GROUP_ADD, &input);
-	if (ret)
-		tcom_err(ret,
-			 "while asking the kernel to link the group at "
-			 "block %"PRIu64" to chain %u",
-			 gd_blkno, chain);
-out:
 	return ret;
 }
 
@@ -193,106 +402,79 @@ static errcode_t init_new_gd(ocfs2_filesys *fs,
 			     uint32_t *used_bits,
 			     int online)
 {
-	errcode_t ret = 0;
-	uint32_t cluster_chunk;
-	uint64_t gd_blkno = 0;
+	errcode_t ret, tmp;
+	int cur = 0;
 	struct ocfs2_chain_list *cl = &di->id2.i_chain;
-	struct ocfs2_chain_rec *cr = NULL;
-	struct ocfs2_group_desc *gd = NULL;
-	char *zero_buf = NULL;
-	char *gd_buf = NULL;
-
-	ret = ocfs2_malloc_block(fs->fs_io, &gd_buf);
-	if (ret) {
-		tcom_err(ret, "while allocating a group descriptor buffer");
-		goto bail;
-	}
+	struct resize_writer rw;
+	struct resize_batch *rb, *prev = NULL;
+	struct resize_group *rg;
 
-	ret = ocfs2_malloc_blocks(fs->fs_io, ocfs2_clusters_to_blocks(fs, 1),
-				  &zero_buf);
+	ret = resize_writer_init(fs, &rw);
 	if (ret) {
-		tcom_err(ret, "while allocating a zeroing buffer");
+		tcom_err(ret, "while allocating the group buffers");
 		goto bail;
 	}
 
-	memset(zero_buf, 0, fs->fs_clustersize);
-	gd = (struct ocfs2_group_desc *)gd_buf;
-
-	while(num_new_clusters) {
-		gd_blkno = ocfs2_which_cluster_group(fs, cl->cl_cpg,
-						     first_new_cluster);
-		cluster_chunk = ocfs2_min(num_new_clusters,
-					  (uint32_t)cl->cl_cpg);
-		num_new_clusters -= cluster_chunk;
-		first_new_cluster += cluster_chunk;
-
-		if (++chain >= cl->cl_count)
-			chain = 0;
-
-		ocfs2_init_group_desc(fs, gd, gd_blkno,
-				      fs->fs_super->i_fs_generation, di->i_blkno,
-				      (cluster_chunk * cl->cl_bpc), chain, 0);
-
-		/* Add group to chain */
-		cr = &(cl->cl_recs[chain]);
-		if (chain >= cl->cl_next_free_rec) {
-			cl->cl_next_free_rec++;
-			cr->c_free = 0;
-			cr->c_total = 0;
-			cr->c_blkno = 0;
+	while (num_new_clusters) {
+		rb = &rw.rw_batches[cur];
+		cur = !cur;
+
+		for (rb->rb_nr = 0;
+		     num_new_clusters && (rb->rb_nr < rw.rw_max);
+		     rb->rb_nr++) {
+			rg = &rb->rb_groups[rb->rb_nr];
+			rg->rg_blkno = ocfs2_which_cluster_group(fs,
+								 cl->cl_cpg,
+								 first_new_cluster);
+			rg->rg_clusters = ocfs2_min(num_new_clusters,
+						    (uint32_t)cl->cl_cpg);
+			num_new_clusters -= rg->rg_clusters;
+			first_new_cluster += rg->rg_clusters;
+
+			if (++chain >= cl->cl_count)
+				chain = 0;
+			rg->rg_chain = chain;
+
+			ret = resize_build_group(fs, di, rg,
+						 rb->rb_buf + (rb->rb_nr *
+							       fs->fs_clustersize),
+						 total_bits, used_bits, online);
+			if (ret)
+				break;
 		}
+		if (ret)
+			break;
 
-		gd->bg_next_group = cr->c_blkno;
-		cr->c_blkno = gd_blkno;
-		cr->c_free += gd->bg_free_bits_count;
-		cr->c_total += gd->bg_bits;
+		ret = resize_submit_batch(&rw, rb);
+		if (ret)
+			tcom_err(ret,
+				 "while writing the cluster groups starting "
+				 "at block %"PRIu64,
+				 rb->rb_groups[0].rg_blkno);
 
-		*used_bits += (gd->bg_bits - gd->bg_free_bits_count);
-		*total_bits += gd->bg_bits;
+		/* Let the kernel have the last batch while this one writes */
+		if (!ret && prev)
+			ret = resize_add_batch(fs, prev, online);
 
-		fs->fs_clusters += cluster_chunk;
-		fs->fs_blocks += ocfs2_clusters_to_blocks(fs, cluster_chunk);
-
-		/* Initialize the first cluster in the group */
-		ret = io_write_block(fs->fs_io, gd_blkno,
-				     ocfs2_clusters_to_blocks(fs, 1), zero_buf);
-		if (ret) {
+		tmp = resize_reap_batch(&rw, rb);
+		if (tmp && !ret) {
+			ret = tmp;
 			tcom_err(ret,
-				 "while initializing the cluster group "
-				 "starting at block %"PRIu64,
-				 gd_blkno);
-			goto bail;
+				 "while writing the cluster groups starting "
+				 "at block %"PRIu64,
+				 rb->rb_groups[0].rg_blkno);
 		}
+		if (ret)
+			break;
 
-		if (online) {
-			ret = online_resize_group_add(fs, di, gd_blkno, gd_buf,
-						      chain, cluster_chunk);
-			if (ret) {
-				tcom_err(ret,
-					 "while trying to add the cluster "
-					 "group at block %"PRIu64,
-					 gd_blkno);
-				goto bail;
-			}
-			tunefs_update_fs_clusters(fs);
-		} else {
-			/* write a new group descriptor */
-			ret = ocfs2_write_group_desc(fs, gd_blkno, gd_buf);
-			if (ret) {
-				tcom_err(ret,
-					 "while writing the new group "
-					 "descriptor at block %"PRIu64,
-					 gd_blkno);
-				goto bail;
-			}
-		}
+		prev = rb;
 	}
 
+	if (!ret && prev)
+		ret = resize_add_batch(fs, prev, online);
+
 bail:
-	if (zero_buf)
-		ocfs2_free(&zero_buf);
-	if (gd_buf)
-		ocfs2_free(&gd_buf);
+	resize_writer_exit(&rw);
 	return ret;
 }
 
@@ -662,6 +844,32 @@ out:
 	return err;
 }
 
+/*
+ * Tell thin-provisioned storage that the space we are about to add
+ * holds nothing.  This is best effort; a device that can't discard
+ * is grown all the same.
+ */
+static void discard_new_space(ocfs2_filesys *fs, uint32_t new_clusters)
+{
+	int ret;
+	int bits = OCFS2_RAW_SB(fs->fs_super)->s_clustersize_bits;
+	uint64_t start = (uint64_t)fs->fs_clusters << bits;
+	uint64_t len = ((uint64_t)new_clusters << bits) - start;
+	struct tools_discard_stats stats;
+
+	ret = tools_discard(io_get_fd(fs->fs_io), start, len,
+			    TOOLS_DISCARD_WORKERS, &stats);
+	if (ret) {
+		verbosef(VL_APP, "%s while discarding the new space\n",
+			 strerror(ret));
+		return;
+	}
+
+	verbosef(VL_APP,
+		 "Discarded %"PRIu64" bytes of new space in %"PRIu64" ms\n",
+		 stats.ds_bytes, stats.ds_usecs / 1000);
+}
+
 static errcode_t update_volume_size(ocfs2_filesys *fs, uint64_t new_size,
 				    int online)
 {
@@ -685,6 +893,8 @@ static errcode_t update_volume_size(ocfs2_filesys *fs, uint64_t new_size,
 			    fs->fs_devname, fs->fs_clusters, new_clusters))
 		goto out;
 
+	discard_new_space(fs, new_clusters);
+
 	if (online)
 		err = update_volume_size_online(fs, new_clusters);
 	else
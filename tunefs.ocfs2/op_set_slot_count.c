@@ -42,7 +42,37 @@ struct relink_ctxt {
 	uint64_t dst_blkno;
 	char *src_inode;
 	char *dst_inode;
-	char *ex_buf;
+};
+
+/*
+ * How much we read and rewrite at a time while fixing up the suballoc
+ * slots of the blocks in relinked groups.
+ */
+#define RELINK_BATCH_BYTES	(4 * 1024 * 1024)
+#define RELINK_MAX_RUNS		256
+
+/* One group of a removed allocator and the slot it is moving to */
+struct relink_group {
+	uint64_t rg_blkno;
+	uint16_t rg_new_slot;
+};
+
+struct relink_plan {
+	struct relink_group *rp_groups;
+	int rp_nr_groups;
+	int rp_alloced;
+};
+
+/* Runs of allocated blocks waiting for their suballoc slot rewrite */
+struct relink_batch {
+	ocfs2_filesys *rb_fs;
+	int rb_inode_type;
+	char *rb_buf;
+	int rb_max_blocks;
+	int rb_nr_blocks;
+	int rb_nr_runs;
+	struct io_vec_unit rb_ivus[RELINK_MAX_RUNS];
+	uint16_t rb_slots[RELINK_MAX_RUNS];
 };
 
 struct remove_slot_ctxt {
@@ -52,15 +82,66 @@ struct remove_slot_ctxt {
 };
 
 
+static errcode_t decrease_link_count(ocfs2_filesys *fs, uint64_t blkno)
+{
+	errcode_t ret;
+	char *buf = NULL;
+	struct ocfs2_dinode *di  = NULL;
+
+	ret = ocfs2_malloc_block(fs->fs_io, &buf);
+	if (ret)
+		goto bail;
+
+	ret = ocfs2_read_inode(fs, blkno, buf);
+	if (ret)
+		goto bail;
+
+	di = (struct ocfs2_dinode *)buf;
+
+	if (di->i_links_count > 0)
+		di->i_links_count--;
+	else {
+		ret = OCFS2_ET_INODE_NOT_VALID;
+		goto bail;
+	}
+
+	ret = ocfs2_write_inode(fs, blkno, buf);
+bail:
+	if (buf)
+		ocfs2_free(&buf);
+	return ret;
+}
+
+/*
+ * Give back a new system file that add_slots() could not finish.  A
+ * dir that was initialized holds clusters and a link on the system dir,
+ * so those are released before the inode is.  This only runs on the way
+ * out of an error, so failures here are not reported.
+ */
+static void discard_system_file(ocfs2_filesys *fs, uint64_t blkno,
+				char *fname, int linked, int dir_inited)
+{
+	if (linked)
+		ocfs2_unlink(fs, fs->fs_sysdir_blkno, fname, blkno, 0);
+	if (dir_inited) {
+		ocfs2_dx_dir_truncate(fs, blkno);
+		decrease_link_count(fs, fs->fs_sysdir_blkno);
+	}
+	ocfs2_truncate(fs, blkno, 0);
+	ocfs2_delete_inode(fs, blkno);
+}
+
 static errcode_t add_slots(ocfs2_filesys *fs, int num_slots)
 {
 	errcode_t ret;
 	uint16_t old_num = OCFS2_RAW_SB(fs->fs_super)->s_max_slots;
 	struct ocfs2_super_block *super = OCFS2_RAW_SB(fs->fs_super);
 	char fname[OCFS2_MAX_FILENAME_LEN];
-	uint64_t blkno;
+	uint64_t blkno, *blknos = NULL;
 	int i, j, max_slots;
-	int ftype;
+	int ftype, *types = NULL, *slots = NULL;
+	int max_files, count = 0, nr_journals = 0;
+	int linked = 0, dir_inited = 0;
 	struct tools_progress *prog = NULL;
 
 	if (ocfs2_uses_extended_slot_map(OCFS2_RAW_SB(fs->fs_super))) {
@@ -73,16 +154,24 @@ static errcode_t add_slots(ocfs2_filesys *fs, int num_slots)
 	if (num_slots > max_slots)
 		goto bail;
 
-	prog = tools_progress_start("Adding slots", "addslots",
-				    (NUM_SYSTEM_INODES -
-				     OCFS2_LAST_GLOBAL_SYSTEM_INODE - 1) *
-				    (num_slots - old_num));
+	max_files = (NUM_SYSTEM_INODES - OCFS2_LAST_GLOBAL_SYSTEM_INODE - 1) *
+		(num_slots - old_num);
+
+	ret = ocfs2_malloc0(sizeof(int) * max_files, &types);
+	if (!ret)
+		ret = ocfs2_malloc0(sizeof(int) * max_files, &slots);
+	if (!ret)
+		ret = ocfs2_malloc0(sizeof(uint64_t) * max_files, &blknos);
+	if (ret)
+		goto bail;
+
+	prog = tools_progress_start("Adding slots", "addslots", max_files);
 	if (!prog) {
 		ret = TUNEFS_ET_NO_MEMORY;
 		goto bail;
 	}
 
-	ret = 0;
+	/* First find out which system files are missing */
 	for (i = OCFS2_LAST_GLOBAL_SYSTEM_INODE + 1; i < NUM_SYSTEM_INODES; ++i) {
 		if (i == LOCAL_USER_QUOTA_SYSTEM_INODE &&
 		    !OCFS2_HAS_RO_COMPAT_FEATURE(super,
@@ -96,10 +185,8 @@ static errcode_t add_slots(ocfs2_filesys *fs, int num_slots)
 			ocfs2_sprintf_system_inode_name(fname,
 							OCFS2_MAX_FILENAME_LEN,
 							i, j);
-			verbosef(VL_APP, "Creating system file \"%s\"\n",
-				 fname);
 
-			/* Goto next if file already exists */
+			/* Skip the file if it already exists */
 			ret = ocfs2_lookup(fs, fs->fs_sysdir_blkno, fname,
 					   strlen(fname), NULL, &blkno);
 			if (!ret) {
@@ -110,119 +197,411 @@ static errcode_t add_slots(ocfs2_filesys *fs, int num_slots)
 				continue;
 			}
 
-			/* create inode for system file */
-			ret = ocfs2_new_system_inode(fs, &blkno,
-						     ocfs2_system_inodes[i].si_mode,
-						     ocfs2_system_inodes[i].si_iflags);
+			types[count] = i;
+			slots[count] = j;
+			count++;
+			if (i == JOURNAL_SYSTEM_INODE)
+				nr_journals++;
+		}
+	}
+
+	ret = 0;
+	if (!count)
+		goto bail;
+
+	/*
+	 * Allocate the inodes for all of them at once, so the global
+	 * inode allocator is grown and written back only once.
+	 */
+	verbosef(VL_APP, "Allocating inodes for %d system files\n", count);
+	ret = ocfs2_new_system_inodes(fs, types, blknos, count);
+	if (ret) {
+		verbosef(VL_APP,
+			 "%s while allocating inodes for %d system files\n",
+			 error_message(ret), count);
+		goto bail;
+	}
+
+	/*
+	 * The new journals are sized right after this.  Give the extent
+	 * allocator room for an extent block per journal now instead of
+	 * growing it halfway through.
+	 */
+	i = 0;
+	ret = ocfs2_reserve_extent_blocks(fs, 0, nr_journals);
+	if (ret) {
+		verbosef(VL_APP,
+			 "%s while reserving extent blocks\n",
+			 error_message(ret));
+		goto undo;
+	}
+
+	for (i = 0; i < count; i++) {
+		linked = 0;
+		dir_inited = 0;
+		ocfs2_sprintf_system_inode_name(fname, OCFS2_MAX_FILENAME_LEN,
+						types[i], slots[i]);
+		verbosef(VL_APP, "Creating system file \"%s\"\n", fname);
+
+		ftype = (S_ISDIR(ocfs2_system_inodes[types[i]].si_mode) ?
+			 OCFS2_FT_DIR : OCFS2_FT_REG_FILE);
+
+		/* if dir, alloc space to it */
+		if (ftype == OCFS2_FT_DIR) {
+			ret = ocfs2_init_dir(fs, blknos[i],
+					     fs->fs_sysdir_blkno);
 			if (ret) {
 				verbosef(VL_APP,
-					 "%s while creating inode for "
-					 "system file \"%s\"\n",
+					 "%s while initializing "
+					 "directory \"%s\"\n",
 					 error_message(ret), fname);
-				goto bail;
-			}
-
-			ftype = (S_ISDIR(ocfs2_system_inodes[i].si_mode) ?
-				 OCFS2_FT_DIR : OCFS2_FT_REG_FILE);
-
-			/* if dir, alloc space to it */
-			if (ftype == OCFS2_FT_DIR) {
-				ret = ocfs2_init_dir(fs, blkno,
-						     fs->fs_sysdir_blkno);
-				if (ret) {
-					verbosef(VL_APP,
-						 "%s while initializing "
-						 "directory \"%s\"\n",
-						 error_message(ret),
-						 fname);
-					goto bail;
-				}
+				goto undo;
 			}
+			dir_inited = 1;
+		}
 
-			/* Add the inode to the system dir */
-			ret = ocfs2_link(fs, fs->fs_sysdir_blkno, fname,
-					 blkno, ftype);
+		/* Add the inode to the system dir */
+		ret = ocfs2_link(fs, fs->fs_sysdir_blkno, fname, blknos[i],
+				 ftype);
+		if (ret) {
+			verbosef(VL_APP,
+				"%s while linking inode %"PRIu64" "
+				"as \"%s\" in the system "
+				"directory\n",
+				error_message(ret), blknos[i], fname);
+			goto undo;
+		}
+		linked = 1;
+		/* Initialize quota files */
+		if (types[i] == LOCAL_USER_QUOTA_SYSTEM_INODE) {
+			verbosef(VL_APP, "Initializing local user "
+				 "quota file\n");
+			ret = ocfs2_init_local_quota_file(fs, USRQUOTA,
+							  blknos[i]);
 			if (ret) {
 				verbosef(VL_APP,
-					"%s while linking inode %"PRIu64" "
-					"as \"%s\" in the system "
-					"directory\n",
-					error_message(ret), blkno, fname);
-				goto bail;
+					 "%s while initializing user "
+					 "quota file %s\n",
+					 error_message(ret), fname);
+				goto undo;
 			}
-			/* Initialize quota files */
-			if (i == LOCAL_USER_QUOTA_SYSTEM_INODE) {
-				verbosef(VL_APP, "Initializing local user "
-					 "quota file\n");
-				ret = ocfs2_init_local_quota_file(fs, USRQUOTA,
-								  blkno);
-				if (ret) {
-					verbosef(VL_APP,
-						 "%s while initializing user "
-						 "quota file %s\n",
-						 error_message(ret), fname);
-					goto bail;
-				}
-			} else if (i == LOCAL_GROUP_QUOTA_SYSTEM_INODE) {
-				verbosef(VL_APP, "Initializing local group "
-					 "quota file\n");
-				ret = ocfs2_init_local_quota_file(fs, GRPQUOTA,
-								  blkno);
-				if (ret) {
-					verbosef(VL_APP,
-						 "%s while initializing group "
-						 "quota file %s\n",
-						 error_message(ret), fname);
-					goto bail;
-				}
+		} else if (types[i] == LOCAL_GROUP_QUOTA_SYSTEM_INODE) {
+			verbosef(VL_APP, "Initializing local group "
+				 "quota file\n");
+			ret = ocfs2_init_local_quota_file(fs, GRPQUOTA,
+							  blknos[i]);
+			if (ret) {
+				verbosef(VL_APP,
+					 "%s while initializing group "
+					 "quota file %s\n",
+					 error_message(ret), fname);
+				goto undo;
 			}
-			verbosef(VL_APP, "System file \"%s\" created\n",
-				 fname);
-			tools_progress_step(prog, 1);
 		}
+		verbosef(VL_APP, "System file \"%s\" created\n", fname);
+		tools_progress_step(prog, 1);
+	}
+	goto bail;
+
+undo:
+	/*
+	 * Every inode was allocated up front.  The files before i are
+	 * complete and stay, the rest are given back so the allocator
+	 * doesn't keep inodes nothing points to.
+	 */
+	for (; i < count; i++) {
+		ocfs2_sprintf_system_inode_name(fname, OCFS2_MAX_FILENAME_LEN,
+						types[i], slots[i]);
+		verbosef(VL_APP, "Discarding system file \"%s\"\n", fname);
+		discard_system_file(fs, blknos[i], fname, linked, dir_inited);
+		linked = 0;
+		dir_inited = 0;
 	}
 
 bail:
 	if (prog)
 		tools_progress_stop(prog);
+	if (blknos)
+		ocfs2_free(&blknos);
+	if (slots)
+		ocfs2_free(&slots);
+	if (types)
+		ocfs2_free(&types);
 
 	return ret;
 }
 
-static errcode_t change_sub_alloc_slot(ocfs2_filesys *fs,
-				       uint64_t blkno,
-				       struct relink_ctxt *ctxt)
+#define relink_sig_match(buf, sig)	(!memcmp((buf), (sig), strlen(sig)))
+
+/*
+ * Point one allocated block at its new slot.  The block is in disk
+ * format, straight from the device.  Besides extent blocks, the extent
+ * allocator also hands out indexed dir roots, xattr blocks and
+ * refcount blocks.
+ */
+static errcode_t relink_fix_block(ocfs2_filesys *fs, int inode_type,
+				  char *blk, uint16_t new_slot)
 {
 	errcode_t ret;
-	struct ocfs2_dinode *di = NULL;
-	struct ocfs2_extent_block *eb = NULL;
-
-	if (ctxt->inode_type == EXTENT_ALLOC_SYSTEM_INODE) {
-		/* change sub alloc bit in the extent block. */
-		ret = ocfs2_read_extent_block(fs, blkno, ctxt->ex_buf);
+	struct ocfs2_dinode *di;
+	struct ocfs2_extent_block *eb;
+	struct ocfs2_dx_root_block *dx_root;
+	struct ocfs2_xattr_block *xb;
+	struct ocfs2_refcount_block *rb;
+
+	if (inode_type != EXTENT_ALLOC_SYSTEM_INODE) {
+		di = (struct ocfs2_dinode *)blk;
+		if (!relink_sig_match(di->i_signature, OCFS2_INODE_SIGNATURE))
+			return OCFS2_ET_BAD_INODE_MAGIC;
+		ret = ocfs2_validate_meta_ecc(fs, blk, &di->i_check);
 		if (ret)
-			goto bail;
+			return ret;
+
+		ocfs2_swap_inode_to_cpu(fs, di);
+		di->i_suballoc_slot = new_slot;
+		ocfs2_swap_inode_from_cpu(fs, di);
+		ocfs2_compute_meta_ecc(fs, blk, &di->i_check);
+	} else if (relink_sig_match(blk, OCFS2_EXTENT_BLOCK_SIGNATURE)) {
+		eb = (struct ocfs2_extent_block *)blk;
+		ret = ocfs2_validate_meta_ecc(fs, blk, &eb->h_check);
+		if (ret)
+			return ret;
+
+		ocfs2_swap_extent_block_to_cpu(fs, eb);
+		eb->h_suballoc_slot = new_slot;
+		ocfs2_swap_extent_block_from_cpu(fs, eb);
+		ocfs2_compute_meta_ecc(fs, blk, &eb->h_check);
+	} else if (relink_sig_match(blk, OCFS2_DX_ROOT_SIGNATURE)) {
+		dx_root = (struct ocfs2_dx_root_block *)blk;
+		ret = ocfs2_validate_meta_ecc(fs, blk, &dx_root->dr_check);
+		if (ret)
+			return ret;
+
+		ocfs2_swap_dx_root_to_cpu(fs, dx_root);
+		dx_root->dr_suballoc_slot = new_slot;
+		ocfs2_swap_dx_root_from_cpu(fs, dx_root);
+		ocfs2_compute_meta_ecc(fs, blk, &dx_root->dr_check);
+	} else if (relink_sig_match(blk, OCFS2_XATTR_BLOCK_SIGNATURE)) {
+		xb = (struct ocfs2_xattr_block *)blk;
+		ret = ocfs2_validate_meta_ecc(fs, blk, &xb->xb_check);
+		if (ret)
+			return ret;
+
+		ocfs2_swap_xattr_block_to_cpu(fs, xb);
+		xb->xb_suballoc_slot = new_slot;
+		ocfs2_swap_xattr_block_from_cpu(fs, xb);
+		ocfs2_compute_meta_ecc(fs, blk, &xb->xb_check);
+	} else if (relink_sig_match(blk, OCFS2_REFCOUNT_BLOCK_SIGNATURE)) {
+		rb = (struct ocfs2_refcount_block *)blk;
+		ret = ocfs2_validate_meta_ecc(fs, blk, &rb->rf_check);
+		if (ret)
+			return ret;
 
-		eb = (struct ocfs2_extent_block *)ctxt->ex_buf;
-		eb->h_suballoc_slot = ctxt->new_slot;
+		ocfs2_swap_refcount_block_to_cpu(fs, rb);
+		rb->rf_suballoc_slot = new_slot;
+		ocfs2_swap_refcount_block_from_cpu(fs, rb);
+		ocfs2_compute_meta_ecc(fs, blk, &rb->rf_check);
+	} else
+		return OCFS2_ET_BAD_EXTENT_BLOCK_MAGIC;
 
-		ret = ocfs2_write_extent_block(fs, blkno, ctxt->ex_buf);
-		if (ret)
-			goto bail;
-	} else {
-		/* change sub alloc bit in the inode. */
-		ret = ocfs2_read_inode(fs, blkno, ctxt->ex_buf);
+	return 0;
+}
+
+static errcode_t relink_batch_flush(struct relink_batch *rb)
+{
+	errcode_t ret;
+	int i, j, count;
+	ocfs2_filesys *fs = rb->rb_fs;
+	struct io_vec_unit *ivu;
+
+	if (!rb->rb_nr_runs)
+		return 0;
+
+	ret = io_vec_read_blocks(fs->fs_io, rb->rb_ivus, rb->rb_nr_runs);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < rb->rb_nr_runs; i++) {
+		ivu = &rb->rb_ivus[i];
+		count = ivu->ivu_buflen / fs->fs_blocksize;
+		for (j = 0; j < count; j++) {
+			ret = relink_fix_block(fs, rb->rb_inode_type,
+					       ivu->ivu_buf +
+					       (j * fs->fs_blocksize),
+					       rb->rb_slots[i]);
+			if (ret)
+				goto out;
+		}
+	}
+
+	ret = io_vec_write_blocks(fs->fs_io, rb->rb_ivus, rb->rb_nr_runs);
+	if (!ret)
+		fs->fs_flags |= OCFS2_FLAG_CHANGED;
+
+out:
+	rb->rb_nr_runs = 0;
+	rb->rb_nr_blocks = 0;
+	return ret;
+}
+
+/* Queue count allocated blocks starting at blkno for new_slot */
+static errcode_t relink_batch_add(struct relink_batch *rb, uint64_t blkno,
+				  int count, uint16_t new_slot)
+{
+	errcode_t ret;
+	int len;
+	struct io_vec_unit *ivu;
+
+	while (count) {
+		if ((rb->rb_nr_runs == RELINK_MAX_RUNS) ||
+		    (rb->rb_nr_blocks == rb->rb_max_blocks)) {
+			ret = relink_batch_flush(rb);
+			if (ret)
+				return ret;
+		}
+
+		len = rb->rb_max_blocks - rb->rb_nr_blocks;
+		if (len > count)
+			len = count;
+
+		ivu = &rb->rb_ivus[rb->rb_nr_runs];
+		ivu->ivu_blkno = blkno;
+		ivu->ivu_buf = rb->rb_buf +
+			((uint64_t)rb->rb_nr_blocks * rb->rb_fs->fs_blocksize);
+		ivu->ivu_buflen = len * rb->rb_fs->fs_blocksize;
+		rb->rb_slots[rb->rb_nr_runs] = new_slot;
+		rb->rb_nr_runs++;
+		rb->rb_nr_blocks += len;
+
+		blkno += len;
+		count -= len;
+	}
+
+	return 0;
+}
+
+static errcode_t relink_plan_add(struct relink_plan *rp, uint64_t blkno,
+				 uint16_t new_slot)
+{
+	errcode_t ret;
+	int alloced;
+
+	if (rp->rp_nr_groups == rp->rp_alloced) {
+		alloced = rp->rp_alloced ? rp->rp_alloced * 2 : 64;
+		ret = ocfs2_realloc(sizeof(struct relink_group) * alloced,
+				    &rp->rp_groups);
 		if (ret)
-			goto bail;
+			return ret;
+		rp->rp_alloced = alloced;
+	}
+
+	rp->rp_groups[rp->rp_nr_groups].rg_blkno = blkno;
+	rp->rp_groups[rp->rp_nr_groups].rg_new_slot = new_slot;
+	rp->rp_nr_groups++;
+
+	return 0;
+}
+
+static int relink_group_cmp(const void *a, const void *b)
+{
+	const struct relink_group *ga = a, *gb = b;
+
+	if (ga->rg_blkno < gb->rg_blkno)
+		return -1;
+	return ga->rg_blkno > gb->rg_blkno;
+}
+
+/*
+ * Walk every chain of the removed allocator and note each group with
+ * the slot that will own it.
+ */
+static errcode_t relink_build_plan(ocfs2_filesys *fs,
+				   struct ocfs2_dinode *di,
+				   uint16_t new_slots, char *gd_buf,
+				   struct relink_plan *rp)
+{
+	errcode_t ret = 0;
+	int16_t i;
+	uint64_t gd_blkno;
+	struct ocfs2_chain_list *cl = &di->id2.i_chain;
+	struct ocfs2_group_desc *gd = (struct ocfs2_group_desc *)gd_buf;
+
+	for (i = cl->cl_next_free_rec - 1; i >= 0; i--) {
+		gd_blkno = cl->cl_recs[i].c_blkno;
+		while (gd_blkno) {
+			ret = ocfs2_read_group_desc(fs, gd_blkno, gd_buf);
+			if (ret)
+				return ret;
+
+			ret = relink_plan_add(rp, gd_blkno, i % new_slots);
+			if (ret)
+				return ret;
+
+			gd_blkno = gd->bg_next_group;
+		}
+	}
+
+	return ret;
+}
+
+/*
+ * Rewrite the "Sub Alloc Slot" of every allocated block in the planned
+ * groups.  The groups are visited in disk order and the runs of set
+ * bits are read and written back in large batches, rather than one
+ * block at a time.
+ */
+static errcode_t relink_fix_suballoc_slots(ocfs2_filesys *fs,
+					   int inode_type,
+					   struct relink_plan *rp,
+					   char *gd_buf)
+{
+	errcode_t ret;
+	int i, start, end;
+	struct relink_group *rg;
+	struct relink_batch rb;
+	struct ocfs2_group_desc *gd = (struct ocfs2_group_desc *)gd_buf;
 
-		di = (struct ocfs2_dinode *)ctxt->ex_buf;
-		di->i_suballoc_slot = ctxt->new_slot;
+	memset(&rb, 0, sizeof(rb));
+	rb.rb_fs = fs;
+	rb.rb_inode_type = inode_type;
+	rb.rb_max_blocks = RELINK_BATCH_BYTES / fs->fs_blocksize;
 
-		ret = ocfs2_write_inode(fs, blkno, ctxt->ex_buf);
+	ret = ocfs2_malloc_blocks(fs->fs_io, rb.rb_max_blocks, &rb.rb_buf);
+	if (ret)
+		return ret;
+
+	qsort(rp->rp_groups, rp->rp_nr_groups, sizeof(struct relink_group),
+	      relink_group_cmp);
+
+	for (i = 0; i < rp->rp_nr_groups; i++) {
+		rg = &rp->rp_groups[i];
+
+		ret = ocfs2_read_group_desc(fs, rg->rg_blkno, gd_buf);
 		if (ret)
-			goto bail;
+			goto out;
+
+		/* Bit 0 is the group descriptor itself */
+		end = 1;
+		while (end < gd->bg_bits) {
+			start = ocfs2_find_next_bit_set(gd->bg_bitmap,
+							gd->bg_bits, end);
+			if (start >= gd->bg_bits)
+				break;
+
+			end = ocfs2_find_next_bit_clear(gd->bg_bitmap,
+							gd->bg_bits, start);
+
+			ret = relink_batch_add(&rb, rg->rg_blkno + start,
+					       end - start, rg->rg_new_slot);
+			if (ret)
+				goto out;
+		}
 	}
-bail:
+
+	ret = relink_batch_flush(&rb);
+
+out:
+	ocfs2_free(&rb.rb_buf);
 	return ret;
 }
 
@@ -298,15 +677,16 @@ bail:
  * This function will iterate the chain_rec and do the following modifications:
  * 1. record all the groups in the chains.
  * 2. for every group, do:
- *    1) modify  Sub Alloc Slot in extent block/inodes accordingly.
- *    2) change the GROUP_PARENT according to its future owner.
- *    3) link the group to the new slot files.
+ *    1) change the GROUP_PARENT according to its future owner.
+ *    2) link the group to the new slot files.
+ *
+ * The Sub Alloc Slot of the blocks in the groups has already been
+ * changed by relink_fix_suballoc_slots().
  */
 static errcode_t move_chain_rec(ocfs2_filesys *fs, struct relink_ctxt *ctxt)
 {
 	errcode_t ret = 0;
-	int i, start, end = 1;
-	uint64_t blkno, gd_blkno = ctxt->cr->c_blkno;
+	uint64_t gd_blkno = ctxt->cr->c_blkno;
 	struct ocfs2_group_desc *gd = NULL;
 	struct moved_group *group = NULL, *group_head = NULL;
 
@@ -347,29 +727,6 @@ static errcode_t move_chain_rec(ocfs2_filesys *fs, struct relink_ctxt *ctxt)
 
 	group = group_head;
 	while (group) {
-		gd = (struct ocfs2_group_desc *)group->gd_buf;
-
-		end = 1;
-		/* Modify the "Sub Alloc Slot" in the extent block/inodes. */
-		while (end < gd->bg_bits) {
-			start = ocfs2_find_next_bit_set(gd->bg_bitmap,
-							gd->bg_bits, end);
-			if (start >= gd->bg_bits)
-				break;
-
-			end = ocfs2_find_next_bit_clear(gd->bg_bitmap,
-							gd->bg_bits, start);
-
-			for (i = start; i < end; i++) {
-				blkno = group->blkno + i;
-
-				ret = change_sub_alloc_slot(fs, blkno, ctxt);
-				if (ret)
-					goto bail;
-
-			}
-		}
-
 		/* move the group to the new slots. */
 		ret = move_group(fs, ctxt, group);
 		if (ret)
@@ -401,9 +758,12 @@ static errcode_t relink_system_alloc(ocfs2_filesys *fs,
 	struct ocfs2_dinode *di = NULL;
 	struct ocfs2_chain_list *cl = NULL;
 	struct relink_ctxt ctxt;
+	struct relink_plan plan;
+	char *gd_buf = NULL;
 	char fname[OCFS2_MAX_FILENAME_LEN];
 
 	memset(&ctxt, 0, sizeof(ctxt));
+	memset(&plan, 0, sizeof(plan));
 
 	ocfs2_sprintf_system_inode_name(fname, OCFS2_MAX_FILENAME_LEN,
 					inode_type, removed_slot);
@@ -446,15 +806,33 @@ static errcode_t relink_system_alloc(ocfs2_filesys *fs,
 	if (di->id1.bitmap1.i_total == 0)
 		goto bail;
 
-	/* Iterate all the groups and modify the group descriptors accordingly. */
-	ret = ocfs2_malloc_block(fs->fs_io, &ctxt.ex_buf);
+	ret = ocfs2_malloc_block(fs->fs_io, &gd_buf);
 	if (ret) {
 		verbosef(VL_APP,
-			 "%s while allocating an extent block buffer\n",
+			 "%s while allocating a group descriptor buffer\n",
 			 error_message(ret));
 		goto bail;
 	}
 
+	/* Work out where every group is going before touching anything. */
+	ret = relink_build_plan(fs, di, new_slots, gd_buf, &plan);
+	if (ret) {
+		verbosef(VL_APP,
+			 "%s while planning the relink of allocator "
+			 "%"PRIu64"\n",
+			 error_message(ret), blkno);
+		goto bail;
+	}
+
+	ret = relink_fix_suballoc_slots(fs, inode_type, &plan, gd_buf);
+	if (ret) {
+		verbosef(VL_APP,
+			 "%s while changing the suballoc slot of the blocks "
+			 "in allocator %"PRIu64"\n",
+			 error_message(ret), blkno);
+		goto bail;
+	}
+
 	ret = ocfs2_malloc_block(fs->fs_io, &ctxt.dst_inode);
 	if (ret) {
 		verbosef(VL_APP,
@@ -519,8 +897,10 @@ static errcode_t relink_system_alloc(ocfs2_filesys *fs,
 			 error_message(ret));
 
 bail:
-	if (ctxt.ex_buf)
-		ocfs2_free(&ctxt.ex_buf);
+	if (plan.rp_groups)
+		ocfs2_free(&plan.rp_groups);
+	if (gd_buf)
+		ocfs2_free(&gd_buf);
 	if (ctxt.dst_inode)
 		ocfs2_free(&ctxt.dst_inode);
 	if (ctxt.src_inode)
@@ -532,38 +912,6 @@ bail:
 	return ret;
 }
 
-/* Empty the content of the specified journal file.
- * Most of the code is copied from ocfs2_format_journal.
- */
-static errcode_t empty_journal(ocfs2_filesys *fs,
-			       ocfs2_cached_inode *ci)
-{
-	errcode_t ret = 0;
-	char *buf = NULL;
-	int bs_bits = OCFS2_RAW_SB(fs->fs_super)->s_blocksize_bits;
-	uint64_t offset = 0;
-	uint32_t wrote, count;
-
-#define BUFLEN	1048576
-	ret = ocfs2_malloc_blocks(fs->fs_io, (BUFLEN >> bs_bits), &buf);
-	if (ret)
-		goto out;
-	memset(buf, 0, BUFLEN);
-
-	count = (uint32_t) ci->ci_inode->i_size;
-	while (count) {
-		ret = ocfs2_file_write(ci, buf, ocfs2_min((uint32_t) BUFLEN, count),
-				       offset, &wrote);
-		if (ret)
-			goto out;
-		offset += wrote;
-		count -= wrote;
-	}
-
-out:
-	return ret;
-}
-
 static errcode_t empty_and_truncate_journal(ocfs2_filesys *fs,
 					    uint16_t removed_slot)
 {
@@ -598,7 +946,7 @@ static errcode_t empty_and_truncate_journal(ocfs2_filesys *fs,
 	 * So if this block range is used for future inode alloc
 	 * files, fsck.ocfs2 may raise some error.
 	 */
-	ret = empty_journal(fs, ci);
+	ret = ocfs2_zero_journal(ci);
 	if (ret) {
 		verbosef(VL_APP, "%s while emptying journal \"%s\"\n",
 			 error_message(ret), fname);
@@ -754,36 +1102,6 @@ static errcode_t remove_slot_entry(ocfs2_filesys *fs, uint16_t removed_slot)
 	return ctxt.errcode;
 }
 
-static errcode_t decrease_link_count(ocfs2_filesys *fs, uint16_t blkno)
-{
-	errcode_t ret;
-	char *buf = NULL;
-	struct ocfs2_dinode *di  = NULL;
-
-	ret = ocfs2_malloc_block(fs->fs_io, &buf);
-	if (ret)
-		goto bail;
-
-	ret = ocfs2_read_inode(fs, blkno, buf);
-	if (ret)
-		goto bail;
-
-	di = (struct ocfs2_dinode *)buf;
-
-	if (di->i_links_count > 0)
-		di->i_links_count--;
-	else {
-		ret = OCFS2_ET_INODE_NOT_VALID;
-		goto bail;
-	}
-
-	ret = ocfs2_write_inode(fs, blkno, buf);
-bail:
-	if (buf)
-		ocfs2_free(&buf);
-	return ret;
-}
-
 static int orphan_iterate(struct ocfs2_dir_entry *dirent,
 			uint64_t blocknr, int offset, int blocksize,
 			char *buf, void *priv_data)